@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Aggregation of small payload packets into shared datagrams
+
+   For small packets like VoIP, game traffic or TCP ACKs, the overhead of the method and the
+   per-packet cost of encryption and sending dominate. When both peers support it, payload packets
+   are sent with a length prefix, and packets sent to a peer within the configured aggregation delay
+   are packed into a single datagram up to the size of a full-sized packet, which is encrypted
+   and sent at once. The receiver splits the datagram into the original packets after decryption.
+
+   The delay is measured in milliseconds; with a delay of 0, only packets sent in the same iteration
+   of the main loop (for example when a transmit queue is drained) are aggregated. Packets too large
+   to share a datagram with another packet of the same size are never held back. As a datagram has
+   a single socket priority and outer TOS value, packets only share a datagram when they match in
+   both.
+
+   The pending packets are kept outside of the buffer pool, so a peer waiting for more packets
+   doesn't hold on to one of the few packet buffers.
+*/
+
+
+#include "aggregate.h"
+#include "tos.h"
+
+
+/** Returns the maximum length of the decrypted payload of a datagram sent to a peer */
+static size_t max_datagram_len(const fastd_peer_t *peer) {
+	return fastd_max_payload(fastd_peer_get_mtu(peer)) + sizeof(fastd_aggregate_header_t);
+}
+
+/** Allocates the aggregation state of a peer after aggregation has been negotiated */
+void fastd_aggregate_init(fastd_peer_t *peer) {
+	fastd_aggregate_t *aggr = fastd_new0(fastd_aggregate_t);
+
+	aggr->peer = peer;
+	aggr->size = fastd_max_payload(ctx.max_mtu) + sizeof(fastd_aggregate_header_t);
+	aggr->pending.data = fastd_alloc(aggr->size);
+	aggr->spare.data = fastd_alloc(aggr->size);
+
+	peer->aggregate = aggr;
+}
+
+/** Frees the aggregation state of a peer, dropping all pending packets */
+void fastd_aggregate_free(fastd_peer_t *peer) {
+	fastd_aggregate_t *aggr = peer->aggregate;
+	if (!aggr)
+		return;
+
+	fastd_task_unschedule(&aggr->task);
+
+	free(aggr->pending.data);
+	free(aggr->spare.data);
+	free(aggr);
+
+	peer->aggregate = NULL;
+}
+
+/** Appends a packet to a frame buffer */
+static void frames_add(fastd_aggregate_frames_t *frames, const fastd_buffer_t *buffer, uint8_t tos) {
+	fastd_aggregate_header_t header = { .len = htobe16(buffer->len) };
+
+	memcpy(frames->data + frames->len, &header, sizeof(header));
+	memcpy(frames->data + frames->len + sizeof(header), buffer->data, buffer->len);
+
+	frames->len += sizeof(header) + buffer->len;
+	frames->count++;
+	frames->priority = ctx.tx_priority;
+	frames->tos = tos;
+}
+
+/**
+   Encrypts and sends the packets of a frame buffer as a single datagram
+
+   Returns false if sending has reset the peer, so the aggregation state has been freed.
+*/
+static bool frames_send(fastd_aggregate_t *aggr, fastd_aggregate_frames_t *frames) {
+	fastd_peer_t *peer = aggr->peer;
+
+	fastd_buffer_t *buffer = fastd_buffer_alloc(frames->len, conf.encrypt_headroom);
+	memcpy(buffer->data, frames->data, frames->len);
+
+	aggr->tx_frames += frames->count;
+	aggr->tx_datagrams++;
+
+	if (frames->count > 1)
+		fastd_stats_add_n(peer, STAT_TX_AGGREGATED, frames->count, frames->len);
+
+	int priority = ctx.tx_priority;
+	ctx.tx_priority = frames->priority;
+
+	/* Sending may reset the peer, freeing the aggregation state, so it must be cleared first */
+	frames->len = 0;
+	frames->count = 0;
+
+	conf.protocol->send(peer, buffer);
+	ctx.tx_priority = priority;
+
+	return (peer->aggregate == aggr);
+}
+
+/** Sends the pending packets of a peer, returning false if the aggregation state has been freed */
+static bool flush(fastd_aggregate_t *aggr) {
+	fastd_task_unschedule(&aggr->task);
+
+	if (!aggr->pending.count)
+		return true;
+
+	return frames_send(aggr, &aggr->pending);
+}
+
+/**
+   Sends a payload packet to a peer, aggregating it with other small packets sent to the peer, consuming the buffer
+
+   When aggregation hasn't been negotiated with the peer, the packet is passed to the protocol directly.
+*/
+void fastd_aggregate_send(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	fastd_aggregate_t *aggr = peer->aggregate;
+	if (!aggr) {
+		conf.protocol->send(peer, buffer);
+		return;
+	}
+
+	size_t frame_len = sizeof(fastd_aggregate_header_t) + buffer->len;
+	size_t max_len = min_size_t(max_datagram_len(peer), aggr->size);
+
+	if (frame_len > max_len) {
+		/* The MTU has been increased by a configuration reload */
+		pr_debug("dropping oversized packet for %P", peer);
+		fastd_stats_add(peer, STAT_TX_DROPPED, buffer->len);
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	/* The outer TOS value of a datagram is determined by its first packet */
+	uint8_t tos = fastd_tos_encapsulate_packet(peer, buffer);
+	bool full = aggr->pending.len + frame_len > max_len;
+
+	if (aggr->pending.count && (full || aggr->pending.priority != ctx.tx_priority || aggr->pending.tos != tos)) {
+		/* Start the next datagram before sending the pending one, so no two packet buffers are held */
+		frames_add(&aggr->spare, buffer, tos);
+		fastd_buffer_free(buffer);
+
+		if (!flush(aggr))
+			return;
+
+		fastd_aggregate_frames_t tmp = aggr->pending;
+		aggr->pending = aggr->spare;
+		aggr->spare = tmp;
+	} else {
+		frames_add(&aggr->pending, buffer, tos);
+		fastd_buffer_free(buffer);
+	}
+
+	/* Packets leaving no room for another packet of the same size are sent right away */
+	if (2 * frame_len > max_len)
+		flush(aggr);
+	else if (!fastd_task_scheduled(&aggr->task))
+		fastd_task_schedule(&aggr->task, TASK_TYPE_AGGREGATE, ctx.now + conf.aggregate_delay);
+}
+
+/** Handles the task of the aggregation state of a peer, sending the pending packets */
+void fastd_aggregate_handle_task(fastd_task_t *task) {
+	fastd_aggregate_t *aggr = container_of(task, fastd_aggregate_t, task);
+
+	/* May free the aggregation state */
+	flush(aggr);
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Aggregation of small payload packets into shared datagrams
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+#include "task.h"
+
+
+/** The aggregation version announced in handshakes */
+#define AGGREGATE_VERSION 1
+
+
+/** The frames that are waiting to be sent in a single datagram */
+typedef struct fastd_aggregate_frames {
+	uint8_t *data; /**< The packets, each preceded by a fastd_aggregate_header_t */
+	size_t len;    /**< The number of used bytes of \e data */
+	size_t count;  /**< The number of packets in \e data */
+	int priority;  /**< The socket priority of the packets */
+	uint8_t tos;   /**< The TOS or traffic class value the packets are sent with */
+} fastd_aggregate_frames_t;
+
+/** The aggregation state of a peer */
+struct fastd_aggregate {
+	fastd_peer_t *peer; /**< The peer the state belongs to */
+	fastd_task_t task;  /**< Task queue entry to send the pending packets when the aggregation delay has passed */
+
+	size_t size;                      /**< The size of the frame buffers */
+	fastd_aggregate_frames_t pending; /**< The packets waiting for more packets to share a datagram with */
+	fastd_aggregate_frames_t spare;   /**< Frame buffer used to assemble the next datagram while sending */
+
+	uint64_t tx_frames;    /**< The number of packets sent */
+	uint64_t tx_datagrams; /**< The number of datagrams the sent packets have been aggregated into */
+	uint64_t rx_frames;    /**< The number of packets received */
+	uint64_t rx_datagrams; /**< The number of datagrams the received packets have been aggregated into */
+};
+
+
+/** Returns true if aggregation of payload packets is offered to peers */
+static inline bool fastd_use_aggregation(void) {
+	return conf.aggregate;
+}
+
+
+void fastd_aggregate_init(fastd_peer_t *peer);
+void fastd_aggregate_free(fastd_peer_t *peer);
+void fastd_aggregate_send(fastd_peer_t *peer, fastd_buffer_t *buffer);
+void fastd_aggregate_handle_task(fastd_task_t *task);
@@ -65,7 +65,7 @@ static bool need_cap_net_admin(void) {
 		return true;
 #endif
 
-	if (fastd_use_offload_l2tp())
+	if (fastd_use_offload_l2tp() || fastd_use_offload_gue() || fastd_use_offload_esp())
 		return true;
 
 	return false;
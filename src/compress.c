@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   LZ4 compression of payload packets
+
+   When both peers support it, payload packets are compressed before encryption and decompressed
+   after decryption. Each payload packet is followed by a one-byte trailer specifying if it has been
+   compressed; packets that don't become smaller are sent uncompressed.
+
+   As trying to compress incompressible traffic (for example traffic that is already compressed or
+   encrypted) only costs CPU time, a running estimate of the achieved compression ratio is kept for
+   each peer. While the estimate is above COMPRESS_BYPASS_RATIO, compression is only tried for every
+   COMPRESS_BYPASS_PACKETS'th packet to detect when the traffic becomes compressible again.
+
+   The packets are compressed into a single scratch buffer and copied back into the packet buffer,
+   so compression doesn't need any additional packet buffers.
+
+   As the compressed length depends on the contents, compression leaks information about the
+   compressed data (see the CRIME and VORACLE attacks). Datagrams combining several aggregated
+   packets are never compressed, so this leak is at least confined to a single packet and an
+   attacker can't learn about other flows by sending packets aggregated with them.
+*/
+
+
+#include "compress.h"
+
+#include <lz4.h>
+
+
+/** The initial compression ratio estimate, assuming moderately compressible traffic */
+#define INITIAL_RATIO 128
+
+
+/** Allocates the LZ4 state and the scratch buffer shared by all peers */
+void fastd_compress_init_buffers(void) {
+	if (!fastd_use_compression())
+		return;
+
+	ctx.compress_state = fastd_alloc(LZ4_sizeofState());
+	ctx.compress_buffer = fastd_alloc(ctx.max_buffer);
+}
+
+/** Frees the LZ4 state and the scratch buffer */
+void fastd_compress_cleanup_buffers(void) {
+	free(ctx.compress_state);
+	free(ctx.compress_buffer);
+
+	ctx.compress_state = NULL;
+	ctx.compress_buffer = NULL;
+}
+
+/** Allocates the compression state of a peer after compression has been negotiated */
+void fastd_compress_init(fastd_peer_t *peer) {
+	fastd_compress_t *comp = fastd_new0(fastd_compress_t);
+	comp->ratio = INITIAL_RATIO;
+
+	peer->compress = comp;
+}
+
+/** Frees the compression state of a peer */
+void fastd_compress_free(fastd_peer_t *peer) {
+	free(peer->compress);
+	peer->compress = NULL;
+}
+
+/** Returns the number of bytes that can be appended to a buffer */
+static size_t tailroom(const fastd_buffer_t *buffer) {
+	return ctx.max_buffer - fastd_buffer_headroom(buffer) - buffer->len;
+}
+
+/** Returns the maximum length of a decompressed payload received from a peer */
+static size_t max_payload_len(const fastd_peer_t *peer) {
+	size_t len = fastd_max_payload(ctx.max_mtu);
+	if (peer->aggregate)
+		len += sizeof(fastd_aggregate_header_t);
+
+	return len;
+}
+
+/** Returns true if a payload packet is a datagram combining several aggregated packets */
+static bool is_aggregated(const fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	fastd_aggregate_header_t header;
+
+	if (!peer->aggregate || buffer->len < sizeof(header))
+		return false;
+
+	memcpy(&header, buffer->data, sizeof(header));
+	return sizeof(header) + be16toh(header.len) < buffer->len;
+}
+
+/**
+   Tries to compress a payload packet in place, updating the compression ratio estimate
+
+   Returns true if the packet has become smaller.
+*/
+static bool compress_packet(fastd_compress_t *comp, fastd_buffer_t *buffer) {
+	int len = LZ4_compress_fast_extState(
+		ctx.compress_state, buffer->data, (char *)ctx.compress_buffer, buffer->len, buffer->len - 1, 1);
+
+	/* Exponentially weighted moving average with a weight of 1/8 for the new sample */
+	unsigned sample = len > 0 ? 256 * len / buffer->len : 256;
+	comp->ratio = (7 * comp->ratio + sample) / 8;
+
+	if (comp->ratio >= COMPRESS_BYPASS_RATIO)
+		comp->bypass = COMPRESS_BYPASS_PACKETS;
+
+	if (len <= 0)
+		return false;
+
+	memcpy(buffer->data, ctx.compress_buffer, len);
+	buffer->len = len;
+
+	return true;
+}
+
+/**
+   Compresses a payload packet for a peer if compression has been negotiated, and appends the trailer
+
+   Returns the buffer containing the packet, which is a new buffer if the passed buffer didn't have
+   enough tailroom for the trailer. Empty packets (keepalives) are left alone, and datagrams of
+   several aggregated packets are sent uncompressed.
+*/
+fastd_buffer_t *fastd_compress(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	fastd_compress_t *comp = peer->compress;
+	if (!comp || !buffer->len)
+		return buffer;
+
+	/* Packets forwarded between peers may have been moved to the end of their buffer */
+	if (tailroom(buffer) < sizeof(fastd_compress_trailer_t)) {
+		fastd_buffer_t *new_buffer = fastd_buffer_dup(buffer, conf.encrypt_headroom);
+		fastd_buffer_free(buffer);
+		buffer = new_buffer;
+	}
+
+	size_t len = buffer->len;
+	fastd_compress_trailer_t trailer = { .type = COMPRESS_NONE };
+
+	if (len >= COMPRESS_MIN_SIZE && !is_aggregated(peer, buffer)) {
+		if (comp->bypass) {
+			comp->bypass--;
+			comp->tx_bypassed++;
+		} else if (compress_packet(comp, buffer)) {
+			trailer.type = COMPRESS_LZ4;
+			fastd_stats_add(peer, STAT_TX_COMPRESSED, len);
+		}
+	}
+
+	memcpy((uint8_t *)buffer->data + buffer->len, &trailer, sizeof(trailer));
+	buffer->len += sizeof(trailer);
+
+	comp->tx_bytes += len;
+	comp->tx_compressed_bytes += buffer->len;
+
+	return buffer;
+}
+
+/**
+   Removes the trailer of a payload packet received from a peer, and decompresses the packet in place
+
+   Must only be called for non-empty packets from peers compression has been negotiated with. Returns
+   false if the packet is invalid; the buffer isn't freed in this case.
+*/
+bool fastd_decompress(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	fastd_compress_t *comp = peer->compress;
+
+	fastd_compress_trailer_t trailer;
+	buffer->len -= sizeof(trailer);
+	memcpy(&trailer, (const uint8_t *)buffer->data + buffer->len, sizeof(trailer));
+
+	size_t compressed_len = buffer->len + sizeof(trailer);
+
+	switch (trailer.type) {
+	case COMPRESS_NONE:
+		break;
+
+	case COMPRESS_LZ4: {
+		int len = LZ4_decompress_safe(
+			buffer->data, (char *)ctx.compress_buffer, buffer->len,
+			min_size_t(max_payload_len(peer), buffer->len + tailroom(buffer)));
+		if (len <= 0)
+			return false;
+
+		memcpy(buffer->data, ctx.compress_buffer, len);
+		buffer->len = len;
+
+		fastd_stats_add(peer, STAT_RX_COMPRESSED, buffer->len);
+		break;
+	}
+
+	default:
+		return false;
+	}
+
+	comp->rx_bytes += buffer->len;
+	comp->rx_compressed_bytes += compressed_len;
+
+	return true;
+}
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   LZ4 compression of payload packets
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+
+
+/** The compression applied to a payload packet, as stored in its fastd_compress_trailer_t */
+typedef enum fastd_compress_type {
+	COMPRESS_NONE = 0, /**< The payload is sent uncompressed */
+	COMPRESS_LZ4 = 1,  /**< The payload is compressed using the LZ4 block format */
+} fastd_compress_type_t;
+
+/** The compression state of a peer */
+struct fastd_compress {
+	unsigned ratio;  /**< The running estimate of the compressed size of payload packets (in 1/256) */
+	unsigned bypass; /**< The number of packets that are still sent without trying to compress them */
+
+	uint64_t tx_bytes;            /**< The number of payload bytes sent before compression */
+	uint64_t tx_compressed_bytes; /**< The number of payload bytes sent after compression (with trailer) */
+	uint64_t tx_bypassed;         /**< The number of packets sent without trying to compress them */
+	uint64_t rx_bytes;            /**< The number of payload bytes received after decompression */
+	uint64_t rx_compressed_bytes; /**< The number of payload bytes received before decompression (with trailer) */
+};
+
+
+/** Returns true if compression of payload packets is offered to peers */
+static inline bool fastd_use_compression(void) {
+#ifdef WITH_LZ4
+	return conf.compress;
+#else
+	return false;
+#endif
+}
+
+
+#ifdef WITH_LZ4
+
+void fastd_compress_init_buffers(void);
+void fastd_compress_cleanup_buffers(void);
+
+void fastd_compress_init(fastd_peer_t *peer);
+void fastd_compress_free(fastd_peer_t *peer);
+
+fastd_buffer_t *fastd_compress(fastd_peer_t *peer, fastd_buffer_t *buffer);
+bool fastd_decompress(fastd_peer_t *peer, fastd_buffer_t *buffer);
+
+#else /* WITH_LZ4 */
+
+static inline void fastd_compress_init_buffers(void) {}
+static inline void fastd_compress_cleanup_buffers(void) {}
+
+static inline void fastd_compress_init(UNUSED fastd_peer_t *peer) {}
+static inline void fastd_compress_free(UNUSED fastd_peer_t *peer) {}
+
+static inline fastd_buffer_t *fastd_compress(UNUSED fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	return buffer;
+}
+
+static inline bool fastd_decompress(UNUSED fastd_peer_t *peer, UNUSED fastd_buffer_t *buffer) {
+	return false;
+}
+
+#endif /* WITH_LZ4 */
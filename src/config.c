@@ -17,6 +17,7 @@
 
 #include "config.h"
 #include "config.yy.h"
+#include "compress.h"
 #include "crypto.h"
 #include "fastd.h"
 #include "handshake.h"
@@ -185,6 +186,10 @@ static void free_peer_group(fastd_peer_group_t *group) {
 	fastd_string_stack_free(group->peer_dirs);
 	fastd_string_stack_free(group->methods);
 
+	free(group->broadcast_limit);
+	free(group->multicast_limit);
+	free(group->pacing);
+
 	fastd_shell_command_unset(&group->on_up);
 	fastd_shell_command_unset(&group->on_down);
 	fastd_shell_command_unset(&group->on_connect);
@@ -484,6 +489,23 @@ static void configure_method_parameters(void) {
 
 	/* ugly hack to get alignment right for aes128-gcm, which needs data aligned to 16 and has a 24 byte header */
 	conf.decrypt_headroom = alignto(conf.decrypt_headroom, 16) + 8;
+
+	if (conf.packet_index) {
+		/* Keep the alignment of the method packet when the index header has been pulled */
+		conf.overhead += sizeof(fastd_index_header_t);
+		conf.decrypt_headroom -= sizeof(fastd_index_header_t);
+	}
+
+	if (conf.fec_redundancy) {
+		conf.overhead += sizeof(fastd_fec_header_t);
+		conf.decrypt_headroom -= sizeof(fastd_fec_header_t);
+	}
+
+	/* The aggregation header and the compression trailer are part of the encrypted payload */
+	if (conf.aggregate)
+		conf.overhead += sizeof(fastd_aggregate_header_t);
+	if (fastd_use_compression())
+		conf.overhead += sizeof(fastd_compress_trailer_t);
 }
 
 
@@ -517,6 +539,12 @@ static void configure_methods(void) {
 		conf.methods[i].name = method_name->str;
 		if (!fastd_method_create_by_name(method_name->str, &conf.methods[i].provider, &conf.methods[i].method))
 			exit_error("config error: method `%s' not supported", method_name->str);
+
+		if ((conf.methods[i].provider->flags & METHOD_TUN_ONLY) && conf.mode != MODE_TUN)
+			exit_error("config error: method `%s' is available in TUN mode only", method_name->str);
+
+		if (conf.methods[i].provider->flags & METHOD_EXPERIMENTAL)
+			pr_warn("method `%s' is experimental", method_name->str);
 	}
 
 	configure_method_parameters();
@@ -559,6 +587,37 @@ static void config_check_base(void) {
 		if (conf.iface_persist)
 			exit_error("`persist iface' must be set to `no' for L2TP offload");
 	}
+
+	if (conf.iface_pool_size && conf.mode != MODE_MULTITAP)
+		exit_error("the interface pool is available in multi-TAP mode only");
+
+	if (fastd_use_offload_gue()) {
+		if (!fastd_use_routed_tun())
+			exit_error("GUE offload is available in routed TUN mode only");
+
+		pr_warn("GUE offload is experimental");
+	}
+
+	if (fastd_use_offload_esp() && !fastd_use_routed_tun())
+		exit_error("ESP offload is available in routed TUN mode only");
+
+	if ((conf.proxy_arp || conf.proxy_ndp) && conf.mode != MODE_TAP)
+		exit_error("ARP and NDP proxies are available in TAP mode only");
+
+	if (conf.mcast_snooping && conf.mode != MODE_TAP)
+		exit_error("multicast snooping is available in TAP mode only");
+
+	if (conf.probe_remotes && !conf.packet_index)
+		exit_error("probing remotes requires `packet index' to be enabled");
+
+	if (conf.multipath && !conf.probe_remotes)
+		exit_error("multipath requires `probe remotes' to be enabled");
+
+	if (conf.fec_redundancy && !conf.packet_index)
+		exit_error("FEC requires `packet index' to be enabled");
+
+	if (VECTOR_LEN(conf.traffic_classes) && !conf.tx_queue)
+		exit_error("traffic classes require `transmit queue' to be enabled");
 }
 
 /** Performs more checks on the configuration */
@@ -579,7 +638,7 @@ void fastd_config_check(void) {
 
 /** Determines if the configuration will never create more than a single interface */
 bool fastd_config_single_iface(void) {
-	if (conf.mode == MODE_TAP)
+	if (fastd_use_shared_iface())
 		return true;
 
 	if (has_peer_group_peer_dirs(conf.peer_group))
@@ -596,7 +655,7 @@ bool fastd_config_persistent_ifaces(void) {
 	if (fastd_use_android_integration())
 		return true;
 
-	if (conf.mode == MODE_TAP)
+	if (fastd_use_shared_iface())
 		return true;
 
 	if (!conf.iface_persist)
@@ -656,7 +715,7 @@ static void configure_peers(bool dirs_only) {
 		if (fastd_peer_is_floating(peer))
 			ctx.has_floating = true;
 
-		if (conf.mode != MODE_TAP && peer->mtu > ctx.max_mtu)
+		if (!fastd_use_shared_iface() && peer->mtu > ctx.max_mtu)
 			ctx.max_mtu = peer->mtu;
 
 		peer->config_state = CONFIG_STATIC;
@@ -670,8 +729,15 @@ static void configure_peers(bool dirs_only) {
 	/* Reserve one extra block of encrypt headroom for multiaf_tun targets */
 	size_t headroom =
 		max_size_t(conf.encrypt_headroom + sizeof(fastd_block128_t), conf.decrypt_headroom + conf.overhead);
-	ctx.max_buffer = alignto(
-		max_size_t(headroom + fastd_max_payload(ctx.max_mtu), MAX_HANDSHAKE_SIZE), sizeof(fastd_block128_t));
+
+	/* Aggregated and compressed payload packets carry an additional header or trailer before encryption */
+	size_t payload = fastd_max_payload(ctx.max_mtu);
+	if (conf.aggregate)
+		payload += sizeof(fastd_aggregate_header_t);
+	if (fastd_use_compression())
+		payload += sizeof(fastd_compress_trailer_t);
+
+	ctx.max_buffer = alignto(max_size_t(headroom + payload, MAX_HANDSHAKE_SIZE), sizeof(fastd_block128_t));
 }
 
 /** Initialized the peers not configured through peer directories */
@@ -729,7 +795,16 @@ void fastd_config_release(void) {
 	free(conf.groups);
 #endif
 
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(conf.traffic_classes); i++) {
+		fastd_traffic_class_t *class = &VECTOR_INDEX(conf.traffic_classes, i);
+		free(class->name);
+		VECTOR_FREE(class->ports);
+	}
+	VECTOR_FREE(conf.traffic_classes);
+
 	free(conf.ifname);
+	VECTOR_FREE(conf.iface_addresses);
 	free(conf.secret);
 	free(conf.protocol_config);
 	free(conf.log_syslog_ident);
@@ -25,6 +25,7 @@
 	struct in_addr addr4;
 	struct in6_addr addr6;
 	fastd_peer_address_t addr;
+	fastd_rate_limit_t *rate_limit;
 	struct {
 		struct in6_addr addr;
 		char ifname[IFNAMSIZ];
@@ -44,71 +45,111 @@
 %token <addr6> TOK_ADDR6
 %token <addr6_scoped> TOK_ADDR6_SCOPED
 
+%token TOK_ADAPTIVE
+%token TOK_ADDRESS
 %token TOK_ADDRESSES
+%token TOK_AGGREGATE
 %token TOK_ANY
+%token TOK_ARP
 %token TOK_AS
 %token TOK_ASYNC
 %token TOK_AUTO
 %token TOK_BIND
+%token TOK_BROADCAST
+%token TOK_BURST
 %token TOK_CAPABILITIES
+%token TOK_CAPACITY
 %token TOK_CIPHER
+%token TOK_CLASS
+%token TOK_COMPRESSION
 %token TOK_CONNECT
+%token TOK_CONNECTED
+%token TOK_COPY
 %token TOK_DEBUG
 %token TOK_DEBUG2
 %token TOK_DEFAULT
 %token TOK_DISESTABLISH
 %token TOK_DOWN
 %token TOK_DROP
+%token TOK_DSCP
 %token TOK_EARLY
+%token TOK_ECN
 %token TOK_ERROR
+%token TOK_ESP
 %token TOK_ESTABLISH
 %token TOK_FATAL
+%token TOK_FEC
 %token TOK_FLOAT
 %token TOK_FORCE
 %token TOK_FORWARD
 %token TOK_FROM
 %token TOK_GROUP
+%token TOK_GUE
 %token TOK_HANDSHAKES
 %token TOK_HIDE
+%token TOK_HIGH
 %token TOK_INCLUDE
+%token TOK_INDEX
 %token TOK_INFO
 %token TOK_INTERFACE
 %token TOK_IP
 %token TOK_IPV4
 %token TOK_IPV6
+%token TOK_KERNEL
 %token TOK_KEY
 %token TOK_L2TP
 %token TOK_LEVEL
 %token TOK_LIMIT
 %token TOK_LOG
+%token TOK_LOW
+%token TOK_LZ4
 %token TOK_MAC
 %token TOK_MARK
 %token TOK_METHOD
 %token TOK_MODE
 %token TOK_MTU
+%token TOK_MULTICAST
+%token TOK_MULTIPATH
 %token TOK_MULTITAP
+%token TOK_NDP
 %token TOK_NO
 %token TOK_OFFLOAD
 %token TOK_ON
+%token TOK_PACING
 %token TOK_PACKET
+%token TOK_PARALLEL
 %token TOK_PEER
 %token TOK_PEERS
 %token TOK_PERSIST
 %token TOK_PMTU
+%token TOK_POOL
 %token TOK_PORT
 %token TOK_POST_DOWN
 %token TOK_PRE_UP
+%token TOK_PRIORITY
+%token TOK_PROBE
 %token TOK_PROTOCOL
+%token TOK_PROXY
+%token TOK_QUEUE
 %token TOK_REMOTE
+%token TOK_REMOTES
+%token TOK_ROUND_ROBIN
+%token TOK_ROUTE
+%token TOK_ROUTED
 %token TOK_SECRET
 %token TOK_SECURE
+%token TOK_SNOOPING
 %token TOK_SOCKET
+%token TOK_SOCKETS
 %token TOK_STATUS
 %token TOK_STDERR
 %token TOK_SYNC
 %token TOK_SYSLOG
 %token TOK_TAP
 %token TOK_TO
+%token TOK_TOS
+%token TOK_TRAFFIC
+%token TOK_TRANSMIT
 %token TOK_TUN
 %token TOK_UP
 %token TOK_USE
@@ -130,6 +171,11 @@
 		fastd_peer_address_t address, int64_t maybe_port, const char *bindtodevice, unsigned bind_default);
 
 	static void fastd_config_error(YYLTYPE *loc, fastd_parser_state_t *state, const char *s);
+
+	/** Returns the traffic class that is currently being configured */
+	static inline fastd_traffic_class_t *current_traffic_class(void) {
+		return &VECTOR_INDEX(conf.traffic_classes, VECTOR_LEN(conf.traffic_classes) - 1);
+	}
 }
 
 
@@ -148,6 +194,12 @@
 %type <uint64> drop_capabilities_enabled
 %type <tristate> autobool
 %type <boolean> sync
+%type <rate_limit> rate_limit
+%type <uint64> maybe_burst
+%type <int64> maybe_pool_low
+%type <int64> maybe_pool_high
+%type <boolean> maybe_adaptive
+%type <boolean> maybe_pacing_kernel
 
 %%
 start:		START_CONFIG config
@@ -175,7 +227,17 @@ statement:	peer_group_statement
 	|	TOK_HIDE hide ';'
 	|	TOK_INTERFACE interface ';'
 	|	TOK_BIND bind ';'
+	|	TOK_CONNECTED TOK_SOCKETS connected_sockets ';'
+	|	TOK_PARALLEL TOK_HANDSHAKES parallel_handshakes ';'
+	|	TOK_PROBE TOK_REMOTES probe_remotes ';'
+	|	TOK_MULTIPATH multipath ';'
+	|	TOK_FEC fec ';'
+	|	TOK_AGGREGATE aggregate ';'
+	|	TOK_COMPRESSION compression ';'
+	|	TOK_TRANSMIT TOK_QUEUE transmit_queue ';'
+	|	TOK_TRAFFIC TOK_CLASS traffic_class '{' traffic_class_config '}'
 	|	TOK_PACKET TOK_MARK packet_mark ';'
+	|	TOK_PACKET TOK_INDEX packet_index ';'
 	|	TOK_MTU mtu ';'
 	|	TOK_PMTU pmtu ';'
 	|	TOK_MODE mode ';'
@@ -187,13 +249,25 @@ statement:	peer_group_statement
 	|	TOK_ON TOK_POST_DOWN on_post_down ';'
 	|	TOK_STATUS TOK_SOCKET status_socket ';'
 	|	TOK_FORWARD forward ';'
+	|	TOK_PROXY proxy ';'
+	|	TOK_MULTICAST TOK_SNOOPING mcast_snooping ';'
 	;
 
 peer_group_statement:
 		TOK_PEER peer '{' peer_conf '}' peer_after
 	|	TOK_PEER TOK_GROUP peer_group '{' peer_group_config '}' peer_group_after
 	|	TOK_PEER TOK_LIMIT peer_limit ';'
+	|	TOK_BROADCAST TOK_LIMIT rate_limit ';' {
+			free(state->peer_group->broadcast_limit);
+			state->peer_group->broadcast_limit = $3;
+		}
+	|	TOK_MULTICAST TOK_LIMIT rate_limit ';' {
+			free(state->peer_group->multicast_limit);
+			state->peer_group->multicast_limit = $3;
+		}
 	|	TOK_METHOD method ';'
+	|	TOK_COPY TOK_TOS copy_tos ';'
+	|	TOK_PACING pacing ';'
 	|	TOK_ON TOK_UP on_up ';'
 	|	TOK_ON TOK_DOWN on_down ';'
 	|	TOK_ON TOK_CONNECT on_connect ';'
@@ -290,6 +364,34 @@ offload:	TOK_L2TP boolean {
 # endif
 				YYERROR;
 			}
+#endif
+		}
+	|	TOK_GUE boolean {
+#ifdef WITH_OFFLOAD_GUE
+			conf.offload_gue = $2;
+#else
+			if ($2) {
+# ifdef __linux__
+				fastd_config_error(&@$, state, "GUE offload is not supported by this build of fastd");
+# else
+				fastd_config_error(&@$, state, "GUE offload is not supported on this platform");
+# endif
+				YYERROR;
+			}
+#endif
+		}
+	|	TOK_ESP boolean {
+#ifdef WITH_OFFLOAD_ESP
+			conf.offload_esp = $2;
+#else
+			if ($2) {
+# ifdef __linux__
+				fastd_config_error(&@$, state, "ESP offload is not supported by this build of fastd");
+# else
+				fastd_config_error(&@$, state, "ESP offload is not supported on this platform");
+# endif
+				YYERROR;
+			}
 #endif
 		}
 	;
@@ -322,6 +424,54 @@ interface:	TOK_STRING	{
 				YYERROR;
 			}
 		}
+	|	TOK_ADDRESS TOK_STRING {
+#ifdef WITH_IFACE_NETLINK
+			fastd_prefix_t address;
+			if (!fastd_prefix_parse_address(&address, $2->str)) {
+				fastd_config_error(&@$, state, "invalid interface address");
+				YYERROR;
+			}
+
+			VECTOR_ADD(conf.iface_addresses, address);
+#else
+# ifdef __linux__
+			fastd_config_error(&@$, state, "interface addresses are not supported by this build of fastd");
+# else
+			fastd_config_error(&@$, state, "interface addresses are not supported on this platform");
+# endif
+			YYERROR;
+#endif
+		}
+	|	TOK_POOL TOK_UINT maybe_pool_low maybe_pool_high {
+#ifdef WITH_IFACE_NETLINK
+			int64_t low = ($3 >= 0) ? $3 : (int64_t)$2;
+			int64_t high = ($4 >= 0) ? $4 : (int64_t)$2;
+
+			if ($2 > 1024 || low > (int64_t)$2 || high < (int64_t)$2 || high > 1024) {
+				fastd_config_error(&@$, state, "invalid interface pool size");
+				YYERROR;
+			}
+
+			conf.iface_pool_size = $2;
+			conf.iface_pool_low = low;
+			conf.iface_pool_high = high;
+#else
+# ifdef __linux__
+			fastd_config_error(&@$, state, "interface pools are not supported by this build of fastd");
+# else
+			fastd_config_error(&@$, state, "interface pools are not supported on this platform");
+# endif
+			YYERROR;
+#endif
+		}
+	;
+
+maybe_pool_low:	TOK_LOW TOK_UINT { $$ = $2; }
+	|	{ $$ = -1; }
+	;
+
+maybe_pool_high: TOK_HIGH TOK_UINT { $$ = $2; }
+	|	{ $$ = -1; }
 	;
 
 bind:		bind_address maybe_bind_port maybe_bind_interface maybe_bind_default {
@@ -399,7 +549,8 @@ pmtu:		autobool
 
 mode:		TOK_TAP		{ conf.mode = MODE_TAP; }
 	|	TOK_MULTITAP	{ conf.mode = MODE_MULTITAP; }
-	|	TOK_TUN		{ conf.mode = MODE_TUN; }
+	|	TOK_TUN		{ conf.mode = MODE_TUN; conf.tun_routed = false; }
+	|	TOK_TUN TOK_ROUTED { conf.mode = MODE_TUN; conf.tun_routed = true; }
 	;
 
 protocol:	TOK_STRING {
@@ -453,6 +604,7 @@ peer_statement: TOK_REMOTE peer_remote ';'
 	|	TOK_KEY peer_key ';'
 	|	TOK_INTERFACE peer_interface ';'
 	|	TOK_MTU peer_mtu ';'
+	|	TOK_ROUTE peer_route ';'
 	|	TOK_INCLUDE peer_include ';'
 	;
 
@@ -523,6 +675,24 @@ peer_interface:	TOK_STRING {
 				YYERROR;
 			}
 		}
+	|	TOK_ADDRESS TOK_STRING {
+#ifdef WITH_IFACE_NETLINK
+			fastd_prefix_t address;
+			if (!fastd_prefix_parse_address(&address, $2->str)) {
+				fastd_config_error(&@$, state, "invalid interface address");
+				YYERROR;
+			}
+
+			VECTOR_ADD(state->peer->iface_addresses, address);
+#else
+# ifdef __linux__
+			fastd_config_error(&@$, state, "interface addresses are not supported by this build of fastd");
+# else
+			fastd_config_error(&@$, state, "interface addresses are not supported on this platform");
+# endif
+			YYERROR;
+#endif
+		}
 	;
 
 peer_mtu:	TOK_UINT {
@@ -534,6 +704,18 @@ peer_mtu:	TOK_UINT {
 			state->peer->mtu = $1;
 		}
 	;
+
+peer_route:	TOK_STRING {
+			fastd_prefix_t prefix;
+			if (!fastd_prefix_parse(&prefix, $1->str)) {
+				fastd_config_error(&@$, state, "invalid route");
+				YYERROR;
+			}
+
+			VECTOR_ADD(state->peer->routes, prefix);
+		}
+	;
+
 peer_include:	TOK_STRING {
 			if (!fastd_config_read($1->str, state->peer_group, state->peer, state->depth))
 				YYERROR;
@@ -552,6 +734,48 @@ peer_group_after:
 		}
 	;
 
+rate_limit:	TOK_UINT maybe_burst {
+			if ($1 > 1000000 || $2 > 1000000) {
+				fastd_config_error(&@$, state, "invalid rate limit");
+				YYERROR;
+			}
+
+			$$ = fastd_new(fastd_rate_limit_t);
+			$$->rate = $1;
+			$$->burst = $2 ? $2 : max_size_t($1, 1);
+		}
+	;
+
+maybe_burst:	TOK_BURST TOK_UINT { $$ = $2; }
+	|	{ $$ = 0; }
+	;
+
+pacing:		TOK_NO {
+			free(state->peer_group->pacing);
+			state->peer_group->pacing = fastd_new0(fastd_pacing_rate_t);
+		}
+	|	TOK_UINT maybe_burst maybe_pacing_kernel {
+			if (!$1 || $1 > 100000000 || $2 > 100000000) {
+				fastd_config_error(&@$, state, "invalid pacing rate");
+				YYERROR;
+			}
+
+			free(state->peer_group->pacing);
+			state->peer_group->pacing = fastd_new(fastd_pacing_rate_t);
+
+			/* The rate is configured in kbit/s */
+			state->peer_group->pacing->rate = 125 * $1;
+			state->peer_group->pacing->burst =
+				$2 ? $2 : max_size_t(125 * $1 * PACING_DEFAULT_BURST / 1000, 1);
+			state->peer_group->pacing->kernel = $3;
+		}
+	;
+
+maybe_pacing_kernel:
+		TOK_KERNEL	{ $$ = true; }
+	|			{ $$ = false; }
+	;
+
 peer_limit:	TOK_UINT {
 			if ($1 > INT_MAX) {
 				fastd_config_error(&@$, state, "invalid peer limit");
@@ -562,6 +786,12 @@ peer_limit:	TOK_UINT {
 		}
 	;
 
+copy_tos:	TOK_NO		{ state->peer_group->copy_tos = TOS_COPY_NONE; }
+	|	TOK_ECN		{ state->peer_group->copy_tos = TOS_COPY_ECN; }
+	|	TOK_DSCP	{ state->peer_group->copy_tos = TOS_COPY_DSCP; }
+	|	TOK_YES		{ state->peer_group->copy_tos = TOS_COPY_ALL; }
+	;
+
 method:		TOK_STRING {
 			fastd_config_method(state->peer_group, $1->str);
 		}
@@ -606,6 +836,160 @@ on_verify:	sync TOK_STRING {
 forward:	boolean		{ conf.forward = $1; }
 	;
 
+connected_sockets:
+		boolean		{ conf.connected_sockets = $1; }
+	;
+
+packet_index:	boolean		{ conf.packet_index = $1; }
+	;
+
+parallel_handshakes:
+		boolean		{ conf.parallel_handshakes = $1; }
+	;
+
+probe_remotes:	boolean		{ conf.probe_remotes = $1; }
+	;
+
+multipath:	TOK_NO		{ conf.multipath = MULTIPATH_OFF; }
+	|	TOK_ROUND_ROBIN	{ conf.multipath = MULTIPATH_ROUND_ROBIN; }
+	|	TOK_CAPACITY	{ conf.multipath = MULTIPATH_CAPACITY; }
+	;
+
+fec:		TOK_NO {
+			conf.fec_redundancy = 0;
+			conf.fec_adaptive = false;
+		}
+	|	TOK_UINT maybe_adaptive {
+			if ($1 < 1 || $1 > 100) {
+				fastd_config_error(&@$, state, "invalid FEC redundancy");
+				YYERROR;
+			}
+
+			conf.fec_redundancy = $1;
+			conf.fec_adaptive = $2;
+		}
+	;
+
+aggregate:	TOK_NO {
+			conf.aggregate = false;
+			conf.aggregate_delay = 0;
+		}
+	|	TOK_UINT {
+			if ($1 > 100) {
+				fastd_config_error(&@$, state, "invalid aggregation delay");
+				YYERROR;
+			}
+
+			conf.aggregate = true;
+			conf.aggregate_delay = $1;
+		}
+	;
+
+compression:	TOK_NO {
+#ifdef WITH_LZ4
+			conf.compress = false;
+#endif
+		}
+	|	TOK_LZ4 {
+#ifdef WITH_LZ4
+			conf.compress = true;
+#else
+			fastd_config_error(&@$, state, "LZ4 compression is not supported by this build of fastd");
+			YYERROR;
+#endif
+		}
+	;
+
+transmit_queue:	boolean		{ conf.tx_queue = $1; }
+	;
+
+traffic_class:	TOK_STRING {
+			if (VECTOR_LEN(conf.traffic_classes) >= TXQ_MAX_CLASSES) {
+				fastd_config_error(&@$, state, "too many traffic classes");
+				YYERROR;
+			}
+
+			/* Unclassified packets are reported as traffic class "default" */
+			bool duplicate = (strcmp($1->str, "default") == 0);
+
+			size_t i;
+			for (i = 0; i < VECTOR_LEN(conf.traffic_classes); i++) {
+				if (strcmp($1->str, VECTOR_INDEX(conf.traffic_classes, i).name) == 0)
+					duplicate = true;
+			}
+
+			if (duplicate) {
+				fastd_config_error(&@$, state, "duplicate traffic class name");
+				YYERROR;
+			}
+
+			fastd_traffic_class_t class = { .name = fastd_strdup($1->str) };
+			VECTOR_ADD(conf.traffic_classes, class);
+		}
+	;
+
+traffic_class_config:
+		traffic_class_config traffic_class_statement
+	|
+	;
+
+traffic_class_statement:
+		TOK_DSCP traffic_class_dscp ';'
+	|	TOK_PORT traffic_class_port ';'
+	|	TOK_PRIORITY traffic_class_priority ';'
+	;
+
+traffic_class_dscp:
+		TOK_UINT {
+			if ($1 > 63) {
+				fastd_config_error(&@$, state, "invalid DSCP value");
+				YYERROR;
+			}
+
+			current_traffic_class()->dscp |= UINT64_C(1) << $1;
+		}
+	;
+
+traffic_class_port:
+		TOK_UINT {
+			if ($1 < 1 || $1 > 65535) {
+				fastd_config_error(&@$, state, "invalid port");
+				YYERROR;
+			}
+
+			uint16_t port = $1;
+			VECTOR_ADD(current_traffic_class()->ports, port);
+		}
+	;
+
+traffic_class_priority:
+		TOK_UINT {
+#ifdef USE_SOCKET_PRIORITY
+			/* Higher priorities require CAP_NET_ADMIN */
+			if ($1 > 6) {
+				fastd_config_error(&@$, state, "invalid socket priority");
+				YYERROR;
+			}
+
+			current_traffic_class()->priority = $1;
+#else
+			fastd_config_error(&@$, state, "setting a socket priority is not supported on this system");
+			YYERROR;
+#endif
+		}
+	;
+
+maybe_adaptive:	TOK_ADAPTIVE	{ $$ = true; }
+	|			{ $$ = false; }
+	;
+
+proxy:		TOK_ARP boolean	{ conf.proxy_arp = $2; }
+	|	TOK_NDP boolean	{ conf.proxy_ndp = $2; }
+	;
+
+mcast_snooping:	boolean		{ conf.mcast_snooping = $1; }
+	;
+
 
 include:	TOK_PEER TOK_STRING maybe_as {
 			fastd_peer_t *peer = fastd_new0(fastd_peer_t);
@@ -17,12 +17,16 @@
 
 #include "fastd.h"
 #include "async.h"
+#include "compress.h"
 #include "config.h"
 #include "crypto.h"
+#include "offload/esp/esp.h"
+#include "offload/gue/gue.h"
 #include "offload/l2tp/l2tp.h"
 #include "peer.h"
 #include "peer_group.h"
 #include "peer_hashtable.h"
+#include "peer_index.h"
 #include "polling.h"
 #include "version.h"
 
@@ -140,6 +144,8 @@ static void init_sockets(void) {
 	if (ctx.ioctl_sock < 0)
 		exit_errno("unable to create ioctl socket");
 
+	fastd_iface_netlink_init();
+
 	ctx.socks = fastd_new_array(conf.n_bind_addrs, fastd_socket_t);
 
 	size_t i;
@@ -173,6 +179,8 @@ static void close_sockets(void) {
 
 	if (close(ctx.ioctl_sock))
 		pr_error_errno("close");
+
+	fastd_iface_netlink_cleanup();
 }
 
 /** Calls the on-pre-up command */
@@ -403,10 +411,6 @@ static inline void init_early(void) {
 
 	fastd_random_init();
 
-	unsigned int seed;
-	fastd_random_bytes(&seed, sizeof(seed), false);
-	srandom(seed);
-
 	fastd_cipher_init();
 	fastd_mac_init();
 }
@@ -475,9 +479,6 @@ static inline void init(int argc, char *argv[]) {
 	fastd_sem_init(&ctx.verify_limit, VERIFY_LIMIT);
 #endif
 
-	if (fastd_use_offload_l2tp())
-		fastd_offload_l2tp_init();
-
 	if (pthread_attr_init(&ctx.detached_thread))
 		exit_errno("pthread_attr_init");
 	if (pthread_attr_setdetachstate(&ctx.detached_thread, PTHREAD_CREATE_DETACHED))
@@ -497,16 +498,27 @@ static inline void init(int argc, char *argv[]) {
 	fastd_status_init();
 	fastd_async_init();
 
+	if (fastd_use_offload_l2tp())
+		fastd_offload_l2tp_init();
+
+	if (fastd_use_offload_gue())
+		fastd_offload_gue_init();
+
+	if (fastd_use_offload_esp())
+		fastd_offload_esp_init();
+
 	fastd_socket_bind_all();
 
 	on_pre_up();
 
-	if (conf.mode == MODE_TAP || fastd_use_android_integration()) {
+	if (fastd_use_shared_iface() || fastd_use_android_integration()) {
 		ctx.iface = fastd_iface_open(NULL);
 		if (!ctx.iface)
 			exit(1); /* An error message has already been printed by fastd_iface_open() */
 	}
 
+	fastd_iface_pool_init();
+
 	/* change groups before trying to write the PID file as they can be relevant for file access */
 	set_groups();
 	write_pid();
@@ -531,6 +543,7 @@ static inline void init(int argc, char *argv[]) {
 
 	fastd_configure_peers();
 	fastd_init_buffers();
+	fastd_compress_init_buffers();
 
 	if (conf.drop_caps == DROP_CAPS_ON)
 		drop_caps();
@@ -592,6 +605,16 @@ static inline void handle_signals(void) {
 /** A single iteration of fastd's main loop */
 static inline void run(void) {
 	fastd_task_handle();
+
+	if (fastd_use_offload_l2tp())
+		fastd_offload_l2tp_flush();
+
+	if (fastd_use_offload_gue())
+		fastd_offload_gue_flush();
+
+	if (fastd_use_offload_esp())
+		fastd_offload_esp_flush();
+
 	fastd_poll_handle();
 
 	handle_signals();
@@ -613,8 +636,10 @@ static void delete_peers(void) {
 static inline void cleanup(void) {
 	pr_info("terminating fastd");
 
+	fastd_iface_pool_cleanup();
 	delete_peers();
 
+	fastd_compress_cleanup_buffers();
 	fastd_cleanup_buffers();
 
 	if (ctx.iface) {
@@ -629,15 +654,25 @@ static inline void cleanup(void) {
 	on_post_down();
 
 	fastd_peer_hashtable_free();
+	fastd_peer_index_free();
 
 	if (fastd_use_offload_l2tp())
 		fastd_offload_l2tp_cleanup();
 
+	if (fastd_use_offload_gue())
+		fastd_offload_gue_cleanup();
+
+	if (fastd_use_offload_esp())
+		fastd_offload_esp_cleanup();
+
 	pthread_attr_destroy(&ctx.detached_thread);
 
 	VECTOR_FREE(ctx.async_pids);
 	VECTOR_FREE(ctx.peers);
 	VECTOR_FREE(ctx.eth_addrs);
+	VECTOR_FREE(ctx.neigh_entries);
+	VECTOR_FREE(ctx.mcast_members);
+	fastd_route_free(&ctx.routes);
 
 	free(ctx.protocol_state);
 
@@ -20,6 +20,7 @@
 #include "buffer.h"
 #include "log.h"
 #include "polling.h"
+#include "route.h"
 #include "sem.h"
 #include "shell.h"
 #include "task.h"
@@ -83,12 +84,31 @@ struct fastd_protocol {
 #endif
 
 
-	/** Handles a received payload packet (performs decryption and validity check, etc.) */
-	void (*handle_recv)(fastd_peer_t *peer, fastd_buffer_t *buffer);
+	/**
+	   Handles a received payload packet (performs decryption and validity check, etc.)
+
+	   Returns true if the packet has been authenticated. \e reordered is set if an authenticated packet
+	   is older than the newest packet received before.
+	*/
+	bool (*handle_recv)(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, bool *reordered);
 
 	/** Sends a payload data packet to the given peer */
 	void (*send)(fastd_peer_t *peer, fastd_buffer_t *buffer);
 
+	/**
+	   Encrypts the payload of a path probe for the given peer using the current session
+
+	   Consumes the passed buffer. Returns NULL if no probe can be sent to the peer.
+	*/
+	fastd_buffer_t *(*encrypt_probe)(fastd_peer_t *peer, fastd_buffer_t *buffer);
+
+	/**
+	   Decrypts and authenticates a path probe received from the given peer
+
+	   Consumes the passed buffer. Returns NULL if the verification has failed.
+	*/
+	fastd_buffer_t *(*decrypt_probe)(fastd_peer_t *peer, fastd_buffer_t *buffer);
+
 
 	/** Initializes the protocol state for a peer */
 	void (*init_peer_state)(fastd_peer_t *peer);
@@ -165,7 +185,19 @@ struct fastd_socket {
 	const fastd_bind_address_t *addr; /**< The address this socket is supposed to be bound to (or NULL) */
 	fastd_peer_address_t *bound_addr; /**< Address that was bound to (differs from addr when it has random port) */
 	fastd_peer_t *peer;               /**< If the socket belongs to a single peer, contains that peer */
-	fastd_socket_t *parent;           /**< Original of L2TP offload socket */
+	fastd_socket_t *parent;           /**< Original of a cloned socket (L2TP offload or connected peer socket) */
+	bool txtime;                      /**< Specifies if SO_TXTIME is enabled, so the kernel can pace sent packets */
+#ifdef USE_SOCKET_PRIORITY
+	int priority; /**< The SO_PRIORITY currently set on the socket */
+#endif
+};
+
+/** A priority class of the transmit queues */
+struct fastd_traffic_class {
+	char *name;             /**< The name of the traffic class */
+	uint64_t dscp;          /**< Bitmask of the inner DSCP values selecting the class */
+	VECTOR(uint16_t) ports; /**< Inner TCP and UDP ports (source or destination) selecting the class */
+	int priority;           /**< The socket priority of the class's packets (default: 0) */
 };
 
 /** A TUN/TAP interface */
@@ -175,17 +207,43 @@ struct fastd_iface {
 	fastd_peer_t *peer; /**< The peer associated with the interface (if any) */
 	uint16_t mtu;       /**< The MTU of the interface */
 	bool cleanup;       /**< Determines if the interface should be deleted after use; not used on all platforms */
+	bool idle;          /**< Specifies if the interface is an idle member of the interface pool */
+};
+
+/** The pool of pre-created TAP interfaces used for peers in multi-TAP mode */
+struct fastd_iface_pool {
+	VECTOR(fastd_iface_t *) idle; /**< The idle interfaces */
+	bool closed;                  /**< Set on shutdown; interfaces are not returned to the pool anymore */
+
+	uint64_t hits;      /**< The number of peer interfaces taken from the pool */
+	uint64_t misses;    /**< The number of peer interfaces created because the pool was empty */
+	uint64_t discarded; /**< The number of interfaces destroyed instead of being returned to the pool */
 };
 
 
 /** Type of a traffic stat counter */
 typedef enum fastd_stat_type {
-	STAT_RX = 0,       /**< Reception statistics (total) */
-	STAT_RX_REORDERED, /**< Reception statistics (reordered) */
-	STAT_TX,           /**< Transmission statistics (OK) */
-	STAT_TX_DROPPED,   /**< Transmission statistics (dropped because of full queues) */
-	STAT_TX_ERROR,     /**< Transmission statistics (other errors) */
-	STAT_MAX,          /**< (Number of defined stat types) */
+	STAT_RX = 0,            /**< Reception statistics (total) */
+	STAT_RX_REORDERED,      /**< Reception statistics (reordered) */
+	STAT_RX_FORWARDED,      /**< Reception statistics (forwarded to another peer without passing the interface) */
+	STAT_RX_LOCAL,          /**< Reception statistics (written to the local interface) */
+	STAT_TX,                /**< Transmission statistics (OK) */
+	STAT_TX_DROPPED,        /**< Transmission statistics (dropped because of full queues) */
+	STAT_TX_ERROR,          /**< Transmission statistics (other errors) */
+	STAT_ARP_SUPPRESSED,    /**< ARP requests answered or dropped by the neighbour proxy instead of being flooded */
+	STAT_ND_SUPPRESSED,     /**< Neighbour solicitations answered or dropped by the neighbour proxy */
+	STAT_BROADCAST_LIMITED, /**< Broadcast frames dropped because of the peer's rate limit */
+	STAT_MULTICAST_LIMITED, /**< Multicast frames dropped because of the peer's rate limit */
+	STAT_RX_FEC_RECOVERED,  /**< Payload packets reconstructed from FEC parity packets */
+	STAT_TX_FEC_PARITY,     /**< FEC parity packets sent */
+	STAT_TX_PACED,          /**< Packets sent with a delayed departure time because of the peer's pacing rate */
+	STAT_TX_PACING_DROPPED, /**< Packets dropped because they exceeded the peer's pacing rate */
+	STAT_TX_QUEUE_DROPPED,  /**< Packets dropped by the peer's transmit queue */
+	STAT_TX_AGGREGATED,     /**< Payload packets sent in a datagram together with other payload packets */
+	STAT_RX_AGGREGATED,     /**< Payload packets received in a datagram together with other payload packets */
+	STAT_TX_COMPRESSED,     /**< Payload packets sent compressed (with their uncompressed size) */
+	STAT_RX_COMPRESSED,     /**< Payload packets received compressed (with their uncompressed size) */
+	STAT_MAX,               /**< (Number of defined stat types) */
 } fastd_stat_type_t;
 
 /** Some kind of network transfer statistics */
@@ -216,6 +274,12 @@ struct fastd_config {
 	bool iface_persist; /**< Configures if peer-specific interfaces should exist always, or only when there's an
 			       established connection */
 
+	VECTOR(fastd_prefix_t) iface_addresses; /**< Addresses configured on all interfaces */
+
+	size_t iface_pool_size; /**< The number of idle TAP interfaces created in advance in multi-TAP mode */
+	size_t iface_pool_low;  /**< The interface pool is refilled when fewer interfaces are idle */
+	size_t iface_pool_high; /**< The maximum number of idle interfaces kept in the interface pool */
+
 	size_t n_bind_addrs;              /**< Number of elements in bind_addrs */
 	fastd_bind_address_t *bind_addrs; /**< Configured bind addresses */
 
@@ -226,12 +290,39 @@ struct fastd_config {
 
 	uint16_t mtu;      /**< The configured MTU */
 	fastd_mode_t mode; /**< The configured mode of operation */
+	bool tun_routed;   /**< Specifies if all peers share a single TUN interface with per-peer routes */
 
 #ifdef USE_PACKET_MARK
 	uint32_t packet_mark; /**< The configured packet mark (or 0) */
 #endif
 	bool forward; /**< Specifies if packet forwarding is enable */
 
+	bool connected_sockets;   /**< Specifies if established peers get a connected socket sharing the bound port */
+	bool packet_index;        /**< Specifies if peers are asked to prefix payload packets with a session index */
+	bool parallel_handshakes; /**< Specifies if handshakes are sent to all addresses of a peer's remotes at once */
+	bool probe_remotes;       /**< Specifies if the paths to all addresses of a peer's remotes are measured */
+
+	fastd_multipath_t multipath; /**< Specifies if payload packets are striped across several paths to a peer */
+
+	uint8_t fec_redundancy; /**< The number of FEC parity packets per 100 payload packets (or 0 if disabled) */
+	bool fec_adaptive;      /**< Specifies if the FEC group size is adapted to the loss rate reported by peers */
+
+	bool aggregate;           /**< Specifies if small payload packets are aggregated into shared datagrams */
+	uint32_t aggregate_delay; /**< The time small payload packets are held back for aggregation (in ms) */
+
+#ifdef WITH_LZ4
+	bool compress; /**< Specifies if payload packets are compressed using LZ4 */
+#endif
+
+	bool tx_queue; /**< Specifies if packets that can't be sent right away are kept in per-peer transmit queues */
+	VECTOR(fastd_traffic_class_t)
+	traffic_classes; /**< The configured traffic classes of the transmit queues, highest priority first */
+
+	bool proxy_arp; /**< Specifies if ARP requests are answered using the learned IPv4 neighbour table */
+	bool proxy_ndp; /**< Specifies if neighbour solicitations are answered using the learned IPv6 neighbour table */
+
+	bool mcast_snooping; /**< Specifies if multicast frames are only sent to peers with members or routers */
+
 	fastd_drop_caps_t drop_caps; /**< Specifies if and when to drop capabilities */
 
 #ifdef USE_USER
@@ -277,6 +368,14 @@ struct fastd_config {
 	bool offload_l2tp; /**< Enable L2TP offloading */
 #endif
 
+#ifdef WITH_OFFLOAD_GUE
+	bool offload_gue; /**< Enable GUE offloading */
+#endif
+
+#ifdef WITH_OFFLOAD_ESP
+	bool offload_esp; /**< Enable ESP offloading */
+#endif
+
 #ifdef __ANDROID__
 	bool android_integration; /**< Enable Android GUI integration features */
 #endif
@@ -326,15 +425,34 @@ struct fastd_context {
 	fastd_offload_l2tp_t *offload_l2tp; /**< Global L2TP offload state */
 #endif
 
+#ifdef WITH_OFFLOAD_GUE
+	fastd_offload_gue_t *offload_gue; /**< Global GUE offload state */
+#endif
+
+#ifdef WITH_OFFLOAD_ESP
+	fastd_offload_esp_t *offload_esp; /**< Global ESP offload state */
+#endif
+
+#ifdef WITH_LZ4
+	void *compress_state;     /**< The LZ4 compression state */
+	uint8_t *compress_buffer; /**< Scratch buffer the payload packets are compressed and decompressed into */
+#endif
+
 	bool has_floating; /**< Specifies if any of the configured peers have floating remotes */
 	uint16_t max_mtu;  /**< The maximum MTU of all peer-specific interfaces */
 	size_t max_buffer; /**< Maximum buffer size needed for any combination of peer MTU, method, or handshake */
 
+	int tx_priority; /**< The socket priority of the payload packet currently being sent (0 for other packets) */
+
 	uint32_t peer_addr_ht_seed;           /**< The hash seed used for peer_addr_ht */
 	size_t peer_addr_ht_size;             /**< The number of hash buckets in the peer address hashtable */
 	size_t peer_addr_ht_used;             /**< The current number of entries in the peer address hashtable */
 	VECTOR(fastd_peer_t *) *peer_addr_ht; /**< An array of hash buckets for the peer hash table */
 
+	size_t peer_index_size;    /**< The number of slots in the session index table */
+	size_t peer_index_used;    /**< The number of assigned session indices */
+	fastd_peer_t **peer_index; /**< The session index table, mapping local session indices to peers */
+
 	fastd_pqueue_t *task_queue;    /**< Priority queue of scheduled tasks */
 	fastd_task_t next_maintenance; /**< Schedules the next maintenance call */
 
@@ -349,8 +467,15 @@ struct fastd_context {
 	int android_ctrl_sock_fd; /**< The unix domain socket for communicating with Android GUI */
 #endif
 
-	FILE *urandom;  /**< /dev/urandom FILE */
+#ifndef HAVE_GETRANDOM
+	int urandom; /**< /dev/urandom file descriptor */
+#endif
+
 	int ioctl_sock; /**< The global ioctl socket */
+#ifdef WITH_IFACE_NETLINK
+	fastd_iface_nl_t *iface_nl;    /**< rtnetlink state for interface configuration */
+	fastd_iface_pool_t iface_pool; /**< The pool of idle TAP interfaces */
+#endif
 
 	size_t n_socks;        /**< The number of sockets in socks */
 	fastd_socket_t *socks; /**< Array of all sockets */
@@ -363,6 +488,16 @@ struct fastd_context {
 	VECTOR(fastd_peer_eth_addr_t)
 	eth_addrs; /**< Sorted vector of all known ethernet addresses with associated peers and timeouts */
 
+	VECTOR(fastd_neigh_entry_t)
+	neigh_entries; /**< Sorted vector of IP-to-MAC bindings learned by the neighbour proxy */
+
+	fastd_route_table_t routes; /**< The routes of all peers for routed TUN mode */
+
+	VECTOR(fastd_mcast_member_t)
+	mcast_members; /**< Sorted vector of multicast group memberships learned from IGMP and MLD reports */
+	fastd_timeout_t
+		mcast_querier_timeout[MCAST_AF_MAX]; /**< Timeouts after which no multicast querier is assumed anymore */
+
 	uint32_t unknown_handshake_seed; /**< Hash seed for the unknown handshake hashtables */
 	fastd_handshake_timeout_t
 		*unknown_handshakes[UNKNOWN_TABLES]; /**< Hash tables unknown addresses handshakes have been sent to */
@@ -386,25 +521,30 @@ void fastd_main(int argc, char *argv[]);
 
 void fastd_send(
 	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const fastd_buffer_t *buffer, size_t stat_size);
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size);
+void fastd_send_payload(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size);
 void fastd_send_data(fastd_buffer_t *buffer, fastd_peer_t *source, fastd_peer_t *dest);
 
 void fastd_receive_unknown_init(void);
 void fastd_receive_unknown_free(void);
 void fastd_receive(fastd_socket_t *sock);
-void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered);
+void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered, uint8_t tos);
 
 void fastd_close_all_fds(void);
 
 void fastd_socket_bind_all(void);
 fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af);
-fastd_socket_t *fastd_socket_open_offload(fastd_socket_t *sock, const fastd_peer_address_t *local_addr);
+fastd_socket_t *fastd_socket_clone(fastd_socket_t *sock, const fastd_peer_address_t *local_addr);
+bool fastd_socket_connect(fastd_socket_t *sock, const fastd_peer_address_t *addr);
 void fastd_socket_close(fastd_socket_t *sock);
 void fastd_socket_error(const fastd_socket_t *sock);
 
 void fastd_resolve_peer(fastd_peer_t *peer, fastd_remote_t *remote);
 
 bool fastd_iface_format_name(char ifname[IFNAMSIZ], const fastd_peer_t *peer);
+bool fastd_iface_format_offload_name(char ifname[IFNAMSIZ], const fastd_peer_t *peer);
 fastd_iface_t *fastd_iface_open(fastd_peer_t *peer);
 void fastd_iface_handle(fastd_iface_t *iface);
 void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t *buffer);
@@ -413,11 +553,51 @@ void fastd_iface_close(fastd_iface_t *iface);
 bool fastd_iface_set_mtu(const char *ifname, uint16_t mtu);
 #endif
 
+#ifdef WITH_IFACE_NETLINK
+
+void fastd_iface_netlink_init(void);
+void fastd_iface_netlink_cleanup(void);
+bool fastd_iface_netlink_configure(fastd_iface_t *iface, const char *ifname);
+bool fastd_iface_netlink_release(fastd_iface_t *iface);
+bool fastd_iface_netlink_egress_fq(const fastd_peer_address_t *addr, char ifname[IF_NAMESIZE], bool *fq);
+
+fastd_iface_t *fastd_iface_open_idle(void);
+void fastd_iface_pool_init(void);
+void fastd_iface_pool_cleanup(void);
+void fastd_iface_pool_maintenance(void);
+fastd_iface_t *fastd_iface_pool_get(fastd_peer_t *peer, const char *ifname);
+bool fastd_iface_pool_put(fastd_iface_t *iface);
+
+#else /* WITH_IFACE_NETLINK */
+
+static inline void fastd_iface_netlink_init(void) {}
+static inline void fastd_iface_netlink_cleanup(void) {}
+
+static inline void fastd_iface_pool_init(void) {}
+static inline void fastd_iface_pool_cleanup(void) {}
+static inline void fastd_iface_pool_maintenance(void) {}
+
+static inline fastd_iface_t *fastd_iface_pool_get(UNUSED fastd_peer_t *peer, UNUSED const char *ifname) {
+	return NULL;
+}
+
+static inline bool fastd_iface_pool_put(UNUSED fastd_iface_t *iface) {
+	return false;
+}
+
+static inline bool fastd_iface_netlink_egress_fq(
+	UNUSED const fastd_peer_address_t *addr, UNUSED char ifname[IF_NAMESIZE], UNUSED bool *fq) {
+	return false;
+}
+
+#endif /* WITH_IFACE_NETLINK */
+
 void fastd_random_init(void);
 void fastd_random_bytes(void *buffer, size_t len, bool secure);
 void fastd_random_cleanup(void);
 
 int64_t fastd_get_time(void);
+int64_t fastd_get_time_ns(void);
 
 
 #ifdef __ANDROID__
@@ -459,7 +639,8 @@ static inline void fastd_status_handle(void) {}
 
 /** Returns a random number between \a min (inclusively) and \a max (exclusively) */
 static inline int fastd_rand(int min, int max) {
-	unsigned int r = (unsigned int)random();
+	unsigned int r;
+	fastd_random_bytes(&r, sizeof(r), false);
 	return (r % (max - min) + min);
 }
 
@@ -474,6 +655,17 @@ static inline void fastd_setnonblock(int fd) {
 }
 
 
+/** Checks if routed TUN mode is used */
+static inline bool fastd_use_routed_tun(void) {
+	return conf.mode == MODE_TUN && conf.tun_routed;
+}
+
+/** Checks if a single interface is shared by all peers */
+static inline bool fastd_use_shared_iface(void) {
+	return conf.mode == MODE_TAP || fastd_use_routed_tun();
+}
+
+
 /** Returns the maximum payload size \em fastd is configured to transport */
 static inline size_t fastd_max_payload(uint16_t mtu) {
 	switch (conf.mode) {
@@ -618,6 +810,24 @@ static inline bool fastd_use_offload_l2tp(void) {
 #endif
 }
 
+/** Returns true if GUE offloading is enabled */
+static inline bool fastd_use_offload_gue(void) {
+#ifdef WITH_OFFLOAD_GUE
+	return conf.offload_gue;
+#else
+	return false;
+#endif
+}
+
+/** Returns true if ESP offloading is enabled */
+static inline bool fastd_use_offload_esp(void) {
+#ifdef WITH_OFFLOAD_ESP
+	return conf.offload_esp;
+#else
+	return false;
+#endif
+}
+
 /** Returns true if android integration is enabled */
 static inline bool fastd_use_android_integration(void) {
 #ifdef __ANDROID__
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Forward error correction of payload packets using XOR parity
+
+   When both peers support it, encrypted payload packets are sent in groups; after the last
+   packet of a group, a parity packet containing the XOR of all packets of the group (padded
+   to the length of the longest one) is sent. The receiver can reconstruct a single lost packet
+   of each group from the parity packet and the other packets. The code is systematic: payload
+   packets are sent unchanged apart from a small header, so no latency is added when no packets
+   are lost. Reconstructed packets are authenticated by the method like any other packet, so
+   forged parity packets can't inject data. As the FEC header isn't authenticated, payload
+   packets are only added to their group (and the loss rate in their header is only used)
+   after the method has authenticated them.
+
+   The group size follows from the configured redundancy. In adaptive mode, the configured
+   redundancy is the maximum, and the group size is adjusted to the loss rate the peer reports
+   in the headers of its payload packets, so a lossless link only carries little redundancy.
+*/
+
+
+#include "fec.h"
+#include "path.h"
+#include "peer_index.h"
+
+
+/** Returns the maximum length of an encrypted payload packet */
+static size_t max_packet_len(void) {
+	return fastd_max_payload(ctx.max_mtu) + conf.overhead;
+}
+
+/** Returns the size of the next group of packets sent to the peer */
+static uint8_t group_size(const fastd_fec_t *fec) {
+	unsigned size = (100 + conf.fec_redundancy - 1) / conf.fec_redundancy;
+
+	if (conf.fec_adaptive) {
+		unsigned adaptive = FEC_GROUP_MAX;
+		if (fec->remote_loss)
+			adaptive = FEC_ADAPTIVE_LOSS_TARGET / fec->remote_loss;
+
+		if (adaptive > size)
+			size = adaptive;
+	}
+
+	if (size > FEC_GROUP_MAX)
+		size = FEC_GROUP_MAX;
+
+	return size;
+}
+
+/** Allocates the FEC state of a peer after FEC has been negotiated */
+void fastd_fec_init(fastd_peer_t *peer) {
+	fastd_fec_t *fec = fastd_new0(fastd_fec_t);
+
+	fec->size = max_packet_len();
+	fec->tx_parity = fastd_alloc0(fec->size);
+	fec->rx_data = fastd_alloc0(fec->size);
+	fec->rx_parity = fastd_alloc0(fec->size);
+	fec->rx_packet = fastd_alloc(fec->size);
+
+	fec->tx_group_size = group_size(fec);
+
+	peer->fec = fec;
+}
+
+/** Frees the FEC state of a peer */
+void fastd_fec_free(fastd_peer_t *peer) {
+	fastd_fec_t *fec = peer->fec;
+	if (!fec)
+		return;
+
+	free(fec->tx_parity);
+	free(fec->rx_data);
+	free(fec->rx_parity);
+	free(fec->rx_packet);
+	free(fec);
+
+	peer->fec = NULL;
+}
+
+/** XORs \e len bytes of \e src into \e dest */
+static void xor_into(uint8_t *dest, const uint8_t *src, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		dest[i] ^= src[i];
+}
+
+/** Prefixes a packet with an FEC header and the session index assigned by the receiver, consuming the buffer */
+static fastd_buffer_t *push_headers(fastd_peer_t *peer, fastd_buffer_t *buffer, const fastd_fec_header_t *header) {
+	if (fastd_buffer_headroom(buffer) < sizeof(*header) + sizeof(fastd_index_header_t)) {
+		fastd_buffer_t *new_buffer = fastd_buffer_dup(buffer, sizeof(*header) + sizeof(fastd_index_header_t));
+		fastd_buffer_free(buffer);
+		buffer = new_buffer;
+	}
+
+	fastd_buffer_push_from(buffer, header, sizeof(*header));
+	return fastd_index_header_push(buffer, PACKET_DATA_FEC, peer->remote_index);
+}
+
+/** Sends the parity packet of the current group and starts a new group */
+static void send_parity(fastd_peer_t *peer) {
+	fastd_fec_t *fec = peer->fec;
+
+	fastd_buffer_t *buffer =
+		fastd_buffer_alloc(fec->tx_len, sizeof(fastd_fec_header_t) + sizeof(fastd_index_header_t));
+	memcpy(buffer->data, fec->tx_parity, fec->tx_len);
+
+	fastd_fec_header_t header = {
+		.group = fec->tx_group,
+		.pos = FEC_PARITY | fec->tx_pos,
+		.param = htobe16(fec->tx_len_xor),
+	};
+	buffer = push_headers(peer, buffer, &header);
+
+	fastd_stats_add(peer, STAT_TX_FEC_PARITY, buffer->len);
+	fastd_path_send(peer, buffer, 0, 0);
+	fastd_buffer_free(buffer);
+
+	memset(fec->tx_parity, 0, fec->tx_len);
+	fec->tx_len = 0;
+	fec->tx_len_xor = 0;
+	fec->tx_pos = 0;
+	fec->tx_group++;
+	fec->tx_group_size = group_size(fec);
+}
+
+/**
+   Sends an encrypted payload packet protected by FEC, consuming the buffer
+
+   The parity packet is sent after the last packet of each group.
+*/
+void fastd_fec_send(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, size_t stat_size) {
+	fastd_fec_t *fec = peer->fec;
+
+	/* The MTU may have been increased by a configuration reload */
+	if (buffer->len > fec->size) {
+		buffer = fastd_index_header_push(buffer, PACKET_DATA_INDEXED, peer->remote_index);
+		fastd_path_send(peer, buffer, tos, stat_size);
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	xor_into(fec->tx_parity, buffer->data, buffer->len);
+	fec->tx_len_xor ^= buffer->len;
+	if (buffer->len > fec->tx_len)
+		fec->tx_len = buffer->len;
+
+	fastd_fec_header_t header = {
+		.group = fec->tx_group,
+		.pos = fec->tx_pos++,
+		.param = htobe16(fec->loss > UINT8_MAX ? UINT8_MAX : fec->loss),
+	};
+	buffer = push_headers(peer, buffer, &header);
+
+	fastd_path_send(peer, buffer, tos, stat_size);
+	fastd_buffer_free(buffer);
+
+	if (fec->tx_pos >= fec->tx_group_size)
+		send_parity(peer);
+}
+
+/** Updates the smoothed loss rate of the received packets with the loss rate of a group */
+static void update_loss(fastd_fec_t *fec, unsigned lost, unsigned count) {
+	fec->loss = (7 * fec->loss + 256 * lost / count) / 8;
+}
+
+/** Starts receiving a new group, accounting the packets lost in the previous groups */
+static void start_group(fastd_fec_t *fec, uint8_t group) {
+	if (fec->rx_active) {
+		unsigned count = fec->rx_has_parity ? fec->rx_group_size : fec->rx_count;
+		unsigned received = __builtin_popcountll(fec->rx_seen);
+
+		if (count > received)
+			update_loss(fec, count - received, count);
+		else
+			update_loss(fec, 0, 1);
+
+		/* Whole groups have been lost in between */
+		uint8_t skipped = group - fec->rx_group - 1;
+		while (skipped--)
+			update_loss(fec, 1, 1);
+	}
+
+	memset(fec->rx_data, 0, fec->rx_len);
+
+	fec->rx_active = true;
+	fec->rx_group = group;
+	fec->rx_seen = 0;
+	fec->rx_count = 0;
+	fec->rx_len = 0;
+	fec->rx_len_xor = 0;
+	fec->rx_recovered = false;
+	fec->rx_has_parity = false;
+}
+
+/**
+   Returns true if a group number refers to the current group, starting a new group if it is newer
+
+   Packets of older groups are not used for FEC.
+*/
+static bool check_group(fastd_fec_t *fec, uint8_t group) {
+	if (!fec->rx_active || (int8_t)(group - fec->rx_group) > 0)
+		start_group(fec, group);
+
+	return (group == fec->rx_group);
+}
+
+/** Returns true if a received payload packet can be added to a group */
+static bool is_data_usable(const fastd_fec_t *fec, const fastd_fec_header_t *header, size_t len) {
+	return header->pos < FEC_GROUP_MAX && len <= fec->size;
+}
+
+/**
+   Adds a received payload packet to the current group
+
+   Must only be called after the packet has been authenticated; \e data is the packet as it was received.
+*/
+static void add_data(fastd_fec_t *fec, const fastd_fec_header_t *header, const uint8_t *data, size_t len) {
+	fec->remote_loss = be16toh(header->param);
+
+	if (!check_group(fec, header->group))
+		return;
+
+	uint64_t bit = UINT64_C(1) << header->pos;
+	if (fec->rx_seen & bit)
+		return;
+
+	fec->rx_seen |= bit;
+	if (header->pos >= fec->rx_count)
+		fec->rx_count = header->pos + 1;
+
+	xor_into(fec->rx_data, data, len);
+	fec->rx_len_xor ^= len;
+	if (len > fec->rx_len)
+		fec->rx_len = len;
+}
+
+/** Stores the received parity packet of the current group */
+static void add_parity(fastd_fec_t *fec, const fastd_fec_header_t *header, const fastd_buffer_t *buffer) {
+	uint8_t count = header->pos & ~FEC_PARITY;
+
+	/* Parity packets aren't authenticated, so they must not start a new group */
+	if (!fec->rx_active || header->group != fec->rx_group || fec->rx_has_parity)
+		return;
+
+	if (!count || count > FEC_GROUP_MAX || count < fec->rx_count || buffer->len > fec->size)
+		return;
+
+	memcpy(fec->rx_parity, buffer->data, buffer->len);
+
+	fec->rx_has_parity = true;
+	fec->rx_group_size = count;
+	fec->rx_parity_len = buffer->len;
+	fec->rx_parity_len_xor = be16toh(header->param);
+}
+
+/**
+   Reconstructs the missing packet of the current group and passes it to the protocol
+
+   This is possible when the parity packet and all but one of the packets of the group have been received.
+*/
+static void recover(fastd_peer_t *peer) {
+	fastd_fec_t *fec = peer->fec;
+
+	/* The peer may have been reset while the packet was handled */
+	if (!fec || !fec->rx_has_parity || fec->rx_recovered)
+		return;
+
+	uint64_t all = (fec->rx_group_size == 64) ? UINT64_MAX : (UINT64_C(1) << fec->rx_group_size) - 1;
+	uint64_t missing = all & ~fec->rx_seen;
+
+	if (!missing || (missing & (missing - 1)))
+		return;
+
+	size_t len = fec->rx_len_xor ^ fec->rx_parity_len_xor;
+	if (!len || len > fec->rx_parity_len || fec->rx_len > fec->rx_parity_len) {
+		pr_debug2("unable to recover packet of %P from inconsistent FEC group", peer);
+		fec->rx_recovered = true;
+		return;
+	}
+
+	size_t headers = sizeof(fastd_index_header_t) + sizeof(fastd_fec_header_t);
+	fastd_buffer_t *buffer = fastd_buffer_alloc(headers + len, conf.decrypt_headroom);
+
+	/* Keep the alignment of a received packet */
+	fastd_buffer_pull(buffer, headers);
+	memcpy(buffer->data, fec->rx_parity, len);
+	xor_into(buffer->data, fec->rx_data, min_size_t(len, fec->rx_len));
+
+	fec->rx_recovered = true;
+
+	pr_debug2("recovered lost packet of %P using FEC", peer);
+	fastd_stats_add(peer, STAT_RX_FEC_RECOVERED, len);
+
+	bool reordered;
+
+	/* Consumes the buffer; the TOS value of the lost packet is unknown */
+	conf.protocol->handle_recv(peer, buffer, 0, &reordered);
+}
+
+/**
+   Handles a received PACKET_DATA_FEC packet after the index header has been removed
+
+   Payload packets are passed to the protocol, and are added to their group when the protocol has
+   authenticated them; the packet is copied for this, as the protocol decrypts it in place. Returns
+   the result of the protocol's handle_recv for payload packets, and false for parity packets.
+   Consumes the buffer.
+*/
+bool fastd_fec_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, bool *reordered) {
+	fastd_fec_t *fec = peer->fec;
+	fastd_fec_header_t header;
+
+	*reordered = false;
+
+	if (!fec || buffer->len < sizeof(header) + 1) {
+		pr_debug2("ignoring unexpected FEC packet from %P", peer);
+		fastd_buffer_free(buffer);
+		return false;
+	}
+
+	fastd_buffer_pull_to(buffer, &header, sizeof(header));
+
+	if (header.pos & FEC_PARITY) {
+		add_parity(fec, &header, buffer);
+		fastd_buffer_free(buffer);
+		recover(peer);
+		return false;
+	}
+
+	size_t len = buffer->len;
+	bool usable = is_data_usable(fec, &header, len);
+	if (usable)
+		memcpy(fec->rx_packet, buffer->data, len);
+
+	/* Consumes the buffer */
+	bool authenticated = conf.protocol->handle_recv(peer, buffer, tos, reordered);
+	if (!authenticated)
+		return false;
+
+	/* The peer may have been reset while the packet was handled */
+	fec = peer->fec;
+	if (!fec)
+		return true;
+
+	if (usable)
+		add_data(fec, &header, fec->rx_packet, len);
+	else
+		fec->remote_loss = be16toh(header.param);
+
+	recover(peer);
+	return true;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Forward error correction of payload packets using XOR parity
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+
+
+/** The FEC version announced in handshakes */
+#define FEC_VERSION 1
+
+
+/** The FEC state of a peer */
+struct fastd_fec {
+	size_t size; /**< The size of the parity buffers (the maximum length of an encrypted payload packet) */
+
+	uint8_t tx_group;      /**< The number of the group that is currently sent */
+	uint8_t tx_pos;        /**< The number of packets of the current group that have been sent */
+	uint8_t tx_group_size; /**< The number of packets in the current group */
+	uint16_t tx_len_xor;   /**< The XOR of the lengths of the packets of the current group */
+	size_t tx_len;         /**< The length of the longest packet of the current group */
+	uint8_t *tx_parity;    /**< The XOR of the packets of the current group */
+
+	uint8_t remote_loss; /**< The loss rate reported by the peer (in units of 1/256) */
+	uint16_t loss;       /**< The smoothed loss rate of the packets received from the peer (in units of 1/256) */
+
+	bool rx_active;             /**< Specifies if a group has been received */
+	uint8_t rx_group;           /**< The number of the group that is currently received */
+	uint64_t rx_seen;           /**< A bitmap of the positions of the current group that have been received */
+	uint8_t rx_count;           /**< The highest received position of the current group plus one */
+	uint16_t rx_len_xor;        /**< The XOR of the lengths of the received packets of the current group */
+	size_t rx_len;              /**< The length of the longest received packet of the current group */
+	uint8_t *rx_data;           /**< The XOR of the received packets of the current group */
+	bool rx_recovered;          /**< Specifies if a packet of the current group has been recovered */
+	bool rx_has_parity;         /**< Specifies if the parity packet of the current group has been received */
+	uint8_t rx_group_size;      /**< The number of packets in the current group (announced by the parity packet) */
+	uint16_t rx_parity_len_xor; /**< The XOR of the lengths of the packets as announced by the parity packet */
+	size_t rx_parity_len;       /**< The length of the parity packet of the current group */
+	uint8_t *rx_parity;         /**< The parity packet of the current group */
+	uint8_t *rx_packet;         /**< A copy of the received packet that is currently authenticated */
+};
+
+
+/** Returns true if forward error correction is offered to peers */
+static inline bool fastd_use_fec(void) {
+	return conf.fec_redundancy;
+}
+
+
+void fastd_fec_init(fastd_peer_t *peer);
+void fastd_fec_free(fastd_peer_t *peer);
+void fastd_fec_send(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, size_t stat_size);
+bool fastd_fec_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, bool *reordered);
@@ -12,9 +12,13 @@
 
 
 #include "handshake.h"
+#include "aggregate.h"
+#include "compress.h"
+#include "fec.h"
 #include "method.h"
 #include "peer.h"
 #include "peer_group.h"
+#include "peer_index.h"
 #include "version.h"
 
 
@@ -36,6 +40,10 @@ static const char *const RECORD_TYPES[RECORD_MAX] = {
 	"version name",
 	"method list",
 	"TLV message authentication code",
+	"session index",
+	"FEC version",
+	"aggregate version",
+	"compression",
 };
 
 
@@ -284,7 +292,7 @@ void fastd_handshake_send_free(
 	 * and one for new fastd versions */
 
 	if (flags == FLAG_INITIAL || !(flags & FLAG_L2TP_SUPPORT))
-		fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+		fastd_send(sock, local_addr, remote_addr, peer, buffer, 0, 0);
 
 	if (flags == FLAG_INITIAL || (flags & FLAG_L2TP_SUPPORT)) {
 		const fastd_control_packet_t header = {
@@ -294,7 +302,7 @@ void fastd_handshake_send_free(
 		};
 		fastd_buffer_push_from(buffer, &header, sizeof(header));
 
-		fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+		fastd_send(sock, local_addr, remote_addr, peer, buffer, 0, 0);
 	}
 
 	fastd_buffer_free(buffer);
@@ -440,6 +448,119 @@ bool fastd_handshake_check_mtu(
 	return true;
 }
 
+/**
+   Adds the local session index of a peer to a handshake
+
+   Nothing is added when session indices are disabled. Peers not supporting session indices
+   ignore the record and keep sending payload packets without index.
+*/
+void fastd_handshake_add_session_index(fastd_buffer_t *buffer, fastd_peer_t *peer) {
+	if (!fastd_use_packet_index())
+		return;
+
+	uint32_t index = fastd_peer_index_assign(peer);
+	if (index)
+		fastd_handshake_add_uint24(buffer, RECORD_SESSION_INDEX, index);
+}
+
+/**
+   Stores the session index announced in an authenticated handshake
+
+   The remote index is cleared if the handshake doesn't contain a session index.
+*/
+void fastd_handshake_set_remote_index(fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_SESSION_INDEX];
+
+	if (record->length == 3)
+		peer->remote_index = as_uint24(record);
+	else
+		peer->remote_index = 0;
+}
+
+/**
+   Adds the supported FEC version to a handshake
+
+   Nothing is added when FEC is disabled.
+*/
+void fastd_handshake_add_fec(fastd_buffer_t *buffer) {
+	if (fastd_use_fec())
+		fastd_handshake_add_uint8(buffer, RECORD_FEC_VERSION, FEC_VERSION);
+}
+
+/**
+   Enables or disables FEC for a peer after an authenticated handshake
+
+   FEC is only used when both sides support the same version, and the peer has announced a session index
+   to prefix the packets with. The FEC state is reset with each new session.
+*/
+void fastd_handshake_set_fec(fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_FEC_VERSION];
+
+	fastd_fec_free(peer);
+
+	if (fastd_use_fec() && peer->remote_index && record->length == 1 && as_uint8(record) == FEC_VERSION)
+		fastd_fec_init(peer);
+}
+
+/**
+   Adds the supported aggregation version to a handshake
+
+   Nothing is added when aggregation is disabled.
+*/
+void fastd_handshake_add_aggregate(fastd_buffer_t *buffer) {
+	if (fastd_use_aggregation())
+		fastd_handshake_add_uint8(buffer, RECORD_AGGREGATE_VERSION, AGGREGATE_VERSION);
+}
+
+/**
+   Enables or disables aggregation of payload packets for a peer after an authenticated handshake
+
+   Aggregation is only used when both sides support the same version, and the negotiated method
+   can't be offloaded to the kernel, which doesn't know about the aggregation header. Both sides
+   come to the same decision, as it only depends on the exchanged records and the method.
+*/
+void fastd_handshake_set_aggregate(
+	fastd_peer_t *peer, const fastd_handshake_t *handshake, const fastd_method_info_t *method) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_AGGREGATE_VERSION];
+
+	bool use = fastd_use_aggregation() && !method->provider->get_offload && record->length == 1 &&
+		   as_uint8(record) == AGGREGATE_VERSION;
+
+	if (!use)
+		fastd_aggregate_free(peer);
+	else if (!peer->aggregate)
+		fastd_aggregate_init(peer);
+}
+
+/**
+   Adds the supported compression algorithm to a handshake
+
+   Nothing is added when compression is disabled.
+*/
+void fastd_handshake_add_compression(fastd_buffer_t *buffer) {
+	if (fastd_use_compression())
+		fastd_handshake_add_uint8(buffer, RECORD_COMPRESSION, COMPRESS_LZ4);
+}
+
+/**
+   Enables or disables compression of payload packets for a peer after an authenticated handshake
+
+   Like aggregation, compression is only used when both sides support the same algorithm and the
+   negotiated method can't be offloaded. The compression ratio estimate is kept across sessions.
+*/
+void fastd_handshake_set_compression(
+	fastd_peer_t *peer, const fastd_handshake_t *handshake, const fastd_method_info_t *method) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_COMPRESSION];
+
+	bool use = fastd_use_compression() && !method->provider->get_offload && record->length == 1 &&
+		   as_uint8(record) == COMPRESS_LZ4;
+
+	if (!use)
+		fastd_compress_free(peer);
+	else if (!peer->compress)
+		fastd_compress_init(peer);
+}
+
 /** Returns the method info with a specified name and length */
 static inline const fastd_method_info_t *
 get_method_by_name(const fastd_string_stack_t *methods, const char *name, size_t n) {
@@ -47,6 +47,10 @@ typedef enum fastd_handshake_record_type {
 	RECORD_VERSION_NAME,            /**< The fastd version */
 	RECORD_METHOD_LIST,             /**< Zero-separated list of supported methods */
 	RECORD_TLV_MAC,                 /**< Message authentication code of the TLV records */
+	RECORD_SESSION_INDEX,           /**< The session index the sender wants payload packets to be prefixed with */
+	RECORD_FEC_VERSION,             /**< The version of forward error correction supported by the sender */
+	RECORD_AGGREGATE_VERSION,       /**< The version of payload packet aggregation supported by the sender */
+	RECORD_COMPRESSION,             /**< The payload compression algorithm supported by the sender */
 	RECORD_MAX,                     /**< (Number of defined record types) */
 } fastd_handshake_record_type_t;
 
@@ -117,6 +121,17 @@ fastd_handshake_get_method_by_name_list(const fastd_peer_t *peer, const fastd_ha
 const fastd_method_info_t *
 fastd_handshake_get_method_by_name(const fastd_peer_t *peer, const fastd_handshake_t *handshake);
 
+void fastd_handshake_add_session_index(fastd_buffer_t *buffer, fastd_peer_t *peer);
+void fastd_handshake_set_remote_index(fastd_peer_t *peer, const fastd_handshake_t *handshake);
+void fastd_handshake_add_fec(fastd_buffer_t *buffer);
+void fastd_handshake_set_fec(fastd_peer_t *peer, const fastd_handshake_t *handshake);
+void fastd_handshake_add_aggregate(fastd_buffer_t *buffer);
+void fastd_handshake_set_aggregate(
+	fastd_peer_t *peer, const fastd_handshake_t *handshake, const fastd_method_info_t *method);
+void fastd_handshake_add_compression(fastd_buffer_t *buffer);
+void fastd_handshake_set_compression(
+	fastd_peer_t *peer, const fastd_handshake_t *handshake, const fastd_method_info_t *method);
+
 void fastd_handshake_handle(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer, fastd_buffer_t *buffer, bool has_control_header);
@@ -74,6 +74,9 @@ static void cleanup_iface(fastd_iface_t *iface);
 
 #ifdef __linux__
 
+#ifndef WITH_IFACE_NETLINK
+
+/** Sets the MTU of an interface */
 bool fastd_iface_set_mtu(const char *ifname, uint16_t mtu) {
 	struct ifreq ifr = {};
 	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
@@ -91,6 +94,8 @@ bool fastd_iface_set_mtu(const char *ifname, uint16_t mtu) {
 	return true;
 }
 
+#endif /* WITH_IFACE_NETLINK */
+
 /** Opens the TUN/TAP device helper shared by Android and Linux targets */
 static bool open_iface_linux(fastd_iface_t *iface, const char *ifname, uint16_t mtu, const char *dev_name) {
 	struct ifreq ifr = {};
@@ -123,10 +128,16 @@ static bool open_iface_linux(fastd_iface_t *iface, const char *ifname, uint16_t
 
 	iface->name = fastd_strndup(ifr.ifr_name, IFNAMSIZ - 1);
 
+#ifdef WITH_IFACE_NETLINK
+	iface->mtu = mtu;
+	if (!fastd_iface_netlink_configure(iface, NULL))
+		return false;
+#else
 	if (!fastd_iface_set_mtu(iface->name, mtu)) {
 		pr_error_errno("failed to set TUN/TAP interface MTU");
 		return false;
 	}
+#endif
 
 	return true;
 }
@@ -439,6 +450,11 @@ void fastd_iface_handle(fastd_iface_t *iface) {
 
 	buffer->len = len;
 
+	if (iface->idle) {
+		fastd_buffer_free(buffer);
+		return;
+	}
+
 	if (multiaf_tun && get_iface_type() == IFACE_TYPE_TUN)
 		fastd_buffer_pull(buffer, 4);
 
@@ -536,21 +552,38 @@ bool fastd_iface_format_name(char ifname[IFNAMSIZ], const fastd_peer_t *peer) {
 	return true;
 }
 
-/** Opens a new TUN/TAP interface, optionally associated with a specific peer */
-fastd_iface_t *fastd_iface_open(fastd_peer_t *peer) {
-	char ifname[IFNAMSIZ];
+/**
+   Formats the name of a peer's offload interface when a shared interface is used
 
-	if (!fastd_iface_format_name(ifname, peer))
-		return NULL;
+   The peer-specific interface name is used when configured, otherwise the
+   peer ID is appended to the name of the shared interface.
+*/
+bool fastd_iface_format_offload_name(char ifname[IFNAMSIZ], const fastd_peer_t *peer) {
+	if (peer->ifname)
+		return fastd_iface_format_name(ifname, peer);
+
+	char suffix[IFNAMSIZ];
+	int suffix_len = snprintf(suffix, sizeof(suffix), "-%llu", (unsigned long long)peer->id);
+	if (suffix_len < 0 || (size_t)suffix_len >= sizeof(suffix) - 1)
+		return false;
 
+	size_t prefix_len = strnlen(ctx.iface->name, IFNAMSIZ - 1 - suffix_len);
+	memcpy(ifname, ctx.iface->name, prefix_len);
+	memcpy(ifname + prefix_len, suffix, suffix_len + 1);
+	return true;
+}
+
+/** Creates a new TUN/TAP interface */
+static fastd_iface_t *create_iface(fastd_peer_t *peer, const char *ifname, bool idle) {
 	fastd_iface_t *iface = fastd_new0(fastd_iface_t);
 	iface->peer = peer;
 	iface->mtu = fastd_peer_get_mtu(peer);
 	iface->fd.fd = -1;
+	iface->idle = idle;
 
 	pr_debug("initializing TUN/TAP device...");
 
-	if (!open_iface(iface, ifname[0] ? ifname : NULL, iface->mtu)) {
+	if (!open_iface(iface, ifname, iface->mtu)) {
 		if (iface->fd.fd >= 0) {
 			if (close(iface->fd.fd) == 0)
 				cleanup_iface(iface);
@@ -573,8 +606,40 @@ fastd_iface_t *fastd_iface_open(fastd_peer_t *peer) {
 	return iface;
 }
 
-/** Closes the TUN/TAP device */
+/** Opens a new TUN/TAP interface, optionally associated with a specific peer */
+fastd_iface_t *fastd_iface_open(fastd_peer_t *peer) {
+	char ifname[IFNAMSIZ];
+
+	if (!fastd_iface_format_name(ifname, peer))
+		return NULL;
+
+	if (peer) {
+		fastd_iface_t *iface = fastd_iface_pool_get(peer, ifname[0] ? ifname : NULL);
+		if (iface)
+			return iface;
+	}
+
+	return create_iface(peer, ifname[0] ? ifname : NULL, false);
+}
+
+#ifdef WITH_IFACE_NETLINK
+
+/** Creates an idle interface for the interface pool */
+fastd_iface_t *fastd_iface_open_idle(void) {
+	return create_iface(NULL, IFACE_POOL_NAME, true);
+}
+
+#endif
+
+/**
+   Closes the TUN/TAP device
+
+   Peer-specific interfaces are returned to the interface pool instead if possible.
+*/
 void fastd_iface_close(fastd_iface_t *iface) {
+	if (iface->peer && fastd_iface_pool_put(iface))
+		return;
+
 	if (fastd_poll_fd_close(&iface->fd))
 		cleanup_iface(iface);
 	else
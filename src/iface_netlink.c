@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Configuration of TUN/TAP interfaces using rtnetlink
+
+   The MTU, the link state, the configured addresses and the routes of an
+   interface are set by a batch of requests that is sent to the kernel with a
+   single system call. The kernel processes the requests in order and
+   acknowledges each of them, so the whole configuration costs only one round
+   trip.
+
+   Interfaces of the TAP interface pool are renamed when they are handed to a
+   peer and when they are returned to the pool.
+
+   The same socket is used to look up the queueing discipline of the interface
+   packets to a peer leave through, which kernel pacing depends on.
+*/
+
+#include "fastd.h"
+#include "peer.h"
+
+#include <libmnl/libmnl.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+
+/** The maximum size of a single request of a configuration batch */
+#define IFACE_NL_MAX_REQUEST_SIZE 256
+
+/** The size of the request buffer of a configuration batch */
+#define IFACE_NL_BUFFER_SIZE 8192
+
+
+/** The rtnetlink state for interface configuration */
+struct fastd_iface_nl {
+	struct mnl_socket *sock; /**< The blocking rtnetlink socket */
+	uint32_t seq;            /**< The sequence number of the last request */
+};
+
+/** A request of a configuration batch */
+typedef struct iface_nl_request {
+	const char *what;             /**< The action for error messages */
+	const fastd_prefix_t *prefix; /**< The configured address or route (NULL for link settings) */
+	bool fatal;                   /**< Specifies if the configuration fails when the request fails */
+} iface_nl_request_t;
+
+/** A batch of pipelined configuration requests */
+typedef struct iface_nl_batch {
+	const char *ifname; /**< The name of the configured interface */
+	unsigned ifindex;   /**< The index of the configured interface */
+	bool ok;            /**< false if a fatal request has failed */
+
+	uint32_t first_seq;                  /**< The sequence number of the first request in the buffer */
+	VECTOR(iface_nl_request_t) requests; /**< The requests in the buffer, indexed by sequence number */
+	size_t len;                          /**< The number of bytes used in the buffer */
+	uint8_t buf[IFACE_NL_BUFFER_SIZE];   /**< The request buffer */
+} iface_nl_batch_t;
+
+
+/** Opens the rtnetlink socket used for interface configuration */
+void fastd_iface_netlink_init(void) {
+	ctx.iface_nl = fastd_new0(fastd_iface_nl_t);
+
+	ctx.iface_nl->sock = mnl_socket_open(NETLINK_ROUTE);
+	if (!ctx.iface_nl->sock)
+		exit_errno("unable to create rtnetlink socket");
+
+	if (mnl_socket_bind(ctx.iface_nl->sock, 0, MNL_SOCKET_AUTOPID) < 0)
+		exit_errno("unable to bind rtnetlink socket");
+}
+
+/** Closes the rtnetlink socket */
+void fastd_iface_netlink_cleanup(void) {
+	if (!ctx.iface_nl)
+		return;
+
+	mnl_socket_close(ctx.iface_nl->sock);
+	free(ctx.iface_nl);
+	ctx.iface_nl = NULL;
+}
+
+
+/** Returns the address length of a prefix's family */
+static size_t prefix_addr_len(const fastd_prefix_t *prefix) {
+	return (prefix->family == AF_INET) ? 4 : 16;
+}
+
+/** Logs a failed request */
+static void report_error(const iface_nl_batch_t *batch, const iface_nl_request_t *request, int err) {
+	if (request->prefix) {
+		char buf[FASTD_PREFIX_STRLEN];
+		fastd_prefix_format(buf, request->prefix);
+
+		pr_warn("failed to %s %s on interface `%s': %s", request->what, buf, batch->ifname, strerror(err));
+	} else {
+		pr_error("failed to configure interface `%s': %s", batch->ifname, strerror(err));
+	}
+}
+
+/** Sends all requests in the buffer and waits for their acknowledgements */
+static void batch_flush(iface_nl_batch_t *batch) {
+	struct mnl_socket *sock = ctx.iface_nl->sock;
+	size_t n = VECTOR_LEN(batch->requests);
+	size_t acked = 0;
+
+	if (!n)
+		return;
+
+	if (mnl_socket_sendto(sock, batch->buf, batch->len) < 0) {
+		pr_error_errno("unable to send rtnetlink requests");
+		batch->ok = false;
+		goto out;
+	}
+
+	while (acked < n) {
+		uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+		ssize_t len = mnl_socket_recvfrom(sock, buf, sizeof(buf));
+		if (len < 0) {
+			pr_error_errno("unable to receive rtnetlink replies");
+			batch->ok = false;
+			goto out;
+		}
+
+		const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+		int remaining = len;
+
+		for (; mnl_nlmsg_ok(nlh, remaining); nlh = mnl_nlmsg_next(nlh, &remaining)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			uint32_t index = nlh->nlmsg_seq - batch->first_seq;
+			if (index >= n)
+				continue;
+
+			acked++;
+
+			const struct nlmsgerr *nlerr = mnl_nlmsg_get_payload(nlh);
+			if (!nlerr->error)
+				continue;
+
+			const iface_nl_request_t *request = &VECTOR_INDEX(batch->requests, index);
+			report_error(batch, request, -nlerr->error);
+
+			if (request->fatal)
+				batch->ok = false;
+		}
+	}
+
+out:
+	VECTOR_RESIZE(batch->requests, 0);
+	batch->len = 0;
+}
+
+/**
+   Starts a new request in the batch buffer
+
+   The buffer is flushed first when the remaining space might not suffice for the new request.
+*/
+static struct nlmsghdr *batch_add(
+	iface_nl_batch_t *batch, uint16_t type, uint16_t flags, const char *what, const fastd_prefix_t *prefix,
+	bool fatal) {
+	if (batch->len + IFACE_NL_MAX_REQUEST_SIZE > sizeof(batch->buf))
+		batch_flush(batch);
+
+	if (!VECTOR_LEN(batch->requests))
+		batch->first_seq = ctx.iface_nl->seq + 1;
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(batch->buf + batch->len);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = ++ctx.iface_nl->seq;
+
+	iface_nl_request_t request = {
+		.what = what,
+		.prefix = prefix,
+		.fatal = fatal,
+	};
+	VECTOR_ADD(batch->requests, request);
+
+	return nlh;
+}
+
+/** Finishes the last request started with \e batch_add */
+static void batch_commit(iface_nl_batch_t *batch, const struct nlmsghdr *nlh) {
+	batch->len += nlh->nlmsg_len;
+}
+
+/**
+   Adds a request changing the link settings
+
+   The interface is renamed if \e ifname is not NULL and its MTU is set if \e mtu is not 0; the
+   interface flags selected by \e change are set to \e flags. The kernel handles renames before
+   flag changes, so an interface that is down can be renamed and brought up with a single request.
+*/
+static void put_link(iface_nl_batch_t *batch, const char *ifname, uint16_t mtu, unsigned flags, unsigned change) {
+	struct nlmsghdr *nlh = batch_add(batch, RTM_NEWLINK, 0, "configure link", NULL, true);
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = batch->ifindex;
+	ifi->ifi_flags = flags;
+	ifi->ifi_change = change;
+
+	if (ifname)
+		mnl_attr_put_strz(nlh, IFLA_IFNAME, ifname);
+	if (mtu)
+		mnl_attr_put_u32(nlh, IFLA_MTU, mtu);
+
+	batch_commit(batch, nlh);
+}
+
+/** Adds a request adding or (if \e add is false) removing an address */
+static void put_address(iface_nl_batch_t *batch, const fastd_prefix_t *address, bool add) {
+	struct nlmsghdr *nlh;
+	if (add)
+		nlh = batch_add(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, "add address", address, false);
+	else
+		nlh = batch_add(batch, RTM_DELADDR, 0, "remove address", address, false);
+
+	struct ifaddrmsg *ifa = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifa));
+	ifa->ifa_family = address->family;
+	ifa->ifa_prefixlen = address->len;
+	ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa->ifa_index = batch->ifindex;
+
+	mnl_attr_put(nlh, IFA_LOCAL, prefix_addr_len(address), address->addr);
+	mnl_attr_put(nlh, IFA_ADDRESS, prefix_addr_len(address), address->addr);
+
+	batch_commit(batch, nlh);
+}
+
+/** Adds a request installing a route via the interface */
+static void put_route(iface_nl_batch_t *batch, const fastd_prefix_t *route) {
+	struct nlmsghdr *nlh = batch_add(batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, "add route", route, false);
+
+	struct rtmsg *rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(*rtm));
+	rtm->rtm_family = route->family;
+	rtm->rtm_dst_len = route->len;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_BOOT;
+	rtm->rtm_scope = RT_SCOPE_LINK;
+	rtm->rtm_type = RTN_UNICAST;
+
+	if (route->len)
+		mnl_attr_put(nlh, RTA_DST, prefix_addr_len(route), route->addr);
+
+	mnl_attr_put_u32(nlh, RTA_OIF, batch->ifindex);
+
+	batch_commit(batch, nlh);
+}
+
+/** Initializes a batch for the given interface */
+static bool batch_init(iface_nl_batch_t *batch, const char *ifname) {
+	batch->ifname = ifname;
+	batch->ifindex = if_nametoindex(ifname);
+	batch->ok = true;
+
+	if (!batch->ifindex) {
+		pr_error_errno("unable to get interface index");
+		return false;
+	}
+
+	return true;
+}
+
+/** Sets the MTU of an interface */
+bool fastd_iface_set_mtu(const char *ifname, uint16_t mtu) {
+	iface_nl_batch_t *batch = fastd_new0(iface_nl_batch_t);
+	bool ok = false;
+
+	if (batch_init(batch, ifname)) {
+		put_link(batch, NULL, mtu, 0, 0);
+		batch_flush(batch);
+		ok = batch->ok;
+	}
+
+	VECTOR_FREE(batch->requests);
+	free(batch);
+
+	return ok;
+}
+
+/** Updates the name of an interface after it has been renamed by the kernel */
+static bool update_name(fastd_iface_t *iface, unsigned ifindex) {
+	char ifname[IF_NAMESIZE];
+	if (!if_indextoname(ifindex, ifname)) {
+		pr_error_errno("unable to get interface name");
+		return false;
+	}
+
+	free(iface->name);
+	iface->name = fastd_strndup(ifname, IFNAMSIZ - 1);
+
+	return true;
+}
+
+/**
+   Configures a TUN/TAP interface
+
+   The interface is renamed to \e ifname if it is not NULL, the MTU is set and the link is brought
+   up; afterwards, the global and peer-specific addresses and the routes of the interface's peer are
+   added. Only a failure to configure the link itself is considered fatal.
+
+   Idle interfaces of the interface pool only get their MTU set and stay down.
+*/
+bool fastd_iface_netlink_configure(fastd_iface_t *iface, const char *ifname) {
+	iface_nl_batch_t *batch = fastd_new0(iface_nl_batch_t);
+	bool ok = false;
+	size_t i;
+
+	if (!batch_init(batch, iface->name))
+		goto out;
+
+	put_link(batch, ifname, iface->mtu, iface->idle ? 0 : IFF_UP, IFF_UP);
+
+	if (!iface->idle) {
+		for (i = 0; i < VECTOR_LEN(conf.iface_addresses); i++)
+			put_address(batch, &VECTOR_INDEX(conf.iface_addresses, i), true);
+	}
+
+	if (iface->peer) {
+		for (i = 0; i < VECTOR_LEN(iface->peer->iface_addresses); i++)
+			put_address(batch, &VECTOR_INDEX(iface->peer->iface_addresses, i), true);
+
+		for (i = 0; i < VECTOR_LEN(iface->peer->routes); i++)
+			put_route(batch, &VECTOR_INDEX(iface->peer->routes, i));
+	}
+
+	batch_flush(batch);
+	ok = batch->ok;
+
+	if (ok && ifname)
+		ok = update_name(iface, batch->ifindex);
+
+out:
+	VECTOR_FREE(batch->requests);
+	free(batch);
+
+	return ok;
+}
+
+/**
+   Prepares a peer's interface for being returned to the interface pool
+
+   The peer-specific addresses are removed, and the interface is brought down and renamed
+   using the IFACE_POOL_NAME pattern. The kernel removes the routes via the interface when
+   it goes down.
+*/
+bool fastd_iface_netlink_release(fastd_iface_t *iface) {
+	iface_nl_batch_t *batch = fastd_new0(iface_nl_batch_t);
+	bool ok = false;
+	size_t i;
+
+	if (!batch_init(batch, iface->name))
+		goto out;
+
+	for (i = 0; i < VECTOR_LEN(iface->peer->iface_addresses); i++)
+		put_address(batch, &VECTOR_INDEX(iface->peer->iface_addresses, i), false);
+
+	put_link(batch, NULL, 0, 0, IFF_UP);
+	put_link(batch, IFACE_POOL_NAME, 0, 0, 0);
+
+	batch_flush(batch);
+	ok = batch->ok && update_name(iface, batch->ifindex);
+
+out:
+	VECTOR_FREE(batch->requests);
+	free(batch);
+
+	return ok;
+}
+
+
+/** Sends a single request and passes its replies to a callback, waiting for the end of the dump for dump requests */
+static bool query(struct nlmsghdr *nlh, mnl_cb_t cb, void *data) {
+	struct mnl_socket *sock = ctx.iface_nl->sock;
+
+	nlh->nlmsg_seq = ++ctx.iface_nl->seq;
+
+	if (mnl_socket_sendto(sock, nlh, nlh->nlmsg_len) < 0)
+		return false;
+
+	while (true) {
+		uint8_t buf[MNL_SOCKET_BUFFER_SIZE];
+		ssize_t len = mnl_socket_recvfrom(sock, buf, sizeof(buf));
+		if (len < 0)
+			return false;
+
+		int ret = mnl_cb_run(buf, len, nlh->nlmsg_seq, mnl_socket_get_portid(sock), cb, data);
+		if (ret == MNL_CB_ERROR)
+			return false;
+
+		if (ret == MNL_CB_STOP || !(nlh->nlmsg_flags & NLM_F_DUMP))
+			return true;
+	}
+}
+
+/** Callback for the route lookup of \e fastd_iface_netlink_egress_fq, storing the outgoing interface */
+static int route_oif_cb(const struct nlmsghdr *nlh, void *data) {
+	unsigned *ifindex = data;
+	const struct nlattr *attr;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct rtmsg)) {
+		if (mnl_attr_get_type(attr) == RTA_OIF && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			*ifindex = mnl_attr_get_u32(attr);
+	}
+
+	return MNL_CB_OK;
+}
+
+/** The state of the queueing discipline dump of \e fastd_iface_netlink_egress_fq */
+typedef struct qdisc_fq_state {
+	unsigned ifindex; /**< The index of the outgoing interface */
+	bool fq;          /**< Set when an fq queueing discipline has been found on the interface */
+} qdisc_fq_state_t;
+
+/** Callback for the queueing discipline dump of \e fastd_iface_netlink_egress_fq */
+static int qdisc_fq_cb(const struct nlmsghdr *nlh, void *data) {
+	qdisc_fq_state_t *state = data;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *attr;
+
+	/* The kernel dumps the queueing disciplines of all interfaces */
+	if ((unsigned)tcm->tcm_ifindex != state->ifindex)
+		return MNL_CB_OK;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*tcm)) {
+		if (mnl_attr_get_type(attr) == TCA_KIND && mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) >= 0 &&
+		    !strcmp(mnl_attr_get_str(attr), "fq"))
+			state->fq = true;
+	}
+
+	return MNL_CB_OK;
+}
+
+/**
+   Checks if the packets sent to an address leave through an interface using the fq queueing discipline
+
+   The fq queueing discipline may also be attached below the root (e.g. to the queues of an mq root).
+   Returns false if the check has failed; otherwise, the name of the outgoing interface is stored in
+   \e ifname and \e fq is set.
+*/
+bool fastd_iface_netlink_egress_fq(const fastd_peer_address_t *addr, char ifname[IF_NAMESIZE], bool *fq) {
+	uint8_t buf[IFACE_NL_MAX_REQUEST_SIZE] __attribute__((aligned(8)));
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETROUTE;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	struct rtmsg *rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(*rtm));
+	rtm->rtm_family = addr->sa.sa_family;
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		rtm->rtm_dst_len = 32;
+		mnl_attr_put(nlh, RTA_DST, sizeof(addr->in.sin_addr), &addr->in.sin_addr);
+		break;
+
+	case AF_INET6:
+		rtm->rtm_dst_len = 128;
+		mnl_attr_put(nlh, RTA_DST, sizeof(addr->in6.sin6_addr), &addr->in6.sin6_addr);
+
+		if (addr->in6.sin6_scope_id)
+			mnl_attr_put_u32(nlh, RTA_OIF, addr->in6.sin6_scope_id);
+
+		break;
+
+	default:
+		return false;
+	}
+
+	/* The packet mark may select a different routing table */
+	if (conf.packet_mark)
+		mnl_attr_put_u32(nlh, RTA_MARK, conf.packet_mark);
+
+	qdisc_fq_state_t state = {};
+	if (!query(nlh, route_oif_cb, &state.ifindex) || !state.ifindex) {
+		pr_debug("unable to look up the route to %I", addr);
+		return false;
+	}
+
+	if (!if_indextoname(state.ifindex, ifname)) {
+		pr_debug_errno("unable to get interface name");
+		return false;
+	}
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETQDISC;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = state.ifindex;
+
+	if (!query(nlh, qdisc_fq_cb, &state)) {
+		pr_debug("unable to get the queueing disciplines of interface `%s': %s", ifname, strerror(errno));
+		return false;
+	}
+
+	*fq = state.fq;
+	return true;
+}
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Pool of pre-created TAP interfaces for multi-TAP mode
+
+   Creating and destroying a kernel network device whenever a peer connects or
+   disconnects is expensive and causes udev events and bridge reconfiguration.
+   When the pool is enabled, idle interfaces are created in advance and kept
+   down under a generic name. Peers take an interface from the pool, which is
+   renamed, configured and brought up with a single rtnetlink request; when a
+   peer disconnects, its interface is returned to the pool.
+
+   The pool is refilled to its configured size by the periodic maintenance
+   when fewer interfaces than the low watermark are idle. Interfaces beyond the
+   high watermark are destroyed instead of being returned.
+*/
+
+#include "fastd.h"
+#include "peer.h"
+
+
+/** Returns true if the interface pool is enabled */
+static inline bool pool_enabled(void) {
+	return (conf.iface_pool_size && !ctx.iface_pool.closed);
+}
+
+/** Creates idle interfaces until the pool has reached its configured size */
+static void fill(void) {
+	while (VECTOR_LEN(ctx.iface_pool.idle) < conf.iface_pool_size) {
+		fastd_iface_t *iface = fastd_iface_open_idle();
+		if (!iface) {
+			pr_warn("unable to create interface for the interface pool");
+			return;
+		}
+
+		VECTOR_ADD(ctx.iface_pool.idle, iface);
+	}
+}
+
+/** Fills the interface pool on startup */
+void fastd_iface_pool_init(void) {
+	if (!conf.iface_pool_size)
+		return;
+
+	fill();
+
+	pr_verbose("created %u idle interfaces", (unsigned)VECTOR_LEN(ctx.iface_pool.idle));
+}
+
+/** Destroys all idle interfaces and stops accepting returned interfaces */
+void fastd_iface_pool_cleanup(void) {
+	ctx.iface_pool.closed = true;
+
+	while (VECTOR_LEN(ctx.iface_pool.idle)) {
+		fastd_iface_t *iface = VECTOR_INDEX(ctx.iface_pool.idle, VECTOR_LEN(ctx.iface_pool.idle) - 1);
+		VECTOR_DELETE(ctx.iface_pool.idle, VECTOR_LEN(ctx.iface_pool.idle) - 1);
+
+		fastd_iface_close(iface);
+	}
+
+	VECTOR_FREE(ctx.iface_pool.idle);
+}
+
+/** Refills the interface pool when the number of idle interfaces has dropped below the low watermark */
+void fastd_iface_pool_maintenance(void) {
+	if (!pool_enabled())
+		return;
+
+	if (VECTOR_LEN(ctx.iface_pool.idle) < conf.iface_pool_low)
+		fill();
+}
+
+/**
+   Takes an idle interface from the pool and configures it for a peer
+
+   Returns NULL if the pool is empty or disabled, or the interface could not be configured; the
+   caller creates a new interface in this case.
+*/
+fastd_iface_t *fastd_iface_pool_get(fastd_peer_t *peer, const char *ifname) {
+	if (!pool_enabled())
+		return NULL;
+
+	size_t len = VECTOR_LEN(ctx.iface_pool.idle);
+	if (!len) {
+		ctx.iface_pool.misses++;
+		return NULL;
+	}
+
+	fastd_iface_t *iface = VECTOR_INDEX(ctx.iface_pool.idle, len - 1);
+	VECTOR_DELETE(ctx.iface_pool.idle, len - 1);
+
+	iface->peer = peer;
+	iface->mtu = fastd_peer_get_mtu(peer);
+	iface->idle = false;
+
+	if (!fastd_iface_netlink_configure(iface, ifname ? ifname : "tap%d")) {
+		iface->peer = NULL;
+		fastd_iface_close(iface);
+
+		ctx.iface_pool.misses++;
+		return NULL;
+	}
+
+	ctx.iface_pool.hits++;
+	pr_debug("TUN/TAP device `%s' taken from the interface pool.", iface->name);
+
+	return iface;
+}
+
+/**
+   Returns a peer's interface to the pool
+
+   Returns false if the pool is disabled or full, or the interface could not be reset; the caller
+   destroys the interface in this case.
+*/
+bool fastd_iface_pool_put(fastd_iface_t *iface) {
+	if (!pool_enabled())
+		return false;
+
+	if (VECTOR_LEN(ctx.iface_pool.idle) >= conf.iface_pool_high || !fastd_iface_netlink_release(iface)) {
+		ctx.iface_pool.discarded++;
+		return false;
+	}
+
+	iface->peer = NULL;
+	iface->idle = true;
+
+	VECTOR_ADD(ctx.iface_pool.idle, iface);
+
+	pr_debug("TUN/TAP device returned to the interface pool as `%s'.", iface->name);
+
+	return true;
+}
@@ -42,71 +42,111 @@ typedef struct keyword {
    The keyword list must be sorted so binary search can work.
 */
 static const keyword_t keywords[] = {
+	{ "adaptive", TOK_ADAPTIVE },
+	{ "address", TOK_ADDRESS },
 	{ "addresses", TOK_ADDRESSES },
+	{ "aggregate", TOK_AGGREGATE },
 	{ "any", TOK_ANY },
+	{ "arp", TOK_ARP },
 	{ "as", TOK_AS },
 	{ "async", TOK_ASYNC },
 	{ "auto", TOK_AUTO },
 	{ "bind", TOK_BIND },
+	{ "broadcast", TOK_BROADCAST },
+	{ "burst", TOK_BURST },
 	{ "capabilities", TOK_CAPABILITIES },
+	{ "capacity", TOK_CAPACITY },
 	{ "cipher", TOK_CIPHER },
+	{ "class", TOK_CLASS },
+	{ "compression", TOK_COMPRESSION },
 	{ "connect", TOK_CONNECT },
+	{ "connected", TOK_CONNECTED },
+	{ "copy", TOK_COPY },
 	{ "debug", TOK_DEBUG },
 	{ "debug2", TOK_DEBUG2 },
 	{ "default", TOK_DEFAULT },
 	{ "disestablish", TOK_DISESTABLISH },
 	{ "down", TOK_DOWN },
 	{ "drop", TOK_DROP },
+	{ "dscp", TOK_DSCP },
 	{ "early", TOK_EARLY },
+	{ "ecn", TOK_ECN },
 	{ "error", TOK_ERROR },
+	{ "esp", TOK_ESP },
 	{ "establish", TOK_ESTABLISH },
 	{ "fatal", TOK_FATAL },
+	{ "fec", TOK_FEC },
 	{ "float", TOK_FLOAT },
 	{ "force", TOK_FORCE },
 	{ "forward", TOK_FORWARD },
 	{ "from", TOK_FROM },
 	{ "group", TOK_GROUP },
+	{ "gue", TOK_GUE },
 	{ "handshakes", TOK_HANDSHAKES },
 	{ "hide", TOK_HIDE },
+	{ "high", TOK_HIGH },
 	{ "include", TOK_INCLUDE },
+	{ "index", TOK_INDEX },
 	{ "info", TOK_INFO },
 	{ "interface", TOK_INTERFACE },
 	{ "ip", TOK_IP },
 	{ "ipv4", TOK_IPV4 },
 	{ "ipv6", TOK_IPV6 },
+	{ "kernel", TOK_KERNEL },
 	{ "key", TOK_KEY },
 	{ "l2tp", TOK_L2TP },
 	{ "level", TOK_LEVEL },
 	{ "limit", TOK_LIMIT },
 	{ "log", TOK_LOG },
+	{ "low", TOK_LOW },
+	{ "lz4", TOK_LZ4 },
 	{ "mac", TOK_MAC },
 	{ "mark", TOK_MARK },
 	{ "method", TOK_METHOD },
 	{ "mode", TOK_MODE },
 	{ "mtu", TOK_MTU },
+	{ "multicast", TOK_MULTICAST },
+	{ "multipath", TOK_MULTIPATH },
 	{ "multitap", TOK_MULTITAP },
+	{ "ndp", TOK_NDP },
 	{ "no", TOK_NO },
 	{ "offload", TOK_OFFLOAD },
 	{ "on", TOK_ON },
+	{ "pacing", TOK_PACING },
 	{ "packet", TOK_PACKET },
+	{ "parallel", TOK_PARALLEL },
 	{ "peer", TOK_PEER },
 	{ "peers", TOK_PEERS },
 	{ "persist", TOK_PERSIST },
 	{ "pmtu", TOK_PMTU },
+	{ "pool", TOK_POOL },
 	{ "port", TOK_PORT },
 	{ "post-down", TOK_POST_DOWN },
 	{ "pre-up", TOK_PRE_UP },
+	{ "priority", TOK_PRIORITY },
+	{ "probe", TOK_PROBE },
 	{ "protocol", TOK_PROTOCOL },
+	{ "proxy", TOK_PROXY },
+	{ "queue", TOK_QUEUE },
 	{ "remote", TOK_REMOTE },
+	{ "remotes", TOK_REMOTES },
+	{ "round-robin", TOK_ROUND_ROBIN },
+	{ "route", TOK_ROUTE },
+	{ "routed", TOK_ROUTED },
 	{ "secret", TOK_SECRET },
 	{ "secure", TOK_SECURE },
+	{ "snooping", TOK_SNOOPING },
 	{ "socket", TOK_SOCKET },
+	{ "sockets", TOK_SOCKETS },
 	{ "status", TOK_STATUS },
 	{ "stderr", TOK_STDERR },
 	{ "sync", TOK_SYNC },
 	{ "syslog", TOK_SYSLOG },
 	{ "tap", TOK_TAP },
 	{ "to", TOK_TO },
+	{ "tos", TOK_TOS },
+	{ "traffic", TOK_TRAFFIC },
+	{ "transmit", TOK_TRANSMIT },
 	{ "tun", TOK_TUN },
 	{ "up", TOK_UP },
 	{ "use", TOK_USE },
@@ -0,0 +1,527 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   IGMP and MLD snooping for TAP mode
+
+   Group memberships are learned from IGMPv1/v2/v3 and MLDv1/v2 reports received
+   from peers. Peers sending multicast queries are considered to have
+   a multicast router behind them and receive all multicast traffic.
+
+   Multicast frames are only sent to peers with members or routers when a
+   querier has been seen recently (otherwise memberships wouldn't be refreshed)
+   and the group is known; frames for unknown groups and link-local control
+   groups (224.0.0.0/24, ff02::1) are flooded to all peers. Membership reports
+   are sent to router peers only, so hosts behind other peers don't suppress
+   their own reports.
+
+   The local interface always receives all multicast frames, so only queries are
+   evaluated for frames read from it.
+*/
+
+
+#include "mcast.h"
+#include "peer.h"
+#include "txq.h"
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+
+/** IGMP message types */
+enum igmp_type {
+	IGMP_TYPE_QUERY = 0x11,     /**< Membership query */
+	IGMP_TYPE_V1_REPORT = 0x12, /**< IGMPv1 membership report */
+	IGMP_TYPE_V2_REPORT = 0x16, /**< IGMPv2 membership report */
+	IGMP_TYPE_V2_LEAVE = 0x17,  /**< IGMPv2 leave group */
+	IGMP_TYPE_V3_REPORT = 0x22, /**< IGMPv3 membership report */
+};
+
+/** MLD message types */
+enum mld_type {
+	MLD_TYPE_QUERY = 130,     /**< Multicast listener query */
+	MLD_TYPE_V1_REPORT = 131, /**< MLDv1 multicast listener report */
+	MLD_TYPE_V1_DONE = 132,   /**< MLDv1 multicast listener done */
+	MLD_TYPE_V2_REPORT = 143, /**< MLDv2 multicast listener report */
+};
+
+/** IGMPv3/MLDv2 group record types */
+enum mcast_record_type {
+	RECORD_MODE_IS_INCLUDE = 1,    /**< Current state: include listed sources */
+	RECORD_MODE_IS_EXCLUDE = 2,    /**< Current state: exclude listed sources */
+	RECORD_CHANGE_TO_INCLUDE = 3,  /**< Filter mode change to include */
+	RECORD_CHANGE_TO_EXCLUDE = 4,  /**< Filter mode change to exclude */
+	RECORD_ALLOW_NEW_SOURCES = 5,  /**< Additional sources */
+	RECORD_BLOCK_OLD_SOURCES = 6,  /**< Sources that aren't wanted anymore */
+};
+
+
+/** A parsed IP multicast packet */
+typedef struct mcast_packet {
+	fastd_mcast_group_t group; /**< The destination group */
+	uint8_t proto;             /**< The upper-layer protocol (IPPROTO_NONE for non-initial fragments) */
+	const uint8_t *payload;    /**< The upper-layer payload */
+	size_t payload_len;        /**< The length of the upper-layer payload */
+} mcast_packet_t;
+
+
+/** Reads a 16bit big-endian value */
+static inline uint16_t get_u16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+/** Returns a group for an IPv4 or IPv6 address */
+static inline fastd_mcast_group_t make_group(fastd_mcast_af_t af, const uint8_t *addr) {
+	fastd_mcast_group_t group = { .af = af };
+	memcpy(group.addr, addr, (af == MCAST_AF_IPV4) ? 4 : 16);
+	return group;
+}
+
+/** Checks if a group must always be flooded (or is not a multicast group at all) */
+static bool is_flooded_group(const fastd_mcast_group_t *group) {
+	static const uint8_t all_nodes[16] = { 0xff, 0x02, [15] = 0x01 };
+
+	switch (group->af) {
+	case MCAST_AF_IPV4:
+		/* 224.0.0.0/24 is used by routing protocols and IGMPv3 (RFC 4541) */
+		return (group->addr[0] & 0xf0) != 0xe0 ||
+		       (group->addr[0] == 224 && group->addr[1] == 0 && group->addr[2] == 0);
+
+	case MCAST_AF_IPV6:
+		/* MLD is never used for the link-scope all-nodes group; interface-local groups are invalid on the wire */
+		return group->addr[0] != 0xff || (group->addr[1] & 0x0f) <= 1 ||
+		       memcmp(group->addr, all_nodes, sizeof(all_nodes)) == 0;
+
+	default:
+		return true;
+	}
+}
+
+
+/** Compares the keys of two membership entries */
+static int member_cmp(const fastd_mcast_group_t *group1, uint64_t id1, const fastd_mcast_member_t *member2) {
+	int cmp = memcmp(group1, &member2->group, sizeof(fastd_mcast_group_t));
+	if (cmp)
+		return cmp;
+
+	if (id1 < member2->peer->id)
+		return -1;
+	else if (id1 > member2->peer->id)
+		return 1;
+	else
+		return 0;
+}
+
+/** Returns the index of the first membership entry not less than the given group and peer ID */
+static size_t member_lower_bound(const fastd_mcast_group_t *group, uint64_t id) {
+	size_t min = 0, max = VECTOR_LEN(ctx.mcast_members);
+
+	while (max > min) {
+		size_t cur = min + (max - min) / 2;
+
+		if (member_cmp(group, id, &VECTOR_INDEX(ctx.mcast_members, cur)) > 0)
+			min = cur + 1;
+		else
+			max = cur;
+	}
+
+	return min;
+}
+
+/** Returns the membership entry of a peer for a group (or NULL) */
+static fastd_mcast_member_t *member_find(const fastd_mcast_group_t *group, const fastd_peer_t *peer) {
+	size_t i = member_lower_bound(group, peer->id);
+	if (i == VECTOR_LEN(ctx.mcast_members))
+		return NULL;
+
+	fastd_mcast_member_t *member = &VECTOR_INDEX(ctx.mcast_members, i);
+	if (member_cmp(group, peer->id, member) != 0)
+		return NULL;
+
+	return member;
+}
+
+/** Checks if there is any peer with current members of a group */
+static bool group_known(const fastd_mcast_group_t *group) {
+	size_t i;
+	for (i = member_lower_bound(group, 0); i < VECTOR_LEN(ctx.mcast_members); i++) {
+		const fastd_mcast_member_t *member = &VECTOR_INDEX(ctx.mcast_members, i);
+
+		if (memcmp(group, &member->group, sizeof(*group)) != 0)
+			break;
+
+		if (!fastd_timed_out(member->timeout))
+			return true;
+	}
+
+	return false;
+}
+
+/** Checks if a peer has a current membership for a group */
+static inline bool is_member(const fastd_mcast_group_t *group, const fastd_peer_t *peer) {
+	const fastd_mcast_member_t *member = member_find(group, peer);
+	return member && !fastd_timed_out(member->timeout);
+}
+
+/** Checks if a peer has a multicast router behind it */
+static inline bool is_router(const fastd_peer_t *peer, fastd_mcast_af_t af) {
+	return !fastd_timed_out(peer->mcast_router_timeout[af]);
+}
+
+
+/** Adds or refreshes a membership of a peer */
+static void join(fastd_peer_t *peer, const fastd_mcast_group_t *group) {
+	if (is_flooded_group(group))
+		return;
+
+	fastd_mcast_member_t *member = member_find(group, peer);
+	if (member) {
+		member->timeout = ctx.now + MCAST_MEMBERSHIP_TIME;
+		return;
+	}
+
+	VECTOR_INSERT(
+		ctx.mcast_members, ((fastd_mcast_member_t){ *group, peer, ctx.now + MCAST_MEMBERSHIP_TIME }),
+		member_lower_bound(group, peer->id));
+}
+
+/**
+   Handles a leave message of a peer
+
+   Other hosts behind the same peer may still be members, so the membership is
+   only shortened; remaining members will answer the querier's group-specific query.
+*/
+static void leave(fastd_peer_t *peer, const fastd_mcast_group_t *group) {
+	fastd_mcast_member_t *member = member_find(group, peer);
+	if (member)
+		fastd_timeout_advance(&member->timeout, ctx.now + MCAST_LEAVE_TIME);
+}
+
+/** Handles an IGMPv3 or MLDv2 group record */
+static void handle_record(fastd_peer_t *peer, const fastd_mcast_group_t *group, uint8_t type, uint16_t n_sources) {
+	switch (type) {
+	case RECORD_MODE_IS_INCLUDE:
+	case RECORD_CHANGE_TO_INCLUDE:
+		if (n_sources)
+			join(peer, group);
+		else
+			leave(peer, group);
+		break;
+
+	case RECORD_MODE_IS_EXCLUDE:
+	case RECORD_CHANGE_TO_EXCLUDE:
+	case RECORD_ALLOW_NEW_SOURCES:
+		join(peer, group);
+		break;
+
+	default:
+		/* Source-specific state is not tracked */
+		break;
+	}
+}
+
+/**
+   Handles IGMPv3 or MLDv2 group records
+
+   \e addr_len is the length of the group and source addresses.
+*/
+static void handle_records(fastd_peer_t *peer, fastd_mcast_af_t af, const mcast_packet_t *packet, size_t addr_len) {
+	const uint8_t *p = packet->payload;
+	size_t len = packet->payload_len;
+
+	if (len < 8)
+		return;
+
+	size_t n_records = get_u16(p + 6), pos = 8;
+
+	while (n_records--) {
+		if (pos + 4 + addr_len > len)
+			return;
+
+		uint8_t type = p[pos];
+		size_t aux_len = 4 * (size_t)p[pos + 1];
+		uint16_t n_sources = get_u16(p + pos + 2);
+		fastd_mcast_group_t group = make_group(af, p + pos + 4);
+
+		handle_record(peer, &group, type, n_sources);
+
+		pos += 4 + addr_len + n_sources * addr_len + aux_len;
+	}
+}
+
+/** Handles a multicast query */
+static void handle_query(fastd_peer_t *peer, fastd_mcast_af_t af) {
+	ctx.mcast_querier_timeout[af] = ctx.now + MCAST_QUERIER_TIME;
+
+	if (peer)
+		peer->mcast_router_timeout[af] = ctx.now + MCAST_QUERIER_TIME;
+}
+
+/** Snoops an IGMP packet */
+static void snoop_igmp(fastd_peer_t *peer, const mcast_packet_t *packet) {
+	if (packet->payload_len < 8)
+		return;
+
+	const uint8_t *p = packet->payload;
+
+	if (p[0] == IGMP_TYPE_QUERY) {
+		handle_query(peer, MCAST_AF_IPV4);
+		return;
+	}
+
+	if (!peer)
+		return;
+
+	fastd_mcast_group_t group = make_group(MCAST_AF_IPV4, p + 4);
+
+	switch (p[0]) {
+	case IGMP_TYPE_V1_REPORT:
+	case IGMP_TYPE_V2_REPORT:
+		join(peer, &group);
+		break;
+
+	case IGMP_TYPE_V2_LEAVE:
+		leave(peer, &group);
+		break;
+
+	case IGMP_TYPE_V3_REPORT:
+		handle_records(peer, MCAST_AF_IPV4, packet, 4);
+		break;
+	}
+}
+
+/** Snoops an MLD packet */
+static void snoop_mld(fastd_peer_t *peer, const mcast_packet_t *packet) {
+	if (packet->payload_len < 8)
+		return;
+
+	const uint8_t *p = packet->payload;
+
+	if (p[0] == MLD_TYPE_V2_REPORT) {
+		if (peer)
+			handle_records(peer, MCAST_AF_IPV6, packet, 16);
+		return;
+	}
+
+	if (packet->payload_len < 24)
+		return;
+
+	fastd_mcast_group_t group = make_group(MCAST_AF_IPV6, p + 8);
+
+	switch (p[0]) {
+	case MLD_TYPE_QUERY:
+		handle_query(peer, MCAST_AF_IPV6);
+		break;
+
+	case MLD_TYPE_V1_REPORT:
+		if (peer)
+			join(peer, &group);
+		break;
+
+	case MLD_TYPE_V1_DONE:
+		if (peer)
+			leave(peer, &group);
+		break;
+	}
+}
+
+
+/** Parses an IPv4 packet with a multicast destination */
+static bool parse_ipv4(const uint8_t *data, size_t len, mcast_packet_t *packet) {
+	struct ip ip;
+	if (len < sizeof(ip))
+		return false;
+
+	memcpy(&ip, data, sizeof(ip));
+
+	size_t hlen = 4 * (size_t)ip.ip_hl, tot_len = ntohs(ip.ip_len);
+	if (ip.ip_v != 4 || hlen < sizeof(ip) || tot_len < hlen || tot_len > len)
+		return false;
+
+	packet->group = make_group(MCAST_AF_IPV4, (const uint8_t *)&ip.ip_dst);
+	packet->proto = (ntohs(ip.ip_off) & IP_OFFMASK) ? IPPROTO_NONE : ip.ip_p;
+	packet->payload = data + hlen;
+	packet->payload_len = tot_len - hlen;
+
+	return true;
+}
+
+/** Parses an IPv6 packet with a multicast destination, skipping hop-by-hop and destination options */
+static bool parse_ipv6(const uint8_t *data, size_t len, mcast_packet_t *packet) {
+	struct ip6_hdr ip6;
+	if (len < sizeof(ip6))
+		return false;
+
+	memcpy(&ip6, data, sizeof(ip6));
+
+	size_t end = sizeof(ip6) + ntohs(ip6.ip6_plen), pos = sizeof(ip6);
+	if ((ip6.ip6_vfc >> 4) != 6 || end > len)
+		return false;
+
+	uint8_t proto = ip6.ip6_nxt;
+	while (proto == IPPROTO_HOPOPTS || proto == IPPROTO_DSTOPTS) {
+		if (pos + 2 > end)
+			return false;
+
+		proto = data[pos];
+		pos += 8 * ((size_t)data[pos + 1] + 1);
+	}
+
+	if (pos > end)
+		return false;
+
+	packet->group = make_group(MCAST_AF_IPV6, (const uint8_t *)&ip6.ip6_dst);
+	packet->proto = proto;
+	packet->payload = data + pos;
+	packet->payload_len = end - pos;
+
+	return true;
+}
+
+/** Parses an ethernet frame containing an IP multicast packet */
+static bool parse_packet(const fastd_buffer_t *buffer, mcast_packet_t *packet) {
+	const uint8_t *data = buffer->data;
+	const uint8_t *payload = data + sizeof(fastd_eth_header_t);
+	size_t payload_len = buffer->len - sizeof(fastd_eth_header_t);
+
+	/* 01:00:5e for IPv4, 33:33 for IPv6 */
+	if (data[0] == 0x01 && data[1] == 0x00 && data[2] == 0x5e)
+		return get_u16(data + offsetof(fastd_eth_header_t, proto)) == ETHERTYPE_IP &&
+		       parse_ipv4(payload, payload_len, packet);
+
+	if (data[0] == 0x33 && data[1] == 0x33)
+		return get_u16(data + offsetof(fastd_eth_header_t, proto)) == ETHERTYPE_IPV6 &&
+		       parse_ipv6(payload, payload_len, packet);
+
+	return false;
+}
+
+/** Checks if a packet is an IGMP or MLD membership report or leave message */
+static bool is_report(const mcast_packet_t *packet) {
+	if (!packet->payload_len)
+		return false;
+
+	uint8_t type = packet->payload[0];
+
+	switch (packet->group.af) {
+	case MCAST_AF_IPV4:
+		return packet->proto == IPPROTO_IGMP &&
+		       (type == IGMP_TYPE_V1_REPORT || type == IGMP_TYPE_V2_REPORT || type == IGMP_TYPE_V2_LEAVE ||
+			type == IGMP_TYPE_V3_REPORT);
+
+	case MCAST_AF_IPV6:
+		return packet->proto == IPPROTO_ICMPV6 &&
+		       (type == MLD_TYPE_V1_REPORT || type == MLD_TYPE_V1_DONE || type == MLD_TYPE_V2_REPORT);
+
+	default:
+		return false;
+	}
+}
+
+
+/**
+   Learns group memberships and multicast routers from an ethernet frame
+
+   \e peer is the peer the frame was received from, or NULL if it was read from
+   the local interface.
+*/
+void fastd_mcast_snoop(fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	if (!fastd_mcast_snooping_enabled())
+		return;
+
+	mcast_packet_t packet;
+	if (!parse_packet(buffer, &packet))
+		return;
+
+	if (packet.group.af == MCAST_AF_IPV4 && packet.proto == IPPROTO_IGMP)
+		snoop_igmp(peer, &packet);
+	else if (packet.group.af == MCAST_AF_IPV6 && packet.proto == IPPROTO_ICMPV6)
+		snoop_mld(peer, &packet);
+}
+
+/**
+   Sends a multicast frame only to the peers that need it
+
+   Returns false if the frame must be flooded to all peers; otherwise, the
+   buffer is consumed.
+*/
+bool fastd_mcast_handle(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	if (!fastd_mcast_snooping_enabled())
+		return false;
+
+	mcast_packet_t packet;
+	if (!parse_packet(buffer, &packet))
+		return false;
+
+	fastd_mcast_af_t af = packet.group.af;
+
+	if (fastd_timed_out(ctx.mcast_querier_timeout[af]))
+		return false;
+
+	bool report = is_report(&packet);
+
+	if (!report && (is_flooded_group(&packet.group) || !group_known(&packet.group)))
+		return false;
+
+	fastd_peer_t *last = NULL;
+	size_t i;
+
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		fastd_peer_t *dest = VECTOR_INDEX(ctx.peers, i);
+		if (dest == source || !fastd_peer_is_established(dest))
+			continue;
+
+		if (!is_router(dest, af) && (report || !is_member(&packet.group, dest)))
+			continue;
+
+		if (last)
+			fastd_txq_send(last, fastd_buffer_dup(buffer, conf.encrypt_headroom));
+
+		last = dest;
+	}
+
+	if (last)
+		fastd_txq_send(last, buffer);
+	else
+		fastd_buffer_free(buffer);
+
+	return true;
+}
+
+/** Removes all memberships and router state of a peer */
+void fastd_mcast_peer_reset(fastd_peer_t *peer) {
+	size_t i, deleted = 0;
+
+	for (i = 0; i < VECTOR_LEN(ctx.mcast_members); i++) {
+		if (VECTOR_INDEX(ctx.mcast_members, i).peer == peer)
+			deleted++;
+		else if (deleted)
+			VECTOR_INDEX(ctx.mcast_members, i - deleted) = VECTOR_INDEX(ctx.mcast_members, i);
+	}
+
+	VECTOR_RESIZE(ctx.mcast_members, VECTOR_LEN(ctx.mcast_members) - deleted);
+
+	for (i = 0; i < MCAST_AF_MAX; i++)
+		peer->mcast_router_timeout[i] = ctx.now;
+}
+
+/** Removes all expired memberships */
+void fastd_mcast_cleanup(void) {
+	size_t i, deleted = 0;
+
+	for (i = 0; i < VECTOR_LEN(ctx.mcast_members); i++) {
+		if (fastd_timed_out(VECTOR_INDEX(ctx.mcast_members, i).timeout))
+			deleted++;
+		else if (deleted)
+			VECTOR_INDEX(ctx.mcast_members, i - deleted) = VECTOR_INDEX(ctx.mcast_members, i);
+	}
+
+	VECTOR_RESIZE(ctx.mcast_members, VECTOR_LEN(ctx.mcast_members) - deleted);
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   IGMP and MLD snooping for TAP mode
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+
+
+/** A multicast group address */
+typedef struct fastd_mcast_group {
+	uint8_t af;       /**< The fastd_mcast_af_t of the group */
+	uint8_t addr[16]; /**< The group address (IPv4 addresses use the first 4 bytes, the rest is zeroed) */
+} fastd_mcast_group_t;
+
+/** A multicast group membership of a peer learned from IGMP or MLD reports */
+struct fastd_mcast_member {
+	fastd_mcast_group_t group; /**< The group */
+	fastd_peer_t *peer;        /**< The peer with listeners for the group */
+	fastd_timeout_t timeout;   /**< Timeout after which the membership expires */
+};
+
+
+void fastd_mcast_snoop(fastd_peer_t *peer, const fastd_buffer_t *buffer);
+bool fastd_mcast_handle(fastd_buffer_t *buffer, fastd_peer_t *source);
+void fastd_mcast_peer_reset(fastd_peer_t *peer);
+void fastd_mcast_cleanup(void);
+
+
+/** Checks if multicast snooping is enabled */
+static inline bool fastd_mcast_snooping_enabled(void) {
+	return conf.mode == MODE_TAP && conf.mcast_snooping;
+}
@@ -24,6 +24,8 @@ struct fastd_method_info {
 };
 
 #define METHOD_FORCE_KEEPALIVE 0x01 /**< Send keepalives even in the presence of regular data transmissions */
+#define METHOD_TUN_ONLY 0x02        /**< The method can only be used in TUN mode */
+#define METHOD_EXPERIMENTAL 0x04    /**< A warning is logged when the method is configured */
 
 /** Describes a method provider (an implementation of a class of encryption methods) */
 struct fastd_method_provider {
@@ -49,6 +51,8 @@ struct fastd_method_provider {
 		fastd_peer_t *peer, const fastd_method_t *method, const uint8_t *secret, unsigned session_flags);
 	/** Closes a session */
 	void (*session_free)(fastd_method_session_state_t *session);
+	/** Returns the session keys to hand over to the offload implementation (optional) */
+	const fastd_offload_keys_t *(*session_get_offload_keys)(const fastd_method_session_state_t *session);
 
 	/** Determines if a session is currently valid */
 	bool (*session_is_valid)(fastd_method_session_state_t *session);
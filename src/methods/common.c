@@ -52,13 +52,34 @@ bool fastd_method_is_nonce_valid(
 		if (fastd_timed_out(session->reorder_timeout))
 			return false;
 
-		if (*age > 64)
+		if (*age >= REORDER_WINDOW)
 			return false;
 	}
 
 	return true;
 }
 
+/** Returns the sequence number of a nonce (the nonce without the initiator/responder bit) */
+static inline uint64_t nonce_seq(const uint8_t nonce[COMMON_NONCEBYTES]) {
+	uint64_t ret = 0;
+
+	size_t i;
+	for (i = 0; i < COMMON_NONCEBYTES; i++)
+		ret = (ret << 8) | nonce[i];
+
+	return ret >> 1;
+}
+
+/** Returns a pointer to the word of the reorder bitmap containing the bit of a sequence number */
+static inline uint64_t *reorder_word(fastd_method_common_t *session, uint64_t seq) {
+	return &session->receive_reorder_seen[(seq % REORDER_WINDOW) / 64];
+}
+
+/** Returns the bit of a sequence number in its word of the reorder bitmap */
+static inline uint64_t reorder_bit(uint64_t seq) {
+	return (uint64_t)1 << (seq % 64);
+}
+
 /**
    Checks if a possibly reordered packet should be accepted
 
@@ -68,26 +89,31 @@ bool fastd_method_is_nonce_valid(
 */
 fastd_tristate_t
 fastd_method_reorder_check(fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age) {
+	uint64_t seq = nonce_seq(nonce);
+
 	if (age < 0) {
-		size_t shift = -age;
+		uint64_t shift = -age;
 
-		if (shift >= 64)
-			session->receive_reorder_seen = 0;
-		else
-			session->receive_reorder_seen <<= shift;
+		if (shift >= REORDER_WINDOW) {
+			memset(session->receive_reorder_seen, 0, sizeof(session->receive_reorder_seen));
+		} else {
+			/* Forget the sequence numbers that have dropped out of the window */
+			uint64_t i;
+			for (i = seq - shift + 1; i != seq; i++)
+				*reorder_word(session, i) &= ~reorder_bit(i);
+		}
 
-		if (shift <= 64)
-			session->receive_reorder_seen |= ((uint64_t)1 << (shift - 1));
+		*reorder_word(session, seq) |= reorder_bit(seq);
 
 		memcpy(session->receive_nonce, nonce, COMMON_NONCEBYTES);
 		session->reorder_timeout = ctx.now + REORDER_TIME;
 		return FASTD_TRISTATE_FALSE;
-	} else if (age == 0 || session->receive_reorder_seen & ((uint64_t)1 << (age - 1))) {
+	} else if (age == 0 || (*reorder_word(session, seq) & reorder_bit(seq))) {
 		pr_debug("dropping duplicate packet from %P (age %u)", session->peer, (unsigned)age);
 		return FASTD_TRISTATE_UNDEF;
 	} else {
 		pr_debug2("accepting reordered packet from %P (age %u)", session->peer, (unsigned)age);
-		session->receive_reorder_seen |= ((uint64_t)1 << (age - 1));
+		*reorder_word(session, seq) |= reorder_bit(seq);
 		return FASTD_TRISTATE_TRUE;
 	}
 }
@@ -40,8 +40,9 @@ typedef struct fastd_method_common {
 
 	fastd_timeout_t reorder_timeout; /**< How long to packets with a lower sequence number (nonce) than the newest
 					    received */
-	uint64_t receive_reorder_seen;   /**< Bitmap specifying which of the 64 sequence numbers (nonces) before \a
-					    receive_nonce have bit seen */
+	/** Bitmap specifying which of the REORDER_WINDOW sequence numbers up to \a receive_nonce have been seen,
+	    indexed by the sequence number modulo REORDER_WINDOW */
+	uint64_t receive_reorder_seen[REORDER_WINDOW / 64];
 } fastd_method_common_t;
 
 
@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   esp-gcm method provider
+
+   esp-gcm provides the "aes128-gcm@esp" method, which can hand over its
+   session keys to the kernel's ESP implementation.
+
+   fastd itself always sends packets in the format of the "aes128-gcm" method
+   (which is standard AES-GCM with a 96 bit IV derived from the nonce),
+   using a key that is never handed over to the kernel. Kernels with ESP
+   offloading send ESP-in-UDP packets with the Non-IKE marker (RFC 4106,
+   draft-ietf-ipsec-nat-t-ike-00), using a separate security association for
+   each direction. These packets are also accepted by fastd, so only one side
+   of a connection needs to enable offloading. As the two formats never share
+   a key, fastd and the kernel can't reuse each other's IVs.
+*/
+
+
+#include "../../crypto.h"
+#include "../../method.h"
+#include "../../offload/esp/esp.h"
+#include "../common.h"
+
+
+/** The length of the Non-IKE marker preceding ESP packets sent by the kernel */
+#define ESP_MARKER_BYTES 8
+
+/** The length of the ESP header and IV */
+#define ESP_HEADBYTES 16
+
+/** The length of the ESP trailer (padding length and next header) */
+#define ESP_TRAILERBYTES 2
+
+/** The maximum amount of padding added by the kernel (payloads are padded to a multiple of 4 bytes) */
+#define ESP_MAX_PADDING 3
+
+/** The length of the AES-128 key of a security association */
+#define ESP_KEYBYTES 16
+
+/** The length of the secret derived for a security association (key, salt and SPI) */
+#define ESP_SA_SECRETBYTES (FASTD_OFFLOAD_SA_KEY_LEN + sizeof(uint32_t))
+
+
+/** A specific method provided by this provider */
+struct fastd_method {
+	const fastd_cipher_info_t *cipher_info; /**< AES128-CTR */
+	const fastd_mac_info_t *ghash_info;     /**< GHASH */
+};
+
+/** The cipher and GHASH states of an AES-GCM key */
+typedef struct gcm_key {
+	const fastd_cipher_t *cipher;       /**< The cipher implementation used */
+	fastd_cipher_state_t *cipher_state; /**< The cipher state */
+
+	const fastd_mac_t *ghash;       /**< The GHASH implementation */
+	fastd_mac_state_t *ghash_state; /**< The GHASH state */
+
+	fastd_block128_t H; /**< The GHASH key */
+} gcm_key_t;
+
+/** The method-specific session state */
+struct fastd_method_session_state {
+	fastd_method_common_t common; /**< The common method state */
+
+	const fastd_method_t *method; /**< The specific method used */
+
+	gcm_key_t key; /**< The key of packets sent and received by fastd */
+
+	gcm_key_t esp_key; /**< The key of ESP packets received from the peer's kernel */
+	uint32_t esp_seq;  /**< The highest ESP sequence number received so far */
+	uint64_t esp_seen; /**< Bitmap of the 64 sequence numbers before \a esp_seq that have been seen */
+
+	fastd_offload_keys_t offload_keys; /**< The security associations handed over to the kernel */
+};
+
+
+/** Instanciates the "aes128-gcm@esp" method */
+static bool method_create_by_name(const char *name, fastd_method_t **method) {
+	if (strcmp(name, "aes128-gcm@esp"))
+		return false;
+
+	fastd_method_t m;
+
+	m.cipher_info = fastd_cipher_info_get_by_name("aes128-ctr");
+	if (!m.cipher_info)
+		return false;
+
+	m.ghash_info = fastd_mac_info_get_by_name("ghash");
+	if (!m.ghash_info)
+		return false;
+
+	*method = fastd_new(fastd_method_t);
+	**method = m;
+
+	return true;
+}
+
+/** Frees a method */
+static void method_destroy(fastd_method_t *method) {
+	free(method);
+}
+
+/** Returns the key length used by a method */
+static size_t method_key_length(UNUSED const fastd_method_t *method) {
+	return ESP_KEYBYTES + 2 * ESP_SA_SECRETBYTES;
+}
+
+/** Returns the ESP offload implementation, if enabled */
+static const fastd_offload_t *method_get_offload(UNUSED const fastd_method_t *method) {
+	if (fastd_use_offload_esp())
+		return fastd_offload_esp_get();
+
+	return NULL;
+}
+
+/** Initializes the cipher and GHASH states of a key */
+static bool gcm_key_init(gcm_key_t *key, const fastd_method_t *method, const uint8_t *secret) {
+	key->cipher = fastd_cipher_get(method->cipher_info);
+	key->cipher_state = key->cipher->init(secret, 0);
+
+	static const fastd_block128_t zeroblock = {};
+	static const uint8_t zeroiv[16] __attribute__((aligned(8))) = {};
+
+	if (!key->cipher->crypt(key->cipher_state, &key->H, &zeroblock, sizeof(fastd_block128_t), zeroiv)) {
+		key->cipher->free(key->cipher_state);
+		return false;
+	}
+
+	key->ghash = fastd_mac_get(method->ghash_info);
+	key->ghash_state = key->ghash->init(key->H.b, 0);
+
+	return true;
+}
+
+/** Frees the cipher and GHASH states of a key */
+static void gcm_key_free(gcm_key_t *key) {
+	key->cipher->free(key->cipher_state);
+	key->ghash->free(key->ghash_state);
+}
+
+/** Reads the key, salt and SPI of a security association from the derived secret */
+static void get_sa(fastd_offload_sa_t *sa, const uint8_t *secret) {
+	memcpy(sa->key, secret, FASTD_OFFLOAD_SA_KEY_LEN);
+	memcpy(&sa->spi, secret + FASTD_OFFLOAD_SA_KEY_LEN, sizeof(sa->spi));
+
+	/* Keep out of the reserved SPI range 1-255 */
+	sa->spi |= htobe32(0x80000000);
+}
+
+/** Initializes a session */
+static fastd_method_session_state_t *
+method_session_init(fastd_peer_t *peer, const fastd_method_t *method, const uint8_t *secret, unsigned session_flags) {
+	fastd_method_session_state_t *session = fastd_new0(fastd_method_session_state_t);
+
+	fastd_method_common_init(&session->common, peer, session_flags);
+	session->method = method;
+
+	const uint8_t *sa_initiator = secret + ESP_KEYBYTES;
+	const uint8_t *sa_responder = sa_initiator + ESP_SA_SECRETBYTES;
+	bool initiator = (session_flags & FASTD_SESSION_INITIATOR);
+
+	session->offload_keys.initiator = initiator;
+	get_sa(&session->offload_keys.out, initiator ? sa_initiator : sa_responder);
+	get_sa(&session->offload_keys.in, initiator ? sa_responder : sa_initiator);
+
+	if (!gcm_key_init(&session->key, method, secret))
+		goto fail_key;
+
+	if (!gcm_key_init(&session->esp_key, method, session->offload_keys.in.key))
+		goto fail_esp_key;
+
+	return session;
+
+fail_esp_key:
+	gcm_key_free(&session->key);
+fail_key:
+	secure_memzero(session, sizeof(*session));
+	free(session);
+	return NULL;
+}
+
+/** Checks if the session is currently valid */
+static bool method_session_is_valid(fastd_method_session_state_t *session) {
+	return (session && fastd_method_session_common_is_valid(&session->common));
+}
+
+/** Checks if this side is the initator of the session */
+static bool method_session_is_initiator(fastd_method_session_state_t *session) {
+	return fastd_method_session_common_is_initiator(&session->common);
+}
+
+/** Checks if the session should be refreshed */
+static bool method_session_want_refresh(fastd_method_session_state_t *session) {
+	return fastd_method_session_common_want_refresh(&session->common);
+}
+
+/** Marks the session as superseded */
+static void method_session_superseded(fastd_method_session_state_t *session) {
+	fastd_method_session_common_superseded(&session->common);
+}
+
+/** Frees the session state */
+static void method_session_free(fastd_method_session_state_t *session) {
+	if (session) {
+		gcm_key_free(&session->key);
+		gcm_key_free(&session->esp_key);
+
+		secure_memzero(session, sizeof(*session));
+		free(session);
+	}
+}
+
+/** Returns the security associations to install in the kernel */
+static const fastd_offload_keys_t *method_session_get_offload_keys(const fastd_method_session_state_t *session) {
+	return &session->offload_keys;
+}
+
+
+/**
+   Multiplies a block by another in GF(2^128) as defined for GHASH
+
+   This simple bitwise implementation is only used for single blocks.
+*/
+static void gf128_mul(fastd_block128_t *x, const fastd_block128_t *y) {
+	uint64_t x0 = be64toh(x->qw[0]), x1 = be64toh(x->qw[1]);
+	uint64_t v0 = be64toh(y->qw[0]), v1 = be64toh(y->qw[1]);
+	uint64_t z0 = 0, z1 = 0;
+
+	size_t i;
+	for (i = 0; i < 128; i++) {
+		uint64_t bit = (i < 64) ? (x0 >> (63 - i)) : (x1 >> (127 - i));
+		uint64_t mask = -(bit & 1);
+
+		z0 ^= v0 & mask;
+		z1 ^= v1 & mask;
+
+		uint64_t reduce = -(v1 & 1);
+		v1 = (v1 >> 1) | (v0 << 63);
+		v0 = (v0 >> 1) ^ (UINT64_C(0xe100000000000000) & reduce);
+	}
+
+	x->qw[0] = htobe64(z0);
+	x->qw[1] = htobe64(z1);
+}
+
+/**
+   Computes the GHASH of a single block of additional authenticated data and the ciphertext
+
+   \e in must contain the AAD (zero-padded to a full block), followed by the
+   zero-padded ciphertext.
+
+   fastd's GHASH implementations only support empty AAD, so they hash the
+   AAD block as part of the ciphertext. As GHASH is linear, the resulting
+   difference in the length block can be corrected afterwards.
+*/
+static bool gcm_ghash_aad(
+	const gcm_key_t *key, fastd_block128_t *out, const fastd_block128_t *in, size_t aad_len, size_t data_len) {
+	if (!key->ghash->digest(key->ghash_state, out, in, sizeof(fastd_block128_t) + data_len))
+		return false;
+
+	fastd_block128_t correction = {};
+	correction.dw[1] = htobe32(aad_len << 3);
+	correction.dw[3] = htobe32((sizeof(fastd_block128_t) + data_len) << 3) ^ htobe32(data_len << 3);
+
+	gf128_mul(&correction, &key->H);
+	block_xor_a(out, &correction);
+
+	return true;
+}
+
+
+/** Checks if an ESP sequence number has not been received before */
+static bool esp_seq_valid(const fastd_method_session_state_t *session, uint32_t seq, int64_t *age) {
+	*age = (int64_t)session->esp_seq - seq;
+
+	if (*age > 64)
+		return false;
+
+	if (*age > 0 && (session->esp_seen & ((uint64_t)1 << (*age - 1))))
+		return false;
+
+	return (*age != 0);
+}
+
+/** Records a received ESP sequence number */
+static void esp_seq_update(fastd_method_session_state_t *session, uint32_t seq, int64_t age) {
+	if (age < 0) {
+		size_t shift = -age;
+
+		if (shift >= 64)
+			session->esp_seen = 0;
+		else
+			session->esp_seen <<= shift;
+
+		if (shift <= 64)
+			session->esp_seen |= ((uint64_t)1 << (shift - 1));
+
+		session->esp_seq = seq;
+	} else {
+		session->esp_seen |= ((uint64_t)1 << (age - 1));
+	}
+}
+
+/** Verifies and decrypts an ESP packet sent by the peer's kernel */
+static fastd_buffer_t *decrypt_esp(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+	if (in->len < ESP_MARKER_BYTES + ESP_HEADBYTES + ESP_TRAILERBYTES + sizeof(fastd_block128_t))
+		return NULL;
+
+	/* The ICV is replaced by zero padding in place, so no buffer view is used here */
+	uint8_t *header = (uint8_t *)in->data + ESP_MARKER_BYTES;
+	size_t len = in->len - ESP_MARKER_BYTES;
+	uint32_t spi, seq;
+	memcpy(&spi, header, sizeof(spi));
+	memcpy(&seq, header + sizeof(spi), sizeof(seq));
+	seq = be32toh(seq);
+
+	if (spi != session->offload_keys.in.spi)
+		return NULL;
+
+	int64_t age;
+	if (!esp_seq_valid(session, seq, &age))
+		return NULL;
+
+	/* J0 is the salt and the IV, followed by a counter starting with 1 */
+	uint8_t nonce[sizeof(fastd_block128_t)] __attribute__((aligned(8))) = {};
+	memcpy(nonce, session->offload_keys.in.key + ESP_KEYBYTES, FASTD_OFFLOAD_SA_KEY_LEN - ESP_KEYBYTES);
+	memcpy(nonce + FASTD_OFFLOAD_SA_KEY_LEN - ESP_KEYBYTES, header + 2 * sizeof(uint32_t), 8);
+	nonce[sizeof(nonce) - 1] = 1;
+
+	size_t data_len = len - ESP_HEADBYTES - sizeof(fastd_block128_t);
+
+	fastd_block128_t icv;
+	memcpy(&icv, header + ESP_HEADBYTES + data_len, sizeof(icv));
+	memset(header + ESP_HEADBYTES + data_len, 0, sizeof(icv));
+
+	fastd_buffer_t *out = fastd_buffer_alloc(
+		sizeof(fastd_block128_t) + data_len, ssub_size_t(conf.encrypt_headroom, sizeof(fastd_block128_t)));
+
+	int n_blocks = block_count(sizeof(fastd_block128_t) + data_len, sizeof(fastd_block128_t));
+
+	fastd_block128_t *inblocks = (fastd_block128_t *)header;
+	fastd_block128_t *outblocks = out->data;
+	fastd_block128_t tag;
+
+	if (!session->esp_key.cipher->crypt(
+		    session->esp_key.cipher_state, outblocks, inblocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		goto fail;
+
+	/* The first keystream block, used to encrypt the tag */
+	block_xor_a(&outblocks[0], &inblocks[0]);
+
+	/* The AAD consists of the SPI and sequence number */
+	memset(header + 2 * sizeof(uint32_t), 0, 8);
+	if (!gcm_ghash_aad(&session->esp_key, &tag, inblocks, 2 * sizeof(uint32_t), data_len))
+		goto fail;
+
+	block_xor_a(&tag, &outblocks[0]);
+
+	if (!block_equal(&tag, &icv))
+		goto fail;
+
+	fastd_buffer_free(in);
+
+	fastd_buffer_pull(out, sizeof(fastd_block128_t));
+
+	const uint8_t *trailer = (const uint8_t *)out->data + data_len - ESP_TRAILERBYTES;
+	uint8_t pad_len = trailer[0], next_header = trailer[1];
+
+	if (pad_len > data_len - ESP_TRAILERBYTES)
+		goto fail_out;
+
+	out->len = data_len - ESP_TRAILERBYTES - pad_len;
+
+	switch (next_header) {
+	case IPPROTO_IPIP:
+	case IPPROTO_IPV6:
+		break;
+
+	case IPPROTO_NONE:
+		/* Dummy packet (RFC 4303), handled like a keepalive */
+		out->len = 0;
+		break;
+
+	default:
+		goto fail_out;
+	}
+
+	*reordered = (age > 0);
+	esp_seq_update(session, seq, age);
+
+	return out;
+
+fail:
+	fastd_buffer_free(out);
+	return NULL;
+
+fail_out:
+	fastd_buffer_free(out);
+	return fastd_buffer_alloc(0, 0);
+}
+
+/** Checks if a packet starts with the Non-IKE marker */
+static inline bool is_esp_packet(const fastd_buffer_t *in) {
+	static const uint8_t marker[ESP_MARKER_BYTES] = {};
+	return (in->len >= ESP_MARKER_BYTES && !memcmp(in->data, marker, ESP_MARKER_BYTES));
+}
+
+
+/** Encrypts and authenticates a packet */
+static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	fastd_buffer_push_zero(in, sizeof(fastd_block128_t));
+
+	fastd_buffer_t *out = fastd_buffer_alloc(in->len, COMMON_HEADROOM);
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, session->common.send_nonce, sizeof(nonce));
+
+	int n_blocks = block_count(in->len, sizeof(fastd_block128_t));
+
+	const fastd_block128_t *inblocks = in->data;
+	fastd_block128_t *outblocks = out->data;
+	fastd_block128_t tag;
+
+	if (!session->key.cipher->crypt(
+		    session->key.cipher_state, outblocks, inblocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		goto fail;
+
+	fastd_buffer_zero_pad(out);
+
+	if (!session->key.ghash->digest(
+		    session->key.ghash_state, &tag, outblocks + 1, out->len - sizeof(fastd_block128_t)))
+		goto fail;
+
+	block_xor_a(&outblocks[0], &tag);
+
+	fastd_buffer_free(in);
+
+	fastd_method_put_common_header(&session->common, out, 0);
+
+	return out;
+
+fail:
+	fastd_buffer_free(out);
+	return NULL;
+}
+
+/** Verifies and decrypts a packet */
+static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+	if (!method_session_is_valid(session))
+		return NULL;
+
+	if (is_esp_packet(in))
+		return decrypt_esp(session, in, reordered);
+
+	if (in->len < COMMON_HEADBYTES + sizeof(fastd_block128_t))
+		return NULL;
+
+	fastd_buffer_view_t in_view = fastd_buffer_get_view(in);
+
+	uint8_t in_nonce[COMMON_NONCEBYTES];
+	uint8_t flags;
+	int64_t age;
+	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, &age))
+		return NULL;
+
+	if (flags)
+		return NULL;
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, in_nonce, sizeof(nonce));
+
+	fastd_buffer_t *out =
+		fastd_buffer_alloc(in_view.len, ssub_size_t(conf.encrypt_headroom, sizeof(fastd_block128_t)));
+
+	int n_blocks = block_count(in_view.len, sizeof(fastd_block128_t));
+
+	const fastd_block128_t *inblocks = in_view.data;
+	fastd_block128_t *outblocks = out->data;
+	fastd_block128_t tag;
+
+	if (!session->key.cipher->crypt(
+		    session->key.cipher_state, outblocks, inblocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		goto fail;
+
+	if (!session->key.ghash->digest(
+		    session->key.ghash_state, &tag, inblocks + 1, in_view.len - sizeof(fastd_block128_t)))
+		goto fail;
+
+	if (!block_equal(&tag, &outblocks[0]))
+		goto fail;
+
+	fastd_buffer_free(in);
+
+	fastd_buffer_pull(out, sizeof(fastd_block128_t));
+
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age);
+	if (reorder_check.set)
+		*reordered = reorder_check.state;
+	else
+		out->len = 0;
+
+	return out;
+
+fail:
+	fastd_buffer_free(out);
+	return NULL;
+}
+
+
+/** The esp-gcm method provider */
+const fastd_method_provider_t fastd_method_esp_gcm = {
+	.flags = METHOD_FORCE_KEEPALIVE | METHOD_TUN_ONLY | METHOD_EXPERIMENTAL,
+
+	.overhead = ESP_MARKER_BYTES + ESP_HEADBYTES + ESP_MAX_PADDING + ESP_TRAILERBYTES + sizeof(fastd_block128_t),
+	.encrypt_headroom = sizeof(fastd_block128_t),
+	.decrypt_headroom = 0,
+
+	.create_by_name = method_create_by_name,
+	.destroy = method_destroy,
+
+	.key_length = method_key_length,
+	.get_offload = method_get_offload,
+
+	.session_init = method_session_init,
+	.session_is_valid = method_session_is_valid,
+	.session_is_initiator = method_session_is_initiator,
+	.session_want_refresh = method_session_want_refresh,
+	.session_superseded = method_session_superseded,
+	.session_free = method_session_free,
+	.session_get_offload_keys = method_session_get_offload_keys,
+
+	.encrypt = method_encrypt,
+	.decrypt = method_decrypt,
+};
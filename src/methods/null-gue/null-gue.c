@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   The null method not providing any encryption or authenticaton, using the
+   GUE (Generic UDP Encapsulation) packet format for IP payloads
+*/
+
+#include "../../method.h"
+#include "../../offload/gue/gue.h"
+
+/** The session state */
+struct fastd_method_session_state {
+	unsigned flags; /**< Session flags */
+	bool valid;     /**< true if the session has not been invalidated */
+};
+
+/**
+ * The GUE version 0 header without optional fields
+ *
+ * The first byte (version, control flag and header length) is always 0 and
+ * doubles as fastd's packet type PACKET_DATA.
+ */
+typedef struct method_gue_header {
+	uint8_t packet_type; /**< GUE version, control flag and header length */
+	uint8_t proto;       /**< IP protocol number of the payload */
+	uint16_t flags;      /**< GUE flags */
+} method_gue_header_t;
+
+
+/** Returns the IP protocol number of an IP packet, or 0 if the buffer doesn't contain an IP packet */
+static uint8_t get_proto(const fastd_buffer_t *buf) {
+	if (!buf->len)
+		return 0;
+
+	switch (((const uint8_t *)buf->data)[0] >> 4) {
+	case 4:
+		return IPPROTO_IPIP;
+
+	case 6:
+		return IPPROTO_IPV6;
+
+	default:
+		return 0;
+	}
+}
+
+/** Returns true if the name is "null@gue" */
+static bool method_create_by_name(const char *name, UNUSED fastd_method_t **method) {
+	return !strcmp(name, "null@gue");
+}
+
+/** Does nothing as the null-gue provider provides only a single method */
+static void method_destroy(UNUSED fastd_method_t *method) {}
+
+/** Returns 0 */
+static size_t method_key_length(UNUSED const fastd_method_t *method) {
+	return 0;
+}
+
+/** Returns the GUE offload implementation, if enabled */
+static const fastd_offload_t *method_get_offload(UNUSED const fastd_method_t *method) {
+	if (fastd_use_offload_gue())
+		return fastd_offload_gue_get();
+
+	return NULL;
+}
+
+/** Initiates a new null@gue session */
+static fastd_method_session_state_t *method_session_init(
+	UNUSED fastd_peer_t *peer, UNUSED const fastd_method_t *method, UNUSED const uint8_t *secret,
+	unsigned session_flags) {
+	fastd_method_session_state_t *session = fastd_new(fastd_method_session_state_t);
+
+	session->flags = session_flags;
+	session->valid = true;
+
+	return session;
+}
+
+/** Checks if the session is valid */
+static bool method_session_is_valid(fastd_method_session_state_t *session) {
+	return (session && session->valid);
+}
+
+/** Checks if this side is the initiator of the session */
+static bool method_session_is_initiator(fastd_method_session_state_t *session) {
+	return (session->flags & FASTD_SESSION_INITIATOR);
+}
+
+/** Returns false */
+static bool method_session_want_refresh(UNUSED fastd_method_session_state_t *session) {
+	return false;
+}
+
+/**
+   Marks the session as invalid
+
+   The session in invalidated without any delay to prevent packets of the new session being
+   mistaken to be valid for the old session
+*/
+static void method_session_superseded(fastd_method_session_state_t *session) {
+	session->valid = false;
+}
+
+/** Frees the session state */
+static void method_session_free(fastd_method_session_state_t *session) {
+	free(session);
+}
+
+/**
+ * Prepends the GUE header to the input buffer
+ *
+ * Keepalives are sent with protocol number 0. Non-IP packets can't be
+ * represented and are dropped.
+ */
+static fastd_buffer_t *method_encrypt(UNUSED fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	uint8_t proto = get_proto(in);
+	if (in->len && !proto)
+		return NULL;
+
+	method_gue_header_t header = {
+		.packet_type = PACKET_DATA,
+		.proto = proto,
+	};
+
+	fastd_buffer_push_from(in, &header, sizeof(header));
+
+	return in;
+}
+
+/** Removes the GUE header, checking that it matches the payload */
+static fastd_buffer_t *
+method_decrypt(UNUSED fastd_method_session_state_t *session, fastd_buffer_t *in, UNUSED bool *reordered) {
+	method_gue_header_t header;
+	if (in->len < sizeof(header))
+		return NULL;
+
+	fastd_buffer_view_t in_view = fastd_buffer_get_view(in);
+	fastd_buffer_view_pull_to(&in_view, &header, sizeof(header));
+
+	if (header.packet_type != PACKET_DATA || header.flags)
+		return NULL;
+
+	fastd_buffer_pull(in, sizeof(header));
+
+	if (get_proto(in) != header.proto)
+		return NULL;
+
+	return in;
+}
+
+
+/** The null@gue method provider */
+const fastd_method_provider_t fastd_method_null_gue = {
+	.flags = METHOD_FORCE_KEEPALIVE | METHOD_TUN_ONLY,
+
+	.overhead = sizeof(struct method_gue_header),
+	.encrypt_headroom = sizeof(struct method_gue_header),
+	.decrypt_headroom = 0,
+
+	.create_by_name = method_create_by_name,
+	.destroy = method_destroy,
+
+	.key_length = method_key_length,
+	.get_offload = method_get_offload,
+
+	.session_init = method_session_init,
+	.session_is_valid = method_session_is_valid,
+	.session_is_initiator = method_session_is_initiator,
+	.session_want_refresh = method_session_want_refresh,
+	.session_superseded = method_session_superseded,
+	.session_free = method_session_free,
+
+	.encrypt = method_encrypt,
+	.decrypt = method_decrypt,
+};
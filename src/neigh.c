@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ARP and IPv6 neighbour discovery proxy for TAP mode
+
+   IP-to-MAC bindings are learned from ARP packets and neighbour advertisements
+   passing through fastd. Broadcast ARP requests and multicast neighbour
+   solicitations for known addresses are then answered by fastd itself (when the
+   address belongs to a host behind another peer) or not flooded to other peers
+   at all (when the address is local or belongs to a host behind the requesting
+   peer). The peer an address is located at is always taken from the MAC address
+   table, so moving hosts are handled correctly.
+*/
+
+
+#include "neigh.h"
+#include "peer.h"
+#include "txq.h"
+
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip6.h>
+
+
+/** The size of a neighbour advertisement with a target link-layer address option */
+#define NA_SIZE (sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr) + sizeof(fastd_eth_addr_t))
+
+
+/** A parsed neighbour solicitation or advertisement */
+typedef struct nd_packet {
+	struct ip6_hdr ip6;            /**< The IPv6 header */
+	struct nd_neighbor_solicit nd; /**< The ICMPv6 header and target address (the layout is shared by
+					    solicitations and advertisements) */
+	bool has_lladdr;               /**< true if the packet contains a link-layer address option */
+	fastd_eth_addr_t lladdr;       /**< The source or target link-layer address */
+} nd_packet_t;
+
+
+/** Compares two neighbour table entries by their IP addresses */
+static int neigh_entry_cmp(const fastd_neigh_entry_t *entry1, const fastd_neigh_entry_t *entry2) {
+	return memcmp(&entry1->key, &entry2->key, sizeof(fastd_neigh_key_t));
+}
+
+/** Returns a neighbour table key for an IP address */
+static inline fastd_neigh_key_t neigh_key(uint8_t family, const void *addr, size_t len) {
+	fastd_neigh_key_t key = { .family = family };
+	memcpy(key.addr, addr, len);
+	return key;
+}
+
+/** Returns the EtherType of an ethernet frame */
+static inline uint16_t eth_proto(const fastd_buffer_t *buffer) {
+	uint16_t proto;
+	memcpy(&proto, buffer->data + offsetof(fastd_eth_header_t, proto), sizeof(proto));
+	return ntohs(proto);
+}
+
+
+/** Adds an IP-to-MAC binding to the neighbour table or refreshes an existing entry */
+static void neigh_add(const fastd_neigh_key_t *key, fastd_eth_addr_t addr, bool router) {
+	size_t min = 0, max = VECTOR_LEN(ctx.neigh_entries);
+
+	if (!fastd_eth_addr_is_unicast(addr))
+		return;
+
+	while (max > min) {
+		size_t cur = min + (max - min) / 2;
+		fastd_neigh_entry_t *entry = &VECTOR_INDEX(ctx.neigh_entries, cur);
+		int cmp = memcmp(key, &entry->key, sizeof(*key));
+
+		if (cmp == 0) {
+			entry->addr = addr;
+			entry->router = router;
+			entry->timeout = ctx.now + NEIGH_STALE_TIME;
+			return;
+		} else if (cmp < 0) {
+			max = cur;
+		} else {
+			min = cur + 1;
+		}
+	}
+
+	VECTOR_INSERT(
+		ctx.neigh_entries, ((fastd_neigh_entry_t){ *key, addr, router, ctx.now + NEIGH_STALE_TIME }), min);
+
+	pr_debug2("learned new neighbour binding for MAC address %E", &addr);
+}
+
+/**
+   Finds the MAC address and peer an IP address belongs to
+
+   \e peer is set to NULL for local addresses. Returns false if the IP address or the
+   MAC address it is bound to is not known.
+*/
+static bool neigh_lookup(const fastd_neigh_key_t *key, const fastd_neigh_entry_t **entry, fastd_peer_t **peer) {
+	const fastd_neigh_entry_t search = { .key = *key };
+	*entry = VECTOR_BSEARCH(&search, ctx.neigh_entries, neigh_entry_cmp);
+
+	if (!*entry || fastd_timed_out((*entry)->timeout))
+		return false;
+
+	return fastd_peer_find_by_eth_addr((*entry)->addr, peer);
+}
+
+
+/** Parses an ARP packet for IPv4 over ethernet */
+static bool parse_arp(const fastd_buffer_t *buffer, struct ether_arp *arp) {
+	if (buffer->len < sizeof(fastd_eth_header_t) + sizeof(*arp))
+		return false;
+
+	memcpy(arp, buffer->data + sizeof(fastd_eth_header_t), sizeof(*arp));
+
+	return (ntohs(arp->arp_hrd) == ARPHRD_ETHER && ntohs(arp->arp_pro) == ETHERTYPE_IP &&
+		arp->arp_hln == sizeof(fastd_eth_addr_t) && arp->arp_pln == sizeof(struct in_addr));
+}
+
+/** Parses a neighbour solicitation or advertisement of the given ICMPv6 type */
+static bool parse_nd(const fastd_buffer_t *buffer, uint8_t type, nd_packet_t *packet) {
+	const uint8_t *data = buffer->data + sizeof(fastd_eth_header_t);
+	size_t len = buffer->len - sizeof(fastd_eth_header_t);
+
+	if (len < sizeof(packet->ip6) + sizeof(packet->nd))
+		return false;
+
+	memcpy(&packet->ip6, data, sizeof(packet->ip6));
+	memcpy(&packet->nd, data + sizeof(packet->ip6), sizeof(packet->nd));
+
+	size_t plen = ntohs(packet->ip6.ip6_plen);
+
+	if ((packet->ip6.ip6_vfc >> 4) != 6 || packet->ip6.ip6_nxt != IPPROTO_ICMPV6 || packet->ip6.ip6_hlim != 255)
+		return false;
+	if (plen < sizeof(packet->nd) || sizeof(packet->ip6) + plen > len)
+		return false;
+	if (packet->nd.nd_ns_type != type || packet->nd.nd_ns_code != 0)
+		return false;
+	if (IN6_IS_ADDR_MULTICAST(&packet->nd.nd_ns_target))
+		return false;
+
+	uint8_t opt_type = (type == ND_NEIGHBOR_SOLICIT) ? ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+	size_t pos = sizeof(packet->nd);
+
+	packet->has_lladdr = false;
+
+	while (pos + sizeof(struct nd_opt_hdr) <= plen) {
+		struct nd_opt_hdr opt;
+		memcpy(&opt, data + sizeof(packet->ip6) + pos, sizeof(opt));
+
+		size_t opt_len = 8 * (size_t)opt.nd_opt_len;
+		if (!opt_len || pos + opt_len > plen)
+			return false;
+
+		if (opt.nd_opt_type == opt_type && opt_len == sizeof(opt) + sizeof(fastd_eth_addr_t)) {
+			memcpy(&packet->lladdr, data + sizeof(packet->ip6) + pos + sizeof(opt), sizeof(fastd_eth_addr_t));
+			packet->has_lladdr = true;
+		}
+
+		pos += opt_len;
+	}
+
+	return true;
+}
+
+
+/** Learns the sender's binding from an ARP packet */
+static void learn_arp(const fastd_buffer_t *buffer) {
+	struct ether_arp arp;
+	if (!parse_arp(buffer, &arp))
+		return;
+
+	/* ARP probes don't have a sender address */
+	static const uint8_t zero[sizeof(arp.arp_spa)] = {};
+	if (memcmp(arp.arp_spa, zero, sizeof(zero)) == 0)
+		return;
+
+	fastd_eth_addr_t addr;
+	memcpy(&addr, arp.arp_sha, sizeof(addr));
+
+	fastd_neigh_key_t key = neigh_key(AF_INET, arp.arp_spa, sizeof(arp.arp_spa));
+	neigh_add(&key, addr, false);
+}
+
+/** Learns the target's binding from a neighbour advertisement */
+static void learn_nd(const fastd_buffer_t *buffer) {
+	nd_packet_t packet;
+	if (!parse_nd(buffer, ND_NEIGHBOR_ADVERT, &packet))
+		return;
+
+	fastd_eth_addr_t addr = packet.has_lladdr ? packet.lladdr : fastd_buffer_source_address(buffer);
+	bool router = packet.nd.nd_ns_reserved & ND_NA_FLAG_ROUTER;
+
+	fastd_neigh_key_t key = neigh_key(AF_INET6, &packet.nd.nd_ns_target, sizeof(packet.nd.nd_ns_target));
+	neigh_add(&key, addr, router);
+}
+
+/**
+   Learns IP-to-MAC bindings from an ethernet frame
+
+   Must be called for all frames received from peers and from the local interface.
+*/
+void fastd_neigh_learn(const fastd_buffer_t *buffer) {
+	if (!fastd_neigh_proxy_enabled())
+		return;
+
+	switch (eth_proto(buffer)) {
+	case ETHERTYPE_ARP:
+		if (conf.proxy_arp)
+			learn_arp(buffer);
+		break;
+
+	case ETHERTYPE_IPV6:
+		if (conf.proxy_ndp)
+			learn_nd(buffer);
+		break;
+	}
+}
+
+
+/** Adds data to an internet checksum */
+static uint32_t csum_add(uint32_t sum, const void *data, size_t len) {
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+
+	if (len & 1)
+		sum += p[len - 1] << 8;
+
+	return sum;
+}
+
+/** Finalizes an internet checksum, returning it in network byte order */
+static uint16_t csum_fold(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum);
+}
+
+/** Delivers a reply to the peer a request was received from, or to the local interface */
+static void send_reply(fastd_buffer_t *reply, fastd_peer_t *dest) {
+	if (dest) {
+		fastd_txq_send(dest, reply);
+	} else {
+		fastd_iface_write(ctx.iface, reply);
+		fastd_buffer_free(reply);
+	}
+}
+
+/** Builds an ARP reply on behalf of the owner of the requested address */
+static fastd_buffer_t *make_arp_reply(const struct ether_arp *req, const fastd_neigh_entry_t *entry) {
+	fastd_buffer_t *reply =
+		fastd_buffer_alloc(sizeof(fastd_eth_header_t) + sizeof(struct ether_arp), conf.encrypt_headroom);
+
+	fastd_eth_header_t eth;
+	memcpy(&eth.dest, req->arp_sha, sizeof(eth.dest));
+	eth.source = entry->addr;
+	eth.proto = htons(ETHERTYPE_ARP);
+
+	struct ether_arp arp = *req;
+	arp.arp_op = htons(ARPOP_REPLY);
+	memcpy(arp.arp_sha, &entry->addr, sizeof(arp.arp_sha));
+	memcpy(arp.arp_spa, req->arp_tpa, sizeof(arp.arp_spa));
+	memcpy(arp.arp_tha, req->arp_sha, sizeof(arp.arp_tha));
+	memcpy(arp.arp_tpa, req->arp_spa, sizeof(arp.arp_tpa));
+
+	memcpy(reply->data, &eth, sizeof(eth));
+	memcpy(reply->data + sizeof(eth), &arp, sizeof(arp));
+
+	return reply;
+}
+
+/** Builds a solicited neighbour advertisement on behalf of the owner of the requested address */
+static fastd_buffer_t *
+make_na_reply(const fastd_buffer_t *buffer, const nd_packet_t *req, const fastd_neigh_entry_t *entry) {
+	fastd_buffer_t *reply = fastd_buffer_alloc(
+		sizeof(fastd_eth_header_t) + sizeof(struct ip6_hdr) + NA_SIZE, conf.encrypt_headroom);
+
+	fastd_eth_header_t eth;
+	eth.dest = req->has_lladdr ? req->lladdr : fastd_buffer_source_address(buffer);
+	eth.source = entry->addr;
+	eth.proto = htons(ETHERTYPE_IPV6);
+
+	struct ip6_hdr ip6 = {};
+	ip6.ip6_flow = htonl(0x60000000);
+	ip6.ip6_plen = htons(NA_SIZE);
+	ip6.ip6_nxt = IPPROTO_ICMPV6;
+	ip6.ip6_hlim = 255;
+	ip6.ip6_src = req->nd.nd_ns_target;
+	ip6.ip6_dst = req->ip6.ip6_src;
+
+	uint8_t icmp[NA_SIZE] = {};
+	struct nd_neighbor_advert na = {};
+	na.nd_na_type = ND_NEIGHBOR_ADVERT;
+	na.nd_na_flags_reserved = ND_NA_FLAG_SOLICITED;
+	if (entry->router)
+		na.nd_na_flags_reserved |= ND_NA_FLAG_ROUTER;
+	na.nd_na_target = req->nd.nd_ns_target;
+
+	struct nd_opt_hdr opt = {
+		.nd_opt_type = ND_OPT_TARGET_LINKADDR,
+		.nd_opt_len = 1,
+	};
+
+	memcpy(icmp, &na, sizeof(na));
+	memcpy(icmp + sizeof(na), &opt, sizeof(opt));
+	memcpy(icmp + sizeof(na) + sizeof(opt), &entry->addr, sizeof(entry->addr));
+
+	uint32_t sum = 0;
+	sum = csum_add(sum, &ip6.ip6_src, sizeof(ip6.ip6_src));
+	sum = csum_add(sum, &ip6.ip6_dst, sizeof(ip6.ip6_dst));
+	sum += NA_SIZE + IPPROTO_ICMPV6;
+	sum = csum_add(sum, icmp, sizeof(icmp));
+
+	uint16_t cksum = csum_fold(sum);
+	memcpy(icmp + offsetof(struct icmp6_hdr, icmp6_cksum), &cksum, sizeof(cksum));
+
+	memcpy(reply->data, &eth, sizeof(eth));
+	memcpy(reply->data + sizeof(eth), &ip6, sizeof(ip6));
+	memcpy(reply->data + sizeof(eth) + sizeof(ip6), icmp, sizeof(icmp));
+
+	return reply;
+}
+
+/** Drops a request that doesn't need to be flooded */
+static void suppress_request(fastd_buffer_t *buffer, fastd_peer_t *source, fastd_stat_type_t stat) {
+	fastd_stats_add(source, stat, buffer->len);
+	fastd_buffer_free(buffer);
+}
+
+/** Handles a broadcast ARP request */
+static bool handle_arp_request(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	struct ether_arp req;
+	if (!parse_arp(buffer, &req) || ntohs(req.arp_op) != ARPOP_REQUEST)
+		return false;
+
+	/* Probes and announcements (RFC 5227) must reach the address owner */
+	static const uint8_t zero[sizeof(req.arp_spa)] = {};
+	if (memcmp(req.arp_spa, zero, sizeof(zero)) == 0 || memcmp(req.arp_spa, req.arp_tpa, sizeof(req.arp_spa)) == 0)
+		return false;
+
+	const fastd_neigh_entry_t *entry;
+	fastd_peer_t *dest;
+	fastd_neigh_key_t key = neigh_key(AF_INET, req.arp_tpa, sizeof(req.arp_tpa));
+
+	if (!neigh_lookup(&key, &entry, &dest))
+		return false;
+
+	if (dest && dest != source)
+		send_reply(make_arp_reply(&req, entry), source);
+
+	suppress_request(buffer, source, STAT_ARP_SUPPRESSED);
+	return true;
+}
+
+/** Handles a multicast neighbour solicitation */
+static bool handle_ns(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	nd_packet_t req;
+	if (!parse_nd(buffer, ND_NEIGHBOR_SOLICIT, &req))
+		return false;
+
+	/* Duplicate address detection must reach the address owner */
+	if (IN6_IS_ADDR_UNSPECIFIED(&req.ip6.ip6_src))
+		return false;
+
+	const fastd_neigh_entry_t *entry;
+	fastd_peer_t *dest;
+	fastd_neigh_key_t key = neigh_key(AF_INET6, &req.nd.nd_ns_target, sizeof(req.nd.nd_ns_target));
+
+	if (!neigh_lookup(&key, &entry, &dest))
+		return false;
+
+	if (dest && dest != source)
+		send_reply(make_na_reply(buffer, &req, entry), source);
+
+	suppress_request(buffer, source, STAT_ND_SUPPRESSED);
+	return true;
+}
+
+/**
+   Answers or suppresses a broadcast or multicast ARP request or neighbour solicitation
+
+   \e source is the peer the frame was received from, or NULL if it was read from
+   the local interface. Returns true (and consumes the buffer) when the frame
+   must not be flooded to other peers.
+*/
+bool fastd_neigh_handle_request(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	if (!fastd_neigh_proxy_enabled())
+		return false;
+
+	switch (eth_proto(buffer)) {
+	case ETHERTYPE_ARP:
+		return conf.proxy_arp && handle_arp_request(buffer, source);
+
+	case ETHERTYPE_IPV6:
+		return conf.proxy_ndp && handle_ns(buffer, source);
+
+	default:
+		return false;
+	}
+}
+
+
+/** Removes all time-outed entries from the neighbour table */
+void fastd_neigh_cleanup(void) {
+	size_t i, deleted = 0;
+
+	for (i = 0; i < VECTOR_LEN(ctx.neigh_entries); i++) {
+		if (fastd_timed_out(VECTOR_INDEX(ctx.neigh_entries, i).timeout))
+			deleted++;
+		else if (deleted)
+			VECTOR_INDEX(ctx.neigh_entries, i - deleted) = VECTOR_INDEX(ctx.neigh_entries, i);
+	}
+
+	VECTOR_RESIZE(ctx.neigh_entries, VECTOR_LEN(ctx.neigh_entries) - deleted);
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ARP and IPv6 neighbour discovery proxy for TAP mode
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+
+
+/** The key of a neighbour table entry */
+typedef struct fastd_neigh_key {
+	uint8_t family;   /**< AF_INET or AF_INET6 */
+	uint8_t addr[16]; /**< The IP address (IPv4 addresses use the first 4 bytes, the rest is zeroed) */
+} fastd_neigh_key_t;
+
+/** An IP address to MAC address binding learned from ARP or neighbour discovery traffic */
+struct fastd_neigh_entry {
+	fastd_neigh_key_t key;   /**< The IP address */
+	fastd_eth_addr_t addr;   /**< The MAC address the IP address is bound to */
+	bool router;             /**< The IPv6 router flag of the last neighbour advertisement */
+	fastd_timeout_t timeout; /**< Timeout after which the entry will be purged */
+};
+
+
+void fastd_neigh_learn(const fastd_buffer_t *buffer);
+bool fastd_neigh_handle_request(fastd_buffer_t *buffer, fastd_peer_t *source);
+void fastd_neigh_cleanup(void);
+
+
+/** Checks if the ARP or neighbour discovery proxy is enabled */
+static inline bool fastd_neigh_proxy_enabled(void) {
+	return conf.mode == MODE_TAP && (conf.proxy_arp || conf.proxy_ndp);
+}
@@ -0,0 +1,807 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ESP kernel offloading
+
+   For each peer using the "aes128-gcm@esp" method, an XFRM interface is
+   created, together with a pair of ESP security associations (using UDP
+   encapsulation with the Non-IKE marker) and policies binding them to the
+   interface. Packets routed into the interface are encrypted and sent by the
+   kernel; ESP packets received on fastd's sockets are decrypted by the kernel
+   and appear on the interface. Handshakes and keepalives are still handled by
+   fastd, as they lack the Non-IKE marker.
+
+   On rekeying, the security associations of the previous session are kept
+   until the next one, so packets in flight can still be decrypted. The
+   initiator of a session only switches to the new outbound security
+   association after the peer has confirmed the new session.
+*/
+
+#include "esp.h"
+#include "../../crypto.h"
+#include "../../peer.h"
+#include "../netlink.h"
+
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+#include <linux/udp.h>
+#include <linux/xfrm.h>
+
+
+/** The AEAD algorithm used for the security associations */
+#define ESP_AEAD_ALGORITHM "rfc4106(gcm(aes))"
+
+/** The length of the ICV in bits */
+#define ESP_ICV_BITS 128
+
+/** The size of the kernel's replay window */
+#define ESP_REPLAY_WINDOW 32
+
+
+/** A request that has been sent, but not acknowledged yet */
+typedef struct esp_request {
+	unsigned seq;                   /**< The sequence number of the request */
+	fastd_offload_state_t *session; /**< The session the request belongs to (NULL after it has been freed) */
+} esp_request_t;
+
+/** A non-blocking Netlink socket with the list of unacknowledged requests */
+typedef struct esp_bus {
+	fastd_nl_batch_t batch;         /**< Non-blocking Netlink socket */
+	VECTOR(esp_request_t) requests; /**< Requests in the order they have been added */
+	size_t head;                    /**< Index of the oldest unacknowledged request in \e requests */
+} esp_bus_t;
+
+/** Global ESP offload state */
+struct fastd_offload_esp {
+	esp_bus_t rtnl; /**< rtnetlink socket used to manage the XFRM interfaces */
+	esp_bus_t xfrm; /**< XFRM Netlink socket used to manage security associations and policies */
+
+	VECTOR(fastd_offload_state_t *) busy; /**< Sessions with unacknowledged requests */
+	fastd_nl_stats_round_t stats;         /**< Sessions whose interface statistics have been requested */
+
+	uint32_t if_id; /**< The last XFRM interface ID used */
+	uint32_t reqid; /**< The last request ID used to bind a pair of security associations to a policy */
+};
+
+/** The security associations of one method session */
+typedef struct esp_generation {
+	fastd_offload_sa_t in;  /**< Inbound security association */
+	fastd_offload_sa_t out; /**< Outbound security association */
+	uint32_t reqid;         /**< Request ID of the security associations */
+} esp_generation_t;
+
+/** Offload session state */
+struct fastd_offload_state {
+	fastd_peer_t *peer;                 /**< The peer the session belongs to */
+	fastd_peer_address_t local_address; /**< The local address and port of the security associations */
+	fastd_peer_address_t address;       /**< The peer's address and port */
+	char ifname[IFNAMSIZ];              /**< XFRM interface */
+	uint16_t mtu;                       /**< Configured MTU of the XFRM interface */
+	uint32_t if_id;                     /**< XFRM interface ID */
+
+	esp_generation_t cur;  /**< Security associations of the newest method session */
+	esp_generation_t prev; /**< Security associations of the previous method session */
+	bool have_prev;        /**< \e prev is valid */
+	bool out_prev;         /**< The outbound policies still use the previous security association */
+
+	unsigned outstanding; /**< Number of unacknowledged requests */
+	bool busy;            /**< The session is in the list of busy sessions */
+	bool pending;         /**< The initial setup has not finished yet */
+	bool failed;          /**< A request has failed, or requests or replies have been lost */
+};
+
+
+/** Converts the address part of a fastd_peer_address_t to an xfrm_address_t */
+static xfrm_address_t get_xfrm_address(const fastd_peer_address_t *addr) {
+	xfrm_address_t ret = {};
+
+	if (addr->sa.sa_family == AF_INET6)
+		memcpy(ret.a6, &addr->in6.sin6_addr, sizeof(addr->in6.sin6_addr));
+	else
+		ret.a4 = addr->in.sin_addr.s_addr;
+
+	return ret;
+}
+
+/** Builds a request creating the XFRM interface of a session */
+static struct nlmsghdr *put_link_create(void *buf, const fastd_offload_state_t *session) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_NEWLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_flags = IFF_UP;
+	ifi->ifi_change = IFF_UP;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, session->ifname);
+	mnl_attr_put_u32(nlh, IFLA_MTU, session->mtu);
+
+	struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "xfrm");
+
+	struct nlattr *data = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
+	mnl_attr_put_u32(nlh, IFLA_XFRM_IF_ID, session->if_id);
+	mnl_attr_nest_end(nlh, data);
+
+	mnl_attr_nest_end(nlh, linkinfo);
+
+	return nlh;
+}
+
+/** Builds a request deleting an XFRM interface */
+static struct nlmsghdr *put_link_delete(void *buf, const char *ifname, uint16_t flags) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_DELLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, ifname);
+
+	return nlh;
+}
+
+/**
+ * Builds a request adding a security association
+ *
+ * Outbound security associations are sent from the session's local address to
+ * the peer's address, inbound security associations the other way round.
+ */
+static struct nlmsghdr *put_sa_add(
+	void *buf, const fastd_offload_state_t *session, const fastd_offload_sa_t *sa, uint32_t reqid, bool out) {
+	const fastd_peer_address_t *src = out ? &session->local_address : &session->address;
+	const fastd_peer_address_t *dst = out ? &session->address : &session->local_address;
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = XFRM_MSG_NEWSA;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+
+	struct xfrm_usersa_info *info = mnl_nlmsg_put_extra_header(nlh, sizeof(*info));
+	info->sel.family = AF_UNSPEC;
+	info->id.daddr = get_xfrm_address(dst);
+	info->id.spi = sa->spi;
+	info->id.proto = IPPROTO_ESP;
+	info->saddr = get_xfrm_address(src);
+	info->lft.soft_byte_limit = XFRM_INF;
+	info->lft.hard_byte_limit = XFRM_INF;
+	info->lft.soft_packet_limit = XFRM_INF;
+	info->lft.hard_packet_limit = XFRM_INF;
+	info->reqid = reqid;
+	info->family = src->sa.sa_family;
+	info->mode = XFRM_MODE_TUNNEL;
+	info->replay_window = ESP_REPLAY_WINDOW;
+	info->flags = XFRM_STATE_AF_UNSPEC;
+
+	struct {
+		struct xfrm_algo_aead aead;
+		uint8_t key[FASTD_OFFLOAD_SA_KEY_LEN];
+	} aead = {
+		.aead.alg_key_len = FASTD_OFFLOAD_SA_KEY_LEN * 8,
+		.aead.alg_icv_len = ESP_ICV_BITS,
+	};
+	strncpy(aead.aead.alg_name, ESP_AEAD_ALGORITHM, sizeof(aead.aead.alg_name) - 1);
+	memcpy(aead.key, sa->key, sizeof(aead.key));
+	mnl_attr_put(nlh, XFRMA_ALG_AEAD, sizeof(aead), &aead);
+	secure_memzero(&aead, sizeof(aead));
+
+	struct xfrm_encap_tmpl encap = {
+		.encap_type = UDP_ENCAP_ESPINUDP_NON_IKE,
+		.encap_sport = src->in.sin_port,
+		.encap_dport = dst->in.sin_port,
+	};
+	mnl_attr_put(nlh, XFRMA_ENCAP, sizeof(encap), &encap);
+
+	mnl_attr_put_u32(nlh, XFRMA_IF_ID, session->if_id);
+
+#ifdef USE_PACKET_MARK
+	if (out && conf.packet_mark)
+		mnl_attr_put_u32(nlh, XFRMA_SET_MARK, conf.packet_mark);
+#endif
+
+	return nlh;
+}
+
+/** Builds a request deleting a security association */
+static struct nlmsghdr *
+put_sa_delete(void *buf, const fastd_peer_address_t *dst, const fastd_offload_sa_t *sa, uint16_t flags) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = XFRM_MSG_DELSA;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+	struct xfrm_usersa_id *id = mnl_nlmsg_put_extra_header(nlh, sizeof(*id));
+	id->daddr = get_xfrm_address(dst);
+	id->spi = sa->spi;
+	id->family = dst->sa.sa_family;
+	id->proto = IPPROTO_ESP;
+
+	return nlh;
+}
+
+/** Builds the selector of a policy matching all packets of the given (inner) address family */
+static struct xfrm_selector get_selector(sa_family_t family) {
+	return (struct xfrm_selector){ .family = family };
+}
+
+/**
+ * Builds a request adding or updating a policy
+ *
+ * Inbound and forward policies don't specify a request ID, so they accept the
+ * security associations of both the current and the previous session.
+ */
+static struct nlmsghdr *put_policy(
+	void *buf, uint16_t type, const fastd_offload_state_t *session, sa_family_t family, uint8_t dir,
+	uint32_t reqid) {
+	const fastd_peer_address_t *src = (dir == XFRM_POLICY_OUT) ? &session->local_address : &session->address;
+	const fastd_peer_address_t *dst = (dir == XFRM_POLICY_OUT) ? &session->address : &session->local_address;
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (type == XFRM_MSG_NEWPOLICY)
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+
+	struct xfrm_userpolicy_info *info = mnl_nlmsg_put_extra_header(nlh, sizeof(*info));
+	info->sel = get_selector(family);
+	info->lft.soft_byte_limit = XFRM_INF;
+	info->lft.hard_byte_limit = XFRM_INF;
+	info->lft.soft_packet_limit = XFRM_INF;
+	info->lft.hard_packet_limit = XFRM_INF;
+	info->dir = dir;
+	info->action = XFRM_POLICY_ALLOW;
+
+	struct xfrm_user_tmpl tmpl = {
+		.id.daddr = get_xfrm_address(dst),
+		.id.proto = IPPROTO_ESP,
+		.family = src->sa.sa_family,
+		.saddr = get_xfrm_address(src),
+		.reqid = (dir == XFRM_POLICY_OUT) ? reqid : 0,
+		.mode = XFRM_MODE_TUNNEL,
+		.aalgos = ~0u,
+		.ealgos = ~0u,
+		.calgos = ~0u,
+	};
+	mnl_attr_put(nlh, XFRMA_TMPL, sizeof(tmpl), &tmpl);
+
+	mnl_attr_put_u32(nlh, XFRMA_IF_ID, session->if_id);
+
+	return nlh;
+}
+
+/** Builds a request deleting a policy */
+static struct nlmsghdr *
+put_policy_delete(void *buf, const fastd_offload_state_t *session, sa_family_t family, uint8_t dir) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = XFRM_MSG_DELPOLICY;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	struct xfrm_userpolicy_id *id = mnl_nlmsg_put_extra_header(nlh, sizeof(*id));
+	id->sel = get_selector(family);
+	id->dir = dir;
+
+	mnl_attr_put_u32(nlh, XFRMA_IF_ID, session->if_id);
+
+	return nlh;
+}
+
+
+/** The inner address families handled by the policies of a session */
+static const sa_family_t policy_families[] = { AF_INET, AF_INET6 };
+
+/** The directions of the policies of a session */
+static const uint8_t policy_dirs[] = { XFRM_POLICY_IN, XFRM_POLICY_OUT, XFRM_POLICY_FWD };
+
+
+/** Adds a session to the list of sessions with unacknowledged requests */
+static void set_busy(fastd_offload_state_t *session) {
+	if (session->busy)
+		return;
+
+	VECTOR_ADD(ctx.offload_esp->busy, session);
+	session->busy = true;
+}
+
+/** Removes a session from the list of sessions with unacknowledged requests */
+static void clear_busy(fastd_offload_state_t *session) {
+	fastd_offload_esp_t *esp = ctx.offload_esp;
+
+	if (!session->busy)
+		return;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(esp->busy); i++) {
+		if (VECTOR_INDEX(esp->busy, i) == session) {
+			VECTOR_DELETE(esp->busy, i);
+			break;
+		}
+	}
+
+	session->busy = false;
+}
+
+/** Adds a request whose acknowledgement is tracked for the given session */
+static void add_request(esp_bus_t *bus, fastd_offload_state_t *session, struct nlmsghdr *nlh) {
+	esp_request_t request = {
+		.seq = fastd_nl_batch_add(&bus->batch, nlh),
+		.session = session,
+	};
+	VECTOR_ADD(bus->requests, request);
+
+	session->outstanding++;
+	set_busy(session);
+}
+
+/** Adds the inbound and outbound security associations of a session generation */
+static void add_generation(fastd_offload_state_t *session, const esp_generation_t *gen) {
+	esp_bus_t *bus = &ctx.offload_esp->xfrm;
+
+	add_request(
+		bus, session, put_sa_add(fastd_nl_batch_reserve(&bus->batch), session, &gen->in, gen->reqid, false));
+	add_request(
+		bus, session, put_sa_add(fastd_nl_batch_reserve(&bus->batch), session, &gen->out, gen->reqid, true));
+}
+
+/** Deletes the inbound and outbound security associations of a session generation */
+static void delete_generation(fastd_offload_state_t *session, const esp_generation_t *gen) {
+	fastd_nl_batch_t *batch = &ctx.offload_esp->xfrm.batch;
+
+	fastd_nl_batch_add(batch, put_sa_delete(fastd_nl_batch_reserve(batch), &session->local_address, &gen->in, 0));
+	fastd_nl_batch_add(batch, put_sa_delete(fastd_nl_batch_reserve(batch), &session->address, &gen->out, 0));
+}
+
+/** Adds or updates the policies of a session, using the given request ID for outbound packets */
+static void put_policies(fastd_offload_state_t *session, uint16_t type, uint32_t reqid) {
+	esp_bus_t *bus = &ctx.offload_esp->xfrm;
+
+	size_t i, j;
+	for (i = 0; i < array_size(policy_families); i++) {
+		for (j = 0; j < array_size(policy_dirs); j++) {
+			/* Only the outbound policies refer to a specific generation */
+			if (type == XFRM_MSG_UPDPOLICY && policy_dirs[j] != XFRM_POLICY_OUT)
+				continue;
+
+			void *buf = fastd_nl_batch_reserve(&bus->batch);
+			sa_family_t family = policy_families[i];
+			uint8_t dir = policy_dirs[j];
+
+			add_request(bus, session, put_policy(buf, type, session, family, dir, reqid));
+		}
+	}
+}
+
+/** Switches the outbound policies of a session to the newest generation */
+static void switch_out(fastd_offload_state_t *session) {
+	if (!session->out_prev)
+		return;
+
+	put_policies(session, XFRM_MSG_UPDPOLICY, session->cur.reqid);
+	session->out_prev = false;
+}
+
+
+/**
+ * Handles a session all of whose requests have been acknowledged
+ *
+ * The session may be freed by this function.
+ */
+static void complete(fastd_offload_state_t *session) {
+	clear_busy(session);
+
+	if (session->pending) {
+		session->pending = false;
+
+		if (!session->failed)
+			pr_debug("ESP offload device `%s' initialized.", session->ifname);
+
+		/* On failure, the session is freed by the peer reset */
+		fastd_peer_offload_ready(session->peer, !session->failed);
+	} else if (session->failed) {
+		pr_warn("ESP offload session of %P has failed, resetting peer", session->peer);
+		fastd_peer_reset(session->peer);
+	}
+}
+
+/** Completes all sessions that don't have unacknowledged requests anymore */
+static void complete_idle(void) {
+	fastd_offload_esp_t *esp = ctx.offload_esp;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(esp->busy);) {
+		fastd_offload_state_t *session = VECTOR_INDEX(esp->busy, i);
+
+		if (!session->outstanding)
+			complete(session);
+		else
+			i++;
+	}
+}
+
+/** Handles a single message received on one of the non-blocking sockets */
+static void handle_reply(esp_bus_t *bus, const struct nlmsghdr *nlh) {
+	if (nlh->nlmsg_type != NLMSG_ERROR)
+		return;
+
+	int err = fastd_nl_get_error(nlh);
+	if (err < 0)
+		return;
+
+	/* Replies are received in order; errors of untracked deletion requests don't match any entry */
+	if (bus->head >= VECTOR_LEN(bus->requests) || VECTOR_INDEX(bus->requests, bus->head).seq != nlh->nlmsg_seq)
+		return;
+
+	fastd_offload_state_t *session = VECTOR_INDEX(bus->requests, bus->head).session;
+	bus->head++;
+
+	if (bus->head == VECTOR_LEN(bus->requests)) {
+		VECTOR_RESIZE(bus->requests, 0);
+		bus->head = 0;
+	}
+
+	if (!session)
+		return;
+
+	session->outstanding--;
+
+	if (err) {
+		errno = err;
+		pr_warn_errno("ESP offload request failed");
+		session->failed = true;
+	}
+}
+
+/** Marks all sessions with outstanding requests on a socket as failed */
+static void handle_lost(esp_bus_t *bus) {
+	size_t i;
+	for (i = bus->head; i < VECTOR_LEN(bus->requests); i++) {
+		fastd_offload_state_t *session = VECTOR_INDEX(bus->requests, i).session;
+		if (!session)
+			continue;
+
+		session->outstanding--;
+		session->failed = true;
+	}
+
+	VECTOR_RESIZE(bus->requests, 0);
+	bus->head = 0;
+}
+
+/** Builds a request retrieving the statistics of a session's XFRM interface */
+static struct nlmsghdr *put_stats_get(void *buf, const fastd_offload_state_t *session) {
+	return fastd_nl_put_link_stats_get(buf, session->ifname);
+}
+
+/** Handles a message received on the rtnetlink socket */
+static void handle_rtnl_reply(const struct nlmsghdr *nlh) {
+	if (nlh->nlmsg_type == RTM_NEWLINK) {
+		fastd_offload_state_t *session = fastd_nl_stats_round_get(&ctx.offload_esp->stats, nlh->nlmsg_seq);
+
+		fastd_offload_counters_t counters;
+		if (session && fastd_nl_parse_link_stats(nlh, &counters))
+			fastd_peer_offload_counters(session->peer, &counters);
+
+		return;
+	}
+
+	handle_reply(&ctx.offload_esp->rtnl, nlh);
+}
+
+/** Handles a message received on the XFRM socket */
+static void handle_xfrm_reply(const struct nlmsghdr *nlh) {
+	handle_reply(&ctx.offload_esp->xfrm, nlh);
+}
+
+/** Handles lost requests or replies on the rtnetlink socket */
+static void handle_rtnl_lost(void) {
+	handle_lost(&ctx.offload_esp->rtnl);
+}
+
+/** Handles lost requests or replies on the XFRM socket */
+static void handle_xfrm_lost(void) {
+	handle_lost(&ctx.offload_esp->xfrm);
+}
+
+/** Removes all references to a session from the list of unacknowledged requests of a socket */
+static void forget_requests(esp_bus_t *bus, const fastd_offload_state_t *session) {
+	size_t i;
+	for (i = bus->head; i < VECTOR_LEN(bus->requests); i++) {
+		if (VECTOR_INDEX(bus->requests, i).session == session)
+			VECTOR_INDEX(bus->requests, i).session = NULL;
+	}
+}
+
+
+/**
+ * Checks if ESP security associations and XFRM interfaces can be created
+ *
+ * Error out during fastd start when the kernel lacks ESP, AES-GCM or XFRM
+ * interface support
+ */
+static void esp_selftest(void) {
+	struct mnl_socket *rtnl = mnl_socket_open(NETLINK_ROUTE);
+	if (!rtnl)
+		exit_errno("unable to initialize ESP offload: failed to open rtnetlink socket");
+
+	struct mnl_socket *xfrm = mnl_socket_open(NETLINK_XFRM);
+	if (!xfrm)
+		exit_errno("unable to initialize ESP offload: failed to open XFRM Netlink socket");
+
+	fastd_offload_state_t sessions[2] = {};
+
+	sessions[0].local_address.in = (struct sockaddr_in){
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(1),
+	};
+	sessions[0].address.in = sessions[0].local_address.in;
+	sessions[0].address.in.sin_port = htons(2);
+
+	sessions[1].local_address.in6 = (struct sockaddr_in6){
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_LOOPBACK_INIT,
+		.sin6_port = htons(1),
+	};
+	sessions[1].address.in6 = sessions[1].local_address.in6;
+	sessions[1].address.in6.sin6_port = htons(2);
+
+	/* The SPI is derived from the PID, so concurrently starting instances don't interfere */
+	const fastd_offload_sa_t sa = { .spi = htonl(0xf0000000 | ((uint32_t)getpid() & 0x0fffffff)) };
+
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	size_t i;
+	for (i = 0; i < array_size(sessions); i++) {
+		const fastd_offload_state_t *session = &sessions[i];
+
+		memset(buf, 0, sizeof(buf));
+		if (!fastd_nl_request(xfrm, put_sa_add(buf, session, &sa, 0, true)))
+			exit_errno("unable to initialize ESP offload: failed to add ESP security association");
+
+		memset(buf, 0, sizeof(buf));
+		if (!fastd_nl_request(xfrm, put_sa_delete(buf, &session->address, &sa, NLM_F_ACK)))
+			exit_errno("unable to initialize ESP offload: failed to delete ESP security association");
+	}
+
+	fastd_offload_state_t session = { .mtu = 1280, .if_id = 0xffffffff };
+	snprintf(session.ifname, sizeof(session.ifname), "esp-test%u", (unsigned)getpid() % 10000000);
+
+	memset(buf, 0, sizeof(buf));
+	if (!fastd_nl_request(rtnl, put_link_create(buf, &session)))
+		exit_errno("unable to initialize ESP offload: failed to create XFRM interface");
+
+	memset(buf, 0, sizeof(buf));
+	if (!fastd_nl_request(rtnl, put_link_delete(buf, session.ifname, NLM_F_ACK)))
+		exit_errno("unable to initialize ESP offload: failed to delete XFRM interface");
+
+	mnl_socket_close(xfrm);
+	mnl_socket_close(rtnl);
+}
+
+/** Handles replies on the non-blocking Netlink sockets */
+void fastd_offload_esp_handle(void) {
+	fastd_nl_batch_receive(&ctx.offload_esp->rtnl.batch);
+	fastd_nl_batch_receive(&ctx.offload_esp->xfrm.batch);
+	complete_idle();
+}
+
+/**
+ * Sends all batched requests
+ *
+ * This is called once per main loop iteration before waiting for new events,
+ * so the requests of all sessions established or rekeyed while handling the
+ * previous events are sent together. The statistics of the XFRM interfaces are
+ * requested periodically.
+ */
+void fastd_offload_esp_flush(void) {
+	fastd_offload_esp_t *esp = ctx.offload_esp;
+
+	fastd_nl_stats_request(&esp->stats, &esp->rtnl.batch, fastd_offload_esp_get(), put_stats_get);
+	fastd_nl_batch_send(&esp->rtnl.batch);
+	fastd_nl_batch_send(&esp->xfrm.batch);
+	complete_idle();
+}
+
+/**
+ * Enables the decapsulation of ESP packets on a UDP socket
+ *
+ * Packets starting with the Non-IKE marker are passed to the kernel's ESP
+ * implementation, all other packets are still received by fastd.
+ */
+bool fastd_offload_esp_init_socket(int fd) {
+	int encap = UDP_ENCAP_ESPINUDP_NON_IKE;
+	if (setsockopt(fd, IPPROTO_UDP, UDP_ENCAP, &encap, sizeof(encap))) {
+		pr_error_errno("setsockopt: unable to enable ESP decapsulation");
+		return false;
+	}
+
+	return true;
+}
+
+/** Global ESP offload initialization */
+void fastd_offload_esp_init(void) {
+	esp_selftest();
+
+	ctx.offload_esp = fastd_new0(fastd_offload_esp_t);
+
+	ctx.offload_esp->rtnl.batch.handle_msg = handle_rtnl_reply;
+	ctx.offload_esp->rtnl.batch.lost = handle_rtnl_lost;
+	if (!fastd_nl_batch_open(&ctx.offload_esp->rtnl.batch, NETLINK_ROUTE, POLL_TYPE_OFFLOAD_ESP))
+		exit_errno("unable to initialize ESP offload: failed to open rtnetlink socket");
+
+	ctx.offload_esp->xfrm.batch.handle_msg = handle_xfrm_reply;
+	ctx.offload_esp->xfrm.batch.lost = handle_xfrm_lost;
+	if (!fastd_nl_batch_open(&ctx.offload_esp->xfrm.batch, NETLINK_XFRM, POLL_TYPE_OFFLOAD_ESP))
+		exit_errno("unable to initialize ESP offload: failed to open XFRM Netlink socket");
+}
+
+/** Frees resources allocated by \e fastd_offload_esp_init */
+void fastd_offload_esp_cleanup(void) {
+	if (VECTOR_LEN(ctx.offload_esp->busy))
+		exit_bug("ESP offload: sessions left after cleanup");
+
+	/* Send the deletion requests of the sessions closed during shutdown */
+	fastd_nl_batch_send(&ctx.offload_esp->xfrm.batch);
+	fastd_nl_batch_send(&ctx.offload_esp->rtnl.batch);
+
+	VECTOR_FREE(ctx.offload_esp->busy);
+	fastd_nl_stats_round_free(&ctx.offload_esp->stats);
+	VECTOR_FREE(ctx.offload_esp->rtnl.requests);
+	VECTOR_FREE(ctx.offload_esp->xfrm.requests);
+	fastd_nl_batch_close(&ctx.offload_esp->rtnl.batch);
+	fastd_nl_batch_close(&ctx.offload_esp->xfrm.batch);
+	free(ctx.offload_esp);
+}
+
+/** ESP implementation of \e fastd_offload_t::free_session */
+static void fastd_offload_esp_free_session(fastd_offload_state_t *session) {
+	clear_busy(session);
+	forget_requests(&ctx.offload_esp->rtnl, session);
+	forget_requests(&ctx.offload_esp->xfrm, session);
+	fastd_nl_stats_round_forget(&ctx.offload_esp->stats, session);
+
+	/* Queued after the outstanding requests of the session, so the kernel handles all of them in order */
+	fastd_nl_batch_t *batch = &ctx.offload_esp->xfrm.batch;
+
+	size_t i, j;
+	for (i = 0; i < array_size(policy_families); i++) {
+		for (j = 0; j < array_size(policy_dirs); j++) {
+			void *buf = fastd_nl_batch_reserve(batch);
+			fastd_nl_batch_add(batch, put_policy_delete(buf, session, policy_families[i], policy_dirs[j]));
+		}
+	}
+
+	delete_generation(session, &session->cur);
+	if (session->have_prev)
+		delete_generation(session, &session->prev);
+
+	fastd_nl_batch_t *rtnl_batch = &ctx.offload_esp->rtnl.batch;
+	fastd_nl_batch_add(rtnl_batch, put_link_delete(fastd_nl_batch_reserve(rtnl_batch), session->ifname, 0));
+
+	secure_memzero(session, sizeof(*session));
+	free(session);
+}
+
+/** Returns the security associations of a method session */
+static esp_generation_t get_generation(const fastd_offload_keys_t *keys) {
+	return (esp_generation_t){
+		.in = keys->in,
+		.out = keys->out,
+		.reqid = ++ctx.offload_esp->reqid,
+	};
+}
+
+/**
+ * ESP implementation of \e fastd_offload_t::update_session
+ *
+ * The security associations of the new method session are added, replacing
+ * those of the session before the previous one. The outbound policies are
+ * switched to the new security associations immediately by the responder,
+ * and by the initiator after the new session has been confirmed.
+ *
+ * The security associations are bound to the peer's address, so a full
+ * teardown is requested when it has changed.
+ */
+static bool fastd_offload_esp_update_session(
+	const fastd_peer_t *peer, fastd_offload_state_t *session, const fastd_offload_keys_t *keys) {
+	if (!fastd_peer_address_equal(&peer->local_address, &session->local_address) ||
+	    !fastd_peer_address_equal(&peer->address, &session->address))
+		return false;
+
+	if (!keys || keys->in.spi == session->cur.in.spi)
+		return true;
+
+	if (session->have_prev) {
+		/* The peer has stopped using the previous session, as it has finished a new handshake */
+		switch_out(session);
+		delete_generation(session, &session->prev);
+	}
+
+	session->prev = session->cur;
+	session->have_prev = true;
+	session->out_prev = true;
+
+	session->cur = get_generation(keys);
+	add_generation(session, &session->cur);
+
+	if (!keys->initiator)
+		switch_out(session);
+
+	return true;
+}
+
+/** ESP implementation of \e fastd_offload_t::confirm_session */
+static void fastd_offload_esp_confirm_session(fastd_offload_state_t *session) {
+	switch_out(session);
+}
+
+/**
+ * ESP implementation of \e fastd_offload_t::init_session
+ *
+ * The setup requests are sent by \e fastd_offload_esp_flush together with the
+ * requests of other peers.
+ */
+static fastd_offload_state_t *
+fastd_offload_esp_init_session(fastd_peer_t *peer, const fastd_offload_keys_t *keys) {
+	if (!keys) {
+		pr_warn("can't initialize ESP offload session for %P: the method doesn't support ESP", peer);
+		return NULL;
+	}
+
+	if (peer->address.sa.sa_family != peer->local_address.sa.sa_family) {
+		pr_warn("can't initialize ESP offload session for %P: address families don't match", peer);
+		return NULL;
+	}
+
+	fastd_offload_state_t *session = fastd_new0(fastd_offload_state_t);
+	session->peer = peer;
+	session->local_address = peer->local_address;
+	session->address = peer->address;
+	session->mtu = fastd_peer_get_mtu(peer);
+
+	if (!fastd_iface_format_offload_name(session->ifname, peer)) {
+		pr_warn("can't initialize ESP offload session for %P: invalid interface name", peer);
+		free(session);
+		return NULL;
+	}
+
+	session->if_id = ++ctx.offload_esp->if_id;
+	session->cur = get_generation(keys);
+
+	pr_debug("initializing ESP offload device `%s'...", session->ifname);
+
+	esp_bus_t *rtnl = &ctx.offload_esp->rtnl;
+	add_request(rtnl, session, put_link_create(fastd_nl_batch_reserve(&rtnl->batch), session));
+
+	add_generation(session, &session->cur);
+	put_policies(session, XFRM_MSG_NEWPOLICY, session->cur.reqid);
+
+	session->pending = true;
+
+	return session;
+}
+
+/** ESP implementation of \e fastd_offload_t::get_iface */
+static void fastd_offload_esp_get_iface(const fastd_offload_state_t *session, const char **ifname, uint16_t *mtu) {
+	*ifname = session->ifname;
+	*mtu = session->mtu;
+}
+
+/** The ESP fastd_offload_t implementation */
+static const fastd_offload_t fastd_offload_esp = {
+	.init_session = fastd_offload_esp_init_session,
+	.get_iface = fastd_offload_esp_get_iface,
+	.update_session = fastd_offload_esp_update_session,
+	.confirm_session = fastd_offload_esp_confirm_session,
+	.free_session = fastd_offload_esp_free_session,
+};
+
+/** Returns the ESP fastd_offload_t implementation */
+const fastd_offload_t *fastd_offload_esp_get(void) {
+	return &fastd_offload_esp;
+}
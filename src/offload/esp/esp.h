@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ESP kernel offloading
+*/
+
+#pragma once
+
+#include "../../fastd.h"
+#include "../offload.h"
+
+
+#ifdef WITH_OFFLOAD_ESP
+
+void fastd_offload_esp_init(void);
+void fastd_offload_esp_cleanup(void);
+bool fastd_offload_esp_init_socket(int fd);
+
+void fastd_offload_esp_handle(void);
+void fastd_offload_esp_flush(void);
+
+const fastd_offload_t *fastd_offload_esp_get(void);
+
+#else
+
+static inline void fastd_offload_esp_init(void) {}
+static inline void fastd_offload_esp_cleanup(void) {}
+
+static inline bool fastd_offload_esp_init_socket(UNUSED int fd) {
+	return true;
+}
+
+static inline void fastd_offload_esp_handle(void) {}
+static inline void fastd_offload_esp_flush(void) {}
+
+static inline const fastd_offload_t *fastd_offload_esp_get(void) {
+	return NULL;
+}
+
+#endif
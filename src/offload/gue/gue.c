@@ -0,0 +1,392 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   GUE kernel offloading
+
+   For each peer using the "null@gue" method, a sit (IPv4) or ip6tnl (IPv6)
+   tunnel device with Generic UDP Encapsulation is created. Its source and
+   destination match the addresses and ports of the peer's fastd session, so
+   packets routed into the device leave the kernel in exactly the format
+   null@gue uses, without ever being copied to userspace.
+
+   Only the transmit direction can be offloaded: the Linux FOU/GUE receive path
+   requires a kernel-owned UDP socket and can't pass handshakes on to fastd.
+   Received packets are still handled by fastd and written to the shared TUN
+   interface, which is why GUE offloading requires routed TUN mode.
+*/
+
+#include "gue.h"
+#include "../../peer.h"
+#include "../netlink.h"
+
+#include <linux/if_link.h>
+#include <linux/if_tunnel.h>
+#include <linux/ip6_tunnel.h>
+#include <linux/rtnetlink.h>
+
+
+/** Global GUE offload state */
+struct fastd_offload_gue {
+	VECTOR(fastd_offload_state_t *) setup; /**< Sessions whose tunnel device has not been created yet */
+	fastd_nl_batch_t batch;                /**< Non-blocking rtnetlink socket */
+	fastd_nl_stats_round_t stats;          /**< Sessions whose device statistics have been requested */
+};
+
+/** Offload session state */
+struct fastd_offload_state {
+	fastd_peer_t *peer;                 /**< The peer the session belongs to */
+	fastd_peer_address_t local_address; /**< The source address and port of the tunnel */
+	fastd_peer_address_t address;       /**< The destination address and port of the tunnel */
+	char ifname[IFNAMSIZ];              /**< Tunnel device */
+	uint16_t mtu;                       /**< Configured MTU of the tunnel device */
+
+	bool pending; /**< The creation of the tunnel device has not been acknowledged yet */
+	bool failed;  /**< Requests or replies have been lost; the setup will be aborted */
+	unsigned seq; /**< Sequence number of the device creation request */
+};
+
+
+/** Builds a request creating the tunnel device of a session */
+static struct nlmsghdr *put_link_create(void *buf, const fastd_offload_state_t *session) {
+	bool v6 = (session->address.sa.sa_family == AF_INET6);
+
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_NEWLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_flags = IFF_UP;
+	ifi->ifi_change = IFF_UP;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, session->ifname);
+	mnl_attr_put_u32(nlh, IFLA_MTU, session->mtu);
+
+	struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, v6 ? "ip6tnl" : "sit");
+
+	struct nlattr *data = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
+
+	if (v6) {
+		const struct sockaddr_in6 *local = &session->local_address.in6, *remote = &session->address.in6;
+
+		mnl_attr_put(nlh, IFLA_IPTUN_LOCAL, sizeof(local->sin6_addr), &local->sin6_addr);
+		mnl_attr_put(nlh, IFLA_IPTUN_REMOTE, sizeof(remote->sin6_addr), &remote->sin6_addr);
+
+		if (IN6_IS_ADDR_LINKLOCAL(&remote->sin6_addr))
+			mnl_attr_put_u32(nlh, IFLA_IPTUN_LINK, remote->sin6_scope_id);
+
+		/* Don't add a Tunnel Encapsulation Limit option to the outer header */
+		mnl_attr_put_u32(nlh, IFLA_IPTUN_FLAGS, IP6_TNL_F_IGN_ENCAP_LIMIT);
+	} else {
+		const struct sockaddr_in *local = &session->local_address.in, *remote = &session->address.in;
+
+		mnl_attr_put(nlh, IFLA_IPTUN_LOCAL, sizeof(local->sin_addr), &local->sin_addr);
+		mnl_attr_put(nlh, IFLA_IPTUN_REMOTE, sizeof(remote->sin_addr), &remote->sin_addr);
+	}
+
+	/* Protocol 0 allows both IPv4 and IPv6 payloads */
+	mnl_attr_put_u8(nlh, IFLA_IPTUN_PROTO, 0);
+	mnl_attr_put_u8(nlh, IFLA_IPTUN_TTL, 64);
+
+	mnl_attr_put_u16(nlh, IFLA_IPTUN_ENCAP_TYPE, TUNNEL_ENCAP_GUE);
+	mnl_attr_put_u16(nlh, IFLA_IPTUN_ENCAP_FLAGS, TUNNEL_ENCAP_FLAG_CSUM);
+	mnl_attr_put_u16(nlh, IFLA_IPTUN_ENCAP_SPORT, fastd_peer_address_get_port(&session->local_address));
+	mnl_attr_put_u16(nlh, IFLA_IPTUN_ENCAP_DPORT, fastd_peer_address_get_port(&session->address));
+
+#ifdef USE_PACKET_MARK
+	if (conf.packet_mark)
+		mnl_attr_put_u32(nlh, IFLA_IPTUN_FWMARK, conf.packet_mark);
+#endif
+
+	mnl_attr_nest_end(nlh, data);
+	mnl_attr_nest_end(nlh, linkinfo);
+
+	return nlh;
+}
+
+/** Builds a request deleting a tunnel device */
+static struct nlmsghdr *put_link_delete(void *buf, const char *ifname, uint16_t flags) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_DELLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, ifname);
+
+	return nlh;
+}
+
+/**
+ * Checks if GUE tunnel devices can be created
+ *
+ * Error out during fastd start when the kernel lacks FOU/GUE or sit support
+ */
+static void gue_selftest(void) {
+	struct mnl_socket *sock = mnl_socket_open(NETLINK_ROUTE);
+	if (!sock)
+		exit_errno("unable to initialize GUE offload: failed to open rtnetlink socket");
+
+	fastd_offload_state_t session = {
+		.local_address.in = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+			.sin_port = htons(1),
+		},
+		.address.in = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+			.sin_port = htons(2),
+		},
+		.mtu = 1280,
+	};
+	snprintf(session.ifname, sizeof(session.ifname), "gue-test%u", (unsigned)getpid() % 10000000);
+
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	if (!fastd_nl_request(sock, put_link_create(buf, &session)))
+		exit_errno("unable to initialize GUE offload: failed to create GUE tunnel device");
+
+	memset(buf, 0, sizeof(buf));
+	if (!fastd_nl_request(sock, put_link_delete(buf, session.ifname, NLM_F_ACK)))
+		exit_errno("unable to initialize GUE offload: failed to delete GUE tunnel device");
+
+	mnl_socket_close(sock);
+}
+
+/** Removes a session from the list of sessions whose setup has not finished */
+static void remove_setup(fastd_offload_state_t *session) {
+	fastd_offload_gue_t *gue = ctx.offload_gue;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(gue->setup); i++) {
+		if (VECTOR_INDEX(gue->setup, i) == session) {
+			VECTOR_DELETE(gue->setup, i);
+			break;
+		}
+	}
+
+	session->pending = false;
+}
+
+/** Finishes the setup of a session, notifying its peer */
+static void finish_setup(fastd_offload_state_t *session, bool success) {
+	remove_setup(session);
+
+	if (success)
+		pr_debug("GUE offload device `%s' initialized.", session->ifname);
+
+	/* On failure, the session is freed by the peer reset */
+	fastd_peer_offload_ready(session->peer, success);
+}
+
+/** Builds a request retrieving the statistics of a session's tunnel device */
+static struct nlmsghdr *put_stats_get(void *buf, const fastd_offload_state_t *session) {
+	return fastd_nl_put_link_stats_get(buf, session->ifname);
+}
+
+/** Merges the statistics of a tunnel device into the statistics of its peer */
+static void handle_stats(const struct nlmsghdr *nlh) {
+	fastd_offload_state_t *session = fastd_nl_stats_round_get(&ctx.offload_gue->stats, nlh->nlmsg_seq);
+	if (!session)
+		return;
+
+	fastd_offload_counters_t counters;
+	if (fastd_nl_parse_link_stats(nlh, &counters))
+		fastd_peer_offload_counters(session->peer, &counters);
+}
+
+/** Handles a single rtnetlink message received on the non-blocking socket */
+static void handle_reply(const struct nlmsghdr *nlh) {
+	fastd_offload_gue_t *gue = ctx.offload_gue;
+
+	if (nlh->nlmsg_type == RTM_NEWLINK) {
+		handle_stats(nlh);
+		return;
+	}
+
+	if (nlh->nlmsg_type != NLMSG_ERROR)
+		return;
+
+	int err = fastd_nl_get_error(nlh);
+	if (err < 0)
+		return;
+
+	/* Replies to deletion requests don't match any session and are ignored */
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(gue->setup); i++) {
+		fastd_offload_state_t *session = VECTOR_INDEX(gue->setup, i);
+		if (session->failed || session->seq != nlh->nlmsg_seq)
+			continue;
+
+		if (err) {
+			errno = err;
+			pr_warn_errno("failed to create GUE tunnel device");
+		}
+
+		finish_setup(session, !err);
+		return;
+	}
+}
+
+/** Marks all sessions with outstanding requests as failed */
+static void handle_lost(void) {
+	fastd_offload_gue_t *gue = ctx.offload_gue;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(gue->setup); i++)
+		VECTOR_INDEX(gue->setup, i)->failed = true;
+}
+
+/** Aborts the setup of all sessions which have been marked as failed */
+static void abort_failed(void) {
+	fastd_offload_gue_t *gue = ctx.offload_gue;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(gue->setup);) {
+		fastd_offload_state_t *session = VECTOR_INDEX(gue->setup, i);
+
+		if (session->failed)
+			finish_setup(session, false);
+		else
+			i++;
+	}
+}
+
+/** Handles replies on the non-blocking rtnetlink socket */
+void fastd_offload_gue_handle(void) {
+	fastd_nl_batch_receive(&ctx.offload_gue->batch);
+	abort_failed();
+}
+
+/**
+ * Sends all batched requests
+ *
+ * This is called once per main loop iteration before waiting for new events,
+ * so the tunnel devices of all peers established while handling the previous
+ * events are created together. The statistics of the existing devices are
+ * requested periodically.
+ */
+void fastd_offload_gue_flush(void) {
+	fastd_offload_gue_t *gue = ctx.offload_gue;
+
+	fastd_nl_stats_request(&gue->stats, &gue->batch, fastd_offload_gue_get(), put_stats_get);
+	fastd_nl_batch_send(&gue->batch);
+	abort_failed();
+}
+
+/** Global GUE offload initialization */
+void fastd_offload_gue_init(void) {
+	gue_selftest();
+
+	ctx.offload_gue = fastd_new0(fastd_offload_gue_t);
+
+	ctx.offload_gue->batch.handle_msg = handle_reply;
+	ctx.offload_gue->batch.lost = handle_lost;
+	if (!fastd_nl_batch_open(&ctx.offload_gue->batch, NETLINK_ROUTE, POLL_TYPE_OFFLOAD_GUE))
+		exit_errno("unable to initialize GUE offload: failed to open rtnetlink socket");
+}
+
+/** Frees resources allocated by \e fastd_offload_gue_init */
+void fastd_offload_gue_cleanup(void) {
+	if (VECTOR_LEN(ctx.offload_gue->setup))
+		exit_bug("GUE offload: sessions left after cleanup");
+
+	/* Send the deletion requests of the sessions closed during shutdown */
+	fastd_nl_batch_send(&ctx.offload_gue->batch);
+
+	VECTOR_FREE(ctx.offload_gue->setup);
+	fastd_nl_stats_round_free(&ctx.offload_gue->stats);
+	fastd_nl_batch_close(&ctx.offload_gue->batch);
+	free(ctx.offload_gue);
+}
+
+/** GUE implementation of \e fastd_offload_t::free_session */
+static void fastd_offload_gue_free_session(fastd_offload_state_t *session) {
+	if (session->pending)
+		remove_setup(session);
+
+	fastd_nl_stats_round_forget(&ctx.offload_gue->stats, session);
+
+	/* Queued after the creation request (if it is still outstanding), so the kernel handles both in order */
+	fastd_nl_batch_t *batch = &ctx.offload_gue->batch;
+	fastd_nl_batch_add(batch, put_link_delete(fastd_nl_batch_reserve(batch), session->ifname, 0));
+
+	free(session);
+}
+
+/**
+ * GUE implementation of \e fastd_offload_t::update_session
+ *
+ * The source and destination of a tunnel device can't be changed atomically
+ * with its encapsulation ports, so the device is recreated when the peer's
+ * addresses have changed.
+ */
+static bool fastd_offload_gue_update_session(
+	const fastd_peer_t *peer, fastd_offload_state_t *session, UNUSED const fastd_offload_keys_t *keys) {
+	return fastd_peer_address_equal(&peer->local_address, &session->local_address) &&
+	       fastd_peer_address_equal(&peer->address, &session->address);
+}
+
+/**
+ * GUE implementation of \e fastd_offload_t::init_session
+ *
+ * The device creation request is sent by \e fastd_offload_gue_flush together
+ * with the requests of other peers.
+ */
+static fastd_offload_state_t *
+fastd_offload_gue_init_session(fastd_peer_t *peer, UNUSED const fastd_offload_keys_t *keys) {
+	if (peer->address.sa.sa_family != peer->local_address.sa.sa_family) {
+		pr_warn("can't initialize GUE offload device for %P: address families don't match", peer);
+		return NULL;
+	}
+
+	fastd_offload_state_t *session = fastd_new0(fastd_offload_state_t);
+	session->peer = peer;
+	session->local_address = peer->local_address;
+	session->address = peer->address;
+	session->mtu = fastd_peer_get_mtu(peer);
+
+	if (!fastd_iface_format_offload_name(session->ifname, peer)) {
+		pr_warn("can't initialize GUE offload device for %P: invalid interface name", peer);
+		free(session);
+		return NULL;
+	}
+
+	pr_debug("initializing GUE offload device `%s'...", session->ifname);
+
+	fastd_nl_batch_t *batch = &ctx.offload_gue->batch;
+	session->seq = fastd_nl_batch_add(batch, put_link_create(fastd_nl_batch_reserve(batch), session));
+	session->pending = true;
+	VECTOR_ADD(ctx.offload_gue->setup, session);
+
+	return session;
+}
+
+/** GUE implementation of \e fastd_offload_t::get_iface */
+static void fastd_offload_gue_get_iface(const fastd_offload_state_t *session, const char **ifname, uint16_t *mtu) {
+	*ifname = session->ifname;
+	*mtu = session->mtu;
+}
+
+/** The GUE fastd_offload_t implementation */
+static const fastd_offload_t fastd_offload_gue = {
+	.init_session = fastd_offload_gue_init_session,
+	.get_iface = fastd_offload_gue_get_iface,
+	.update_session = fastd_offload_gue_update_session,
+	.free_session = fastd_offload_gue_free_session,
+};
+
+/** Returns the GUE fastd_offload_t implementation */
+const fastd_offload_t *fastd_offload_gue_get(void) {
+	return &fastd_offload_gue;
+}
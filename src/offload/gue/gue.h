@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   GUE kernel offloading
+*/
+
+#pragma once
+
+#include "../../fastd.h"
+#include "../offload.h"
+
+
+#ifdef WITH_OFFLOAD_GUE
+
+void fastd_offload_gue_init(void);
+void fastd_offload_gue_cleanup(void);
+
+void fastd_offload_gue_handle(void);
+void fastd_offload_gue_flush(void);
+
+const fastd_offload_t *fastd_offload_gue_get(void);
+
+#else
+
+static inline void fastd_offload_gue_init(void) {}
+static inline void fastd_offload_gue_cleanup(void) {}
+
+static inline void fastd_offload_gue_handle(void) {}
+static inline void fastd_offload_gue_flush(void) {}
+
+static inline const fastd_offload_t *fastd_offload_gue_get(void) {
+	return NULL;
+}
+
+#endif
@@ -12,8 +12,8 @@
 
 #include "l2tp.h"
 #include "../../peer.h"
+#include "../netlink.h"
 
-#include <libmnl/libmnl.h>
 #include <linux/genetlink.h>
 #include <linux/l2tp.h>
 
@@ -23,18 +23,40 @@ typedef struct fastd_nl_ctx {
 	unsigned seq;            /**< Last used sequence number */
 } fastd_nl_ctx_t;
 
+
+/** Steps of the asynchronous setup of an offload session */
+typedef enum fastd_offload_l2tp_step {
+	STEP_QUEUED = 0,     /**< No request has been sent yet */
+	STEP_TUNNEL_CREATE,  /**< Waiting for the tunnel creation to be acknowledged */
+	STEP_SESSION_CREATE, /**< Waiting for the session creation to be acknowledged */
+	STEP_SESSION_GET,    /**< Waiting for the name of the session interface */
+	STEP_FAILED,         /**< Requests or replies have been lost; the setup will be aborted */
+	STEP_DONE,           /**< The setup has finished */
+} fastd_offload_l2tp_step_t;
+
 /** Global L2TP offload state */
 struct fastd_offload_l2tp {
-	fastd_nl_ctx_t nl;        /**< Netlink socket state */
+	fastd_nl_ctx_t nl;        /**< Netlink socket state for synchronous requests */
 	unsigned short family_id; /**< L2TP Generic Netlink family ID */
+
+	VECTOR(fastd_offload_state_t *) setup; /**< Sessions whose setup has not finished yet */
+	size_t n_inflight;                     /**< Number of sessions in \e setup with outstanding requests */
+
+	fastd_nl_batch_t batch;       /**< Non-blocking Netlink socket for session setup and statistics */
+	fastd_nl_stats_round_t stats; /**< Sessions whose statistics have been requested */
 };
 
 /** Offload session state */
 struct fastd_offload_state {
+	fastd_peer_t *peer;    /**< The peer the session belongs to */
 	fastd_socket_t *sock;  /**< UDP socket underlying the tunnel */
 	uint32_t conn_id;      /**< L2TP tunnel connection ID */
-	char ifname[IFNAMSIZ]; /**< L2TP session interface */
+	char ifname[IFNAMSIZ]; /**< L2TP session interface (the requested name until the setup has finished) */
 	uint16_t mtu;          /**< Configured MTU of L2TP session interface */
+
+	fastd_offload_l2tp_step_t step; /**< Setup progress */
+	unsigned seq;                   /**< Sequence number of the request whose reply is expected next */
+	bool created;                   /**< The L2TP session has been created and must be deleted on teardown */
 };
 
 /** Callback data for \e parse_cb / \e do_nl */
@@ -139,50 +161,45 @@ static int genl_get_family_id(fastd_nl_ctx_t *nl, const char *name) {
 
 /** Returns a 32bit random number, to be used as a L2TP connection ID */
 static uint32_t new_conn_id(void) {
-	uint32_t val = random();
-	val <<= 1;
-	val ^= random();
+	uint32_t val;
+	fastd_random_bytes(&val, sizeof(val), false);
 	return val;
 }
 
-/** Creates an L2TP tunnel on the passed UDP socket */
-static bool fastd_l2tp_tunnel_create(int fd, uint32_t conn_id) {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	memset(buf, 0, sizeof(buf));
-
+/** Initializes an L2TP Generic Netlink request in \e buf */
+static struct nlmsghdr *put_l2tp_header(void *buf, uint8_t cmd, uint16_t flags) {
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = ctx.offload_l2tp->family_id;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
 
 	struct genlmsghdr *gh = mnl_nlmsg_put_extra_header(nlh, sizeof(*gh));
-	gh->cmd = L2TP_CMD_TUNNEL_CREATE;
+	gh->cmd = cmd;
 	gh->version = L2TP_GENL_VERSION;
 
+	return nlh;
+}
+
+/** Builds a request creating an L2TP tunnel on the passed UDP socket */
+static struct nlmsghdr *put_tunnel_create(void *buf, int fd, uint32_t conn_id) {
+	struct nlmsghdr *nlh = put_l2tp_header(buf, L2TP_CMD_TUNNEL_CREATE, NLM_F_ACK);
+
 	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
 	mnl_attr_put_u32(nlh, L2TP_ATTR_PEER_CONN_ID, 1);
 	mnl_attr_put_u8(nlh, L2TP_ATTR_PROTO_VERSION, PACKET_L2TP_VERSION);
 	mnl_attr_put_u16(nlh, L2TP_ATTR_ENCAP_TYPE, L2TP_ENCAPTYPE_UDP);
 	mnl_attr_put_u32(nlh, L2TP_ATTR_FD, fd);
 
-	return do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), NULL, NULL);
+	return nlh;
 }
 
 /**
- * Creates an L2TP session in the tunnel with the given connection ID, optionally setting the L2TP interface name
+ * Builds a request creating an L2TP session in the tunnel with the given connection ID, optionally setting the L2TP
+ * interface name
  *
  * The session ID is always set to 1.
  */
-static bool fastd_l2tp_session_create(uint32_t conn_id, const char *ifname) {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	memset(buf, 0, sizeof(buf));
-
-	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = ctx.offload_l2tp->family_id;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-
-	struct genlmsghdr *gh = mnl_nlmsg_put_extra_header(nlh, sizeof(*gh));
-	gh->cmd = L2TP_CMD_SESSION_CREATE;
-	gh->version = L2TP_GENL_VERSION;
+static struct nlmsghdr *put_session_create(void *buf, uint32_t conn_id, const char *ifname) {
+	struct nlmsghdr *nlh = put_l2tp_header(buf, L2TP_CMD_SESSION_CREATE, NLM_F_ACK);
 
 	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
 	mnl_attr_put_u32(nlh, L2TP_ATTR_SESSION_ID, 1);
@@ -193,10 +210,66 @@ static bool fastd_l2tp_session_create(uint32_t conn_id, const char *ifname) {
 	if (ifname)
 		mnl_attr_put_strz(nlh, L2TP_ATTR_IFNAME, ifname);
 
+	return nlh;
+}
+
+/**
+ * Builds a request retrieving session 1 in the L2TP tunnel with the given connection ID
+ *
+ * No acknowledgement is requested, as the reply itself confirms success.
+ */
+static struct nlmsghdr *put_session_get(void *buf, uint32_t conn_id) {
+	struct nlmsghdr *nlh = put_l2tp_header(buf, L2TP_CMD_SESSION_GET, 0);
+
+	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
+	mnl_attr_put_u32(nlh, L2TP_ATTR_SESSION_ID, 1);
+
+	return nlh;
+}
+
+/** Builds a request retrieving the statistics of an offload session */
+static struct nlmsghdr *put_stats_get(void *buf, const fastd_offload_state_t *session) {
+	return put_session_get(buf, session->conn_id);
+}
+
+/** Builds a request deleting session 1 in the L2TP tunnel with the given connection ID */
+static struct nlmsghdr *put_session_delete(void *buf, uint32_t conn_id) {
+	struct nlmsghdr *nlh = put_l2tp_header(buf, L2TP_CMD_SESSION_DELETE, NLM_F_ACK);
+
+	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
+	mnl_attr_put_u32(nlh, L2TP_ATTR_SESSION_ID, 1);
+
+	return nlh;
+}
+
+/** Creates an L2TP tunnel on the passed UDP socket, waiting for the result */
+static bool fastd_l2tp_tunnel_create(int fd, uint32_t conn_id) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	memset(buf, 0, sizeof(buf));
+
+	struct nlmsghdr *nlh = put_tunnel_create(buf, fd, conn_id);
+	return do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), NULL, NULL);
+}
+
+/** Creates session 1 in the L2TP tunnel with the given connection ID, waiting for the result */
+static bool fastd_l2tp_session_create(uint32_t conn_id, const char *ifname) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	memset(buf, 0, sizeof(buf));
+
+	struct nlmsghdr *nlh = put_session_create(buf, conn_id, ifname);
 	return do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), NULL, NULL);
 }
 
-/** Callback for \e fastd_l2tp_session_get_ifname */
+/** Deletes session 1 in the L2TP tunnel with the given connection ID, waiting for the result */
+static bool fastd_l2tp_session_delete(uint32_t conn_id) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	memset(buf, 0, sizeof(buf));
+
+	struct nlmsghdr *nlh = put_session_delete(buf, conn_id);
+	return do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), NULL, NULL);
+}
+
+/** Callback for \e handle_session_get */
 static int session_get_ifname_cb(const struct nlattr *attr, void *data) {
 	char *ifname = data;
 
@@ -212,46 +285,53 @@ static int session_get_ifname_cb(const struct nlattr *attr, void *data) {
 	return MNL_CB_OK;
 }
 
-/** Retrieves the interface name for session 1 in the the L2TP tunnel with the given connection ID */
-static bool fastd_l2tp_session_get_ifname(uint32_t conn_id, char ifname[IFNAMSIZ]) {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	memset(buf, 0, sizeof(buf));
+/** Callback for the nested statistics attribute in \e handle_stats */
+static int session_stats_cb(const struct nlattr *attr, void *data) {
+	fastd_offload_counters_t *counters = data;
+	uint64_t *counter;
 
-	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = ctx.offload_l2tp->family_id;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	switch (mnl_attr_get_type(attr)) {
+	case L2TP_ATTR_RX_PACKETS:
+		counter = &counters->rx_packets;
+		break;
 
-	struct genlmsghdr *gh = mnl_nlmsg_put_extra_header(nlh, sizeof(*gh));
-	gh->cmd = L2TP_CMD_SESSION_GET;
-	gh->version = L2TP_GENL_VERSION;
+	case L2TP_ATTR_RX_BYTES:
+		counter = &counters->rx_bytes;
+		break;
 
-	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
-	mnl_attr_put_u32(nlh, L2TP_ATTR_SESSION_ID, 1);
+	case L2TP_ATTR_TX_PACKETS:
+		counter = &counters->tx_packets;
+		break;
 
-	ifname[0] = 0;
-	if (!do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), session_get_ifname_cb, ifname))
-		return false;
+	case L2TP_ATTR_TX_BYTES:
+		counter = &counters->tx_bytes;
+		break;
 
-	return (ifname[0] != 0);
-}
+	case L2TP_ATTR_TX_ERRORS:
+		counter = &counters->tx_errors;
+		break;
 
-/** Deletes session 1 in the L2TP tunnel with the given connection ID */
-static bool fastd_l2tp_session_delete(uint32_t conn_id) {
-	char buf[MNL_SOCKET_BUFFER_SIZE];
-	memset(buf, 0, sizeof(buf));
+	default:
+		return MNL_CB_OK;
+	}
 
-	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
-	nlh->nlmsg_type = ctx.offload_l2tp->family_id;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (mnl_attr_validate(attr, MNL_TYPE_U64) < 0)
+		return MNL_CB_ERROR;
 
-	struct genlmsghdr *gh = mnl_nlmsg_put_extra_header(nlh, sizeof(*gh));
-	gh->cmd = L2TP_CMD_SESSION_DELETE;
-	gh->version = L2TP_GENL_VERSION;
+	*counter = mnl_attr_get_u64(attr);
+	return MNL_CB_OK;
+}
 
-	mnl_attr_put_u32(nlh, L2TP_ATTR_CONN_ID, conn_id);
-	mnl_attr_put_u32(nlh, L2TP_ATTR_SESSION_ID, 1);
+/** Callback for \e handle_stats */
+static int session_get_stats_cb(const struct nlattr *attr, void *data) {
+	switch (mnl_attr_get_type(attr)) {
+	case L2TP_ATTR_STATS:
+		if (mnl_attr_validate(attr, MNL_TYPE_NESTED) < 0)
+			return MNL_CB_ERROR;
+		return mnl_attr_parse_nested(attr, session_stats_cb, data);
+	}
 
-	return do_nl(&ctx.offload_l2tp->nl, nlh, sizeof(struct genlmsghdr), NULL, NULL);
+	return MNL_CB_OK;
 }
 
 /**
@@ -290,59 +370,46 @@ static void l2tp_selftest(void) {
 	close(fd);
 }
 
-/** Global L2TP offload initialization */
-void fastd_offload_l2tp_init(void) {
-	ctx.offload_l2tp = fastd_new0(fastd_offload_l2tp_t);
-
-	ctx.offload_l2tp->nl.sock = mnl_socket_open(NETLINK_GENERIC);
-	if (!ctx.offload_l2tp->nl.sock)
-		exit_errno("unable to initialize L2TP offload: failed to open Generic Netlink socket");
-
-	int family_id = genl_get_family_id(&ctx.offload_l2tp->nl, L2TP_GENL_NAME);
-	if (family_id < 0)
-		exit_errno("unable to initialize L2TP offload: no kernel L2TP support");
-
-	ctx.offload_l2tp->family_id = family_id;
+/** Checks if a session has a request in flight */
+static inline bool is_inflight(const fastd_offload_state_t *session) {
+	switch (session->step) {
+	case STEP_TUNNEL_CREATE:
+	case STEP_SESSION_CREATE:
+	case STEP_SESSION_GET:
+		return true;
 
-	l2tp_selftest();
-}
-
-/** Frees resources allocated by \e fastd_offload_l2tp_init  */
-void fastd_offload_l2tp_cleanup(void) {
-	if (ctx.offload_l2tp->nl.sock)
-		mnl_socket_close(ctx.offload_l2tp->nl.sock);
-	free(ctx.offload_l2tp);
+	default:
+		return false;
+	}
 }
 
-/**
- * Connects a \e fastd_socket_t to the given address
- *
- * The L2TP kernel code expects the offload socket to be connected to the
- * peer address.
- */
-static bool connect_socket(fastd_socket_t *sock, const fastd_peer_address_t *addr) {
-	int err;
-
-	switch (addr->sa.sa_family) {
-	case AF_INET:
-		err = connect(sock->fd.fd, (const struct sockaddr *)&addr->in, sizeof(addr->in));
-		break;
+/** Removes a session from the list of sessions whose setup has not finished */
+static void remove_setup(fastd_offload_state_t *session) {
+	fastd_offload_l2tp_t *l2tp = ctx.offload_l2tp;
 
-	case AF_INET6:
-		err = connect(sock->fd.fd, (const struct sockaddr *)&addr->in6, sizeof(addr->in6));
-		break;
-
-	default:
-		exit_bug("unsupported address family");
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(l2tp->setup); i++) {
+		if (VECTOR_INDEX(l2tp->setup, i) == session) {
+			VECTOR_DELETE(l2tp->setup, i);
+			break;
+		}
 	}
 
-	return (err == 0);
+	if (session->step != STEP_QUEUED)
+		l2tp->n_inflight--;
+
+	session->step = STEP_DONE;
 }
 
 /** Helper to close an offload session */
-static void free_offload_session(fastd_offload_state_t *session, bool delete) {
+static void free_offload_session(fastd_offload_state_t *session) {
+	if (session->step != STEP_DONE)
+		remove_setup(session);
+
+	fastd_nl_stats_round_forget(&ctx.offload_l2tp->stats, session);
+
 	if (session->sock) {
-		if (delete) {
+		if (session->created) {
 			/* Explicitly delete the session, so the interface name becomes usable again.
 			 * Just closing the socket will not delete the session instantaneously,
 			 * probably because of O_NONBLOCK */
@@ -356,86 +423,323 @@ static void free_offload_session(fastd_offload_state_t *session, bool delete) {
 	free(session);
 }
 
-/** L2TP implementation of \e fastd_offload_t::free_session */
-static void fastd_offload_l2tp_free_session(fastd_offload_state_t *session) {
-	free_offload_session(session, true);
+/** Queues the tunnel creation request for a session, using a new random connection ID */
+static void request_tunnel_create(fastd_offload_state_t *session) {
+	do
+		session->conn_id = new_conn_id();
+	while (!session->conn_id);
+
+	fastd_nl_batch_t *batch = &ctx.offload_l2tp->batch;
+
+	session->step = STEP_TUNNEL_CREATE;
+	session->seq = fastd_nl_batch_add(
+		batch, put_tunnel_create(fastd_nl_batch_reserve(batch), session->sock->fd.fd, session->conn_id));
 }
 
-/** L2TP implementation of \e fastd_offload_t::update_session */
-static bool fastd_offload_l2tp_update_session(UNUSED const fastd_peer_t *peer, UNUSED fastd_offload_state_t *session) {
-	if (!fastd_peer_address_equal(&peer->local_address, session->sock->bound_addr))
-		return false;
+/**
+ * Queues the session creation request for a session
+ *
+ * The request for the interface name is pipelined directly after it, so
+ * no additional round-trip is needed.
+ */
+static void request_session_create(fastd_offload_state_t *session) {
+	fastd_nl_batch_t *batch = &ctx.offload_l2tp->batch;
+	const char *ifname = session->ifname[0] ? session->ifname : NULL;
+
+	session->step = STEP_SESSION_CREATE;
+	session->seq =
+		fastd_nl_batch_add(batch, put_session_create(fastd_nl_batch_reserve(batch), session->conn_id, ifname));
+	fastd_nl_batch_add(batch, put_session_get(fastd_nl_batch_reserve(batch), session->conn_id));
+}
+
+/** Finishes the setup of a session, notifying its peer */
+static void finish_setup(fastd_offload_state_t *session, bool success) {
+	remove_setup(session);
 
-	return connect_socket(session->sock, &peer->address);
+	if (success)
+		pr_debug("L2TP offload device `%s' initialized.", session->ifname);
+
+	/* On failure, the session is freed by the peer reset */
+	fastd_peer_offload_ready(session->peer, success);
 }
 
-/** L2TP implementation of \e fastd_offload_t::init_session */
-static fastd_offload_state_t *fastd_offload_l2tp_init_session(const fastd_peer_t *peer) {
-	if (!peer->sock)
-		exit_bug("tried to init offload session for peer without socket");
+/** Aborts the setup of all sessions matching the given predicate */
+static void abort_setup(bool (*pred)(const fastd_offload_state_t *session)) {
+	fastd_offload_l2tp_t *l2tp = ctx.offload_l2tp;
 
-	char ifname[IFNAMSIZ];
-	if (!fastd_iface_format_name(ifname, peer))
-		return NULL;
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(l2tp->setup);) {
+		fastd_offload_state_t *session = VECTOR_INDEX(l2tp->setup, i);
 
-	pr_debug("initializing L2TP offload device...");
+		if (pred(session))
+			finish_setup(session, false);
+		else
+			i++;
+	}
+}
 
-	fastd_offload_state_t *session = fastd_new0(fastd_offload_state_t);
-	bool delete = false;
+/** Checks if a session has been marked as failed by \e handle_lost */
+static bool is_failed(const fastd_offload_state_t *session) {
+	return session->step == STEP_FAILED;
+}
 
-	session->sock = fastd_socket_open_offload(peer->sock, &peer->local_address);
-	if (!session->sock) {
-		pr_warn_errno("socket creation for L2TP offloading failed");
-		goto err;
+/** Aborts the setup of all sessions which have been marked as failed */
+static inline void abort_failed(void) {
+	abort_setup(is_failed);
+}
+
+/** Finds the session which expects a reply with the given sequence number */
+static fastd_offload_state_t *find_session(unsigned seq) {
+	fastd_offload_l2tp_t *l2tp = ctx.offload_l2tp;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(l2tp->setup); i++) {
+		fastd_offload_state_t *session = VECTOR_INDEX(l2tp->setup, i);
+		if (is_inflight(session) && session->seq == seq)
+			return session;
 	}
 
-	if (!connect_socket(session->sock, &peer->address)) {
-		pr_warn_errno("failed to set peer address for L2TP offloading");
-		goto err;
+	return NULL;
+}
+
+/** Handles the interface name of a new L2TP session, finishing its setup */
+static void handle_session_get(fastd_offload_state_t *session, const struct nlmsghdr *nlh) {
+	session->ifname[0] = 0;
+	if (mnl_attr_parse(nlh, sizeof(struct genlmsghdr), session_get_ifname_cb, session->ifname) == MNL_CB_ERROR ||
+	    !session->ifname[0]) {
+		pr_warn("failed to get L2TP interface name");
+		finish_setup(session, false);
+		return;
 	}
 
-	/* Retry when the conn_id is already in use */
-	while (true) {
-		session->conn_id = new_conn_id();
-		if (!session->conn_id)
-			continue;
+	session->mtu = fastd_peer_get_mtu(session->peer);
 
-		if (!fastd_l2tp_tunnel_create(session->sock->fd.fd, session->conn_id)) {
-			if (errno == EEXIST)
-				continue;
+	if (!fastd_iface_set_mtu(session->ifname, session->mtu)) {
+		pr_error_errno("failed to set L2TP interface MTU");
+		finish_setup(session, false);
+		return;
+	}
+
+	finish_setup(session, true);
+}
+
+/** Merges the statistics of an L2TP session into the statistics of its peer */
+static void handle_stats(const struct nlmsghdr *nlh) {
+	fastd_offload_state_t *session = fastd_nl_stats_round_get(&ctx.offload_l2tp->stats, nlh->nlmsg_seq);
+	if (!session)
+		return;
+
+	fastd_offload_counters_t counters = {};
+	if (mnl_attr_parse(nlh, sizeof(struct genlmsghdr), session_get_stats_cb, &counters) == MNL_CB_ERROR) {
+		pr_debug("failed to parse L2TP session statistics");
+		return;
+	}
+
+	fastd_peer_offload_counters(session->peer, &counters);
+}
+
+/** Handles a single Netlink message received on the non-blocking socket */
+static void handle_reply(const struct nlmsghdr *nlh) {
+	fastd_offload_state_t *session = find_session(nlh->nlmsg_seq);
+	if (!session) {
+		if (nlh->nlmsg_type == ctx.offload_l2tp->family_id)
+			handle_stats(nlh);
+
+		return;
+	}
+
+	int err;
+
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		err = fastd_nl_get_error(nlh);
+		if (err < 0)
+			return;
+	} else if (nlh->nlmsg_type == ctx.offload_l2tp->family_id && session->step == STEP_SESSION_GET) {
+		handle_session_get(session, nlh);
+		return;
+	} else {
+		return;
+	}
+
+	switch (session->step) {
+	case STEP_TUNNEL_CREATE:
+		/* Retry when the conn_id is already in use */
+		if (err == EEXIST) {
+			request_tunnel_create(session);
+			return;
+		}
 
+		if (err) {
+			errno = err;
 			pr_warn_errno("failed to create L2TP tunnel");
-			goto err;
+			finish_setup(session, false);
+			return;
 		}
 
-		break;
+		request_session_create(session);
+		return;
+
+	case STEP_SESSION_CREATE:
+		if (err) {
+			errno = err;
+			pr_warn_errno("failed to create L2TP session");
+			finish_setup(session, false);
+			return;
+		}
+
+		session->created = true;
+		session->step = STEP_SESSION_GET;
+		session->seq++;
+		return;
+
+	case STEP_SESSION_GET:
+		/* Requested without NLM_F_ACK, so this must be an error */
+		if (!err)
+			return;
+
+		errno = err;
+		pr_warn_errno("failed to get L2TP interface name");
+		finish_setup(session, false);
+		return;
+
+	default:
+		exit_bug("L2TP offload: invalid setup step");
 	}
+}
 
-	if (!fastd_l2tp_session_create(session->conn_id, ifname[0] ? ifname : NULL)) {
-		pr_warn_errno("failed to create L2TP session");
-		goto err;
+/** Marks all sessions with outstanding requests as failed */
+static void handle_lost(void) {
+	fastd_offload_l2tp_t *l2tp = ctx.offload_l2tp;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(l2tp->setup); i++) {
+		fastd_offload_state_t *session = VECTOR_INDEX(l2tp->setup, i);
+		if (is_inflight(session))
+			session->step = STEP_FAILED;
+	}
+}
+
+/** Handles replies on the non-blocking Netlink socket */
+void fastd_offload_l2tp_handle(void) {
+	fastd_nl_batch_receive(&ctx.offload_l2tp->batch);
+	abort_failed();
+}
+
+/**
+ * Starts the setup of queued sessions and sends all batched requests
+ *
+ * This is called once per main loop iteration before waiting for new events,
+ * so all requests queued while handling the previous events are sent together.
+ * The statistics of the established sessions are requested periodically.
+ */
+void fastd_offload_l2tp_flush(void) {
+	fastd_offload_l2tp_t *l2tp = ctx.offload_l2tp;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(l2tp->setup) && l2tp->n_inflight < OFFLOAD_L2TP_SETUP_LIMIT; i++) {
+		fastd_offload_state_t *session = VECTOR_INDEX(l2tp->setup, i);
+		if (session->step != STEP_QUEUED)
+			continue;
+
+		l2tp->n_inflight++;
+		request_tunnel_create(session);
 	}
 
-	delete = true;
+	fastd_nl_stats_request(&l2tp->stats, &l2tp->batch, fastd_offload_l2tp_get(), put_stats_get);
 
-	if (!fastd_l2tp_session_get_ifname(session->conn_id, session->ifname)) {
-		pr_warn_errno("failed to get L2TP interface name");
+	fastd_nl_batch_send(&l2tp->batch);
+	abort_failed();
+}
+
+/** Global L2TP offload initialization */
+void fastd_offload_l2tp_init(void) {
+	ctx.offload_l2tp = fastd_new0(fastd_offload_l2tp_t);
+
+	ctx.offload_l2tp->nl.sock = mnl_socket_open(NETLINK_GENERIC);
+	if (!ctx.offload_l2tp->nl.sock)
+		exit_errno("unable to initialize L2TP offload: failed to open Generic Netlink socket");
+
+	int family_id = genl_get_family_id(&ctx.offload_l2tp->nl, L2TP_GENL_NAME);
+	if (family_id < 0)
+		exit_errno("unable to initialize L2TP offload: no kernel L2TP support");
+
+	ctx.offload_l2tp->family_id = family_id;
+
+	l2tp_selftest();
+
+	ctx.offload_l2tp->batch.handle_msg = handle_reply;
+	ctx.offload_l2tp->batch.lost = handle_lost;
+	if (!fastd_nl_batch_open(&ctx.offload_l2tp->batch, NETLINK_GENERIC, POLL_TYPE_OFFLOAD_L2TP))
+		exit_errno("unable to initialize L2TP offload: failed to open Generic Netlink socket");
+}
+
+/** Frees resources allocated by \e fastd_offload_l2tp_init  */
+void fastd_offload_l2tp_cleanup(void) {
+	if (VECTOR_LEN(ctx.offload_l2tp->setup))
+		exit_bug("L2TP offload: sessions left after cleanup");
+
+	VECTOR_FREE(ctx.offload_l2tp->setup);
+	fastd_nl_stats_round_free(&ctx.offload_l2tp->stats);
+
+	fastd_nl_batch_close(&ctx.offload_l2tp->batch);
+	if (ctx.offload_l2tp->nl.sock)
+		mnl_socket_close(ctx.offload_l2tp->nl.sock);
+	free(ctx.offload_l2tp);
+}
+
+/** L2TP implementation of \e fastd_offload_t::free_session */
+static void fastd_offload_l2tp_free_session(fastd_offload_state_t *session) {
+	free_offload_session(session);
+}
+
+/** L2TP implementation of \e fastd_offload_t::update_session */
+static bool fastd_offload_l2tp_update_session(
+	const fastd_peer_t *peer, fastd_offload_state_t *session, UNUSED const fastd_offload_keys_t *keys) {
+	if (!fastd_peer_address_equal(&peer->local_address, session->sock->bound_addr))
+		return false;
+
+	return fastd_socket_connect(session->sock, &peer->address);
+}
+
+/**
+ * L2TP implementation of \e fastd_offload_t::init_session
+ *
+ * Only the offload socket is set up synchronously. The tunnel and session are
+ * created by pipelined Netlink requests, which are sent by
+ * \e fastd_offload_l2tp_flush together with the requests of other peers.
+ */
+static fastd_offload_state_t *
+fastd_offload_l2tp_init_session(fastd_peer_t *peer, UNUSED const fastd_offload_keys_t *keys) {
+	if (!peer->sock)
+		exit_bug("tried to init offload session for peer without socket");
+
+	fastd_offload_state_t *session = fastd_new0(fastd_offload_state_t);
+	session->peer = peer;
+	session->step = STEP_DONE;
+
+	if (!fastd_iface_format_name(session->ifname, peer))
 		goto err;
-	}
 
-	session->mtu = fastd_peer_get_mtu(peer);
+	pr_debug("initializing L2TP offload device...");
 
-	if (!fastd_iface_set_mtu(session->ifname, session->mtu)) {
-		pr_error_errno("failed to set L2TP interface MTU");
+	session->sock = fastd_socket_clone(peer->sock, &peer->local_address);
+	if (!session->sock) {
+		pr_warn_errno("socket creation for L2TP offloading failed");
+		goto err;
+	}
+
+	if (!fastd_socket_connect(session->sock, &peer->address)) {
+		pr_warn_errno("failed to set peer address for L2TP offloading");
 		goto err;
 	}
 
-	pr_debug("L2TP offload device `%s' initialized.", session->ifname);
+	session->step = STEP_QUEUED;
+	VECTOR_ADD(ctx.offload_l2tp->setup, session);
 
 	return session;
 
 err:
-	free_offload_session(session, delete);
+	free_offload_session(session);
 	return NULL;
 }
 
@@ -21,6 +21,9 @@
 void fastd_offload_l2tp_init(void);
 void fastd_offload_l2tp_cleanup(void);
 
+void fastd_offload_l2tp_handle(void);
+void fastd_offload_l2tp_flush(void);
+
 const fastd_offload_t *fastd_offload_l2tp_get(void);
 
 #else
@@ -28,6 +31,9 @@ const fastd_offload_t *fastd_offload_l2tp_get(void);
 static inline void fastd_offload_l2tp_init(void) {}
 static inline void fastd_offload_l2tp_cleanup(void) {}
 
+static inline void fastd_offload_l2tp_handle(void) {}
+static inline void fastd_offload_l2tp_flush(void) {}
+
 static inline const fastd_offload_t *fastd_offload_l2tp_get(void) {
 	return NULL;
 }
@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Batched requests on non-blocking Netlink sockets
+
+   Requests are collected in a buffer and sent together with a single system
+   call; the kernel processes them in order. Replies are read from the poll
+   loop and dispatched by sequence number by the offload provider.
+
+   The kernel counters of offloaded sessions are requested in periodic rounds
+   on the same sockets and merged into the peers' statistics.
+*/
+
+#include "netlink.h"
+#include "../peer.h"
+
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+
+
+/** Sends a single request on a blocking Netlink socket and waits for the acknowledgement */
+bool fastd_nl_request(struct mnl_socket *sock, struct nlmsghdr *nlh) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	nlh->nlmsg_seq = 1;
+
+	if (mnl_socket_sendto(sock, nlh, nlh->nlmsg_len) < 0)
+		return false;
+
+	ssize_t len = mnl_socket_recvfrom(sock, buf, sizeof(buf));
+	if (len < 0)
+		return false;
+
+	return (mnl_cb_run(buf, len, nlh->nlmsg_seq, mnl_socket_get_portid(sock), NULL, NULL) != MNL_CB_ERROR);
+}
+
+/** Opens a non-blocking Netlink socket and registers it in the poll loop */
+bool fastd_nl_batch_open(fastd_nl_batch_t *batch, int bus, fastd_poll_type_t type) {
+	batch->sock = mnl_socket_open2(bus, SOCK_NONBLOCK);
+	if (!batch->sock)
+		return false;
+
+	batch->fd = FASTD_POLL_FD(type, mnl_socket_get_fd(batch->sock));
+	fastd_poll_fd_register(&batch->fd);
+
+	return true;
+}
+
+/**
+ * Closes a socket opened by \e fastd_nl_batch_open
+ *
+ * Must only be called after the poll loop has been shut down.
+ */
+void fastd_nl_batch_close(fastd_nl_batch_t *batch) {
+	if (batch->sock)
+		mnl_socket_close(batch->sock);
+}
+
+/** Returns a buffer for the next request of the batch, sending the batch first if it is full */
+void *fastd_nl_batch_reserve(fastd_nl_batch_t *batch) {
+	if (batch->len + FASTD_NL_MAX_REQUEST_SIZE > sizeof(batch->buf))
+		fastd_nl_batch_send(batch);
+
+	return batch->buf + batch->len;
+}
+
+/** Adds a request built in the buffer returned by \e fastd_nl_batch_reserve, returning its sequence number */
+unsigned fastd_nl_batch_add(fastd_nl_batch_t *batch, struct nlmsghdr *nlh) {
+	if (nlh->nlmsg_len > FASTD_NL_MAX_REQUEST_SIZE)
+		exit_bug("Netlink request too large");
+
+	nlh->nlmsg_seq = ++batch->seq;
+	batch->len += MNL_ALIGN(nlh->nlmsg_len);
+
+	return nlh->nlmsg_seq;
+}
+
+/** Sends all batched requests */
+void fastd_nl_batch_send(fastd_nl_batch_t *batch) {
+	if (!batch->len)
+		return;
+
+	if (mnl_socket_sendto(batch->sock, batch->buf, batch->len) < 0) {
+		pr_warn_errno("failed to send Netlink requests");
+		batch->lost();
+	}
+
+	batch->len = 0;
+}
+
+/** Handles all messages that have been received on a socket */
+void fastd_nl_batch_receive(fastd_nl_batch_t *batch) {
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+
+	while (true) {
+		ssize_t len = mnl_socket_recvfrom(batch->sock, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			if (errno == ENOBUFS) {
+				pr_warn("Netlink receive buffer overrun, replies have been lost");
+				batch->lost();
+				continue;
+			}
+
+			pr_warn_errno("failed to receive Netlink replies");
+			return;
+		}
+
+		const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+		int rem = len;
+
+		while (mnl_nlmsg_ok(nlh, rem)) {
+			batch->handle_msg(nlh);
+			nlh = mnl_nlmsg_next(nlh, &rem);
+		}
+	}
+}
+
+
+/**
+ * Requests the kernel counters of all established sessions of an offload provider
+ *
+ * A new round of requests is only started when the statistics are enabled and
+ * the interval has elapsed since the previous round. Replies to the requests of
+ * the previous round that have not been received yet are ignored from now on.
+ */
+void fastd_nl_stats_request(
+	fastd_nl_stats_round_t *round, fastd_nl_batch_t *batch, const fastd_offload_t *offload,
+	struct nlmsghdr *(*put)(void *buf, const fastd_offload_state_t *session)) {
+	if (!fastd_stats_enabled() || !fastd_timed_out(round->next))
+		return;
+
+	round->next = ctx.now + OFFLOAD_STATS_INTERVAL;
+	round->first_seq = batch->seq + 1;
+	VECTOR_RESIZE(round->sessions, 0);
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
+		if (peer->offload != offload || peer->offload_pending)
+			continue;
+
+		/* Nothing else is added to the batch in between, so the sequence numbers are consecutive */
+		fastd_nl_batch_add(batch, put(fastd_nl_batch_reserve(batch), peer->offload_state));
+		VECTOR_ADD(round->sessions, peer->offload_state);
+	}
+}
+
+/** Returns the session a reply with the given sequence number belongs to, or NULL if it isn't part of the round */
+fastd_offload_state_t *fastd_nl_stats_round_get(fastd_nl_stats_round_t *round, unsigned seq) {
+	unsigned i = seq - round->first_seq;
+	if (i >= VECTOR_LEN(round->sessions))
+		return NULL;
+
+	return VECTOR_INDEX(round->sessions, i);
+}
+
+/** Removes a session that is about to be freed from the current round */
+void fastd_nl_stats_round_forget(fastd_nl_stats_round_t *round, const fastd_offload_state_t *session) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(round->sessions); i++) {
+		if (VECTOR_INDEX(round->sessions, i) == session)
+			VECTOR_INDEX(round->sessions, i) = NULL;
+	}
+}
+
+/** Frees the session list of a round */
+void fastd_nl_stats_round_free(fastd_nl_stats_round_t *round) {
+	VECTOR_FREE(round->sessions);
+}
+
+
+/**
+ * Builds an rtnetlink request retrieving an interface, including its statistics
+ *
+ * No acknowledgement is requested, as the reply itself confirms success.
+ */
+struct nlmsghdr *fastd_nl_put_link_stats_get(void *buf, const char *ifname) {
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	struct ifinfomsg *ifi = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, ifname);
+
+	return nlh;
+}
+
+/** Callback for \e fastd_nl_parse_link_stats */
+static int link_stats_cb(const struct nlattr *attr, void *data) {
+	const struct nlattr **stats = data;
+
+	if (mnl_attr_get_type(attr) == IFLA_STATS64) {
+		if (mnl_attr_validate2(attr, MNL_TYPE_UNSPEC, sizeof(struct rtnl_link_stats64)) < 0)
+			return MNL_CB_ERROR;
+
+		*stats = attr;
+	}
+
+	return MNL_CB_OK;
+}
+
+/**
+ * Extracts the counters of an interface from a RTM_NEWLINK message
+ *
+ * Packets sent into the interface are reported as sent to the peer, packets
+ * appearing on the interface as received from the peer.
+ */
+bool fastd_nl_parse_link_stats(const struct nlmsghdr *nlh, fastd_offload_counters_t *counters) {
+	if (nlh->nlmsg_type != RTM_NEWLINK)
+		return false;
+
+	const struct nlattr *attr = NULL;
+	if (mnl_attr_parse(nlh, sizeof(struct ifinfomsg), link_stats_cb, &attr) == MNL_CB_ERROR || !attr)
+		return false;
+
+	struct rtnl_link_stats64 stats;
+	memcpy(&stats, mnl_attr_get_payload(attr), sizeof(stats));
+
+	*counters = (fastd_offload_counters_t){
+		.rx_packets = stats.rx_packets,
+		.rx_bytes = stats.rx_bytes,
+		.tx_packets = stats.tx_packets,
+		.tx_bytes = stats.tx_bytes,
+		.tx_dropped = stats.tx_dropped,
+		.tx_errors = stats.tx_errors,
+	};
+
+	return true;
+}
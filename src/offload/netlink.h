@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Batched requests on non-blocking Netlink sockets, used by the kernel offload providers
+*/
+
+#pragma once
+
+#include "../fastd.h"
+#include "offload.h"
+
+#include <libmnl/libmnl.h>
+
+
+/** Maximum size of a single request in a batch */
+#define FASTD_NL_MAX_REQUEST_SIZE 512
+
+/** Size of the buffer used to batch requests */
+#define FASTD_NL_BATCH_SIZE 8192
+
+
+/**
+ * Offload sessions whose kernel counters have been requested
+ *
+ * The requests of a round are added without any other requests in between,
+ * so their sequence numbers are consecutive and can be used as an index.
+ */
+typedef struct fastd_nl_stats_round {
+	unsigned first_seq;                       /**< Sequence number of the first request of the round */
+	VECTOR(fastd_offload_state_t *) sessions; /**< Sessions by sequence number (NULL when they have been freed) */
+	fastd_timeout_t next;                     /**< Time after which the next round is started */
+} fastd_nl_stats_round_t;
+
+
+/** A non-blocking Netlink socket with a buffer of requests that have not been sent yet */
+typedef struct fastd_nl_batch {
+	struct mnl_socket *sock; /**< Netlink socket */
+	fastd_poll_fd_t fd;      /**< The file descriptor of the Netlink socket */
+	unsigned seq;            /**< Last used sequence number */
+
+	/** Handles a single message received on the socket */
+	void (*handle_msg)(const struct nlmsghdr *nlh);
+	/**
+	 * Handles the loss of requests or replies
+	 *
+	 * As it can't be determined which requests are affected, all outstanding
+	 * requests must be considered failed. The callback may be run while a batch
+	 * is being built, so it must not add new requests or free any state the
+	 * caller might be working on.
+	 */
+	void (*lost)(void);
+
+	size_t len;                      /**< Length of the requests in \e buf */
+	uint8_t buf[FASTD_NL_BATCH_SIZE]; /**< Requests that have not been sent yet */
+} fastd_nl_batch_t;
+
+
+bool fastd_nl_request(struct mnl_socket *sock, struct nlmsghdr *nlh);
+
+bool fastd_nl_batch_open(fastd_nl_batch_t *batch, int bus, fastd_poll_type_t type);
+void fastd_nl_batch_close(fastd_nl_batch_t *batch);
+
+void *fastd_nl_batch_reserve(fastd_nl_batch_t *batch);
+unsigned fastd_nl_batch_add(fastd_nl_batch_t *batch, struct nlmsghdr *nlh);
+void fastd_nl_batch_send(fastd_nl_batch_t *batch);
+void fastd_nl_batch_receive(fastd_nl_batch_t *batch);
+
+void fastd_nl_stats_request(
+	fastd_nl_stats_round_t *round, fastd_nl_batch_t *batch, const fastd_offload_t *offload,
+	struct nlmsghdr *(*put)(void *buf, const fastd_offload_state_t *session));
+fastd_offload_state_t *fastd_nl_stats_round_get(fastd_nl_stats_round_t *round, unsigned seq);
+void fastd_nl_stats_round_forget(fastd_nl_stats_round_t *round, const fastd_offload_state_t *session);
+void fastd_nl_stats_round_free(fastd_nl_stats_round_t *round);
+
+struct nlmsghdr *fastd_nl_put_link_stats_get(void *buf, const char *ifname);
+bool fastd_nl_parse_link_stats(const struct nlmsghdr *nlh, fastd_offload_counters_t *counters);
+
+
+/**
+ * Returns the error code of a Netlink error message
+ *
+ * 0 is returned for acknowledgements, -1 for truncated messages.
+ */
+static inline int fastd_nl_get_error(const struct nlmsghdr *nlh) {
+	const struct nlmsgerr *nlerr = mnl_nlmsg_get_payload(nlh);
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*nlerr)))
+		return -1;
+
+	return -nlerr->error;
+}
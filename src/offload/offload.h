@@ -14,11 +14,48 @@
 
 #include "../types.h"
 
+
+/** Length of the AES-128-GCM key and salt of a security association (RFC 4106) */
+#define FASTD_OFFLOAD_SA_KEY_LEN 20
+
+/** A unidirectional security association for offload providers handling encryption in the kernel */
+typedef struct fastd_offload_sa {
+	uint32_t spi;                          /**< Security parameter index (network byte order) */
+	uint8_t key[FASTD_OFFLOAD_SA_KEY_LEN]; /**< AES-128 key followed by the 4 byte salt */
+} fastd_offload_sa_t;
+
+/** The keys of a method session, exported for offload providers handling encryption in the kernel */
+struct fastd_offload_keys {
+	bool initiator;         /**< The local side is the initiator of the session */
+	fastd_offload_sa_t in;  /**< The security association of received packets */
+	fastd_offload_sa_t out; /**< The security association of sent packets */
+};
+
+
+/** Cumulative traffic counters of an offload session, as reported by the kernel */
+typedef struct fastd_offload_counters {
+	uint64_t rx_packets; /**< Number of packets received from the peer */
+	uint64_t rx_bytes;   /**< Number of payload bytes received from the peer */
+	uint64_t tx_packets; /**< Number of packets sent to the peer */
+	uint64_t tx_bytes;   /**< Number of payload bytes sent to the peer */
+	uint64_t tx_dropped; /**< Number of packets to the peer dropped because of a lack of resources */
+	uint64_t tx_errors;  /**< Number of packets to the peer that could not be sent because of other errors */
+} fastd_offload_counters_t;
+
+
 /** Generic session offload provider */
 struct fastd_offload {
-	/** Initializes an offload session for the given peer */
-	fastd_offload_state_t *(*init_session)(const fastd_peer_t *peer);
-	/** Returns the name and MTU for an offload interface */
+	/**
+	 * Starts initializing an offload session for the given peer
+	 *
+	 * The setup may finish asynchronously; the provider must call
+	 * fastd_peer_offload_ready() once the session is usable or its setup
+	 * has failed, but never from within \e init_session itself.
+	 *
+	 * \e keys is NULL unless the method exports its session keys.
+	 */
+	fastd_offload_state_t *(*init_session)(fastd_peer_t *peer, const fastd_offload_keys_t *keys);
+	/** Returns the name and MTU for an offload interface (only called after the setup has finished) */
 	void (*get_iface)(const fastd_offload_state_t *session, const char **ifname, uint16_t *mtu);
 	/**
 	 * Update a session after a new handshake (e.g. because of peer address change)
@@ -26,7 +63,15 @@ struct fastd_offload {
 	 * May return false when update is not possible (e.g. bind address has changed),
 	 * so a full teardown and new session initialization will be performed.
 	 */
-	bool (*update_session)(const fastd_peer_t *peer, fastd_offload_state_t *session);
+	bool (*update_session)(
+		const fastd_peer_t *peer, fastd_offload_state_t *session, const fastd_offload_keys_t *keys);
+	/**
+	 * Notifies the provider that the peer has started using the newest session (optional)
+	 *
+	 * Until then, the initiator of a session must keep sending with the keys of
+	 * the previous session.
+	 */
+	void (*confirm_session)(fastd_offload_state_t *session);
 	/** Closes an offload session */
 	void (*free_session)(fastd_offload_state_t *session);
 };
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Transmit pacing of the packets sent to a peer
+
+   Packets read from the tunnel interface in bursts would otherwise leave fastd back-to-back and
+   overflow the shallow buffers of slow uplinks on the way to the peer. When a pacing rate is
+   configured, each peer has a departure clock which is advanced by the transmission time of every
+   packet sent to the peer at the configured rate.
+
+   By default, the rate is enforced in userspace: packets that would have to wait are held back in the
+   peer's transmit queue when transmit queues are enabled, and dropped like by a token bucket otherwise.
+
+   With kernel pacing, packets are passed to the kernel with their departure time (SO_TXTIME) instead,
+   and the fq queueing discipline holds them back until then. As other queueing disciplines silently
+   ignore the departure time, kernel pacing is only used for a peer when the outgoing interface is
+   found to use fq.
+*/
+
+
+#include "pacing.h"
+
+
+/** The number of nanoseconds per second */
+#define NSEC_PER_SEC 1000000000
+
+
+/**
+   Determines if the packets sent to a peer can be paced by the kernel
+
+   Called when a peer is established. Falls back to pacing in userspace with a warning when kernel
+   pacing is configured, but the socket doesn't support SO_TXTIME or the outgoing interface doesn't
+   use the fq queueing discipline.
+*/
+void fastd_pacing_init(fastd_peer_t *peer) {
+	peer->pacing_kernel = false;
+
+	const fastd_pacing_rate_t *pacing = fastd_pacing_rate(peer);
+	if (!pacing || !pacing->kernel)
+		return;
+
+	if (!peer->sock || !peer->sock->txtime) {
+		pr_warn("kernel pacing is not supported, pacing packets to %P in userspace", peer);
+		return;
+	}
+
+	char ifname[IF_NAMESIZE];
+	bool fq;
+	if (fastd_iface_netlink_egress_fq(&peer->address, ifname, &fq) && !fq) {
+		pr_warn("interface `%s' doesn't use the fq queueing discipline, pacing packets to %P in userspace",
+			ifname, peer);
+		return;
+	}
+
+	peer->pacing_kernel = true;
+}
+
+/**
+   Determines the departure time of a packet of \e len bytes sent to a peer on a socket
+
+   Returns false if the packet must be dropped, as it would have to wait longer than
+   PACING_MAX_DELAY (or at all when the packets to the peer are paced in userspace).
+   Otherwise, \e txtime is set to the departure time to pass to the kernel, or to 0 if
+   the packet can be sent immediately.
+*/
+bool fastd_pacing_schedule(fastd_peer_t *peer, const fastd_socket_t *sock, size_t len, uint64_t *txtime) {
+	*txtime = 0;
+
+	const fastd_pacing_rate_t *pacing = fastd_pacing_rate(peer);
+	if (!pacing)
+		return true;
+
+	int64_t now = fastd_get_time_ns();
+	int64_t max_delay = (peer->pacing_kernel && sock->txtime) ? PACING_MAX_DELAY * (NSEC_PER_SEC / 1000) : 0;
+
+	/* Up to a burst worth of transmission time may be accumulated while the peer is idle */
+	int64_t earliest = now - (int64_t)(NSEC_PER_SEC * (uint64_t)pacing->burst / pacing->rate);
+	if (peer->pacing_next < earliest)
+		peer->pacing_next = earliest;
+
+	if (peer->pacing_next - now > max_delay)
+		return false;
+
+	if (peer->pacing_next > now)
+		*txtime = peer->pacing_next;
+
+	peer->pacing_next += NSEC_PER_SEC * (uint64_t)len / pacing->rate;
+
+	return true;
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Transmit pacing of the packets sent to a peer
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+#include "peer_group.h"
+
+
+/** Returns the pacing rate of a peer, or NULL if packets sent to the peer aren't paced */
+static inline const fastd_pacing_rate_t *fastd_pacing_rate(const fastd_peer_t *peer) {
+	const fastd_pacing_rate_t *pacing = *fastd_peer_group_lookup_peer(peer, pacing);
+
+	if (!pacing || !pacing->rate)
+		return NULL;
+
+	return pacing;
+}
+
+
+/** Returns the time (in nanoseconds) until the pacing rate of a peer allows sending the next packet, or 0 */
+static inline int64_t fastd_pacing_delay(const fastd_peer_t *peer, int64_t now) {
+	if (!fastd_pacing_rate(peer) || peer->pacing_next <= now)
+		return 0;
+
+	return peer->pacing_next - now;
+}
+
+
+void fastd_pacing_init(fastd_peer_t *peer);
+bool fastd_pacing_schedule(fastd_peer_t *peer, const fastd_socket_t *sock, size_t len, uint64_t *txtime);
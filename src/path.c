@@ -0,0 +1,643 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   RTT and loss measurement of the paths to the addresses of a peer's remotes
+
+   When a peer has several remotes (or a remote resolving to several addresses), the
+   connection is established with whichever address answers a handshake first. To find
+   better paths later on, a probe is sent to each address of the peer's remotes
+   periodically. Probes are encrypted with the current session and prefixed with the
+   receiver's session index, so they can be authenticated without a handshake and are
+   answered from any address. The session uses separate keys for probes, so they can't be
+   mistaken for payload packets.
+
+   The round-trip time and loss rate of each path are smoothed over several probes. The
+   connection is moved to another path when it is significantly better than the current
+   one, at most once per PATH_SWITCH_INTERVAL, or immediately when the current path has
+   stopped answering probes. As the session is kept, the peer follows the move like a
+   roaming peer.
+
+   In multipath mode, paths are also measured from each socket bound to a specific address or
+   interface (i.e. each uplink), and paths on which payload packets are received from the peer
+   are learned. Payload packets are then striped across all working paths by a weighted
+   round-robin scheduler. In capacity mode, the weights are adjusted according to the packet
+   loss of each path, which the peer reports in its replies to the probes.
+*/
+
+
+#include "path.h"
+#include "peer_index.h"
+
+
+/** The type of a path probe */
+typedef enum path_probe_type {
+	PATH_PROBE_REQUEST = 1, /**< A probe that is answered by the receiver */
+	PATH_PROBE_REPLY,       /**< The answer to a probe */
+} path_probe_type_t;
+
+/** The \e rx_packets field of a path probe reply is set */
+#define PATH_PROBE_FLAG_RX_PACKETS 0x01
+
+/** The encrypted payload of a path probe */
+typedef struct path_probe {
+	uint8_t type;        /**< The probe type (path_probe_type_t) */
+	uint8_t flags;       /**< PATH_PROBE_FLAG_* */
+	uint8_t reserved[2]; /**< Reserved, set to zero */
+	uint32_t id;         /**< A random ID that is echoed in the reply */
+	uint32_t rx_packets; /**< The number of payload packets received on the path of a request (big endian) */
+} path_probe_t;
+
+
+/** Returns the measurements of the path to an address using the peer's socket, or NULL if the address isn't probed */
+static fastd_path_t *find_path(const fastd_peer_t *peer, const fastd_peer_address_t *addr) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (!path->sock && fastd_peer_address_equal(&path->address, addr))
+			return path;
+	}
+
+	return NULL;
+}
+
+/** Checks if a packet received on a socket and local address from a remote address has taken a path */
+static bool path_matches(
+	const fastd_peer_t *peer, const fastd_path_t *path, const fastd_socket_t *sock,
+	const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr) {
+	if (!fastd_peer_address_equal(&path->address, remote_addr))
+		return false;
+
+	if (!path->sock)
+		return fastd_peer_address_equal(&peer->local_address, local_addr);
+
+	if (path->sock != sock)
+		return false;
+
+	return (
+		path->local_address.sa.sa_family == AF_UNSPEC ||
+		fastd_peer_address_equal(&path->local_address, local_addr));
+}
+
+/** Returns the path a packet received on a socket and local address from a remote address has taken (or NULL) */
+static fastd_path_t *find_rx_path(
+	const fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (path_matches(peer, path, sock, local_addr, remote_addr))
+			return path;
+	}
+
+	return NULL;
+}
+
+/** Returns true if an address is unspecified (i.e. a socket bound to it accepts packets to any address) */
+static bool is_unspecified(const fastd_peer_address_t *addr) {
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		return addr->in.sin_addr.s_addr == htonl(INADDR_ANY);
+
+	case AF_INET6:
+		return IN6_IS_ADDR_UNSPECIFIED(&addr->in6.sin6_addr);
+
+	default:
+		return true;
+	}
+}
+
+/**
+   Checks if a socket is bound to a specific uplink (a specific address or interface) that can be used
+   for additional paths to a peer in multipath mode
+*/
+static bool is_uplink_socket(const fastd_peer_t *peer, const fastd_socket_t *sock, sa_family_t af) {
+	if (sock == peer->sock || !sock->addr || !sock->bound_addr)
+		return false;
+
+	sa_family_t sock_af = sock->addr->addr.sa.sa_family;
+	if (sock_af != AF_UNSPEC && sock_af != af)
+		return false;
+
+	return (!is_unspecified(&sock->addr->addr) || sock->addr->bindtodev);
+}
+
+/** Checks if an address is the current address of a peer or one of the addresses of its remotes */
+static bool is_candidate_address(const fastd_peer_t *peer, const fastd_peer_address_t *addr) {
+	if (addr->sa.sa_family != peer->address.sa.sa_family)
+		return false;
+
+	if (fastd_peer_address_equal(addr, &peer->address))
+		return true;
+
+	size_t i, j;
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		const fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+
+		for (j = 0; j < remote->n_addresses; j++) {
+			if (fastd_peer_address_equal(&remote->addresses[j], addr))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+   Checks if a path is still measured
+
+   Only addresses of the family of the current address are probed, as probes are sent on the peer's socket
+   (or on uplink sockets of the same family). Learned paths are forgotten when they have stopped answering
+   probes.
+*/
+static bool is_candidate(const fastd_peer_t *peer, const fastd_path_t *path) {
+	if (path->learned)
+		return fastd_use_multipath() && path->unanswered < PATH_LEARNED_MAX_UNANSWERED;
+
+	if (!is_candidate_address(peer, &path->address))
+		return false;
+
+	if (!path->sock)
+		return true;
+
+	return fastd_use_multipath() && is_uplink_socket(peer, path->sock, path->address.sa.sa_family);
+}
+
+/** Returns true if the same path is already measured */
+static bool has_path(const fastd_peer_t *peer, const fastd_path_t *new_path) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		const fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (path->sock == new_path->sock && fastd_peer_address_equal(&path->address, &new_path->address))
+			return true;
+	}
+
+	return false;
+}
+
+/** Starts measuring a path if it isn't measured yet */
+static void add_path(fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *addr) {
+	fastd_path_t path = {
+		.address = *addr,
+		.sock = sock,
+		.local_address.sa.sa_family = AF_UNSPEC,
+		.srtt = -1,
+		.weight = PATH_WEIGHT_DEFAULT,
+	};
+
+	if (VECTOR_LEN(peer->paths) >= PATH_MAX_COUNT || !is_candidate(peer, &path) || has_path(peer, &path))
+		return;
+
+	VECTOR_ADD(peer->paths, path);
+}
+
+/** Starts measuring the paths to an address from the peer's socket and (in multipath mode) all uplink sockets */
+static void add_paths(fastd_peer_t *peer, const fastd_peer_address_t *addr) {
+	add_path(peer, NULL, addr);
+
+	if (!fastd_use_multipath())
+		return;
+
+	size_t i;
+	for (i = 0; i < ctx.n_socks; i++)
+		add_path(peer, &ctx.socks[i], addr);
+}
+
+/**
+   Updates the list of probed paths after the remotes have been resolved again or the peer has moved
+
+   The measurements of paths that are still probed are kept.
+*/
+static void update_paths(fastd_peer_t *peer) {
+	size_t i, j;
+	for (i = 0; i < VECTOR_LEN(peer->paths);) {
+		if (is_candidate(peer, &VECTOR_INDEX(peer->paths, i)))
+			i++;
+		else
+			VECTOR_DELETE(peer->paths, i);
+	}
+
+	add_paths(peer, &peer->address);
+
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		const fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+
+		for (j = 0; j < remote->n_addresses; j++)
+			add_paths(peer, &remote->addresses[j]);
+	}
+}
+
+/** Updates the smoothed loss rate of a path with the result of a probe */
+static void update_loss(fastd_path_t *path, bool lost) {
+	path->loss = (7 * path->loss) / 8 + (lost ? 256 / 8 : 0);
+}
+
+/** Returns the score of a path (lower is better), or INT64_MAX if the path can't be used */
+static int64_t path_score(const fastd_path_t *path) {
+	if (path->srtt < 0 || path->unanswered >= PATH_DEAD_PROBES)
+		return INT64_MAX;
+
+	return path->srtt + (int64_t)path->loss * PATH_LOSS_PENALTY / 256;
+}
+
+/** Moves the connection with a peer to a significantly better path if there is one */
+static void select_path(fastd_peer_t *peer) {
+	const fastd_path_t *current = find_path(peer, &peer->address);
+	int64_t current_score = current ? path_score(current) : INT64_MAX;
+	bool current_dead = (current_score == INT64_MAX);
+
+	if (!current_dead && !fastd_timed_out(peer->path_switch_timeout))
+		return;
+
+	const fastd_path_t *best = NULL;
+	int64_t best_score = INT64_MAX;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		const fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		/* The connection is only moved to paths using the peer's socket */
+		if (path == current || path->sock || path->replies < (current_dead ? 1 : PATH_MIN_SAMPLES))
+			continue;
+
+		int64_t score = path_score(path);
+		if (score < best_score) {
+			best = path;
+			best_score = score;
+		}
+	}
+
+	if (!best)
+		return;
+
+	if (!current_dead) {
+		int64_t gain = current_score - best_score;
+
+		if (gain < PATH_SWITCH_MIN_GAIN || 100 * gain < PATH_SWITCH_MIN_GAIN_PERCENT * current_score)
+			return;
+	}
+
+	fastd_peer_address_t old_addr = peer->address, new_addr = best->address;
+	int64_t rtt = best->srtt;
+
+	peer->path_switch_timeout = ctx.now + PATH_SWITCH_INTERVAL;
+
+	if (fastd_peer_move(peer, NULL, NULL, &new_addr))
+		pr_verbose(
+			"moved connection with %P from %I to %I (RTT %u ms)", peer, &old_addr, &new_addr,
+			(unsigned)rtt);
+}
+
+/** Returns the socket packets on a path are sent on */
+static const fastd_socket_t *path_sock(const fastd_peer_t *peer, const fastd_path_t *path) {
+	return path->sock ? path->sock : peer->sock;
+}
+
+/** Returns the local address packets on a path are sent from, or NULL to let the kernel choose */
+static const fastd_peer_address_t *path_local_address(const fastd_peer_t *peer, const fastd_path_t *path) {
+	if (!path->sock)
+		return &peer->local_address;
+
+	if (path->local_address.sa.sa_family == AF_UNSPEC)
+		return NULL;
+
+	return &path->local_address;
+}
+
+/** Returns true if a path has answered recent probes and can be used for payload packets */
+static inline bool is_usable(const fastd_path_t *path) {
+	return path_score(path) != INT64_MAX;
+}
+
+/** Encrypts and sends a path probe */
+static void send_probe(
+	fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr, const path_probe_t *probe) {
+	fastd_buffer_t *buffer = fastd_buffer_alloc(sizeof(*probe), conf.encrypt_headroom);
+	memcpy(buffer->data, probe, sizeof(*probe));
+
+	buffer = conf.protocol->encrypt_probe(peer, buffer);
+	if (!buffer)
+		return;
+
+	buffer = fastd_index_header_push(buffer, PACKET_PATH_PROBE, peer->remote_index);
+
+	fastd_send(sock, local_addr, remote_addr, NULL, buffer, 0, 0);
+	fastd_buffer_free(buffer);
+}
+
+/**
+   Chooses the path for the next payload packet in multipath mode
+
+   Uses smooth weighted round-robin scheduling, which interleaves the paths instead of sending bursts of
+   packets on each path. Returns NULL if no path is working.
+*/
+static fastd_path_t *next_tx_path(fastd_peer_t *peer) {
+	fastd_path_t *ret = NULL;
+	int64_t total = 0;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (!is_usable(path))
+			continue;
+
+		path->credit += path->weight;
+		total += path->weight;
+
+		if (!ret || path->credit > ret->credit)
+			ret = path;
+	}
+
+	if (ret)
+		ret->credit -= total;
+
+	return ret;
+}
+
+/**
+   Sends an encrypted payload packet prefixed with the peer's session index
+
+   In multipath mode, the packet is sent on the next working path; otherwise, or if no path is working,
+   it is sent to the peer's current address.
+*/
+void fastd_path_send(fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size) {
+	fastd_path_t *path = NULL;
+
+	if (fastd_use_multipath())
+		path = next_tx_path(peer);
+
+	if (!path) {
+		fastd_send_payload(peer->sock, &peer->local_address, &peer->address, peer, buffer, tos, stat_size);
+		return;
+	}
+
+	path->tx_packets++;
+	path->tx_bytes += buffer->len;
+
+	fastd_send_payload(
+		path_sock(peer, path), path_local_address(peer, path), &path->address, peer, buffer, tos, stat_size);
+}
+
+/** Returns a new random probe ID */
+static uint32_t new_probe_id(void) {
+	uint32_t id;
+
+	do {
+		fastd_random_bytes(&id, sizeof(id), false);
+	} while (!id);
+
+	return id;
+}
+
+/**
+   Sends a round of probes to the addresses of a peer's remotes
+
+   The probes of the previous round that haven't been answered are counted as lost, and the connection
+   is moved to a better path before the new probes are sent.
+*/
+void fastd_path_probe(fastd_peer_t *peer) {
+	peer->next_path_probe = ctx.now + PATH_PROBE_INTERVAL;
+
+	if (!fastd_peer_is_established(peer) || peer->offload || !peer->remote_index) {
+		VECTOR_RESIZE(peer->paths, 0);
+		return;
+	}
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (!path->probe_id)
+			continue;
+
+		path->probe_id = 0;
+		if (path->unanswered < UINT8_MAX)
+			path->unanswered++;
+
+		update_loss(path, true);
+	}
+
+	update_paths(peer);
+
+	if (VECTOR_LEN(peer->paths) < 2)
+		return;
+
+	select_path(peer);
+
+	/* encrypt_probe() resets the peer when its session has timed out, which empties the path list */
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		path->probe_id = new_probe_id();
+		path->probe_sent = ctx.now;
+		path->probe_tx_packets = path->tx_packets;
+		path->probes++;
+
+		path_probe_t probe = { .type = PATH_PROBE_REQUEST, .id = path->probe_id };
+		fastd_peer_address_t addr = path->address;
+		send_probe(peer, path_sock(peer, path), path_local_address(peer, path), &addr, &probe);
+	}
+}
+
+/**
+   Adjusts the weight of a path in multipath capacity mode
+
+   The weight is reduced multiplicatively when the peer has received significantly fewer packets on the path
+   than have been sent since the last answered probe, and increased additively otherwise, so the share of
+   each path settles just below the rate at which it starts losing packets.
+*/
+static void update_capacity(fastd_path_t *path, uint32_t rx_packets) {
+	if (path->sample_valid && conf.multipath == MULTIPATH_CAPACITY) {
+		uint64_t sent = path->probe_tx_packets - path->sample_tx_packets;
+		uint32_t received = rx_packets - path->sample_rx_packets;
+
+		if (sent >= PATH_CAPACITY_MIN_PACKETS &&
+		    100 * (uint64_t)received < (100 - PATH_CAPACITY_MAX_LOSS_PERCENT) * sent)
+			path->weight = 3 * path->weight / 4;
+		else
+			path->weight++;
+
+		if (path->weight < PATH_WEIGHT_MIN)
+			path->weight = PATH_WEIGHT_MIN;
+		if (path->weight > PATH_WEIGHT_MAX)
+			path->weight = PATH_WEIGHT_MAX;
+	}
+
+	path->sample_tx_packets = path->probe_tx_packets;
+	path->sample_rx_packets = rx_packets;
+	path->sample_valid = true;
+}
+
+/** Updates the measurements of a path after a reply to a probe has been received */
+static void handle_reply(fastd_peer_t *peer, const path_probe_t *probe) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+
+		if (path->probe_id != probe->id)
+			continue;
+
+		int64_t rtt = ctx.now - path->probe_sent;
+
+		path->probe_id = 0;
+		path->unanswered = 0;
+		path->replies++;
+
+		if (path->srtt < 0)
+			path->srtt = rtt;
+		else
+			path->srtt = (7 * path->srtt + rtt) / 8;
+
+		update_loss(path, false);
+
+		if (probe->flags & PATH_PROBE_FLAG_RX_PACKETS)
+			update_capacity(path, be32toh(probe->rx_packets));
+
+		pr_debug2("path to %I of %P: RTT %u ms", &path->address, peer, (unsigned)rtt);
+		return;
+	}
+
+	pr_debug2("received unexpected path probe reply from %P", peer);
+}
+
+/**
+   Handles a received path probe
+
+   Requests are answered on the socket and from the local address they have been received on, so the
+   reply takes the same path in reverse direction. In multipath mode, the reply contains the number of
+   payload packets received on this path.
+*/
+void fastd_path_handle_probe(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer) {
+	fastd_index_header_t header;
+
+	if (buffer->len < sizeof(header) + 1) {
+		pr_debug("received short path probe from %I", remote_addr);
+		goto end_free;
+	}
+
+	fastd_buffer_pull_to(buffer, &header, sizeof(header));
+
+	fastd_peer_t *peer = fastd_peer_index_lookup(fastd_index_header_get(&header));
+	if (!peer || !fastd_peer_is_established(peer) || peer->offload || !peer->remote_index ||
+	    (sock->peer && sock->peer != peer)) {
+		pr_debug2("ignoring path probe from %I", remote_addr);
+		goto end_free;
+	}
+
+	/* Consumes the buffer */
+	fastd_buffer_t *probe_buffer = conf.protocol->decrypt_probe(peer, buffer);
+	if (!probe_buffer) {
+		pr_debug2("verification failed for path probe received from %I", remote_addr);
+		return;
+	}
+
+	path_probe_t probe;
+	bool valid = (probe_buffer->len >= sizeof(probe));
+	if (valid)
+		memcpy(&probe, probe_buffer->data, sizeof(probe));
+
+	fastd_buffer_free(probe_buffer);
+
+	if (!valid) {
+		pr_debug("received invalid path probe from %P", peer);
+		return;
+	}
+
+	switch (probe.type) {
+	case PATH_PROBE_REQUEST: {
+		path_probe_t reply = { .type = PATH_PROBE_REPLY, .id = probe.id };
+
+		const fastd_path_t *path = find_rx_path(peer, sock, local_addr, remote_addr);
+		if (path && fastd_use_multipath()) {
+			reply.flags |= PATH_PROBE_FLAG_RX_PACKETS;
+			reply.rx_packets = htobe32(path->rx_packets);
+		}
+
+		send_probe(peer, sock, local_addr, remote_addr, &reply);
+		break;
+	}
+
+	case PATH_PROBE_REPLY:
+		handle_reply(peer, &probe);
+		break;
+
+	default:
+		pr_debug("received path probe of unknown type from %P", peer);
+	}
+
+	return;
+
+end_free:
+	fastd_buffer_free(buffer);
+}
+
+/** Checks if a packet received on a socket and local address from a remote address has taken a measured path */
+bool fastd_path_is_known(
+	const fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr) {
+	return find_rx_path(peer, sock, local_addr, remote_addr);
+}
+
+/** Accounts a payload packet to the path it has been received on in multipath mode */
+void fastd_path_handle_rx(
+	fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr, size_t len) {
+	if (!fastd_use_multipath())
+		return;
+
+	fastd_path_t *path = find_rx_path(peer, sock, local_addr, remote_addr);
+	if (!path)
+		return;
+
+	path->rx_packets++;
+	path->rx_bytes += len;
+}
+
+/**
+   Adds the path an authenticated payload packet has been received on to the measured paths in multipath mode
+
+   This replaces roaming: the peer's address is not updated, but the new path is used for sending payload
+   packets as soon as it has answered a probe. Learned paths that stop answering probes are forgotten again.
+*/
+void fastd_path_learn(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr) {
+	/* The peer may have been reset while the packet was handled */
+	if (!fastd_peer_may_roam(peer, sock, remote_addr))
+		return;
+
+	peer->roam_timeout = ctx.now + MIN_ROAM_INTERVAL;
+
+	fastd_path_t path = {
+		.address = *remote_addr,
+		.sock = sock,
+		.local_address = *local_addr,
+		.learned = true,
+		.srtt = -1,
+		.weight = PATH_WEIGHT_DEFAULT,
+	};
+
+	if (has_path(peer, &path))
+		return;
+
+	if (VECTOR_LEN(peer->paths) >= PATH_MAX_COUNT) {
+		pr_debug("not learning path to %P at %I as too many paths are measured", peer, remote_addr);
+		return;
+	}
+
+	VECTOR_ADD(peer->paths, path);
+
+	pr_verbose("learned new path to %P at %I", peer, remote_addr);
+}
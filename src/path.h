@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   RTT and loss measurement of the paths to the addresses of a peer's remotes, and multipath sending
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+
+
+/** Returns true if payload packets are striped across all working paths to a peer */
+static inline bool fastd_use_multipath(void) {
+	return conf.multipath != MULTIPATH_OFF;
+}
+
+/** Returns true if the paths to the addresses of a peer's remotes are probed */
+static inline bool fastd_path_use_probes(const fastd_peer_t *peer) {
+	return conf.probe_remotes && (VECTOR_LEN(peer->remotes) || fastd_use_multipath());
+}
+
+
+void fastd_path_probe(fastd_peer_t *peer);
+void fastd_path_handle_probe(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer);
+bool fastd_path_is_known(
+	const fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr);
+void fastd_path_handle_rx(
+	fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr, size_t len);
+void fastd_path_learn(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr);
+void fastd_path_send(fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size);
@@ -11,10 +11,18 @@
 */
 
 #include "peer.h"
+#include "aggregate.h"
+#include "compress.h"
+#include "fec.h"
+#include "mcast.h"
 #include "offload/offload.h"
+#include "pacing.h"
+#include "path.h"
 #include "peer_group.h"
 #include "peer_hashtable.h"
+#include "peer_index.h"
 #include "polling.h"
+#include "txq.h"
 
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -68,7 +76,7 @@ void fastd_peer_set_shell_env(
 	const char *ifname = NULL;
 	uint16_t mtu = 0;
 	if (peer) {
-		if (peer->offload) {
+		if (peer->offload && !peer->offload_pending) {
 			peer->offload->get_iface(peer->offload_state, &ifname, &mtu);
 		} else if (peer->iface) {
 			ifname = peer->iface->name;
@@ -166,8 +174,62 @@ fastd_peer_t *fastd_peer_find_by_id(uint64_t id) {
 		return NULL;
 }
 
+/** Closes and frees a peer's connected socket */
+static void close_connected_socket(fastd_peer_t *peer) {
+	if (!peer->connected_sock)
+		return;
+
+	fastd_socket_close(peer->connected_sock);
+	free(peer->connected_sock);
+	peer->connected_sock = NULL;
+}
+
+/**
+   Opens a socket connected to the peer's current address
+
+   The connected socket shares the port of the peer's bound socket, so the peer sees no difference;
+   sending on it avoids the per-packet route lookup and ancillary data. Peers with dynamic sockets
+   and offloaded peers don't get a connected socket. Failures are not fatal, as packets are sent
+   on the peer's bound socket when there is no connected socket.
+*/
+static void open_connected_socket(fastd_peer_t *peer) {
+	if (!conf.connected_sockets || peer->offload || fastd_peer_is_socket_dynamic(peer))
+		return;
+
+	if (!peer->local_address.sa.sa_family)
+		return;
+
+	if (peer->connected_sock) {
+		if (fastd_peer_address_equal(&peer->local_address, peer->connected_sock->bound_addr) &&
+		    fastd_peer_address_equal(&peer->address, &peer->connected_address))
+			return;
+
+		close_connected_socket(peer);
+	}
+
+	fastd_socket_t *sock = fastd_socket_clone(peer->sock, &peer->local_address);
+	if (!sock) {
+		pr_debug("unable to open connected socket for %P", peer);
+		return;
+	}
+
+	if (!fastd_socket_connect(sock, &peer->address)) {
+		pr_debug_errno("connect");
+		fastd_socket_close(sock);
+		free(sock);
+		return;
+	}
+
+	peer->connected_sock = sock;
+	peer->connected_address = peer->address;
+
+	pr_debug("opened connected socket for %P", peer);
+}
+
 /** Closes and frees a peer's dynamic socket */
 static inline void free_socket(fastd_peer_t *peer) {
+	close_connected_socket(peer);
+
 	if (!peer->sock)
 		return;
 
@@ -231,6 +293,7 @@ void fastd_peer_reset_socket(fastd_peer_t *peer) {
 static void schedule_peer_task(fastd_peer_t *peer) {
 	fastd_timeout_t timeout = fastd_timeout_min(
 		peer->reset_timeout, fastd_timeout_min(peer->keepalive_timeout, peer->next_handshake));
+	timeout = fastd_timeout_min(timeout, peer->next_path_probe);
 
 	if (timeout == FASTD_TIMEOUT_INV) {
 		pr_debug2("Removing scheduled task for %P", peer);
@@ -277,6 +340,18 @@ static inline bool is_group_in(const fastd_peer_group_t *group1, const fastd_pee
 	return false;
 }
 
+/** Closes the offload session of a peer */
+static void free_offload(fastd_peer_t *peer) {
+	if (!peer->offload_pending)
+		on_down(peer, false);
+
+	peer->offload->free_session(peer->offload_state);
+	peer->offload = NULL;
+	peer->offload_state = NULL;
+	peer->offload_pending = false;
+	memset(&peer->offload_counters, 0, sizeof(peer->offload_counters));
+}
+
 /** Checks if a peer lies in a peer group */
 static bool is_peer_in_group(const fastd_peer_t *peer, const fastd_peer_group_t *group) {
 	return is_group_in(peer->group, group);
@@ -310,9 +385,19 @@ static void reset_peer(fastd_peer_t *peer) {
 
 	VECTOR_RESIZE(ctx.eth_addrs, VECTOR_LEN(ctx.eth_addrs) - deleted);
 
+	fastd_mcast_peer_reset(peer);
+
 	fastd_task_unschedule(&peer->task);
 
 	fastd_peer_hashtable_remove(peer);
+	fastd_peer_index_release(peer);
+	peer->remote_index = 0;
+
+	VECTOR_RESIZE(peer->paths, 0);
+	fastd_fec_free(peer);
+	fastd_txq_free(peer);
+	fastd_aggregate_free(peer);
+	fastd_compress_free(peer);
 
 	memset(&peer->stats, 0, sizeof(peer->stats));
 
@@ -320,11 +405,8 @@ static void reset_peer(fastd_peer_t *peer) {
 	peer->local_address.sa.sa_family = AF_UNSPEC;
 	peer->state = STATE_INACTIVE;
 
-	if (peer->offload) {
-		on_down(peer, false);
-		peer->offload->free_session(peer->offload_state);
-		peer->offload = NULL;
-	}
+	if (peer->offload)
+		free_offload(peer);
 
 	if (!conf.iface_persist || peer->config_state == CONFIG_DISABLED || fastd_peer_is_dynamic(peer)) {
 		if (peer->iface && peer->iface->peer) {
@@ -336,6 +418,82 @@ static void reset_peer(fastd_peer_t *peer) {
 	}
 }
 
+/** Checks if handshakes are sent to all addresses of a peer's remotes in parallel */
+static inline bool use_parallel_handshakes(const fastd_peer_t *peer) {
+	return conf.parallel_handshakes && VECTOR_LEN(peer->remotes) && (ctx.sock_default_v4 || ctx.sock_default_v6);
+}
+
+/**
+   Sends handshakes to all resolved addresses of an address family of a peer's remotes
+
+   If \e remote is not NULL, only the addresses of the given remote are contacted. Parallel handshakes
+   are always sent on the default sockets, as a dynamic socket only accepts packets from the peer's
+   current address. Returns the number of handshakes sent.
+*/
+static size_t send_parallel_handshakes(fastd_peer_t *peer, const fastd_remote_t *remote, sa_family_t af) {
+	fastd_socket_t *sock = (af == AF_INET6) ? ctx.sock_default_v6 : ctx.sock_default_v4;
+	if (!sock)
+		return 0;
+
+	size_t i, j, n = 0;
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		const fastd_remote_t *r = &VECTOR_INDEX(peer->remotes, i);
+		if (remote && r != remote)
+			continue;
+
+		for (j = 0; j < r->n_addresses; j++) {
+			const fastd_peer_address_t *addr = &r->addresses[j];
+			if (addr->sa.sa_family != af)
+				continue;
+
+			/* The handshake that completes first claims its address again when establishing */
+			if (!fastd_peer_claim_address(peer, sock, NULL, addr, false))
+				continue;
+
+			conf.protocol->handshake_init(sock, &peer->local_address, addr, peer);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/**
+   Starts a new round of parallel handshakes with a peer
+
+   Handshakes are sent to the IPv6 addresses of all remotes first; the IPv4 addresses follow after
+   PARALLEL_HANDSHAKE_IPV4_DELAY. All hostnames are resolved again, and handshakes are sent to the
+   addresses of a remote as soon as it has been resolved. The first handshake to complete establishes
+   the connection; the handshake replies from the other addresses are ignored as they use the same
+   handshake key.
+*/
+static void start_parallel_handshakes(fastd_peer_t *peer) {
+	if (!fastd_timed_out(peer->last_handshake_timeout)) {
+		pr_debug("not sending handshakes to %P as we sent some a short time ago", peer);
+		return;
+	}
+
+	peer->last_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+	peer->last_handshake_address.sa.sa_family = AF_UNSPEC;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+
+		if (remote->hostname)
+			fastd_resolve_peer(peer, remote);
+	}
+
+	peer->state = STATE_HANDSHAKE;
+
+	if (send_parallel_handshakes(peer, NULL, AF_INET6)) {
+		peer->parallel_ipv4_pending = true;
+		set_next_handshake(peer, PARALLEL_HANDSHAKE_IPV4_DELAY);
+	} else {
+		send_parallel_handshakes(peer, NULL, AF_INET);
+	}
+}
+
 /**
    Starts the first handshake with a newly setup peer
 
@@ -363,8 +521,13 @@ void fastd_peer_handle_resolve(
 	remote->n_addresses = n_addresses;
 	remote->current_address = 0;
 
-	if (peer->state == STATE_RESOLVING)
+	if (peer->state == STATE_RESOLVING) {
 		init_handshake(peer);
+	} else if (peer->state == STATE_HANDSHAKE && use_parallel_handshakes(peer) && fastd_peer_may_connect(peer)) {
+		/* Don't wait for the next round of parallel handshakes */
+		send_parallel_handshakes(peer, remote, AF_INET6);
+		send_parallel_handshakes(peer, remote, AF_INET);
+	}
 }
 
 /** Initializes a peer */
@@ -389,11 +552,16 @@ static void setup_peer(fastd_peer_t *peer) {
 
 	peer->last_handshake_timeout = ctx.now;
 	peer->last_handshake_address.sa.sa_family = AF_UNSPEC;
+	peer->parallel_ipv4_pending = false;
 
 	peer->last_handshake_response_timeout = ctx.now;
 	peer->last_handshake_response_address.sa.sa_family = AF_UNSPEC;
 
 	peer->establish_handshake_timeout = ctx.now;
+	peer->roam_timeout = ctx.now;
+
+	peer->next_path_probe = FASTD_TIMEOUT_INV;
+	peer->path_switch_timeout = ctx.now;
 
 #ifdef WITH_DYNAMIC_PEERS
 	peer->verify_timeout = ctx.now;
@@ -427,7 +595,7 @@ static void setup_peer(fastd_peer_t *peer) {
 	if (next_remote) {
 		next_remote->current_address = 0;
 
-		if (next_remote->hostname) {
+		if (next_remote->hostname && !use_parallel_handshakes(peer)) {
 			peer->state = STATE_RESOLVING;
 			fastd_resolve_peer(peer, next_remote);
 			set_next_handshake_default(peer);
@@ -461,6 +629,9 @@ void fastd_peer_free(fastd_peer_t *peer) {
 	}
 
 	VECTOR_FREE(peer->remotes);
+	VECTOR_FREE(peer->routes);
+	VECTOR_FREE(peer->iface_addresses);
+	VECTOR_FREE(peer->paths);
 
 	free(peer->ifname);
 	free(peer->name);
@@ -477,6 +648,9 @@ static void delete_peer(fastd_peer_t *peer) {
 
 	conf.protocol->free_peer_state(peer);
 
+	for (i = 0; i < VECTOR_LEN(peer->routes); i++)
+		fastd_route_remove(&ctx.routes, &VECTOR_INDEX(peer->routes, i), peer);
+
 	if (peer->iface && peer->iface->peer) {
 		on_down(peer, true);
 		fastd_iface_close(peer->iface);
@@ -648,6 +822,87 @@ bool fastd_peer_claim_address(
 	return true;
 }
 
+/** Checks if an address is statically configured for or currently used by another established peer */
+static bool is_address_taken(const fastd_peer_t *peer, const fastd_peer_address_t *addr) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		const fastd_peer_t *other = VECTOR_INDEX(ctx.peers, i);
+
+		if (other == peer || !fastd_peer_is_enabled(other))
+			continue;
+
+		if (fastd_peer_owns_address(other, addr))
+			return true;
+
+		if (fastd_peer_is_established(other) && fastd_peer_address_equal(&other->address, addr))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+   Checks if the address of an established peer may be updated from a payload packet received from a new address
+
+   The new address must match the peer's remotes (which any address does for floating peers), and the
+   peer's address must not have been updated in the last MIN_ROAM_INTERVAL milliseconds.
+*/
+bool fastd_peer_may_roam(
+	const fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *remote_addr) {
+	if (!fastd_peer_is_established(peer) || peer->offload)
+		return false;
+
+	if (sock->peer && sock->peer != peer)
+		return false;
+
+	if (!fastd_timed_out(peer->roam_timeout))
+		return false;
+
+	return fastd_peer_matches_address(peer, remote_addr);
+}
+
+/**
+   Updates the address of an established peer without a new handshake
+
+   Unlike after a new handshake, the session is kept. The update is refused when the address is in use by another
+   peer, leaving the connection with the peer intact. \e sock and \e local_addr may be NULL to keep the peer's socket
+   and local address.
+*/
+bool fastd_peer_move(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr) {
+	if (is_address_taken(peer, remote_addr)) {
+		pr_debug("not updating the address of %P to %I as it is used by another peer", peer, remote_addr);
+		return false;
+	}
+
+	if (!fastd_peer_claim_address(peer, sock, local_addr, remote_addr, false))
+		return false;
+
+	open_connected_socket(peer);
+
+	return true;
+}
+
+/**
+   Updates the address of an established peer after an authenticated payload packet has been received from a new
+   address
+*/
+void fastd_peer_roam(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr) {
+	/* The peer may have been reset while the packet was handled */
+	if (!fastd_peer_may_roam(peer, sock, remote_addr))
+		return;
+
+	peer->roam_timeout = ctx.now + MIN_ROAM_INTERVAL;
+
+	fastd_peer_address_t old_addr = peer->address;
+
+	if (fastd_peer_move(peer, sock, local_addr, remote_addr))
+		pr_verbose("%P has moved from %I to %I", peer, &old_addr, remote_addr);
+}
+
 /** Resets and re-initializes a peer */
 void fastd_peer_reset(fastd_peer_t *peer) {
 	if (peer->state != STATE_INACTIVE) {
@@ -721,9 +976,40 @@ static inline bool peer_configs_equal(const fastd_peer_t *peer1, const fastd_pee
 			return false;
 	}
 
+	if (VECTOR_LEN(peer1->routes) != VECTOR_LEN(peer2->routes))
+		return false;
+
+	for (i = 0; i < VECTOR_LEN(peer1->routes); i++) {
+		if (!fastd_prefix_equal(&VECTOR_INDEX(peer1->routes, i), &VECTOR_INDEX(peer2->routes, i)))
+			return false;
+	}
+
+	if (VECTOR_LEN(peer1->iface_addresses) != VECTOR_LEN(peer2->iface_addresses))
+		return false;
+
+	for (i = 0; i < VECTOR_LEN(peer1->iface_addresses); i++) {
+		if (!fastd_prefix_equal(
+			    &VECTOR_INDEX(peer1->iface_addresses, i), &VECTOR_INDEX(peer2->iface_addresses, i)))
+			return false;
+	}
+
 	return true;
 }
 
+/** Adds the configured routes of a peer to the routing table */
+static void add_routes(fastd_peer_t *peer) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->routes); i++) {
+		const fastd_prefix_t *prefix = &VECTOR_INDEX(peer->routes, i);
+
+		if (!fastd_route_add(&ctx.routes, prefix, peer)) {
+			char buf[FASTD_PREFIX_STRLEN];
+			pr_warn("route %s of peer %P is already used by another peer, ignoring",
+				fastd_prefix_format(buf, prefix), peer);
+		}
+	}
+}
+
 /** Adds a new peer */
 bool fastd_peer_add(fastd_peer_t *peer) {
 	if (!peer->key) {
@@ -779,6 +1065,8 @@ bool fastd_peer_add(fastd_peer_t *peer) {
 
 	conf.protocol->init_peer_state(peer);
 
+	add_routes(peer);
+
 	if (fastd_peer_is_dynamic(peer) || peer->config_source_dir)
 		pr_verbose("adding peer %P", peer);
 
@@ -827,20 +1115,18 @@ static void send_handshake(fastd_peer_t *peer, fastd_remote_t *next_remote) {
 }
 
 /** Marks a peer as established */
-bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offload) {
+bool fastd_peer_set_established(
+	fastd_peer_t *peer, const fastd_offload_t *offload, const fastd_offload_keys_t *keys) {
 	if (peer->offload) {
 		bool need_reset;
 
 		if (peer->offload == offload)
-			need_reset = !peer->offload->update_session(peer, peer->offload_state);
+			need_reset = !peer->offload->update_session(peer, peer->offload_state, keys);
 		else
 			need_reset = true;
 
-		if (need_reset) {
-			on_down(peer, false);
-			peer->offload->free_session(peer->offload_state);
-			peer->offload = NULL;
-		}
+		if (need_reset)
+			free_offload(peer);
 	}
 
 	if (offload && !peer->offload) {
@@ -848,14 +1134,17 @@ bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offlo
 			on_down(peer, false);
 			fastd_iface_close(peer->iface);
 		}
-		peer->iface = NULL;
 
-		peer->offload_state = offload->init_session(peer);
+		/* The shared interface is still used to receive packets from offloaded peers */
+		if (!fastd_use_shared_iface())
+			peer->iface = NULL;
+
+		peer->offload_state = offload->init_session(peer, keys);
 		if (!peer->offload_state)
 			return false;
 
 		peer->offload = offload;
-		on_up(peer, false);
+		peer->offload_pending = true;
 	}
 
 	if (!peer->iface && !peer->offload) {
@@ -866,6 +1155,13 @@ bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offlo
 		on_up(peer, false);
 	}
 
+	if (peer->offload)
+		close_connected_socket(peer);
+	else
+		open_connected_socket(peer);
+
+	peer->parallel_ipv4_pending = false;
+
 	if (fastd_peer_is_established(peer))
 		return true;
 
@@ -873,6 +1169,10 @@ bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offlo
 	peer->established = ctx.now;
 	fastd_peer_seen(peer);
 	fastd_peer_clear_keepalive(peer);
+	fastd_pacing_init(peer);
+
+	if (fastd_path_use_probes(peer))
+		peer->next_path_probe = ctx.now + PATH_PROBE_INTERVAL;
 
 	schedule_peer_task(peer);
 
@@ -882,6 +1182,64 @@ bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offlo
 	return true;
 }
 
+/**
+   Finishes the setup of a peer's offload session
+
+   Called by the offload provider when a session started by its \e init_session
+   has become usable (and the peer's traffic is now handled by the kernel), or
+   when the setup has failed, in which case the peer is reset.
+*/
+void fastd_peer_offload_ready(fastd_peer_t *peer, bool success) {
+	if (!peer->offload || !peer->offload_pending)
+		exit_bug("offload setup finished for peer without pending offload session");
+
+	if (!success) {
+		fastd_peer_reset(peer);
+		return;
+	}
+
+	peer->offload_pending = false;
+	on_up(peer, false);
+}
+
+/**
+   Notifies the offload provider that the peer has started using the newest session
+
+   Called by the protocol when the first packet of a new session has been
+   received, allowing the provider to switch to the new keys for sending.
+*/
+void fastd_peer_offload_confirm(fastd_peer_t *peer) {
+	if (peer->offload && peer->offload->confirm_session)
+		peer->offload->confirm_session(peer->offload_state);
+}
+
+/** Returns the increase of a kernel counter since it was last seen, handling counter resets */
+static inline uint64_t counter_delta(uint64_t cur, uint64_t prev) {
+	return (cur >= prev) ? (cur - prev) : cur;
+}
+
+/**
+   Merges the kernel counters of a peer's offload session into its statistics
+
+   Called by the offload provider with the cumulative counters of the session;
+   only the increase since the previous call is added to the peer's and the
+   global statistics.
+*/
+void fastd_peer_offload_counters(fastd_peer_t *peer, const fastd_offload_counters_t *counters) {
+	const fastd_offload_counters_t *prev = &peer->offload_counters;
+
+	fastd_stats_add_n(
+		peer, STAT_RX, counter_delta(counters->rx_packets, prev->rx_packets),
+		counter_delta(counters->rx_bytes, prev->rx_bytes));
+	fastd_stats_add_n(
+		peer, STAT_TX, counter_delta(counters->tx_packets, prev->tx_packets),
+		counter_delta(counters->tx_bytes, prev->tx_bytes));
+	fastd_stats_add_n(peer, STAT_TX_DROPPED, counter_delta(counters->tx_dropped, prev->tx_dropped), 0);
+	fastd_stats_add_n(peer, STAT_TX_ERROR, counter_delta(counters->tx_errors, prev->tx_errors), 0);
+
+	peer->offload_counters = *counters;
+}
+
 /** Compares two MAC addresses */
 static inline int eth_addr_cmp(const fastd_eth_addr_t *addr1, const fastd_eth_addr_t *addr2) {
 	return memcmp(addr1->data, addr2->data, sizeof(fastd_eth_addr_t));
@@ -937,6 +1295,9 @@ bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **pee
 
 /** Sends a handshake to one peer, if a scheduled handshake is due */
 static void handle_task_handshake(fastd_peer_t *peer) {
+	bool ipv4_pending = peer->parallel_ipv4_pending;
+	peer->parallel_ipv4_pending = false;
+
 	set_next_handshake_default(peer);
 
 	if (!fastd_peer_may_connect(peer)) {
@@ -948,6 +1309,24 @@ static void handle_task_handshake(fastd_peer_t *peer) {
 		return;
 	}
 
+	if (use_parallel_handshakes(peer)) {
+		if (peer->next_remote < 0)
+			peer->next_remote = 0;
+
+		if (ipv4_pending) {
+			/* A connection may have been established by one of the IPv6 handshakes */
+			if (!fastd_peer_is_established(peer))
+				send_parallel_handshakes(peer, NULL, AF_INET);
+
+			return;
+		}
+
+		if (!fastd_peer_is_established(peer)) {
+			start_parallel_handshakes(peer);
+			return;
+		}
+	}
+
 	fastd_remote_t *next_remote = fastd_peer_get_next_remote(peer);
 
 	if (next_remote || fastd_peer_is_established(peer)) {
@@ -979,6 +1358,7 @@ static void handle_task_handshake(fastd_peer_t *peer) {
 
    \li If no data was received from the peer for some time, it is reset.
    \li If no data was sent to the peer for some time, a keepalive is sent.
+   \li If the paths to the peer's remotes are measured, probes are sent periodically.
  */
 void fastd_peer_handle_task(fastd_task_t *task) {
 	fastd_peer_t *peer = container_of(task, fastd_peer_t, task);
@@ -1003,6 +1383,9 @@ void fastd_peer_handle_task(fastd_task_t *task) {
 	if (fastd_timed_out(peer->next_handshake))
 		handle_task_handshake(peer);
 
+	if (fastd_timed_out(peer->next_path_probe))
+		fastd_path_probe(peer);
+
 	schedule_peer_task(peer);
 }
 
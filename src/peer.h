@@ -14,6 +14,7 @@
 #pragma once
 
 #include "fastd.h"
+#include "offload/offload.h"
 
 
 /** The state of a peer */
@@ -36,6 +37,25 @@ typedef enum fastd_peer_config_state {
 #endif
 } fastd_peer_config_state_t;
 
+/** A packet rate limit */
+struct fastd_rate_limit {
+	uint32_t rate;  /**< The sustained rate in packets per second; 0 for no limit */
+	uint32_t burst; /**< The number of packets that may be sent in a burst */
+};
+
+/** The state of a token bucket rate limiter */
+struct fastd_token_bucket {
+	int64_t tokens;       /**< The available tokens (in thousandths of a packet) */
+	fastd_timeout_t last; /**< The time the bucket was last refilled */
+};
+
+/** A transmit pacing rate */
+struct fastd_pacing_rate {
+	uint64_t rate;  /**< The rate in bytes per second; 0 for no pacing */
+	uint32_t burst; /**< The number of bytes that may be sent back-to-back after an idle period */
+	bool kernel;    /**< Specifies if the packets should be paced by the kernel (using SO_TXTIME) */
+};
+
 /** A peer's configuration and state */
 struct fastd_peer {
 	/* The following fields are more or less static configuration: */
@@ -57,20 +77,40 @@ struct fastd_peer {
 	char *ifname; /**< Peer-specific interface name */
 	uint16_t mtu; /**< Peer-specific interface MTU */
 
+	VECTOR(fastd_prefix_t) routes;          /**< The prefixes routed to the peer */
+	VECTOR(fastd_prefix_t) iface_addresses; /**< Addresses configured on the peer-specific interface */
+
 	/* Starting here, more dynamic fields follow: */
 
 	fastd_iface_t *iface; /**< The interface this peer is associated with */
 	/** The socket used by the peer. This can either be a common bound socket or a
 	    dynamic, unbound socket that is used exclusively by this peer */
 	fastd_socket_t *sock;
+	/** A socket connected to the peer's address, sharing the port of \e sock (or NULL) */
+	fastd_socket_t *connected_sock;
+	/** The address \e connected_sock is connected to */
+	fastd_peer_address_t connected_address;
 	const fastd_offload_t *offload;       /**< Datapath kernel offloading provider */
 	fastd_offload_state_t *offload_state; /**< Datapath kernel offloading - provider-specific state */
+	bool offload_pending;                 /**< The offload session is still being set up */
 	fastd_peer_address_t local_address;   /**< The local address used to communicate with this peer */
 	fastd_peer_address_t address;         /**< The peers current address */
+	uint32_t local_index;                 /**< The session index assigned to the peer locally (or 0) */
+	uint32_t remote_index;                /**< The index the peer wants payload packets prefixed with (or 0) */
 
 	fastd_peer_address_t last_handshake_address;          /**< The address the last handshake was sent to */
 	fastd_peer_address_t last_handshake_response_address; /**< The address the last handshake was received from */
 	ssize_t next_remote;                                  /**< An index into the field remotes or -1 */
+	bool parallel_ipv4_pending; /**< The IPv4 handshakes of the current parallel handshake round are still due */
+
+	VECTOR(fastd_path_t) paths;          /**< The measured paths to the peer's addresses */
+	fastd_timeout_t next_path_probe;     /**< The time of the next round of path probes */
+	fastd_timeout_t path_switch_timeout; /**< The connection isn't moved to a better path until this timeout */
+
+	fastd_fec_t *fec; /**< The FEC state if forward error correction has been negotiated with the peer (or NULL) */
+
+	fastd_aggregate_t *aggregate; /**< The aggregation state if packet aggregation has been negotiated (or NULL) */
+	fastd_compress_t *compress;   /**< The compression state if payload compression has been negotiated (or NULL) */
 
 	fastd_peer_state_t state; /**< The peer's state */
 
@@ -83,12 +123,25 @@ struct fastd_peer {
 							    until this timeout has occured */
 	fastd_timeout_t establish_handshake_timeout; /**< A timeout during which all handshakes for this peer will be
 							ignored after a new connection has been established */
+	fastd_timeout_t roam_timeout; /**< The peer's address isn't updated from payload packets until this timeout */
 	int64_t established;                         /**< The time this peer connection has been established */
 
 	fastd_timeout_t reset_timeout;     /**< The timeout after which the peer is reset */
 	fastd_timeout_t keepalive_timeout; /**< The timeout after which a keepalive is sent to the peer */
 
 	fastd_stats_t stats; /**< Traffic statistics */
+	/** Kernel counters of the offload session that have already been merged into \e stats */
+	fastd_offload_counters_t offload_counters;
+
+	fastd_token_bucket_t broadcast_bucket; /**< Rate limiter state for broadcast frames received from the peer */
+	fastd_token_bucket_t multicast_bucket; /**< Rate limiter state for multicast frames received from the peer */
+
+	int64_t pacing_next; /**< The earliest departure time of the next packet sent to the peer (in nanoseconds) */
+	bool pacing_kernel;  /**< Specifies if the packets sent to the peer are paced by the kernel */
+	fastd_txq_t *txq;    /**< The peer's transmit queue (if transmit queues are enabled and packets have been sent) */
+
+	fastd_timeout_t
+		mcast_router_timeout[MCAST_AF_MAX]; /**< Timeouts after which the peer stops being a multicast router port */
 
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_timeout_t verify_timeout; /**< Specifies the minimum time after which on-verify may be run again */
@@ -117,6 +170,39 @@ struct fastd_remote {
 	fastd_timeout_t last_resolve_timeout; /**< Timeout before the remote must not be resolved again */
 };
 
+/** The measurements and statistics of a path to an address of a peer */
+struct fastd_path {
+	fastd_peer_address_t address; /**< The remote address */
+	/** The socket used for the path, or NULL if the peer's socket and local address are used */
+	fastd_socket_t *sock;
+	/** The local address used with \e sock (AF_UNSPEC to let the kernel choose) */
+	fastd_peer_address_t local_address;
+	bool learned; /**< Specifies if the path has been learned from payload packets received from the peer */
+
+	uint32_t probe_id;  /**< The ID of the last probe if it is still unanswered (or 0) */
+	int64_t probe_sent; /**< The time the last probe was sent */
+	uint8_t unanswered; /**< The number of consecutive probes that have not been answered */
+
+	uint64_t probes;  /**< The number of probes sent */
+	uint64_t replies; /**< The number of replies received */
+
+	int64_t srtt;  /**< The smoothed round-trip time in milliseconds (or -1 if unknown) */
+	uint16_t loss; /**< The smoothed probe loss rate (in units of 1/256) */
+
+	uint32_t weight; /**< The share of payload packets sent on the path in multipath mode */
+	int64_t credit;  /**< The state of the weighted round-robin scheduler */
+
+	uint64_t tx_packets; /**< The number of payload packets sent on the path in multipath mode */
+	uint64_t tx_bytes;   /**< The number of bytes sent on the path in multipath mode */
+	uint64_t rx_packets; /**< The number of payload packets received on the path in multipath mode */
+	uint64_t rx_bytes;   /**< The number of bytes received on the path in multipath mode */
+
+	uint64_t probe_tx_packets;  /**< The value of \e tx_packets when the last probe was sent */
+	uint64_t sample_tx_packets; /**< The value of \e tx_packets when the last answered probe was sent */
+	uint32_t sample_rx_packets; /**< The number of packets the peer had received when answering the last probe */
+	bool sample_valid;          /**< Specifies if \e sample_tx_packets and \e sample_rx_packets are set */
+};
+
 
 bool fastd_peer_address_equal(const fastd_peer_address_t *addr1, const fastd_peer_address_t *addr2);
 void fastd_peer_address_simplify(fastd_peer_address_t *addr);
@@ -126,7 +212,11 @@ bool fastd_peer_add(fastd_peer_t *peer);
 void fastd_peer_reset(fastd_peer_t *peer);
 void fastd_peer_delete(fastd_peer_t *peer);
 void fastd_peer_free(fastd_peer_t *peer);
-bool fastd_peer_set_established(fastd_peer_t *peer, const fastd_offload_t *offload);
+bool fastd_peer_set_established(
+	fastd_peer_t *peer, const fastd_offload_t *offload, const fastd_offload_keys_t *keys);
+void fastd_peer_offload_ready(fastd_peer_t *peer, bool success);
+void fastd_peer_offload_confirm(fastd_peer_t *peer);
+void fastd_peer_offload_counters(fastd_peer_t *peer, const fastd_offload_counters_t *counters);
 bool fastd_peer_may_connect(fastd_peer_t *peer);
 void fastd_peer_handle_resolve(
 	fastd_peer_t *peer, fastd_remote_t *remote, size_t n_addresses, const fastd_peer_address_t *addresses);
@@ -135,6 +225,14 @@ bool fastd_peer_matches_address(const fastd_peer_t *peer, const fastd_peer_addre
 bool fastd_peer_claim_address(
 	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *remote_addr, bool force);
+bool fastd_peer_may_roam(
+	const fastd_peer_t *peer, const fastd_socket_t *sock, const fastd_peer_address_t *remote_addr);
+bool fastd_peer_move(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr);
+void fastd_peer_roam(
+	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr);
 void fastd_peer_reset_socket(fastd_peer_t *peer);
 void fastd_peer_schedule_handshake(fastd_peer_t *peer, int delay);
 fastd_peer_t *fastd_peer_find_by_id(uint64_t id);
@@ -269,7 +367,7 @@ static inline bool fastd_peer_is_socket_dynamic(const fastd_peer_t *peer) {
 
 /** Returns the MTU to use for a peer */
 static inline uint16_t fastd_peer_get_mtu(const fastd_peer_t *peer) {
-	if (conf.mode == MODE_TAP)
+	if (fastd_use_shared_iface())
 		return conf.mtu;
 
 	if (peer && peer->mtu)
@@ -278,12 +376,64 @@ static inline uint16_t fastd_peer_get_mtu(const fastd_peer_t *peer) {
 	return conf.mtu;
 }
 
+/**
+   Takes a packet from a token bucket
+
+   Returns false if the packet exceeds the limit. A bucket that hasn't been used
+   before starts out full.
+*/
+static inline bool fastd_token_bucket_take(fastd_token_bucket_t *bucket, const fastd_rate_limit_t *limit) {
+	if (!limit || !limit->rate)
+		return true;
+
+	/* Tokens are added at a rate of limit->rate thousandths of a packet per millisecond */
+	int64_t capacity = 1000 * (int64_t)limit->burst, elapsed = ctx.now - bucket->last;
+
+	if (elapsed < capacity)
+		bucket->tokens += elapsed * limit->rate;
+
+	if (elapsed >= capacity || bucket->tokens > capacity)
+		bucket->tokens = capacity;
+
+	bucket->last = ctx.now;
+
+	if (bucket->tokens < 1000)
+		return false;
+
+	bucket->tokens -= 1000;
+	return true;
+}
+
 /** Checks if a MAC address is a normal unicast address */
 static inline bool fastd_eth_addr_is_unicast(fastd_eth_addr_t addr) {
 	return ((addr.data[0] & 1) == 0);
 }
 
-/** Adds statistics for a single packet of a given size */
+/** Checks if traffic statistics are collected (i.e. the status socket is enabled) */
+static inline bool fastd_stats_enabled(void) {
+#ifdef WITH_STATUS_SOCKET
+	return conf.status_socket;
+#else
+	return false;
+#endif
+}
+
+/** Adds statistics for a number of packets of a given total size (\e peer may be NULL) */
+static inline void fastd_stats_add_n(
+	UNUSED fastd_peer_t *peer, UNUSED fastd_stat_type_t stat, UNUSED uint64_t packets, UNUSED uint64_t bytes) {
+#ifdef WITH_STATUS_SOCKET
+	ctx.stats.packets[stat] += packets;
+	ctx.stats.bytes[stat] += bytes;
+
+	if (!peer)
+		return;
+
+	peer->stats.packets[stat] += packets;
+	peer->stats.bytes[stat] += bytes;
+#endif
+}
+
+/** Adds statistics for a single packet of a given size (\e peer may be NULL for packets from the local interface) */
 static inline void fastd_stats_add(UNUSED fastd_peer_t *peer, UNUSED fastd_stat_type_t stat, UNUSED size_t bytes) {
 #ifdef WITH_STATUS_SOCKET
 	if (!bytes)
@@ -292,6 +442,9 @@ static inline void fastd_stats_add(UNUSED fastd_peer_t *peer, UNUSED fastd_stat_
 	ctx.stats.packets[stat]++;
 	ctx.stats.bytes[stat] += bytes;
 
+	if (!peer)
+		return;
+
 	peer->stats.packets[stat]++;
 	peer->stats.bytes[stat] += bytes;
 #endif
@@ -32,6 +32,13 @@ struct fastd_peer_group {
 	int max_connections;           /**< The maximum number of connections to allow in this group; -1 for no limit */
 	fastd_string_stack_t *methods; /**< The list of configured method names */
 
+	fastd_rate_limit_t *broadcast_limit; /**< The limit for broadcast frames received from each peer (TAP mode) */
+	fastd_rate_limit_t *multicast_limit; /**< The limit for multicast frames received from each peer (TAP mode) */
+
+	fastd_pacing_rate_t *pacing; /**< The transmit pacing rate of each peer */
+
+	fastd_tos_copy_t copy_tos; /**< The fields of the inner IP header that are copied to the outer header */
+
 	fastd_shell_command_t on_up;   /**< The command to execute after the initialization of the tunnel interface */
 	fastd_shell_command_t on_down; /**< The command to execute before the destruction of the tunnel interface */
 	fastd_shell_command_t
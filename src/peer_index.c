@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   A table allowing fast lookup from a session index to a peer
+
+   Each peer gets a random local session index when the first handshake carrying it
+   is sent. The index is announced to the peer in the handshake, which prefixes its
+   payload packets with it, so received packets can be matched to a peer with a single
+   array access instead of a hashtable lookup of the source address.
+
+   Assigned indices must not change while the table is resized, so the table only ever
+   grows and entries keep their slots. Index 0 is never assigned.
+*/
+
+
+#include "peer_index.h"
+
+
+/** Frees the resources used by the session index table */
+void fastd_peer_index_free(void) {
+	free(ctx.peer_index);
+	ctx.peer_index = NULL;
+	ctx.peer_index_size = 0;
+	ctx.peer_index_used = 0;
+}
+
+/** Doubles the size of the session index table, keeping all entries at their slots */
+static void grow_table(void) {
+	size_t old_size = ctx.peer_index_size;
+
+	if (!old_size)
+		ctx.peer_index_size = PEER_INDEX_MIN_SIZE;
+	else
+		ctx.peer_index_size = 2 * old_size;
+
+	ctx.peer_index = fastd_realloc_array(ctx.peer_index, ctx.peer_index_size, sizeof(*ctx.peer_index));
+	memset(&ctx.peer_index[old_size], 0, (ctx.peer_index_size - old_size) * sizeof(*ctx.peer_index));
+
+	pr_debug("resizing session index table to %u slots", (unsigned)ctx.peer_index_size);
+}
+
+/**
+   Returns the local session index of a peer, assigning a new random index if the peer doesn't have one yet
+
+   The index stays assigned until fastd_peer_index_release() is called when the connection with the peer is
+   reset. Returns 0 if no index could be assigned.
+*/
+uint32_t fastd_peer_index_assign(fastd_peer_t *peer) {
+	if (peer->local_index)
+		return peer->local_index;
+
+	/* Keep the table at most half full, so a random probe finds a free slot quickly */
+	if (2 * (ctx.peer_index_used + 1) > ctx.peer_index_size) {
+		if (ctx.peer_index_size >= PEER_INDEX_MAX_SIZE)
+			return 0;
+
+		grow_table();
+	}
+
+	uint32_t index = fastd_rand(1, ctx.peer_index_size);
+	while (ctx.peer_index[index]) {
+		index++;
+		if (index == ctx.peer_index_size)
+			index = 1;
+	}
+
+	ctx.peer_index[index] = peer;
+	ctx.peer_index_used++;
+
+	peer->local_index = index;
+	return index;
+}
+
+/** Releases the local session index of a peer */
+void fastd_peer_index_release(fastd_peer_t *peer) {
+	if (!peer->local_index)
+		return;
+
+	if (ctx.peer_index[peer->local_index] != peer)
+		exit_bug("session index table corrupted");
+
+	ctx.peer_index[peer->local_index] = NULL;
+	ctx.peer_index_used--;
+
+	peer->local_index = 0;
+}
+
+/** Looks up the peer a session index has been assigned to */
+fastd_peer_t *fastd_peer_index_lookup(uint32_t index) {
+	if (index >= ctx.peer_index_size)
+		return NULL;
+
+	return ctx.peer_index[index];
+}
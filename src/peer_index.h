@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   A table allowing fast lookup from a session index to a peer
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+
+
+/** Returns true if session indices are negotiated and accepted in received payload packets */
+static inline bool fastd_use_packet_index(void) {
+	return conf.packet_index;
+}
+
+/** Builds the header of an indexed payload packet or path probe */
+static inline fastd_index_header_t fastd_index_header(uint8_t packet_type, uint32_t index) {
+	return (fastd_index_header_t){
+		.packet_type = packet_type,
+		.index = { index >> 16, index >> 8, index },
+	};
+}
+
+/** Returns the session index of an indexed payload packet or path probe header */
+static inline uint32_t fastd_index_header_get(const fastd_index_header_t *header) {
+	return (uint32_t)header->index[0] << 16 | (uint32_t)header->index[1] << 8 | header->index[2];
+}
+
+/**
+   Prefixes an encrypted payload packet or path probe with the session index assigned by the receiver
+
+   Consumes the passed buffer.
+*/
+static inline fastd_buffer_t *fastd_index_header_push(fastd_buffer_t *buffer, uint8_t packet_type, uint32_t index) {
+	if (fastd_buffer_headroom(buffer) < sizeof(fastd_index_header_t)) {
+		fastd_buffer_t *new_buffer = fastd_buffer_dup(buffer, sizeof(fastd_index_header_t));
+		fastd_buffer_free(buffer);
+		buffer = new_buffer;
+	}
+
+	fastd_index_header_t header = fastd_index_header(packet_type, index);
+	fastd_buffer_push_from(buffer, &header, sizeof(header));
+
+	return buffer;
+}
+
+
+void fastd_peer_index_free(void);
+
+uint32_t fastd_peer_index_assign(fastd_peer_t *peer);
+void fastd_peer_index_release(fastd_peer_t *peer);
+fastd_peer_t *fastd_peer_index_lookup(uint32_t index);
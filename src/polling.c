@@ -14,6 +14,10 @@
 #include "polling.h"
 #include "async.h"
 #include "peer.h"
+#include "txq.h"
+#include "offload/esp/esp.h"
+#include "offload/gue/gue.h"
+#include "offload/l2tp/l2tp.h"
 
 #include <signal.h>
 
@@ -47,7 +51,7 @@ static inline int task_timeout(void) {
 
 
 /** Handles a file descriptor that was selected on */
-static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
+static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool output, bool error) {
 	switch (fd->type) {
 	case POLL_TYPE_ASYNC:
 		if (input)
@@ -76,12 +80,30 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 			error = false;
 		}
 
+		if (output)
+			fastd_txq_handle_writable(sock);
+
 		if (input)
 			fastd_receive(sock);
 
 		break;
 	}
 
+	case POLL_TYPE_OFFLOAD_L2TP:
+		if (input)
+			fastd_offload_l2tp_handle();
+		break;
+
+	case POLL_TYPE_OFFLOAD_GUE:
+		if (input)
+			fastd_offload_gue_handle();
+		break;
+
+	case POLL_TYPE_OFFLOAD_ESP:
+		if (input)
+			fastd_offload_esp_handle();
+		break;
+
 	default:
 		exit_bug("unknown FD type");
 	}
@@ -137,6 +159,21 @@ bool fastd_poll_fd_close(fastd_poll_fd_t *fd) {
 	return (close(fd->fd) == 0);
 }
 
+void fastd_poll_fd_set_output(fastd_poll_fd_t *fd, bool output) {
+	if (fd->output == output)
+		return;
+
+	fd->output = output;
+
+	struct epoll_event event = {
+		.events = EPOLLIN | (output ? EPOLLOUT : 0),
+		.data.ptr = fd,
+	};
+
+	if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_MOD, fd->fd, &event) < 0)
+		exit_errno("epoll_ctl");
+}
+
 
 void fastd_poll_handle(void) {
 	int timeout = task_timeout();
@@ -153,7 +190,9 @@ void fastd_poll_handle(void) {
 
 	size_t i;
 	for (i = 0; i < (size_t)ret; i++)
-		handle_fd(events[i].data.ptr, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+		handle_fd(
+			events[i].data.ptr, events[i].events & EPOLLIN, events[i].events & EPOLLOUT,
+			events[i].events & (EPOLLERR | EPOLLHUP));
 }
 
 #else
@@ -189,6 +228,15 @@ bool fastd_poll_fd_close(fastd_poll_fd_t *fd) {
 	return (close(fd->fd) == 0);
 }
 
+void fastd_poll_fd_set_output(fastd_poll_fd_t *fd, bool output) {
+	if (fd->output == output)
+		return;
+
+	fd->output = output;
+
+	VECTOR_RESIZE(ctx.pollfds, 0);
+}
+
 
 void fastd_poll_handle(void) {
 	size_t i;
@@ -203,7 +251,7 @@ void fastd_poll_handle(void) {
 
 			struct pollfd pollfd = {
 				.fd = fd->fd,
-				.events = POLLIN,
+				.events = POLLIN | (fd->output ? POLLOUT : 0),
 				.revents = 0,
 			};
 			VECTOR_ADD(ctx.pollfds, pollfd);
@@ -218,8 +266,9 @@ void fastd_poll_handle(void) {
 
 #ifdef USE_SELECT
 	/* Inefficient implementation for OSX... */
-	fd_set readfds;
+	fd_set readfds, writefds;
 	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
 	int maxfd = -1;
 
 	for (i = 0; i < VECTOR_LEN(ctx.pollfds); i++) {
@@ -227,6 +276,9 @@ void fastd_poll_handle(void) {
 		if (pollfd->fd >= 0) {
 			FD_SET(pollfd->fd, &readfds);
 
+			if (pollfd->events & POLLOUT)
+				FD_SET(pollfd->fd, &writefds);
+
 			if (pollfd->fd > maxfd)
 				maxfd = pollfd->fd;
 		}
@@ -241,7 +293,7 @@ void fastd_poll_handle(void) {
 			tv.tv_sec = timeout / 1000;
 			tv.tv_usec = (timeout % 1000) * 1000;
 		}
-		ret = select(maxfd + 1, &readfds, NULL, &errfds, tvp);
+		ret = select(maxfd + 1, &readfds, &writefds, &errfds, tvp);
 		if (ret < 0 && errno != EINTR)
 			exit_errno("select");
 	}
@@ -258,6 +310,8 @@ void fastd_poll_handle(void) {
 
 			if (FD_ISSET(pollfd->fd, &readfds))
 				pollfd->revents |= POLLIN;
+			if (FD_ISSET(pollfd->fd, &writefds))
+				pollfd->revents |= POLLOUT;
 			if (FD_ISSET(pollfd->fd, &errfds))
 				pollfd->revents |= POLLERR;
 
@@ -285,7 +339,7 @@ void fastd_poll_handle(void) {
 			ret--;
 
 		handle_fd(
-			VECTOR_INDEX(ctx.fds, pollfd->fd), pollfd->revents & POLLIN,
+			VECTOR_INDEX(ctx.fds, pollfd->fd), pollfd->revents & POLLIN, pollfd->revents & POLLOUT,
 			pollfd->revents & (POLLERR | POLLHUP | POLLNVAL));
 	}
 }
@@ -21,6 +21,7 @@
 struct fastd_poll_fd {
 	fastd_poll_type_t type; /**< What the file descriptor is used for */
 	int fd;                 /**< The file descriptor itself */
+	bool output;            /**< Specifies if the file descriptor is also polled for writability */
 };
 
 
@@ -30,12 +31,14 @@ void fastd_poll_init(void);
 void fastd_poll_free(void);
 
 /** Returns a fastd_poll_fd_t structure */
-#define FASTD_POLL_FD(type, fd) ((fastd_poll_fd_t){ type, fd })
+#define FASTD_POLL_FD(type, fd) ((fastd_poll_fd_t){ type, fd, false })
 
 /** Registers a new file descriptor to poll on */
 void fastd_poll_fd_register(fastd_poll_fd_t *fd);
 /** Unregisters and closes a file descriptor */
 bool fastd_poll_fd_close(fastd_poll_fd_t *fd);
+/** Enables or disables polling a registered file descriptor for writability */
+void fastd_poll_fd_set_output(fastd_poll_fd_t *fd, bool output);
 
 /** Waits for the next input event */
 void fastd_poll_handle(void);
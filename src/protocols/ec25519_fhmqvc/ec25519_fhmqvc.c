@@ -12,6 +12,11 @@
 
 
 #include "ec25519_fhmqvc.h"
+#include "../../compress.h"
+#include "../../fec.h"
+#include "../../path.h"
+#include "../../tos.h"
+#include "../../peer_index.h"
 
 
 /** Converts a private or public key from a hexadecimal string representation to a uint8 array */
@@ -105,23 +110,24 @@ static inline bool use_old_session(const fastd_protocol_peer_state_t *state) {
 	return true;
 }
 
-/** Handles a payload packet received from a peer */
-static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+/** Handles a payload packet received from a peer, returning true if it has been authenticated */
+static bool protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer, uint8_t tos, bool *reordered) {
+	*reordered = false;
+
 	if (!peer->protocol_state || !check_session(peer))
 		goto fail;
 
 	fastd_buffer_t *recv_buffer = NULL;
-	bool reordered = false;
 
 	fastd_buffer_zero_pad(buffer);
 
 	if (is_session_valid(&peer->protocol_state->old_session))
 		recv_buffer = peer->protocol_state->old_session.method->provider->decrypt(
-			peer->protocol_state->old_session.method_state, buffer, &reordered);
+			peer->protocol_state->old_session.method_state, buffer, reordered);
 
 	if (!recv_buffer) {
 		recv_buffer = peer->protocol_state->session.method->provider->decrypt(
-			peer->protocol_state->session.method_state, buffer, &reordered);
+			peer->protocol_state->session.method_state, buffer, reordered);
 		if (!recv_buffer) {
 			pr_debug2("verification failed for packet received from %P", peer);
 			goto fail;
@@ -129,9 +135,10 @@ static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer) {
 
 		if (peer->protocol_state->old_session.method) {
 			pr_debug("invalidating old session with %P", peer);
-			peer->protocol_state->old_session.method->provider->session_free(
-				peer->protocol_state->old_session.method_state);
+			free_session_state(&peer->protocol_state->old_session);
 			peer->protocol_state->old_session = (protocol_session_t){};
+
+			fastd_peer_offload_confirm(peer);
 		}
 
 		if (!peer->protocol_state->session.handshakes_cleaned) {
@@ -149,32 +156,67 @@ static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer) {
 
 	fastd_peer_seen(peer);
 
-	if (recv_buffer->len)
-		fastd_handle_receive(peer, recv_buffer, reordered);
-	else
+	if (!recv_buffer->len) {
 		fastd_buffer_free(recv_buffer);
+		return true;
+	}
 
-	return;
+	if (peer->compress && !fastd_decompress(peer, recv_buffer)) {
+		pr_debug("received invalid compressed packet from %P", peer);
+		fastd_buffer_free(recv_buffer);
+		return true;
+	}
+
+	fastd_handle_receive(peer, recv_buffer, *reordered, tos);
+
+	return true;
 
 fail:
 	fastd_buffer_free(buffer);
+	return false;
 }
 
-/** Encrypts and sends a packet to a peer using a specified session */
-static void session_send(fastd_peer_t *peer, fastd_buffer_t *buffer, protocol_session_t *session) {
-	size_t stat_size = buffer->len;
-
+/** Encrypts a packet for a peer using the specified method state of a session, consuming the passed buffer */
+static fastd_buffer_t *session_encrypt(
+	fastd_peer_t *peer, fastd_buffer_t *buffer, const protocol_session_t *session,
+	fastd_method_session_state_t *method_state) {
 	fastd_buffer_zero_pad(buffer);
 
-	fastd_buffer_t *send_buffer = session->method->provider->encrypt(session->method_state, buffer);
+	fastd_buffer_t *send_buffer = session->method->provider->encrypt(method_state, buffer);
 	if (!send_buffer) {
 		fastd_buffer_free(buffer);
 		pr_error("failed to encrypt packet for %P", peer);
-		return;
 	}
 
-	fastd_send(peer->sock, &peer->local_address, &peer->address, peer, send_buffer, stat_size);
-	fastd_buffer_free(send_buffer);
+	return send_buffer;
+}
+
+/** Encrypts and sends a packet to a peer using a specified session */
+static void session_send(fastd_peer_t *peer, fastd_buffer_t *buffer, protocol_session_t *session) {
+	size_t stat_size = buffer->len;
+	uint8_t tos = fastd_tos_encapsulate(peer, buffer);
+
+	/* The inner IP header must be looked at before the packet is compressed */
+	buffer = fastd_compress(peer, buffer);
+
+	fastd_buffer_t *send_buffer = session_encrypt(peer, buffer, session, session->method_state);
+	if (!send_buffer)
+		return;
+
+	/* The packets of offloadable methods must stay compatible with the kernel implementation */
+	if (peer->remote_index && !session->method->provider->get_offload) {
+		if (peer->fec) {
+			/* Consumes the buffer */
+			fastd_fec_send(peer, send_buffer, tos, stat_size);
+		} else {
+			send_buffer = fastd_index_header_push(send_buffer, PACKET_DATA_INDEXED, peer->remote_index);
+			fastd_path_send(peer, send_buffer, tos, stat_size);
+			fastd_buffer_free(send_buffer);
+		}
+	} else {
+		fastd_send_payload(peer->sock, &peer->local_address, &peer->address, peer, send_buffer, tos, stat_size);
+		fastd_buffer_free(send_buffer);
+	}
 
 	if (!(session->method->provider->flags & METHOD_FORCE_KEEPALIVE))
 		fastd_peer_clear_keepalive(peer);
@@ -197,6 +239,58 @@ static void protocol_send(fastd_peer_t *peer, fastd_buffer_t *buffer) {
 	}
 }
 
+/** encrypt_probe implementation for ec25519-fhmqvc */
+static fastd_buffer_t *protocol_encrypt_probe(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	if (!peer->protocol_state || !fastd_peer_is_established(peer) || !check_session(peer)) {
+		fastd_buffer_free(buffer);
+		return NULL;
+	}
+
+	protocol_session_t *session = &peer->protocol_state->session;
+	if (use_old_session(peer->protocol_state))
+		session = &peer->protocol_state->old_session;
+
+	/* Sessions of offloadable methods don't have probe keys */
+	if (!session->probe_state) {
+		fastd_buffer_free(buffer);
+		return NULL;
+	}
+
+	return session_encrypt(peer, buffer, session, session->probe_state);
+}
+
+/**
+   decrypt_probe implementation for ec25519-fhmqvc
+
+   Probes are decrypted with the probe keys of the sessions only, so payload packets relabeled as
+   probes are rejected. Unlike protocol_handle_recv(), this doesn't invalidate the old session, as
+   probes may take a slower path than the payload packets.
+*/
+static fastd_buffer_t *protocol_decrypt_probe(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	if (!peer->protocol_state || !check_session(peer)) {
+		fastd_buffer_free(buffer);
+		return NULL;
+	}
+
+	const protocol_session_t *old_session = &peer->protocol_state->old_session;
+	const protocol_session_t *session = &peer->protocol_state->session;
+	fastd_buffer_t *recv_buffer = NULL;
+	bool reordered;
+
+	fastd_buffer_zero_pad(buffer);
+
+	if (is_session_valid(old_session) && old_session->probe_state)
+		recv_buffer = old_session->method->provider->decrypt(old_session->probe_state, buffer, &reordered);
+
+	if (!recv_buffer && session->probe_state)
+		recv_buffer = session->method->provider->decrypt(session->probe_state, buffer, &reordered);
+
+	if (!recv_buffer)
+		fastd_buffer_free(buffer);
+
+	return recv_buffer;
+}
+
 /** Sends an empty payload packet (i.e. keepalive) to a peer using a specified session */
 void fastd_protocol_ec25519_fhmqvc_send_empty(fastd_peer_t *peer, protocol_session_t *session) {
 	session_send(peer, fastd_buffer_alloc(0, alignto(session->method->provider->encrypt_headroom, 8)), session);
@@ -228,6 +322,8 @@ const fastd_protocol_t fastd_protocol_ec25519_fhmqvc = {
 
 	.handle_recv = protocol_handle_recv,
 	.send = protocol_send,
+	.encrypt_probe = protocol_encrypt_probe,
+	.decrypt_probe = protocol_decrypt_probe,
 
 	.init_peer_state = fastd_protocol_ec25519_fhmqvc_init_peer_state,
 	.reset_peer_state = fastd_protocol_ec25519_fhmqvc_reset_peer_state,
@@ -66,6 +66,14 @@ typedef struct protocol_session {
 
 	const fastd_method_info_t *method;          /**< The used crypto method */
 	fastd_method_session_state_t *method_state; /**< The method-specific state */
+
+	/**
+	   The method-specific state used for path probes, or NULL if the method can't be used for probes
+
+	   Its keys are derived separately from the keys of payload packets, so probes and payload packets
+	   can't be substituted for each other and don't share the nonces and the replay window.
+	*/
+	fastd_method_session_state_t *probe_state;
 } protocol_session_t;
 
 /** Protocol-specific peer state */
@@ -119,6 +127,14 @@ static inline void hexdump(char out[65], const unsigned char d[32]) {
 		snprintf(out + 2 * i, 3, "%02x", d[i]);
 }
 
+/** Frees the method-specific state of a session */
+static inline void free_session_state(const protocol_session_t *session) {
+	session->method->provider->session_free(session->method_state);
+
+	if (session->probe_state)
+		session->method->provider->session_free(session->probe_state);
+}
+
 /** Checks if a session is currently valid */
 static inline bool is_session_valid(const protocol_session_t *session) {
 	return (session->method && session->method->provider->session_is_valid(session->method_state));
@@ -18,6 +18,9 @@
 #include "../../verify.h"
 
 
+/** The label separating the keys of path probes from the keys of payload packets */
+#define PROBE_KEY_LABEL "path-probe"
+
 /** The size of the hash outputs used in the handshake */
 #define HASHBYTES FASTD_SHA256_HASH_BYTES
 
@@ -35,13 +38,19 @@
 #define KEY_PRINT(k) (const uint8_t *)(k), (size_t)PUBLICKEYBYTES
 
 
-/** Derives a key of arbitraty length from the shared key material after a handshake using the HKDF algorithm */
+/**
+   Derives a key of arbitraty length from the shared key material after a handshake using the HKDF algorithm
+
+   Keys used for other purposes than payload packets are derived with a \e label, which is appended to
+   the method name after a null byte. \e label is NULL for the keys of payload packets.
+*/
 static void derive_key(
-	fastd_sha256_t *out, size_t blocks, const uint32_t *salt, const char *method_name, const aligned_int256_t *A,
-	const aligned_int256_t *B, const aligned_int256_t *X, const aligned_int256_t *Y,
+	fastd_sha256_t *out, size_t blocks, const uint32_t *salt, const char *method_name, const char *label,
+	const aligned_int256_t *A, const aligned_int256_t *B, const aligned_int256_t *X, const aligned_int256_t *Y,
 	const aligned_int256_t *sigma) {
 	size_t methodlen = strlen(method_name);
-	uint8_t info[4 * PUBLICKEYBYTES + methodlen] __attribute__((aligned(8)));
+	size_t labellen = label ? strlen(label) + 1 : 0;
+	uint8_t info[4 * PUBLICKEYBYTES + methodlen + labellen] __attribute__((aligned(8)));
 
 	memcpy(info, A, PUBLICKEYBYTES);
 	memcpy(info + PUBLICKEYBYTES, B, PUBLICKEYBYTES);
@@ -49,6 +58,11 @@ static void derive_key(
 	memcpy(info + 3 * PUBLICKEYBYTES, Y, PUBLICKEYBYTES);
 	memcpy(info + 4 * PUBLICKEYBYTES, method_name, methodlen);
 
+	if (label) {
+		info[4 * PUBLICKEYBYTES + methodlen] = 0;
+		memcpy(info + 4 * PUBLICKEYBYTES + methodlen + 1, label, labellen - 1);
+	}
+
 	fastd_sha256_t prk;
 	fastd_hkdf_sha256_extract(&prk, salt, sigma->u32, PUBLICKEYBYTES);
 
@@ -59,20 +73,17 @@ static void derive_key(
 static inline void supersede_session(fastd_peer_t *peer, const fastd_method_info_t *method) {
 	if (is_session_valid(&peer->protocol_state->session) && !is_session_valid(&peer->protocol_state->old_session)) {
 		if (peer->protocol_state->old_session.method)
-			peer->protocol_state->old_session.method->provider->session_free(
-				peer->protocol_state->old_session.method_state);
+			free_session_state(&peer->protocol_state->old_session);
 		peer->protocol_state->old_session = peer->protocol_state->session;
 	} else {
 		if (peer->protocol_state->session.method)
-			peer->protocol_state->session.method->provider->session_free(
-				peer->protocol_state->session.method_state);
+			free_session_state(&peer->protocol_state->session);
 	}
 
 	if (peer->protocol_state->old_session.method) {
 		if (peer->protocol_state->old_session.method != method) {
 			pr_debug("method of %P has changed, terminating old session", peer);
-			peer->protocol_state->old_session.method->provider->session_free(
-				peer->protocol_state->old_session.method_state);
+			free_session_state(&peer->protocol_state->old_session);
 			peer->protocol_state->old_session = (protocol_session_t){};
 		} else {
 			peer->protocol_state->old_session.method->provider->session_superseded(
@@ -91,14 +102,29 @@ static inline bool new_session(
 
 	size_t blocks = block_count(method->provider->key_length(method->method), sizeof(fastd_sha256_t));
 	fastd_sha256_t secret[blocks ?: 1];
-	derive_key(secret, blocks, salt, method->name, A, B, X, Y, sigma);
+	derive_key(secret, blocks, salt, method->name, NULL, A, B, X, Y, sigma);
 
 	peer->protocol_state->session.method_state =
 		method->provider->session_init(peer, method->method, (const uint8_t *)secret, session_flags);
+	peer->protocol_state->session.probe_state = NULL;
 
 	if (!peer->protocol_state->session.method_state)
 		return false;
 
+	/* Path probes are prefixed with a session index, which offloadable methods don't support */
+	if (!method->provider->get_offload) {
+		derive_key(secret, blocks, salt, method->name, PROBE_KEY_LABEL, A, B, X, Y, sigma);
+
+		peer->protocol_state->session.probe_state =
+			method->provider->session_init(peer, method->method, (const uint8_t *)secret, session_flags);
+
+		if (!peer->protocol_state->session.probe_state) {
+			method->provider->session_free(peer->protocol_state->session.method_state);
+			peer->protocol_state->session.method_state = NULL;
+			return false;
+		}
+	}
+
 	peer->protocol_state->session.handshakes_cleaned = false;
 	peer->protocol_state->session.refreshing = false;
 	peer->protocol_state->session.method = method;
@@ -133,8 +159,14 @@ static bool establish(
 		return false;
 	}
 
-	if (!fastd_peer_set_established(
-		    peer, method->provider->get_offload ? method->provider->get_offload(method->method) : NULL)) {
+	const fastd_method_provider_t *provider = method->provider;
+	const fastd_offload_t *offload = provider->get_offload ? provider->get_offload(method->method) : NULL;
+	const fastd_offload_keys_t *offload_keys = NULL;
+
+	if (offload && provider->session_get_offload_keys)
+		offload_keys = provider->session_get_offload_keys(peer->protocol_state->session.method_state);
+
+	if (!fastd_peer_set_established(peer, offload, offload_keys)) {
 		fastd_peer_reset(peer);
 		return false;
 	}
@@ -244,7 +276,7 @@ static bool make_shared_handshake_key(
 
 	ecc_25519_store_packed_legacy(&sigma->int256, &work);
 
-	derive_key(shared_handshake_key, 1, zero_salt, "", A, B, X, Y, sigma);
+	derive_key(shared_handshake_key, 1, zero_salt, "", NULL, A, B, X, Y, sigma);
 
 	return true;
 }
@@ -290,12 +322,16 @@ static void respond_handshake(
 
 	fastd_buffer_t *buffer = fastd_handshake_new_reply(
 		2, fastd_peer_get_mtu(peer), NULL, *fastd_peer_group_lookup_peer(peer, methods),
-		4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
+		4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(3) + 3 * RECORD_LEN(1) + RECORD_LEN(HASHBYTES));
 
 	fastd_handshake_add(buffer, RECORD_SENDER_KEY, PUBLICKEYBYTES, &conf.protocol_config->key.public);
 	fastd_handshake_add(buffer, RECORD_RECIPIENT_KEY, PUBLICKEYBYTES, &peer->key->key);
 	fastd_handshake_add(buffer, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES, &handshake_key->key.public);
 	fastd_handshake_add(buffer, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES, peer_handshake_key);
+	fastd_handshake_add_session_index(buffer, peer);
+	fastd_handshake_add_fec(buffer);
+	fastd_handshake_add_aggregate(buffer);
+	fastd_handshake_add_compression(buffer);
 
 	fastd_sha256_t hmacbuf;
 
@@ -339,6 +375,11 @@ static void finish_handshake(
 		return;
 	}
 
+	fastd_handshake_set_remote_index(peer, handshake);
+	fastd_handshake_set_fec(peer, handshake);
+	fastd_handshake_set_aggregate(peer, handshake, method);
+	fastd_handshake_set_compression(peer, handshake, method);
+
 	if (!establish(
 		    peer, method, sock, local_addr, remote_addr, get_session_flags(true, handshake->flags),
 		    &handshake_key->key.public, peer_handshake_key, &conf.protocol_config->key.public, &peer->key->key,
@@ -346,12 +387,17 @@ static void finish_handshake(
 		return;
 
 	fastd_buffer_t *buffer = fastd_handshake_new_reply(
-		3, fastd_peer_get_mtu(peer), method, NULL, 4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
+		3, fastd_peer_get_mtu(peer), method, NULL,
+		4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(3) + 3 * RECORD_LEN(1) + RECORD_LEN(HASHBYTES));
 
 	fastd_handshake_add(buffer, RECORD_SENDER_KEY, PUBLICKEYBYTES, &conf.protocol_config->key.public);
 	fastd_handshake_add(buffer, RECORD_RECIPIENT_KEY, PUBLICKEYBYTES, &peer->key->key);
 	fastd_handshake_add(buffer, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES, &handshake_key->key.public);
 	fastd_handshake_add(buffer, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES, peer_handshake_key);
+	fastd_handshake_add_session_index(buffer, peer);
+	fastd_handshake_add_fec(buffer);
+	fastd_handshake_add_aggregate(buffer);
+	fastd_handshake_add_compression(buffer);
 
 	fastd_sha256_t hmacbuf;
 	uint8_t *tlv_mac = fastd_handshake_add_zero(buffer, RECORD_TLV_MAC, HASHBYTES);
@@ -391,6 +437,11 @@ static void handle_finish_handshake(
 		return;
 	}
 
+	fastd_handshake_set_remote_index(peer, handshake);
+	fastd_handshake_set_fec(peer, handshake);
+	fastd_handshake_set_aggregate(peer, handshake, method);
+	fastd_handshake_set_compression(peer, handshake, method);
+
 	establish(
 		peer, method, sock, local_addr, remote_addr, get_session_flags(false, handshake->flags),
 		peer_handshake_key, &handshake_key->key.public, &peer->key->key, &conf.protocol_config->key.public,
@@ -75,7 +75,7 @@ void fastd_protocol_ec25519_fhmqvc_init_peer_state(fastd_peer_t *peer) {
 /** Resets a the state of a session, freeing method-specific state */
 static void reset_session(protocol_session_t *session) {
 	if (session->method)
-		session->method->provider->session_free(session->method_state);
+		free_session_state(session);
 	secure_memzero(session, sizeof(protocol_session_t));
 }
 
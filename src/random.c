@@ -8,48 +8,251 @@
    \file
 
    Utilities for random data
+
+   Non-secure random data is provided by a per-thread ChaCha20-based generator
+   using fast key erasure: every refill of the output buffer replaces the key
+   with the first 32 bytes of keystream, and bytes are wiped from the buffer as
+   soon as they have been handed out. The generator is seeded from the kernel
+   (using getrandom() where available) and reseeded after RANDOM_RESEED_BYTES
+   bytes of output and after fork().
 */
 
 
+#include "crypto.h"
 #include "fastd.h"
 
-#include <sys/stat.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+
+/** The number of ChaCha20 blocks generated per refill */
+#define RANDOM_BLOCKS 4
+
+/** The size of the key of the ChaCha20 generator */
+#define RANDOM_KEYBYTES 32
+
+/** The size of the output buffer of the ChaCha20 generator */
+#define RANDOM_BUFBYTES (RANDOM_BLOCKS * 64 - RANDOM_KEYBYTES)
+
+
+/** The state of a per-thread random generator */
+typedef struct fastd_random_state {
+	bool seeded;           /**< true if the state has been seeded */
+	size_t reseed_counter; /**< Number of bytes that may be returned before the state is reseeded */
+
+	uint32_t key[RANDOM_KEYBYTES / 4]; /**< The current ChaCha20 key */
+
+	size_t buf_avail;              /**< Number of unused bytes at the end of buf */
+	uint8_t buf[RANDOM_BUFBYTES]; /**< Keystream that has not been returned yet */
+} fastd_random_state_t;
+
+
+/** The random generator of the current thread */
+static __thread fastd_random_state_t random_state;
+
+/** Incremented on fork() to invalidate the random generators of the child process */
+static volatile unsigned random_generation;
+
+/** The value of random_generation the current thread's generator was seeded in */
+static __thread unsigned random_state_generation;
+
+
+/** Rotates a 32bit value left */
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/** A ChaCha quarter round */
+#define QUARTERROUND(a, b, c, d)       \
+	do {                           \
+		a += b;                \
+		d = ROTL32(d ^ a, 16); \
+		c += d;                \
+		b = ROTL32(b ^ c, 12); \
+		a += b;                \
+		d = ROTL32(d ^ a, 8);  \
+		c += d;                \
+		b = ROTL32(b ^ c, 7);  \
+	} while (0)
+
+
+/** Computes a single ChaCha20 block with an all-zero nonce */
+static void chacha20_block(uint32_t out[16], const uint32_t key[8], uint32_t counter) {
+	const uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, key[0], key[1], key[2], key[3],
+		key[4],     key[5],     key[6],     key[7],     counter, 0,     0,      0,
+	};
+	uint32_t x[16];
+	size_t i;
+
+	memcpy(x, in, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		out[i] = x[i] + in[i];
+}
+
+
+/**
+   Reads random data from the kernel
+
+   When \e secure is set, the blocking random pool is used.
+*/
+static void get_entropy(void *buffer, size_t len, bool secure) {
+	uint8_t *p = buffer;
+
+	while (len) {
+#ifdef HAVE_GETRANDOM
+		ssize_t ret = getrandom(p, len, secure ? GRND_RANDOM : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			exit_errno("getrandom");
+		}
+#else
+		int fd = ctx.urandom;
+
+		if (secure) {
+			fd = open("/dev/random", O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				exit_errno("unable to open /dev/random");
+		}
+
+		ssize_t ret = read(fd, p, len);
+
+		if (secure)
+			close(fd);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			exit_errno("unable to read from random device");
+		}
+		if (ret == 0)
+			exit_error("unable to read from random device: unexpected EOF");
+#endif
+
+		p += ret;
+		len -= ret;
+	}
+}
+
+/** Generates a new output buffer and replaces the key of the generator */
+static void random_refill(fastd_random_state_t *state) {
+	uint32_t block[RANDOM_BLOCKS][16];
+	size_t i;
+
+	for (i = 0; i < RANDOM_BLOCKS; i++)
+		chacha20_block(block[i], state->key, i);
+
+	memcpy(state->key, block, RANDOM_KEYBYTES);
+	memcpy(state->buf, (uint8_t *)block + RANDOM_KEYBYTES, RANDOM_BUFBYTES);
+	state->buf_avail = RANDOM_BUFBYTES;
+
+	secure_memzero(block, sizeof(block));
+}
+
+/** Mixes fresh kernel entropy into the key of the generator */
+static void random_reseed(fastd_random_state_t *state) {
+	uint32_t seed[RANDOM_KEYBYTES / 4];
+	size_t i;
+
+	get_entropy(seed, sizeof(seed), false);
+
+	if (!state->seeded || random_state_generation != random_generation) {
+		memcpy(state->key, seed, sizeof(seed));
+		state->seeded = true;
+		random_state_generation = random_generation;
+	} else {
+		for (i = 0; i < array_size(seed); i++)
+			state->key[i] ^= seed[i];
+	}
+
+	secure_memzero(seed, sizeof(seed));
+
+	random_refill(state);
+	state->reseed_counter = RANDOM_RESEED_BYTES;
+}
+
+/** Invalidates the random generators after fork() so the child doesn't repeat the parent's output */
+static void random_atfork_child(void) {
+	random_generation++;
+}
 
 
 /**
-   Opens urandom
+   Prepares the random data source
+
+   When getrandom() is not available, /dev/urandom is opened and kept open, so
+   random data can still be obtained after fastd has dropped its privileges.
 */
 void fastd_random_init(void) {
-	ctx.urandom = fopen("/dev/urandom", "rb");
-	if (!ctx.urandom)
+#ifndef HAVE_GETRANDOM
+	ctx.urandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (ctx.urandom < 0)
 		exit_errno("unable to open /dev/urandom");
+#endif
+
+	if ((errno = pthread_atfork(NULL, NULL, random_atfork_child)) != 0)
+		exit_errno("pthread_atfork");
 }
 
 /**
-   Closes urandom
+   Closes the random data source
 */
 void fastd_random_cleanup(void) {
-	fclose(ctx.urandom);
+	secure_memzero(&random_state, sizeof(random_state));
+
+#ifndef HAVE_GETRANDOM
+	close(ctx.urandom);
+#endif
 }
 
 
 /**
    Provides a given amount of cryptographic random data
+
+   Secure random data is read from the kernel's blocking random pool directly,
+   everything else is taken from the calling thread's userspace generator.
 */
 void fastd_random_bytes(void *buffer, size_t len, bool secure) {
-	FILE *f;
+	fastd_random_state_t *state = &random_state;
+	uint8_t *p = buffer;
 
 	if (secure) {
-		f = fopen("/dev/random", "rb");
-		if (!f)
-			exit_errno("unable to open /dev/random");
-	} else {
-		f = ctx.urandom;
+		get_entropy(buffer, len, true);
+		return;
 	}
 
-	if (fread(buffer, len, 1, f) != 1)
-		exit_errno("unable to read from random device");
+	if (!state->seeded || random_state_generation != random_generation || state->reseed_counter < len)
+		random_reseed(state);
+
+	state->reseed_counter = ssub_size_t(state->reseed_counter, len);
 
-	if (secure)
-		fclose(f);
+	while (len) {
+		if (!state->buf_avail)
+			random_refill(state);
+
+		size_t n = min_size_t(len, state->buf_avail);
+		uint8_t *out = state->buf + RANDOM_BUFBYTES - state->buf_avail;
+
+		memcpy(p, out, n);
+		secure_memzero(out, n);
+
+		p += n;
+		len -= n;
+		state->buf_avail -= n;
+	}
 }
@@ -12,18 +12,28 @@
 
 
 #include "fastd.h"
+#include "aggregate.h"
+#include "fec.h"
 #include "handshake.h"
 #include "hash.h"
+#include "mcast.h"
+#include "neigh.h"
+#include "path.h"
 #include "peer.h"
+#include "peer_group.h"
 #include "peer_hashtable.h"
+#include "peer_index.h"
+#include "tos.h"
+#include "txq.h"
 
 #include <sys/uio.h>
 
 
 /** Handles the ancillary control messages of received packets */
-static inline void
-handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_peer_address_t *local_addr) {
+static inline void handle_socket_control(
+	struct msghdr *message, const fastd_socket_t *sock, fastd_peer_address_t *local_addr, uint8_t *tos) {
 	memset(local_addr, 0, sizeof(fastd_peer_address_t));
+	*tos = 0;
 
 	const uint8_t *end = (const uint8_t *)message->msg_control + message->msg_controllen;
 
@@ -45,7 +55,28 @@ handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_
 			local_addr->in.sin_addr = pktinfo.ipi_addr;
 			local_addr->in.sin_port = fastd_peer_address_get_port(sock->bound_addr);
 
-			return;
+			continue;
+		}
+#endif
+
+#ifdef USE_TOS
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+			if ((const uint8_t *)CMSG_DATA(cmsg) + 1 > end)
+				return;
+
+			*tos = *(const uint8_t *)CMSG_DATA(cmsg);
+			continue;
+		}
+
+		if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_TCLASS) {
+			int tclass;
+
+			if ((const uint8_t *)CMSG_DATA(cmsg) + sizeof(tclass) > end)
+				return;
+
+			memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+			*tos = tclass;
+			continue;
 		}
 #endif
 
@@ -64,7 +95,7 @@ handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_
 			if (IN6_IS_ADDR_LINKLOCAL(&local_addr->in6.sin6_addr))
 				local_addr->in6.sin6_scope_id = pktinfo.ipi6_ifindex;
 
-			return;
+			continue;
 		}
 	}
 }
@@ -170,16 +201,128 @@ static inline bool is_data_packet(uint8_t packet_type) {
 	return !(packet_type & PACKET_L2TP_T) && !is_handshake_packet(packet_type);
 }
 
+/** Sends a handshake after a payload packet has been received that can't be associated with an established session */
+static void handle_unexpected_data(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr) {
+	if (!backoff_unknown(remote_addr)) {
+		pr_debug("unexpectedly received payload data from %I", remote_addr);
+		conf.protocol->handshake_init(sock, local_addr, remote_addr, NULL);
+	}
+}
+
+/**
+   Passes an indexed payload packet to the protocol after the index header has been removed
+
+   PACKET_DATA_FEC packets are passed through forward error correction first. Returns true if the
+   packet has been authenticated and isn't reordered or replayed. Consumes the buffer.
+*/
+static bool receive_indexed_data(fastd_peer_t *peer, uint8_t packet_type, fastd_buffer_t *buffer, uint8_t tos) {
+	bool authenticated, reordered;
+
+	if (packet_type == PACKET_DATA_FEC)
+		authenticated = fastd_fec_handle_recv(peer, buffer, tos, &reordered);
+	else
+		authenticated = conf.protocol->handle_recv(peer, buffer, tos, &reordered);
+
+	return authenticated && !reordered;
+}
+
+/**
+   Handles a payload packet prefixed with a session index
+
+   The peer is found by the session index instead of the source address. When a packet from
+   a new address is authenticated and isn't a reordered or replayed packet, the peer has
+   moved (e.g. after a NAT mapping has changed), and its address is updated without a new
+   handshake. In multipath mode, the new address is added as an additional path instead.
+*/
+static void handle_indexed_data(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer, uint8_t tos) {
+	fastd_index_header_t header;
+
+	if (buffer->len < sizeof(header) + 1) {
+		pr_debug("received short indexed data packet from %I", remote_addr);
+		goto end_free;
+	}
+
+	fastd_buffer_pull_to(buffer, &header, sizeof(header));
+
+	fastd_peer_t *peer = fastd_peer_index_lookup(fastd_index_header_get(&header));
+
+	if (peer && fastd_peer_address_equal(&peer->address, remote_addr) && can_receive_data(peer, local_addr)) {
+		fastd_path_handle_rx(peer, sock, local_addr, remote_addr, buffer->len);
+
+		/* Consumes the buffer */
+		receive_indexed_data(peer, header.packet_type, buffer, tos);
+		return;
+	}
+
+	/*
+	   After the connection has been moved to another path, packets may still arrive on the old one for a moment;
+	   in multipath mode, packets are received on all measured paths
+	*/
+	if (peer && fastd_peer_is_established(peer) && (!sock->peer || sock->peer == peer) &&
+	    fastd_path_is_known(peer, sock, local_addr, remote_addr)) {
+		fastd_path_handle_rx(peer, sock, local_addr, remote_addr, buffer->len);
+
+		/* Consumes the buffer */
+		receive_indexed_data(peer, header.packet_type, buffer, tos);
+		return;
+	}
+
+	if (peer && fastd_peer_may_roam(peer, sock, remote_addr)) {
+		/* Consumes the buffer */
+		if (!receive_indexed_data(peer, header.packet_type, buffer, tos))
+			return;
+
+		if (fastd_use_multipath())
+			fastd_path_learn(peer, sock, local_addr, remote_addr);
+		else
+			fastd_peer_roam(peer, sock, local_addr, remote_addr);
+
+		return;
+	}
+
+	if (sock->peer) {
+		pr_debug2("ignoring indexed data packet from %I on dynamic socket of %P", remote_addr, sock->peer);
+		goto end_free;
+	}
+
+	if (!fastd_peer_hashtable_lookup(remote_addr) && !allow_unknown_peers()) {
+		pr_debug("received packet from unknown address %I", remote_addr);
+		goto end_free;
+	}
+
+	handle_unexpected_data(sock, local_addr, remote_addr);
+
+end_free:
+	fastd_buffer_free(buffer);
+}
+
 /** Handles a packet read from a socket */
 static void handle_socket_receive(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_buffer_t *buffer) {
+	fastd_buffer_t *buffer, uint8_t tos) {
 	fastd_peer_t *peer = NULL;
 
-	/* Most of fastd's code should never have to deal with L2TP offload sockets */
+	/* Most of fastd's code should never have to deal with cloned sockets */
 	if (sock->parent)
 		sock = sock->parent;
 
+	/* Indexed data packets and path probes don't need an address lookup */
+	if (fastd_use_packet_index()) {
+		switch (*(const uint8_t *)buffer->data) {
+		case PACKET_DATA_INDEXED:
+		case PACKET_DATA_FEC:
+			handle_indexed_data(sock, local_addr, remote_addr, buffer, tos);
+			return;
+
+		case PACKET_PATH_PROBE:
+			fastd_path_handle_probe(sock, local_addr, remote_addr, buffer);
+			return;
+		}
+	}
+
 	if (sock->peer) {
 		if (!fastd_peer_address_equal(&sock->peer->address, remote_addr)) {
 			pr_debug2("ignoring packet from %I on dynamic socket of %P", remote_addr, sock->peer);
@@ -214,8 +357,10 @@ static void handle_socket_receive(
 	}
 
 	if (is_data_packet(packet_type) && can_receive_data(peer, local_addr)) {
+		bool reordered;
+
 		/* Consumes the buffer */
-		conf.protocol->handle_recv(peer, buffer);
+		conf.protocol->handle_recv(peer, buffer, tos, &reordered);
 		return;
 	}
 
@@ -227,10 +372,7 @@ static void handle_socket_receive(
 	if (is_handshake_packet(packet_type)) {
 		fastd_handshake_handle(sock, local_addr, remote_addr, peer, buffer, has_control_header);
 	} else if (is_data_packet(packet_type)) {
-		if (!backoff_unknown(remote_addr)) {
-			pr_debug("unexpectedly received payload data from %I", remote_addr);
-			conf.protocol->handshake_init(sock, local_addr, remote_addr, NULL);
-		}
+		handle_unexpected_data(sock, local_addr, remote_addr);
 	} else {
 		pr_debug("received packet with invalid type from %I", remote_addr);
 	}
@@ -245,6 +387,7 @@ void fastd_receive(fastd_socket_t *sock) {
 	fastd_buffer_t *buffer = fastd_buffer_alloc(max_len, conf.decrypt_headroom);
 	fastd_peer_address_t local_addr;
 	fastd_peer_address_t recvaddr;
+	uint8_t tos;
 	struct iovec buffer_vec = { .iov_base = buffer->data, .iov_len = buffer->len };
 	uint8_t cbuf[1024] __attribute__((aligned(8)));
 
@@ -268,7 +411,7 @@ void fastd_receive(fastd_socket_t *sock) {
 
 	buffer->len = len;
 
-	handle_socket_control(&message, sock, &local_addr);
+	handle_socket_control(&message, sock, &local_addr, &tos);
 
 #ifdef USE_PKTINFO
 	if (!local_addr.sa.sa_family) {
@@ -281,17 +424,76 @@ void fastd_receive(fastd_socket_t *sock) {
 	fastd_peer_address_simplify(&local_addr);
 	fastd_peer_address_simplify(&recvaddr);
 
-	handle_socket_receive(sock, &local_addr, &recvaddr, buffer);
+	handle_socket_receive(sock, &local_addr, &recvaddr, buffer, tos);
 }
 
-/** Handles a received and decrypted payload packet */
-void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered) {
+/**
+   Applies the broadcast and multicast rate limits of a peer's group to a received ethernet frame
+
+   Returns false if the frame must be dropped.
+*/
+static bool check_rate_limit(fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	static const fastd_eth_addr_t broadcast = { { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
+
+	fastd_eth_addr_t dest_addr = fastd_buffer_dest_address(buffer);
+	if (fastd_eth_addr_is_unicast(dest_addr))
+		return true;
+
+	if (memcmp(&dest_addr, &broadcast, sizeof(broadcast)) == 0) {
+		if (fastd_token_bucket_take(&peer->broadcast_bucket, *fastd_peer_group_lookup_peer(peer, broadcast_limit)))
+			return true;
+
+		fastd_stats_add(peer, STAT_BROADCAST_LIMITED, buffer->len);
+	} else {
+		if (fastd_token_bucket_take(&peer->multicast_bucket, *fastd_peer_group_lookup_peer(peer, multicast_limit)))
+			return true;
+
+		fastd_stats_add(peer, STAT_MULTICAST_LIMITED, buffer->len);
+	}
+
+	return false;
+}
+
+/**
+   Returns the peer a received unicast packet can be forwarded to directly, without
+   writing it to the local interface
+
+   Returns NULL for packets that are destined for the local interface, for unknown
+   destinations and for broadcast and multicast packets, which are flooded.
+*/
+static fastd_peer_t *get_forward_dest(const fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	fastd_peer_t *dest = NULL;
+
+	if (conf.mode == MODE_TAP) {
+		fastd_eth_addr_t dest_addr = fastd_buffer_dest_address(buffer);
+
+		if (!fastd_eth_addr_is_unicast(dest_addr) || !fastd_peer_find_by_eth_addr(dest_addr, &dest))
+			return NULL;
+	} else if (fastd_use_routed_tun()) {
+		dest = fastd_route_lookup_packet(&ctx.routes, buffer, false);
+	}
+
+	return (dest != peer) ? dest : NULL;
+}
+
+/**
+   Handles a received and decrypted payload packet
+
+   \e tos is the TOS or traffic class value of the outer IP header the packet was received with.
+*/
+static void handle_receive_packet(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered, uint8_t tos) {
 	if (!peer->iface) {
 		pr_debug("received packet from offloaded session");
 		fastd_buffer_free(buffer);
 		return;
 	}
 
+	if (!fastd_tos_decapsulate(buffer, tos)) {
+		pr_debug2("dropping packet from %P received with congestion mark, but without ECN support", peer);
+		fastd_buffer_free(buffer);
+		return;
+	}
+
 	if (conf.mode == MODE_TAP) {
 		if (buffer->len < sizeof(fastd_eth_header_t)) {
 			pr_debug("received truncated packet");
@@ -303,6 +505,20 @@ void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reord
 
 		if (fastd_eth_addr_is_unicast(src_addr))
 			fastd_peer_eth_addr_add(peer, src_addr);
+
+		if (!check_rate_limit(peer, buffer)) {
+			fastd_buffer_free(buffer);
+			return;
+		}
+
+		fastd_neigh_learn(buffer);
+		fastd_mcast_snoop(peer, buffer);
+	}
+
+	if (fastd_use_routed_tun() && fastd_route_lookup_packet(&ctx.routes, buffer, true) != peer) {
+		pr_debug("received packet with unrouted source address from %P", peer);
+		fastd_buffer_free(buffer);
+		return;
 	}
 
 	fastd_stats_add(peer, STAT_RX, buffer->len);
@@ -310,15 +526,28 @@ void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reord
 	if (reordered)
 		fastd_stats_add(peer, STAT_RX_REORDERED, buffer->len);
 
+	if (conf.forward) {
+		fastd_peer_t *dest = get_forward_dest(peer, buffer);
+
+		if (dest) {
+			fastd_stats_add(peer, STAT_RX_FORWARDED, buffer->len);
+
+			/*
+			  Misaligned buffers come from the null method, as it uses a 1-byte header
+			  rather than (16*n+8)-byte like all other methods. When such a buffer enters
+			  the transmit path again through fastd's forward feature, it will violate
+			  the fastd_block128_t alignment.
+			*/
+			buffer = fastd_buffer_align(buffer, conf.encrypt_headroom);
+			fastd_txq_send(dest, buffer);
+			return;
+		}
+	}
+
+	fastd_stats_add(peer, STAT_RX_LOCAL, buffer->len);
 	fastd_iface_write(peer->iface, buffer);
 
 	if (conf.mode == MODE_TAP && conf.forward) {
-		/*
-		  Misaligned buffers come from the null method, as it uses a 1-byte header
-		  rather than (16*n+8)-byte like all other methods. When such a buffer enters
-		  the transmit path again through fastd's forward feature, it will violate
-		  the fastd_block128_t alignment.
-		*/
 		buffer = fastd_buffer_align(buffer, conf.encrypt_headroom);
 
 		fastd_send_data(buffer, peer, NULL);
@@ -327,3 +556,78 @@ void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reord
 
 	fastd_buffer_free(buffer);
 }
+
+/**
+   Splits a received and decrypted datagram of aggregated payload packets into its packets
+
+   A datagram containing a single packet is handled without copying. Otherwise, the datagram is
+   copied out of the packet buffer first, so handling its packets never needs more than one
+   additional buffer.
+*/
+static void handle_receive_aggregate(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered, uint8_t tos) {
+	fastd_aggregate_t *aggr = peer->aggregate;
+	const uint8_t *data = buffer->data;
+	size_t len = buffer->len;
+
+	size_t pos = 0, count = 0;
+	while (pos < len) {
+		fastd_aggregate_header_t header;
+		if (len - pos < sizeof(header))
+			break;
+
+		memcpy(&header, data + pos, sizeof(header));
+		pos += sizeof(header) + be16toh(header.len);
+		count++;
+	}
+
+	if (pos != len) {
+		pr_debug("received invalid aggregated packet from %P", peer);
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	aggr->rx_frames += count;
+	aggr->rx_datagrams++;
+
+	if (count == 1) {
+		fastd_buffer_pull(buffer, sizeof(fastd_aggregate_header_t));
+		handle_receive_packet(peer, buffer, reordered, tos);
+		return;
+	}
+
+	uint8_t *copy = fastd_alloc(len);
+	memcpy(copy, data, len);
+	fastd_buffer_free(buffer);
+
+	for (pos = 0; pos < len;) {
+		fastd_aggregate_header_t header;
+		memcpy(&header, copy + pos, sizeof(header));
+		pos += sizeof(header);
+
+		size_t packet_len = be16toh(header.len);
+		if (packet_len) {
+			fastd_buffer_t *packet = fastd_buffer_alloc(packet_len, conf.encrypt_headroom);
+			memcpy(packet->data, copy + pos, packet_len);
+
+			fastd_stats_add(peer, STAT_RX_AGGREGATED, packet_len);
+			handle_receive_packet(peer, packet, reordered, tos);
+		}
+
+		pos += packet_len;
+	}
+
+	free(copy);
+}
+
+/**
+   Handles a received and decrypted payload packet
+
+   When aggregation has been negotiated with the peer, the packet is split into the aggregated packets.
+   \e tos is the TOS or traffic class value of the outer IP header the packet was received with.
+*/
+void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered, uint8_t tos) {
+	if (peer->aggregate)
+		handle_receive_aggregate(peer, buffer, reordered, tos);
+	else
+		handle_receive_packet(peer, buffer, reordered, tos);
+}
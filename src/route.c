@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Longest-prefix-match routing tables for routed TUN mode
+
+   Each address family uses a path-compressed binary trie: every node stores a
+   complete prefix, and chains of single-child nodes are collapsed, so a table
+   with \e n prefixes never has more than 2n-1 nodes, and a lookup visits at
+   most one node per distinct prefix length on the path to the longest match.
+*/
+
+
+#include "route.h"
+#include "alloc.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+
+/** Returns the trie index of an address family */
+static inline size_t family_index(uint8_t family) {
+	switch (family) {
+	case AF_INET:
+		return 0;
+
+	case AF_INET6:
+		return 1;
+
+	default:
+		exit_bug("route: invalid address family");
+	}
+}
+
+/** Returns the address length of an address family in bits */
+static inline unsigned family_bits(uint8_t family) {
+	return (family == AF_INET) ? 32 : 128;
+}
+
+/** Returns bit \e i of an address (counting from the most significant bit) */
+static inline unsigned get_bit(const uint8_t *addr, unsigned i) {
+	return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/**
+   Returns the length of the common prefix of two addresses, up to \e max bits
+
+   The first \e start bits of the addresses must already be known to be equal.
+*/
+static inline unsigned common_prefix_len(const uint8_t *addr1, const uint8_t *addr2, unsigned start, unsigned max) {
+	unsigned i;
+	for (i = start / 8; 8 * i < max; i++) {
+		unsigned diff = addr1[i] ^ addr2[i];
+		if (diff)
+			return min_size_t(8 * i + __builtin_clz(diff) - (8 * sizeof(unsigned) - 8), max);
+	}
+
+	return max;
+}
+
+/** Clears all bits of an address after the first \e len */
+static void mask_addr(uint8_t addr[16], unsigned len) {
+	if (len % 8)
+		addr[len / 8] &= 0xff << (8 - len % 8);
+
+	unsigned i;
+	for (i = (len + 7) / 8; i < 16; i++)
+		addr[i] = 0;
+}
+
+/** Allocates a new trie node */
+static fastd_route_node_t *
+new_node(fastd_route_table_t *table, const uint8_t *addr, unsigned len, fastd_peer_t *peer) {
+	fastd_route_node_t *node = fastd_new0(fastd_route_node_t);
+
+	node->peer = peer;
+	node->len = len;
+	memcpy(node->addr, addr, sizeof(node->addr));
+	mask_addr(node->addr, len);
+
+	table->n_nodes++;
+
+	return node;
+}
+
+/** Frees a trie node */
+static inline void free_node(fastd_route_table_t *table, fastd_route_node_t *node) {
+	free(node);
+	table->n_nodes--;
+}
+
+/** Frees a subtrie */
+static void free_trie(fastd_route_node_t *node) {
+	if (!node)
+		return;
+
+	free_trie(node->child[0]);
+	free_trie(node->child[1]);
+	free(node);
+}
+
+
+/** Parses an address with an optional prefix length, optionally clearing the bits after the prefix length */
+static bool parse_prefix(fastd_prefix_t *prefix, const char *str, bool mask) {
+	char addrbuf[INET6_ADDRSTRLEN];
+	const char *slash = strchr(str, '/');
+	size_t addrlen = slash ? (size_t)(slash - str) : strlen(str);
+
+	if (addrlen >= sizeof(addrbuf))
+		return false;
+
+	memcpy(addrbuf, str, addrlen);
+	addrbuf[addrlen] = 0;
+
+	memset(prefix, 0, sizeof(*prefix));
+
+	if (inet_pton(AF_INET, addrbuf, prefix->addr) == 1)
+		prefix->family = AF_INET;
+	else if (inet_pton(AF_INET6, addrbuf, prefix->addr) == 1)
+		prefix->family = AF_INET6;
+	else
+		return false;
+
+	unsigned long len = family_bits(prefix->family);
+
+	if (slash) {
+		char *endptr;
+
+		if (!isdigit((unsigned char)slash[1]))
+			return false;
+
+		len = strtoul(slash + 1, &endptr, 10);
+		if (*endptr || len > family_bits(prefix->family))
+			return false;
+	}
+
+	prefix->len = len;
+
+	if (mask)
+		mask_addr(prefix->addr, prefix->len);
+
+	return true;
+}
+
+/**
+   Parses a prefix in the format \e address/length
+
+   If the length is omitted, a host route is returned. Bits after the prefix
+   length are cleared.
+*/
+bool fastd_prefix_parse(fastd_prefix_t *prefix, const char *str) {
+	return parse_prefix(prefix, str, true);
+}
+
+/**
+   Parses an interface address in the format \e address/length
+
+   Unlike \e fastd_prefix_parse, the bits after the prefix length are kept.
+*/
+bool fastd_prefix_parse_address(fastd_prefix_t *prefix, const char *str) {
+	return parse_prefix(prefix, str, false);
+}
+
+/** Formats a prefix in the format \e address/length */
+const char *fastd_prefix_format(char buf[FASTD_PREFIX_STRLEN], const fastd_prefix_t *prefix) {
+	char addrbuf[INET6_ADDRSTRLEN] = "";
+	inet_ntop(prefix->family, prefix->addr, addrbuf, sizeof(addrbuf));
+
+	snprintf(buf, FASTD_PREFIX_STRLEN, "%s/%u", addrbuf, (unsigned)prefix->len);
+	return buf;
+}
+
+
+/**
+   Adds a prefix to a routing table
+
+   Returns false if the prefix is already routed to a different peer.
+*/
+bool fastd_route_add(fastd_route_table_t *table, const fastd_prefix_t *prefix, fastd_peer_t *peer) {
+	fastd_route_node_t **slot = &table->root[family_index(prefix->family)];
+	unsigned known = 0;
+
+	while (*slot) {
+		fastd_route_node_t *node = *slot;
+		unsigned common = common_prefix_len(node->addr, prefix->addr, known, min_size_t(node->len, prefix->len));
+
+		if (common < node->len) {
+			/* The new prefix branches off (or is a prefix of) the node's prefix */
+			fastd_route_node_t *leaf = new_node(table, prefix->addr, prefix->len, peer);
+
+			if (common == prefix->len) {
+				leaf->child[get_bit(node->addr, common)] = node;
+				*slot = leaf;
+			} else {
+				fastd_route_node_t *branch = new_node(table, prefix->addr, common, NULL);
+				branch->child[get_bit(node->addr, common)] = node;
+				branch->child[get_bit(prefix->addr, common)] = leaf;
+				*slot = branch;
+			}
+
+			table->n_routes++;
+			return true;
+		}
+
+		if (node->len == prefix->len) {
+			if (node->peer)
+				return (node->peer == peer);
+
+			node->peer = peer;
+			table->n_routes++;
+			return true;
+		}
+
+		known = node->len;
+		slot = &node->child[get_bit(prefix->addr, node->len)];
+	}
+
+	*slot = new_node(table, prefix->addr, prefix->len, peer);
+	table->n_routes++;
+	return true;
+}
+
+/** Removes a prefix from a routing table if it is routed to the given peer */
+void fastd_route_remove(fastd_route_table_t *table, const fastd_prefix_t *prefix, const fastd_peer_t *peer) {
+	fastd_route_node_t **parent_slot = NULL, **slot = &table->root[family_index(prefix->family)];
+	unsigned known = 0;
+
+	while (true) {
+		fastd_route_node_t *node = *slot;
+
+		if (!node || node->len > prefix->len)
+			return;
+
+		if (common_prefix_len(node->addr, prefix->addr, known, node->len) < node->len)
+			return;
+
+		if (node->len == prefix->len)
+			break;
+
+		known = node->len;
+		parent_slot = slot;
+		slot = &node->child[get_bit(prefix->addr, node->len)];
+	}
+
+	fastd_route_node_t *node = *slot;
+	if (!node->peer || node->peer != peer)
+		return;
+
+	node->peer = NULL;
+	table->n_routes--;
+
+	/* The node stays as a branching node */
+	if (node->child[0] && node->child[1])
+		return;
+
+	*slot = node->child[0] ? node->child[0] : node->child[1];
+	free_node(table, node);
+
+	if (*slot || !parent_slot)
+		return;
+
+	/* A leaf was removed, so its parent may have become a branching node with a single child */
+	fastd_route_node_t *parent = *parent_slot;
+	if (parent->peer)
+		return;
+
+	*parent_slot = parent->child[0] ? parent->child[0] : parent->child[1];
+	free_node(table, parent);
+}
+
+/** Returns the peer the longest matching prefix of an address is routed to (or NULL) */
+fastd_peer_t *fastd_route_lookup(const fastd_route_table_t *table, uint8_t family, const uint8_t *addr) {
+	const fastd_route_node_t *node = table->root[family_index(family)];
+	unsigned bits = family_bits(family), known = 0;
+	fastd_peer_t *ret = NULL;
+
+	while (node) {
+		if (common_prefix_len(node->addr, addr, known, node->len) < node->len)
+			break;
+
+		if (node->peer)
+			ret = node->peer;
+
+		if (node->len == bits)
+			break;
+
+		known = node->len;
+		node = node->child[get_bit(addr, node->len)];
+	}
+
+	return ret;
+}
+
+/** Frees all nodes of a routing table */
+void fastd_route_free(fastd_route_table_t *table) {
+	free_trie(table->root[0]);
+	free_trie(table->root[1]);
+
+	memset(table, 0, sizeof(*table));
+}
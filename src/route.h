@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2016, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Longest-prefix-match routing tables for routed TUN mode
+*/
+
+#pragma once
+
+#include "buffer.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+
+/** The maximum length of a formatted prefix (including the terminating zero byte) */
+#define FASTD_PREFIX_STRLEN (INET6_ADDRSTRLEN + 4)
+
+
+/** An IPv4 or IPv6 prefix */
+struct fastd_prefix {
+	uint8_t family;   /**< AF_INET or AF_INET6 */
+	uint8_t len;      /**< The prefix length in bits */
+	uint8_t addr[16]; /**< The prefix address (all bits after the prefix length are zero) */
+};
+
+/**
+   A node of a path-compressed binary trie
+
+   Nodes without a peer are internal branching nodes; they always have two children.
+*/
+struct fastd_route_node {
+	fastd_route_node_t *child[2]; /**< The subtries for the next bit after the prefix being 0 or 1 */
+	fastd_peer_t *peer;           /**< The peer the prefix is routed to (or NULL) */
+	uint8_t len;                  /**< The prefix length in bits */
+	uint8_t addr[16];             /**< The prefix address */
+};
+
+/** A routing table for IPv4 and IPv6 prefixes */
+struct fastd_route_table {
+	fastd_route_node_t *root[2]; /**< The tries for IPv4 and IPv6 prefixes */
+	size_t n_routes;             /**< The number of prefixes in the table */
+	size_t n_nodes;              /**< The number of trie nodes (including internal nodes) */
+};
+
+
+bool fastd_prefix_parse(fastd_prefix_t *prefix, const char *str);
+bool fastd_prefix_parse_address(fastd_prefix_t *prefix, const char *str);
+const char *fastd_prefix_format(char buf[FASTD_PREFIX_STRLEN], const fastd_prefix_t *prefix);
+
+bool fastd_route_add(fastd_route_table_t *table, const fastd_prefix_t *prefix, fastd_peer_t *peer);
+void fastd_route_remove(fastd_route_table_t *table, const fastd_prefix_t *prefix, const fastd_peer_t *peer);
+fastd_peer_t *fastd_route_lookup(const fastd_route_table_t *table, uint8_t family, const uint8_t *addr);
+void fastd_route_free(fastd_route_table_t *table);
+
+
+/** Checks if two prefixes are equal */
+static inline bool fastd_prefix_equal(const fastd_prefix_t *prefix1, const fastd_prefix_t *prefix2) {
+	return prefix1->family == prefix2->family && prefix1->len == prefix2->len &&
+	       memcmp(prefix1->addr, prefix2->addr, sizeof(prefix1->addr)) == 0;
+}
+
+/**
+   Looks up the peer responsible for the source or destination address of an IP packet
+
+   Returns NULL for truncated packets and packets without a matching route.
+*/
+static inline fastd_peer_t *
+fastd_route_lookup_packet(const fastd_route_table_t *table, const fastd_buffer_t *buffer, bool source) {
+	const uint8_t *data = buffer->data;
+
+	if (!buffer->len)
+		return NULL;
+
+	switch (data[0] >> 4) {
+	case 4:
+		if (buffer->len < 20)
+			return NULL;
+
+		return fastd_route_lookup(table, AF_INET, data + (source ? 12 : 16));
+
+	case 6:
+		if (buffer->len < 40)
+			return NULL;
+
+		return fastd_route_lookup(table, AF_INET6, data + (source ? 8 : 24));
+
+	default:
+		return NULL;
+	}
+}
@@ -16,7 +16,11 @@
 
 
 #include "fastd.h"
+#include "mcast.h"
+#include "neigh.h"
+#include "pacing.h"
 #include "peer.h"
+#include "txq.h"
 
 #include <sys/uio.h>
 
@@ -39,7 +43,7 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
 
-		msg->msg_controllen += cmsg->cmsg_len;
+		msg->msg_controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
 
 		struct in_pktinfo pktinfo = {};
 		pktinfo.ipi_spec_dst = local_addr->in.sin_addr;
@@ -53,7 +57,7 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
 
-		msg->msg_controllen += cmsg->cmsg_len;
+		msg->msg_controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
 
 		struct in6_pktinfo pktinfo = {};
 		pktinfo.ipi6_addr = local_addr->in6.sin6_addr;
@@ -65,13 +69,131 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 	}
 }
 
-/** Sends a packet */
-void fastd_send(
+/** Adds the TOS (IPv4) or traffic class (IPv6) of the outer IP header to ancillary control messages */
+static inline void
+add_tos(UNUSED struct msghdr *msg, UNUSED const fastd_peer_address_t *remote_addr, UNUSED uint8_t tos) {
+#ifdef USE_TOS
+	if (!tos)
+		return;
+
+	struct cmsghdr *cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
+	int value = tos;
+
+	/* IPv4 packets sent on IPv6 sockets use the IPv4 option as well */
+	if (remote_addr->sa.sa_family == AF_INET) {
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_TOS;
+	} else {
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_TCLASS;
+	}
+
+	cmsg->cmsg_len = CMSG_LEN(sizeof(value));
+	msg->msg_controllen += CMSG_SPACE(sizeof(value));
+
+	memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+#endif
+}
+
+/** Adds the departure time determined by transmit pacing to ancillary control messages */
+static inline void add_txtime(UNUSED struct msghdr *msg, UNUSED uint64_t txtime) {
+#ifdef USE_TXTIME
+	if (!txtime)
+		return;
+
+	struct cmsghdr *cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+	msg->msg_controllen += CMSG_SPACE(sizeof(txtime));
+
+	memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+#endif
+}
+
+/** Sets the socket priority of the traffic class of the payload packet currently being sent */
+static inline void set_priority(UNUSED const fastd_socket_t *sock) {
+#ifdef USE_SOCKET_PRIORITY
+	if (sock->priority == ctx.tx_priority)
+		return;
+
+	if (setsockopt(sock->fd.fd, SOL_SOCKET, SO_PRIORITY, &ctx.tx_priority, sizeof(ctx.tx_priority))) {
+		pr_debug_errno("setsockopt: unable to set socket priority");
+		return;
+	}
+
+	/* The priority is only cached to avoid redundant system calls, so updating it on a const socket is fine */
+	((fastd_socket_t *)sock)->priority = ctx.tx_priority;
+#endif
+}
+
+/**
+   Sends a packet on a peer's connected socket
+
+   Returns false if the connected socket can't be used for the packet, as it is sent from
+   or to a different address than the socket is bound or connected to, or if sending on the
+   connected socket failed. The caller must send the packet on the bound socket in this case.
+*/
+static bool send_connected(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, uint64_t txtime, size_t stat_size) {
+	const fastd_socket_t *connected_sock = peer->connected_sock;
+
+	if (sock != peer->sock || !local_addr || !fastd_peer_address_equal(local_addr, connected_sock->bound_addr) ||
+	    !fastd_peer_address_equal(remote_addr, &peer->connected_address))
+		return false;
+
+	struct iovec iov = { .iov_base = buffer->data, .iov_len = buffer->len };
+	uint8_t cbuf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint64_t))] __attribute__((aligned(8))) = {};
+
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+	};
+
+	add_tos(&msg, remote_addr, tos);
+	add_txtime(&msg, txtime);
+
+	if (!msg.msg_controllen)
+		msg.msg_control = NULL;
+
+	set_priority(connected_sock);
+
+	if (sendmsg(connected_sock->fd.fd, &msg, 0) < 0) {
+		switch (errno) {
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			pr_debug2_errno("sendmsg");
+			fastd_stats_add(peer, STAT_TX_DROPPED, stat_size);
+			fastd_txq_blocked(peer);
+			return true;
+
+		default:
+			/* e.g. ECONNREFUSED reporting an earlier ICMP error; retry on the bound socket */
+			pr_debug2_errno("send on connected socket");
+			return false;
+		}
+	}
+
+	fastd_stats_add(peer, STAT_TX, stat_size);
+	return true;
+}
+
+/** Sends a packet with a given departure time (or 0 to send it immediately) */
+static void send_packet(
 	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const fastd_buffer_t *buffer, size_t stat_size) {
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, uint64_t txtime, size_t stat_size) {
 	if (!sock)
 		exit_bug("send: sock == NULL");
 
+	if (peer && peer->connected_sock &&
+	    send_connected(sock, local_addr, remote_addr, peer, buffer, tos, txtime, stat_size))
+		return;
+
 	struct msghdr msg = {};
 	uint8_t cbuf[1024] __attribute__((aligned(8))) = {};
 	fastd_peer_address_t remote_addr6;
@@ -107,10 +229,14 @@ void fastd_send(
 	msg.msg_controllen = 0;
 
 	add_pktinfo(&msg, local_addr);
+	add_tos(&msg, remote_addr, tos);
+	add_txtime(&msg, txtime);
 
 	if (!msg.msg_controllen)
 		msg.msg_control = NULL;
 
+	set_priority(sock);
+
 	int ret = sendmsg(sock->fd.fd, &msg, 0);
 
 	if (ret < 0 && msg.msg_controllen) {
@@ -137,6 +263,10 @@ void fastd_send(
 #endif
 			pr_debug2_errno("sendmsg");
 			fastd_stats_add(peer, STAT_TX_DROPPED, stat_size);
+
+			if (peer)
+				fastd_txq_blocked(peer);
+
 			break;
 
 		case ENETDOWN:
@@ -155,6 +285,39 @@ void fastd_send(
 	}
 }
 
+/** Sends a packet */
+void fastd_send(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size) {
+	send_packet(sock, local_addr, remote_addr, peer, buffer, tos, 0, stat_size);
+}
+
+/**
+   Sends a payload packet to a peer, applying the peer's transmit pacing rate
+
+   Handshakes and path probes are sent with fastd_send() instead, so they are neither delayed nor
+   dropped when the payload exhausts the pacing rate.
+*/
+void fastd_send_payload(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_buffer_t *buffer, uint8_t tos, size_t stat_size) {
+	if (!sock)
+		exit_bug("send: sock == NULL");
+
+	uint64_t txtime;
+
+	if (!fastd_pacing_schedule(peer, sock, buffer->len, &txtime)) {
+		pr_debug2("dropping packet exceeding the pacing rate of %P", peer);
+		fastd_stats_add(peer, STAT_TX_PACING_DROPPED, stat_size);
+		return;
+	}
+
+	if (txtime)
+		fastd_stats_add(peer, STAT_TX_PACED, stat_size);
+
+	send_packet(sock, local_addr, remote_addr, peer, buffer, tos, txtime, stat_size);
+}
+
 /** Encrypts and sends a payload packet to all peers */
 static inline void send_all(fastd_buffer_t *buffer, fastd_peer_t *source) {
 	size_t i;
@@ -165,11 +328,11 @@ static inline void send_all(fastd_buffer_t *buffer, fastd_peer_t *source) {
 
 		/* optimization, primarily for TUN mode: don't duplicate the buffer for the last (or only) peer */
 		if (i == VECTOR_LEN(ctx.peers) - 1) {
-			conf.protocol->send(dest, buffer);
+			fastd_txq_send(dest, buffer);
 			return;
 		}
 
-		conf.protocol->send(dest, fastd_buffer_dup(buffer, conf.encrypt_headroom));
+		fastd_txq_send(dest, fastd_buffer_dup(buffer, conf.encrypt_headroom));
 	}
 
 	fastd_buffer_free(buffer);
@@ -191,11 +354,14 @@ static inline bool send_data_tap_single(fastd_buffer_t *buffer, fastd_peer_t *so
 
 		if (fastd_eth_addr_is_unicast(src_addr))
 			fastd_peer_eth_addr_add(NULL, src_addr);
+
+		fastd_neigh_learn(buffer);
+		fastd_mcast_snoop(NULL, buffer);
 	}
 
 	fastd_eth_addr_t dest_addr = fastd_buffer_dest_address(buffer);
 	if (!fastd_eth_addr_is_unicast(dest_addr))
-		return false;
+		return fastd_neigh_handle_request(buffer, source) || fastd_mcast_handle(buffer, source);
 
 	fastd_peer_t *dest;
 	bool found = fastd_peer_find_by_eth_addr(dest_addr, &dest);
@@ -208,20 +374,39 @@ static inline bool send_data_tap_single(fastd_buffer_t *buffer, fastd_peer_t *so
 		return true;
 	}
 
-	conf.protocol->send(dest, buffer);
+	fastd_txq_send(dest, buffer);
+	return true;
+}
+
+/** Handles sending of a payload packet to the peer its destination address is routed to in routed TUN mode */
+static inline bool send_data_tun_routed(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	if (!fastd_use_routed_tun())
+		return false;
+
+	fastd_peer_t *dest = fastd_route_lookup_packet(&ctx.routes, buffer, false);
+
+	if (!dest || dest == source) {
+		fastd_buffer_free(buffer);
+		return true;
+	}
+
+	fastd_txq_send(dest, buffer);
 	return true;
 }
 
 /** Sends a buffer of payload data to other peers */
 void fastd_send_data(fastd_buffer_t *buffer, fastd_peer_t *source, fastd_peer_t *dest) {
 	if (dest) {
-		conf.protocol->send(dest, buffer);
+		fastd_txq_send(dest, buffer);
 		return;
 	}
 
 	if (send_data_tap_single(buffer, source))
 		return;
 
+	if (send_data_tun_routed(buffer, source))
+		return;
+
 	/* TUN mode or multicast packet */
 	send_all(buffer, source);
 }
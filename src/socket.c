@@ -11,8 +11,23 @@
 */
 
 #include "fastd.h"
+#include "offload/esp/esp.h"
 #include "polling.h"
 
+#ifdef USE_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+
+/**
+   Checks if bound sockets need SO_REUSEADDR
+
+   Cloned sockets (for L2TP offloading and connected peer sockets) are bound to the same
+   port as the original socket.
+*/
+static inline bool use_reuseaddr(void) {
+	return (fastd_use_offload_l2tp() || conf.connected_sockets);
+}
 
 /**
    Creates a new socket bound to a specific address
@@ -59,6 +74,14 @@ static int bind_socket(const fastd_bind_address_t *addr, bool reuseaddr_early) {
 	}
 #endif
 
+#ifdef USE_TOS
+	if (setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &one, sizeof(one)))
+		pr_warn_errno("setsockopt: unable to set IP_RECVTOS");
+
+	if (af == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &one, sizeof(one)))
+		pr_warn_errno("setsockopt: unable to set IPV6_RECVTCLASS");
+#endif
+
 #ifdef USE_FREEBIND
 	if (setsockopt(fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof(one)))
 		pr_warn_errno("setsockopt: unable to set IP_FREEBIND");
@@ -122,7 +145,7 @@ static int bind_socket(const fastd_bind_address_t *addr, bool reuseaddr_early) {
 			bind_address.in.sin_port = addr->addr.in.sin_port;
 	}
 
-	if (fastd_use_offload_l2tp() && reuseaddr_early) {
+	if (use_reuseaddr() && reuseaddr_early) {
 		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
 			pr_error_errno("setsockopt: unable to set SO_REUSEADDR");
 			goto error;
@@ -135,13 +158,16 @@ static int bind_socket(const fastd_bind_address_t *addr, bool reuseaddr_early) {
 		goto error;
 	}
 
-	if (fastd_use_offload_l2tp() && !reuseaddr_early) {
+	if (use_reuseaddr() && !reuseaddr_early) {
 		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
 			pr_error_errno("setsockopt: unable to set SO_REUSEADDR");
 			goto error;
 		}
 	}
 
+	if (fastd_use_offload_esp() && !fastd_offload_esp_init_socket(fd))
+		goto error;
+
 #ifdef __ANDROID__
 	if (!fastd_android_protect_socket(fd)) {
 		pr_error("error protecting socket");
@@ -180,6 +206,24 @@ static void set_bound_address(fastd_socket_t *sock) {
 	*sock->bound_addr = addr;
 }
 
+/**
+   Enables SO_TXTIME on a socket, so packets can be paced by the kernel
+
+   Failures are not fatal, as transmit pacing falls back to enforcing the rate in userspace.
+*/
+static void enable_txtime(UNUSED fastd_socket_t *sock) {
+#ifdef USE_TXTIME
+	const struct sock_txtime txtime = { .clockid = CLOCK_MONOTONIC };
+
+	if (setsockopt(sock->fd.fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime))) {
+		pr_debug_errno("setsockopt: unable to set SO_TXTIME");
+		return;
+	}
+
+	sock->txtime = true;
+#endif
+}
+
 /** Tries to initialize sockets for all configured bind addresses */
 void fastd_socket_bind_all(void) {
 	size_t i;
@@ -195,6 +239,7 @@ void fastd_socket_bind_all(void) {
 			exit(1); /* message has already been printed */
 
 		set_bound_address(sock);
+		enable_txtime(sock);
 
 		fastd_peer_address_t bound_addr = *sock->bound_addr;
 		if (!sock->addr->addr.sa.sa_family)
@@ -218,6 +263,7 @@ static fastd_socket_t *open_dynamic_socket(const fastd_bind_address_t *addr, boo
 	fastd_socket_t *sock = fastd_new0(fastd_socket_t);
 	sock->fd = FASTD_POLL_FD(POLL_TYPE_SOCKET, fd);
 	set_bound_address(sock);
+	enable_txtime(sock);
 
 	return sock;
 }
@@ -251,8 +297,14 @@ fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af) {
 	return sock;
 }
 
-/** Opens a socket for L2TP offloading */
-fastd_socket_t *fastd_socket_open_offload(fastd_socket_t *sock, const fastd_peer_address_t *local_addr) {
+/**
+   Opens a socket bound to the same port as an existing socket
+
+   The clone is bound to a specific local address; it is used for L2TP offloading and as a
+   connected peer socket. Packets received on the clone are handled as if they had been
+   received on the original socket.
+*/
+fastd_socket_t *fastd_socket_clone(fastd_socket_t *sock, const fastd_peer_address_t *local_addr) {
 	if (!sock->bound_addr)
 		exit_bug("attempted to clone unbound socket");
 
@@ -261,15 +313,40 @@ fastd_socket_t *fastd_socket_open_offload(fastd_socket_t *sock, const fastd_peer
 		.bindtodev = sock->addr ? sock->addr->bindtodev : NULL,
 	};
 
-	fastd_socket_t *offload_sock = open_dynamic_socket(&bind_address, true);
-	if (!offload_sock)
+	fastd_socket_t *clone = open_dynamic_socket(&bind_address, true);
+	if (!clone)
 		return NULL;
 
-	offload_sock->parent = sock;
+	clone->parent = sock;
 
-	fastd_poll_fd_register(&offload_sock->fd);
+	fastd_poll_fd_register(&clone->fd);
+
+	return clone;
+}
+
+/**
+   Connects a socket to the given address
+
+   The L2TP kernel code expects the offload socket to be connected to the peer address;
+   connected peer sockets use the kernel's cached route for sending.
+*/
+bool fastd_socket_connect(fastd_socket_t *sock, const fastd_peer_address_t *addr) {
+	int err;
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		err = connect(sock->fd.fd, (const struct sockaddr *)&addr->in, sizeof(addr->in));
+		break;
+
+	case AF_INET6:
+		err = connect(sock->fd.fd, (const struct sockaddr *)&addr->in6, sizeof(addr->in6));
+		break;
+
+	default:
+		exit_bug("unsupported address family");
+	}
 
-	return offload_sock;
+	return (err == 0);
 }
 
 /** Closes a socket */
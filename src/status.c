@@ -16,8 +16,15 @@
 
 #ifdef WITH_STATUS_SOCKET
 
+#include "aggregate.h"
+#include "compress.h"
+#include "fec.h"
 #include "method.h"
+#include "neigh.h"
+#include "pacing.h"
+#include "path.h"
 #include "peer.h"
+#include "txq.h"
 
 #include <json-c/json.h>
 #include <sys/file.h>
@@ -72,6 +79,25 @@ static json_object *dump_iface(const fastd_iface_t *iface) {
 	return (iface && iface->name) ? json_object_new_string(iface->name) : NULL;
 }
 
+#ifdef WITH_IFACE_NETLINK
+
+/** Dumps the state of the interface pool */
+static json_object *dump_iface_pool(void) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "size", json_object_new_int64(conf.iface_pool_size));
+	json_object_object_add(ret, "low", json_object_new_int64(conf.iface_pool_low));
+	json_object_object_add(ret, "high", json_object_new_int64(conf.iface_pool_high));
+	json_object_object_add(ret, "idle", json_object_new_int64(VECTOR_LEN(ctx.iface_pool.idle)));
+	json_object_object_add(ret, "hits", json_object_new_int64(ctx.iface_pool.hits));
+	json_object_object_add(ret, "misses", json_object_new_int64(ctx.iface_pool.misses));
+	json_object_object_add(ret, "discarded", json_object_new_int64(ctx.iface_pool.discarded));
+
+	return ret;
+}
+
+#endif
+
 /** Dumps a fastd_stats_t as a JSON object */
 static json_object *dump_stats(const fastd_stats_t *stats) {
 	struct json_object *statistics = json_object_new_object();
@@ -79,14 +105,217 @@ static json_object *dump_stats(const fastd_stats_t *stats) {
 	json_object_object_add(statistics, "rx", dump_stat(stats, STAT_RX));
 	json_object_object_add(statistics, "rx_reordered", dump_stat(stats, STAT_RX_REORDERED));
 
+	if (conf.forward) {
+		json_object_object_add(statistics, "rx_forwarded", dump_stat(stats, STAT_RX_FORWARDED));
+		json_object_object_add(statistics, "rx_local", dump_stat(stats, STAT_RX_LOCAL));
+	}
+
 	json_object_object_add(statistics, "tx", dump_stat(stats, STAT_TX));
 	json_object_object_add(statistics, "tx_dropped", dump_stat(stats, STAT_TX_DROPPED));
 	json_object_object_add(statistics, "tx_error", dump_stat(stats, STAT_TX_ERROR));
 
+	if (fastd_neigh_proxy_enabled()) {
+		json_object_object_add(statistics, "arp_suppressed", dump_stat(stats, STAT_ARP_SUPPRESSED));
+		json_object_object_add(statistics, "nd_suppressed", dump_stat(stats, STAT_ND_SUPPRESSED));
+	}
+
+	if (conf.mode == MODE_TAP) {
+		json_object_object_add(statistics, "broadcast_limited", dump_stat(stats, STAT_BROADCAST_LIMITED));
+		json_object_object_add(statistics, "multicast_limited", dump_stat(stats, STAT_MULTICAST_LIMITED));
+	}
+
+	if (fastd_use_fec()) {
+		json_object_object_add(statistics, "rx_fec_recovered", dump_stat(stats, STAT_RX_FEC_RECOVERED));
+		json_object_object_add(statistics, "tx_fec_parity", dump_stat(stats, STAT_TX_FEC_PARITY));
+	}
+
+	if (fastd_use_aggregation()) {
+		json_object_object_add(statistics, "rx_aggregated", dump_stat(stats, STAT_RX_AGGREGATED));
+		json_object_object_add(statistics, "tx_aggregated", dump_stat(stats, STAT_TX_AGGREGATED));
+	}
+
+	if (fastd_use_compression()) {
+		json_object_object_add(statistics, "rx_compressed", dump_stat(stats, STAT_RX_COMPRESSED));
+		json_object_object_add(statistics, "tx_compressed", dump_stat(stats, STAT_TX_COMPRESSED));
+	}
+
+	json_object_object_add(statistics, "tx_paced", dump_stat(stats, STAT_TX_PACED));
+	json_object_object_add(statistics, "tx_pacing_dropped", dump_stat(stats, STAT_TX_PACING_DROPPED));
+
+	if (conf.tx_queue)
+		json_object_object_add(statistics, "tx_queue_dropped", dump_stat(stats, STAT_TX_QUEUE_DROPPED));
+
 	return statistics;
 }
 
 
+/** Dumps the FEC state of a peer as a JSON object */
+static json_object *dump_fec(const fastd_fec_t *fec) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "group_size", json_object_new_int64(fec->tx_group_size));
+	json_object_object_add(ret, "rx_loss", json_object_new_double((double)fec->loss / 256));
+	json_object_object_add(ret, "tx_loss", json_object_new_double((double)fec->remote_loss / 256));
+
+	return ret;
+}
+
+/** Returns the average number of packets per datagram */
+static double aggregate_ratio(uint64_t frames, uint64_t datagrams) {
+	return datagrams ? (double)frames / datagrams : 0;
+}
+
+/** Dumps the aggregation state of a peer as a JSON object */
+static json_object *dump_aggregate(const fastd_aggregate_t *aggr) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "delay", json_object_new_int64(conf.aggregate_delay));
+	json_object_object_add(ret, "rx_packets", json_object_new_int64(aggr->rx_frames));
+	json_object_object_add(ret, "rx_datagrams", json_object_new_int64(aggr->rx_datagrams));
+	json_object_object_add(
+		ret, "rx_ratio", json_object_new_double(aggregate_ratio(aggr->rx_frames, aggr->rx_datagrams)));
+	json_object_object_add(ret, "tx_packets", json_object_new_int64(aggr->tx_frames));
+	json_object_object_add(ret, "tx_datagrams", json_object_new_int64(aggr->tx_datagrams));
+	json_object_object_add(
+		ret, "tx_ratio", json_object_new_double(aggregate_ratio(aggr->tx_frames, aggr->tx_datagrams)));
+
+	return ret;
+}
+
+/**
+   Dumps the compression state of a peer as a JSON object
+
+   The saved bytes are negative when the trailers outweigh the compression gains.
+*/
+static json_object *dump_compress(const fastd_compress_t *comp) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "ratio", json_object_new_double((double)comp->ratio / 256));
+	json_object_object_add(ret, "bypassed", json_object_new_int64(comp->tx_bypassed));
+	json_object_object_add(ret, "rx_bytes", json_object_new_int64(comp->rx_bytes));
+	json_object_object_add(
+		ret, "rx_saved", json_object_new_int64((int64_t)(comp->rx_bytes - comp->rx_compressed_bytes)));
+	json_object_object_add(ret, "tx_bytes", json_object_new_int64(comp->tx_bytes));
+	json_object_object_add(
+		ret, "tx_saved", json_object_new_int64((int64_t)(comp->tx_bytes - comp->tx_compressed_bytes)));
+
+	return ret;
+}
+
+/** Returns the number of non-empty flow queues of a traffic class of a transmit queue */
+static size_t txq_class_flows(const fastd_txq_class_t *class) {
+	size_t flows = 0, i;
+	for (i = 0; i < TXQ_FLOWS; i++) {
+		if (class->flows[i].head)
+			flows++;
+	}
+
+	return flows;
+}
+
+/** Dumps a traffic class of a transmit queue as a JSON object */
+static json_object *dump_txq_class(const fastd_txq_class_t *class) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "packets", json_object_new_int64(class->packets));
+	json_object_object_add(ret, "bytes", json_object_new_int64(class->bytes));
+	json_object_object_add(ret, "flows", json_object_new_int64(txq_class_flows(class)));
+	json_object_object_add(ret, "sent_packets", json_object_new_int64(class->sent_packets));
+	json_object_object_add(ret, "sent_bytes", json_object_new_int64(class->sent_bytes));
+	json_object_object_add(ret, "dropped", json_object_new_int64(class->dropped));
+
+	return ret;
+}
+
+/** Dumps the state of a peer's transmit queue as a JSON object */
+static json_object *dump_txq(const fastd_txq_t *txq) {
+	struct json_object *ret = json_object_new_object();
+
+	size_t flows = 0, i;
+	for (i = 0; i < txq->n_classes; i++)
+		flows += txq_class_flows(&txq->classes[i]);
+
+	json_object_object_add(ret, "packets", json_object_new_int64(txq->packets));
+	json_object_object_add(ret, "bytes", json_object_new_int64(txq->bytes));
+	json_object_object_add(ret, "flows", json_object_new_int64(flows));
+	json_object_object_add(ret, "blocked", json_object_new_boolean(txq->blocked));
+
+	/* Without configured traffic classes, all packets belong to the default class */
+	if (txq->n_classes > 1) {
+		struct json_object *classes = json_object_new_object();
+
+		for (i = 0; i < txq->n_classes; i++)
+			json_object_object_add(classes, fastd_txq_class_name(i), dump_txq_class(&txq->classes[i]));
+
+		json_object_object_add(ret, "classes", classes);
+	}
+
+	return ret;
+}
+
+/** Dumps the transmit pacing state of a peer as a JSON object */
+static json_object *dump_pacing(const fastd_peer_t *peer, const fastd_pacing_rate_t *pacing) {
+	struct json_object *ret = json_object_new_object();
+
+	/* The time the next packet would have to wait, in microseconds */
+	int64_t delay = (peer->pacing_next - fastd_get_time_ns()) / 1000;
+
+	json_object_object_add(ret, "rate", json_object_new_int64(pacing->rate / 125));
+	json_object_object_add(ret, "burst", json_object_new_int64(pacing->burst));
+	json_object_object_add(ret, "delay", json_object_new_int64(delay > 0 ? delay : 0));
+	json_object_object_add(ret, "kernel", json_object_new_boolean(peer->pacing_kernel));
+
+	return ret;
+}
+
+/** Dumps the measurements of the paths to a peer's remotes as a JSON array */
+static json_object *dump_paths(const fastd_peer_t *peer) {
+	struct json_object *paths = json_object_new_array();
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->paths); i++) {
+		const fastd_path_t *path = &VECTOR_INDEX(peer->paths, i);
+		struct json_object *ret = json_object_new_object();
+
+		/* '[' + IPv6 addresss + '%' + interface + ']:' + port + NUL */
+		char addr_buf[1 + INET6_ADDRSTRLEN + 2 + IFNAMSIZ + 1 + 5 + 1];
+		fastd_snprint_peer_address(addr_buf, sizeof(addr_buf), &path->address, NULL, false, false);
+
+		json_object_object_add(ret, "address", json_object_new_string(addr_buf));
+
+		const fastd_peer_address_t *local_addr = &peer->local_address;
+		if (path->local_address.sa.sa_family != AF_UNSPEC)
+			local_addr = &path->local_address;
+		else if (path->sock)
+			local_addr = path->sock->bound_addr;
+
+		fastd_snprint_peer_address(addr_buf, sizeof(addr_buf), local_addr, NULL, false, false);
+		json_object_object_add(ret, "local", json_object_new_string(addr_buf));
+
+		json_object_object_add(ret, "rtt", path->srtt >= 0 ? json_object_new_int64(path->srtt) : NULL);
+		json_object_object_add(ret, "loss", json_object_new_double((double)path->loss / 256));
+		json_object_object_add(ret, "probes", json_object_new_int64(path->probes));
+		json_object_object_add(ret, "replies", json_object_new_int64(path->replies));
+
+		json_object_object_add(ret, "learned", json_object_new_boolean(path->learned));
+
+		bool current = !path->sock && fastd_peer_address_equal(&path->address, &peer->address);
+		json_object_object_add(ret, "current", json_object_new_boolean(current));
+
+		if (fastd_use_multipath()) {
+			json_object_object_add(ret, "weight", json_object_new_int64(path->weight));
+			json_object_object_add(ret, "tx_packets", json_object_new_int64(path->tx_packets));
+			json_object_object_add(ret, "tx_bytes", json_object_new_int64(path->tx_bytes));
+			json_object_object_add(ret, "rx_packets", json_object_new_int64(path->rx_packets));
+			json_object_object_add(ret, "rx_bytes", json_object_new_int64(path->rx_bytes));
+		}
+
+		json_object_array_add(paths, ret);
+	}
+
+	return paths;
+}
+
 /** Dumps a peer's status as a JSON object */
 static json_object *dump_peer(const fastd_peer_t *peer) {
 	struct json_object *ret = json_object_new_object();
@@ -117,8 +346,30 @@ static json_object *dump_peer(const fastd_peer_t *peer) {
 
 		json_object_object_add(connection, "method", method);
 
+		json_object_object_add(
+			connection, "offloaded", json_object_new_boolean(peer->offload && !peer->offload_pending));
+
 		json_object_object_add(connection, "statistics", dump_stats(&peer->stats));
 
+		if (VECTOR_LEN(peer->paths))
+			json_object_object_add(connection, "paths", dump_paths(peer));
+
+		if (peer->fec)
+			json_object_object_add(connection, "fec", dump_fec(peer->fec));
+
+		if (peer->aggregate)
+			json_object_object_add(connection, "aggregation", dump_aggregate(peer->aggregate));
+
+		if (peer->compress)
+			json_object_object_add(connection, "compression", dump_compress(peer->compress));
+
+		const fastd_pacing_rate_t *pacing = fastd_pacing_rate(peer);
+		if (pacing)
+			json_object_object_add(connection, "pacing", dump_pacing(peer, pacing));
+
+		if (peer->txq)
+			json_object_object_add(connection, "tx_queue", dump_txq(peer->txq));
+
 		if (conf.mode == MODE_TAP) {
 			struct json_object *mac_addresses = json_object_new_array();
 			json_object_object_add(connection, "mac_addresses", mac_addresses);
@@ -156,6 +407,11 @@ static void dump_status(int fd) {
 	if (ctx.iface)
 		json_object_object_add(json, "interface", dump_iface(ctx.iface));
 
+#ifdef WITH_IFACE_NETLINK
+	if (conf.iface_pool_size)
+		json_object_object_add(json, "interface_pool", dump_iface_pool());
+#endif
+
 	json_object_object_add(json, "statistics", dump_stats(&ctx.stats));
 
 	struct json_object *peers = json_object_new_object();
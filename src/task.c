@@ -11,12 +11,19 @@
 */
 
 #include "task.h"
+#include "aggregate.h"
+#include "mcast.h"
+#include "neigh.h"
 #include "peer.h"
+#include "txq.h"
 
 
 /** Performs periodic maintenance tasks */
 static inline void maintenance(void) {
 	fastd_peer_eth_addr_cleanup();
+	fastd_neigh_cleanup();
+	fastd_mcast_cleanup();
+	fastd_iface_pool_maintenance();
 	fastd_task_reschedule_relative(&ctx.next_maintenance, MAINTENANCE_INTERVAL);
 }
 
@@ -34,6 +41,14 @@ static void handle_task(void) {
 		fastd_peer_handle_task(task);
 		break;
 
+	case TASK_TYPE_TXQ:
+		fastd_txq_handle_task(task);
+		break;
+
+	case TASK_TYPE_AGGREGATE:
+		fastd_aggregate_handle_task(task);
+		break;
+
 	default:
 		exit_bug("unknown task type");
 	}
@@ -31,6 +31,16 @@ int64_t fastd_get_time(void) {
 	return nsecs / 1000000;
 }
 
+/** Returns a monotonic timestamp in nanoseconds */
+int64_t fastd_get_time_ns(void) {
+	static mach_timebase_info_data_t timebase_info = {};
+
+	if (!timebase_info.denom)
+		mach_timebase_info(&timebase_info);
+
+	return (((long double)mach_absolute_time()) * timebase_info.numer) / timebase_info.denom;
+}
+
 #else
 
 /** Returns a monotonic timestamp in milliseconds */
@@ -41,4 +51,16 @@ int64_t fastd_get_time(void) {
 	return (1000 * (int64_t)ts.tv_sec) + ts.tv_nsec / 1000000;
 }
 
+/**
+   Returns a monotonic timestamp in nanoseconds
+
+   The timestamp uses the clock the kernel expects SO_TXTIME departure times in.
+*/
+int64_t fastd_get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (1000000000 * (int64_t)ts.tv_sec) + ts.tv_nsec;
+}
+
 #endif
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Propagation of the DSCP and ECN fields between the inner and outer IP headers
+
+   When an encapsulated packet is sent, the DSCP and/or ECN fields of the inner IP header
+   can be copied to the outer header, so QoS classes are honored and active queue management
+   can mark packets on the path between the peers. On receipt, congestion marks of the outer
+   header are propagated to the inner header following the normal mode of RFC 6040.
+*/
+
+
+#include "tos.h"
+#include "peer.h"
+#include "peer_group.h"
+
+#include <net/ethernet.h>
+
+
+/** The mask of the DSCP field in an IPv4 TOS or IPv6 traffic class value */
+#define TOS_DSCP_MASK 0xfc
+
+
+/**
+   Returns a pointer to the IP header of an inner packet, or NULL if the packet isn't an IPv4 or IPv6 packet
+
+   \e offset bytes at the start of the buffer are skipped.
+*/
+static uint8_t *ip_header(const fastd_buffer_t *buffer, size_t offset) {
+	if (buffer->len < offset)
+		return NULL;
+
+	uint8_t *data = (uint8_t *)buffer->data + offset;
+	size_t len = buffer->len - offset;
+
+	if (conf.mode != MODE_TUN) {
+		if (len < sizeof(fastd_eth_header_t))
+			return NULL;
+
+		uint16_t proto;
+		memcpy(&proto, data + offsetof(fastd_eth_header_t, proto), sizeof(proto));
+		if (proto != htons(ETHERTYPE_IP) && proto != htons(ETHERTYPE_IPV6))
+			return NULL;
+
+		data += sizeof(fastd_eth_header_t);
+		len -= sizeof(fastd_eth_header_t);
+	}
+
+	if (len < 1)
+		return NULL;
+
+	switch (data[0] >> 4) {
+	case 4:
+		return (len >= 20) ? data : NULL;
+
+	case 6:
+		return (len >= 40) ? data : NULL;
+
+	default:
+		return NULL;
+	}
+}
+
+/** Returns the TOS (IPv4) or traffic class (IPv6) value of an IP header */
+static uint8_t get_tos(const uint8_t *ip) {
+	if ((ip[0] >> 4) == 4)
+		return ip[1];
+	else
+		return (ip[0] << 4) | (ip[1] >> 4);
+}
+
+/** Sets the TOS (IPv4) or traffic class (IPv6) value of an IP header, updating the IPv4 header checksum */
+static void set_tos(uint8_t *ip, uint8_t tos) {
+	if ((ip[0] >> 4) == 4) {
+		/* Incremental checksum update (RFC 1624) of the 16bit word containing the TOS */
+		uint16_t old_word = (ip[0] << 8) | ip[1];
+		uint16_t new_word = (ip[0] << 8) | tos;
+		uint32_t sum = (uint16_t)~((ip[10] << 8) | ip[11]);
+
+		sum += (uint16_t)~old_word;
+		sum += new_word;
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+
+		ip[1] = tos;
+		ip[10] = ~sum >> 8;
+		ip[11] = ~sum;
+	} else {
+		ip[0] = (ip[0] & 0xf0) | (tos >> 4);
+		ip[1] = (ip[1] & 0x0f) | (tos << 4);
+	}
+}
+
+/** Returns the TOS or traffic class value to send a packet with, skipping \e offset bytes at its start */
+static uint8_t encapsulate(const fastd_peer_t *peer, const fastd_buffer_t *buffer, size_t offset) {
+	uint8_t mask;
+
+	switch (*fastd_peer_group_lookup_peer(peer, copy_tos)) {
+	case TOS_COPY_ECN:
+		mask = TOS_ECN_MASK;
+		break;
+
+	case TOS_COPY_DSCP:
+		mask = TOS_DSCP_MASK;
+		break;
+
+	case TOS_COPY_ALL:
+		mask = TOS_DSCP_MASK | TOS_ECN_MASK;
+		break;
+
+	default:
+		return 0;
+	}
+
+	const uint8_t *ip = ip_header(buffer, offset);
+	if (!ip)
+		return 0;
+
+	return get_tos(ip) & mask;
+}
+
+/**
+   Returns the TOS or traffic class value to send an encapsulated packet with
+
+   When aggregation has been negotiated with the peer, the packet is prefixed with an aggregation header,
+   and the value is determined by the first of the aggregated packets.
+*/
+uint8_t fastd_tos_encapsulate(const fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	return encapsulate(peer, buffer, peer->aggregate ? sizeof(fastd_aggregate_header_t) : 0);
+}
+
+/** Returns the TOS or traffic class value a single packet would be sent with before it is aggregated */
+uint8_t fastd_tos_encapsulate_packet(const fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	return encapsulate(peer, buffer, 0);
+}
+
+/**
+   Propagates the ECN field of the outer IP header of a received packet to the inner header
+
+   Implements the decapsulation of RFC 6040 (normal mode). Returns false if the packet must be
+   dropped, as the outer header is marked as CE, but the inner packet doesn't support ECN.
+*/
+bool fastd_tos_decapsulate(fastd_buffer_t *buffer, uint8_t outer_tos) {
+	uint8_t outer_ecn = outer_tos & TOS_ECN_MASK;
+
+	/* Only CE and ECT(1) are propagated */
+	if (outer_ecn != TOS_ECN_CE && outer_ecn != TOS_ECN_ECT_1)
+		return true;
+
+	uint8_t *ip = ip_header(buffer, 0);
+	if (!ip)
+		return true;
+
+	uint8_t tos = get_tos(ip);
+
+	switch (tos & TOS_ECN_MASK) {
+	case TOS_ECN_NOT_ECT:
+		return (outer_ecn != TOS_ECN_CE);
+
+	case TOS_ECN_ECT_0:
+		break;
+
+	case TOS_ECN_ECT_1:
+		if (outer_ecn != TOS_ECN_CE)
+			return true;
+
+		break;
+
+	default:
+		return true;
+	}
+
+	set_tos(ip, (tos & ~TOS_ECN_MASK) | outer_ecn);
+	return true;
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Propagation of the DSCP and ECN fields between the inner and outer IP headers
+*/
+
+
+#pragma once
+
+
+#include "fastd.h"
+
+
+/** The mask of the ECN field in an IPv4 TOS or IPv6 traffic class value */
+#define TOS_ECN_MASK 0x03
+
+/** ECN codepoint \em Not-ECT (the packet doesn't support ECN) */
+#define TOS_ECN_NOT_ECT 0x00
+/** ECN codepoint \em ECT(1) */
+#define TOS_ECN_ECT_1 0x01
+/** ECN codepoint \em ECT(0) */
+#define TOS_ECN_ECT_0 0x02
+/** ECN codepoint \em CE (congestion experienced) */
+#define TOS_ECN_CE 0x03
+
+
+uint8_t fastd_tos_encapsulate(const fastd_peer_t *peer, const fastd_buffer_t *buffer);
+uint8_t fastd_tos_encapsulate_packet(const fastd_peer_t *peer, const fastd_buffer_t *buffer);
+bool fastd_tos_decapsulate(fastd_buffer_t *buffer, uint8_t outer_tos);
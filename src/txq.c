@@ -0,0 +1,595 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Per-peer transmit queues with traffic classes, flow-fair scheduling and CoDel active queue management
+
+   Without a transmit queue, payload packets are encrypted and passed to the kernel immediately;
+   a bulk transfer to a peer can then fill the queues on the path to the peer and add hundreds of
+   milliseconds of latency to interactive traffic to the same peer.
+
+   When transmit queues are enabled, packets are only queued when they can't be sent right away,
+   i.e. when the peer's pacing rate has been reached or its socket has returned EAGAIN. Queued
+   packets are assigned to one of TXQ_FLOWS flow queues by a hash of the inner IP addresses,
+   protocol and ports, and the flow queues are served by deficit round robin, preferring flows
+   which have just become active (like the fq_codel queueing discipline of Linux). The CoDel
+   algorithm (RFC 8289) drops packets of flows whose packets have been queued for longer than
+   TXQ_CODEL_TARGET for an interval, so the queue stays short while bulk flows still fill the link.
+
+   Packets can additionally be assigned to configured traffic classes by their inner DSCP value or
+   TCP/UDP port. Each class has its own set of flow queues; the classes are served by strict
+   priority, so queued packets of a higher class overtake all packets of lower classes, and are
+   sent with the socket priority of their class, so local queueing disciplines can honor it as well.
+
+   Packets are queued unencrypted, so dropped packets don't waste any crypto and nonces are
+   assigned in sending order.
+*/
+
+
+#include "txq.h"
+#include "aggregate.h"
+#include "hash.h"
+#include "pacing.h"
+#include "polling.h"
+
+#include <net/ethernet.h>
+
+
+/** The number of nanoseconds per millisecond */
+#define NSEC_PER_MSEC 1000000
+
+
+/** The header fields of an inner IP packet used to assign it to a flow and traffic class */
+typedef struct packet_headers {
+	const uint8_t *addrs; /**< The source and destination addresses */
+	size_t addrs_len;     /**< The length of the source and destination addresses */
+	uint8_t proto;        /**< The protocol of the payload */
+	uint8_t tos;          /**< The TOS (IPv4) or traffic class (IPv6) value */
+	const uint8_t *ports; /**< The TCP or UDP source and destination ports (or NULL) */
+} packet_headers_t;
+
+
+/** Returns the number of bytes a flow may send in each round */
+static inline int32_t quantum(void) {
+	return fastd_max_payload(ctx.max_mtu);
+}
+
+/** Finds the IP header fields of a packet; returns false if the packet isn't a (complete enough) IP packet */
+static bool parse_headers(const fastd_buffer_t *buffer, packet_headers_t *headers) {
+	const uint8_t *data = buffer->data;
+	size_t len = buffer->len;
+
+	if (conf.mode != MODE_TUN) {
+		if (len < sizeof(fastd_eth_header_t))
+			return false;
+
+		uint16_t proto;
+		memcpy(&proto, data + offsetof(fastd_eth_header_t, proto), sizeof(proto));
+
+		if (proto != htons(ETHERTYPE_IP) && proto != htons(ETHERTYPE_IPV6))
+			return false;
+
+		data += sizeof(fastd_eth_header_t);
+		len -= sizeof(fastd_eth_header_t);
+	}
+
+	if (len < 1)
+		return false;
+
+	size_t l4_offset;
+
+	switch (data[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return false;
+
+		headers->addrs = data + 12;
+		headers->addrs_len = 8;
+		headers->proto = data[9];
+		headers->tos = data[1];
+		l4_offset = 4 * (data[0] & 0x0f);
+
+		/* Only the first fragment contains the ports */
+		if ((data[6] & 0x1f) || data[7])
+			l4_offset = len;
+
+		break;
+
+	case 6:
+		if (len < 40)
+			return false;
+
+		headers->addrs = data + 8;
+		headers->addrs_len = 32;
+		headers->proto = data[6];
+		headers->tos = (data[0] << 4) | (data[1] >> 4);
+		l4_offset = 40;
+		break;
+
+	default:
+		return false;
+	}
+
+	if ((headers->proto == IPPROTO_TCP || headers->proto == IPPROTO_UDP) && l4_offset + 4 <= len)
+		headers->ports = data + l4_offset;
+	else
+		headers->ports = NULL;
+
+	return true;
+}
+
+/** Returns the flow hash of a packet, using the inner IP addresses, protocol and ports where available */
+static uint32_t flow_hash(const fastd_txq_t *txq, const fastd_buffer_t *buffer, const packet_headers_t *headers) {
+	uint32_t hash = txq->seed;
+
+	if (headers) {
+		fastd_hash(&hash, headers->addrs, headers->addrs_len);
+		fastd_hash(&hash, &headers->proto, sizeof(headers->proto));
+
+		if (headers->ports)
+			fastd_hash(&hash, headers->ports, 4);
+	} else if (conf.mode != MODE_TUN && buffer->len >= sizeof(fastd_eth_header_t)) {
+		/* Other frames are distinguished by their addresses only */
+		fastd_hash(&hash, buffer->data, offsetof(fastd_eth_header_t, proto));
+	}
+
+	fastd_hash_final(&hash);
+	return hash;
+}
+
+/** Checks if a packet matches a traffic class */
+static bool class_match(const fastd_traffic_class_t *class, const packet_headers_t *headers) {
+	if (class->dscp & (UINT64_C(1) << (headers->tos >> 2)))
+		return true;
+
+	if (!headers->ports)
+		return false;
+
+	uint16_t src_port = (headers->ports[0] << 8) | headers->ports[1];
+	uint16_t dest_port = (headers->ports[2] << 8) | headers->ports[3];
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(class->ports); i++) {
+		uint16_t port = VECTOR_INDEX(class->ports, i);
+		if (port == src_port || port == dest_port)
+			return true;
+	}
+
+	return false;
+}
+
+/** Returns the index of the first traffic class a packet matches, or of the default class */
+static size_t classify(const packet_headers_t *headers) {
+	size_t n_classes = VECTOR_LEN(conf.traffic_classes);
+	if (!headers)
+		return n_classes;
+
+	size_t i;
+	for (i = 0; i < n_classes; i++) {
+		if (class_match(&VECTOR_INDEX(conf.traffic_classes, i), headers))
+			return i;
+	}
+
+	return n_classes;
+}
+
+/** Returns the socket priority of a traffic class */
+static inline int class_priority(size_t class) {
+	if (class >= VECTOR_LEN(conf.traffic_classes))
+		return 0;
+
+	return VECTOR_INDEX(conf.traffic_classes, class).priority;
+}
+
+/** Returns the name of a traffic class */
+const char *fastd_txq_class_name(size_t class) {
+	if (class >= VECTOR_LEN(conf.traffic_classes))
+		return "default";
+
+	return VECTOR_INDEX(conf.traffic_classes, class).name;
+}
+
+/** Appends a flow to a list of flows */
+static void flow_list_add(fastd_txq_flow_list_t *list, fastd_txq_flow_t *flow) {
+	flow->next = NULL;
+
+	if (list->tail)
+		list->tail->next = flow;
+	else
+		list->head = flow;
+
+	list->tail = flow;
+}
+
+/** Removes the first flow from a list of flows */
+static void flow_list_pop(fastd_txq_flow_list_t *list) {
+	list->head = list->head->next;
+
+	if (!list->head)
+		list->tail = NULL;
+}
+
+/** Removes the oldest packet from a flow of a traffic class */
+static fastd_txq_packet_t *packet_pop(fastd_txq_t *txq, fastd_txq_class_t *class, fastd_txq_flow_t *flow) {
+	fastd_txq_packet_t *packet = flow->head;
+	if (!packet)
+		return NULL;
+
+	flow->head = packet->next;
+	if (!flow->head)
+		flow->tail = NULL;
+
+	flow->bytes -= packet->len;
+	class->bytes -= packet->len;
+	class->packets--;
+	txq->bytes -= packet->len;
+	txq->packets--;
+
+	return packet;
+}
+
+/** Drops a packet of a traffic class that has been removed from the queue */
+static void packet_drop(fastd_txq_t *txq, fastd_txq_class_t *class, fastd_txq_packet_t *packet) {
+	fastd_stats_add(txq->peer, STAT_TX_QUEUE_DROPPED, packet->len);
+	class->dropped++;
+	free(packet);
+}
+
+/** Drops the oldest packet of the flow with the most queued bytes in the lowest non-empty traffic class */
+static void drop_fattest(fastd_txq_t *txq) {
+	fastd_txq_class_t *class = &txq->classes[txq->n_classes - 1];
+	while (!class->packets)
+		class--;
+
+	fastd_txq_flow_t *fattest = &class->flows[0];
+
+	size_t i;
+	for (i = 1; i < TXQ_FLOWS; i++) {
+		if (class->flows[i].bytes > fattest->bytes)
+			fattest = &class->flows[i];
+	}
+
+	packet_drop(txq, class, packet_pop(txq, class, fattest));
+}
+
+/** Adds a packet of a traffic class to the queue */
+static void enqueue(
+	fastd_txq_t *txq, size_t class_index, const fastd_buffer_t *buffer, const packet_headers_t *headers,
+	int64_t now) {
+	fastd_txq_class_t *class = &txq->classes[class_index];
+	fastd_txq_flow_t *flow = &class->flows[flow_hash(txq, buffer, headers) % TXQ_FLOWS];
+
+	fastd_txq_packet_t *packet = fastd_alloc(sizeof(*packet) + buffer->len);
+	packet->next = NULL;
+	packet->enqueued = now;
+	packet->len = buffer->len;
+	memcpy(packet->data, buffer->data, buffer->len);
+
+	if (flow->tail)
+		flow->tail->next = packet;
+	else
+		flow->head = packet;
+
+	flow->tail = packet;
+	flow->bytes += packet->len;
+	class->bytes += packet->len;
+	class->packets++;
+	txq->bytes += packet->len;
+	txq->packets++;
+
+	if (!flow->active) {
+		flow->active = true;
+		flow->deficit = quantum();
+		flow_list_add(&class->new_flows, flow);
+	}
+
+	if (txq->packets > TXQ_LIMIT)
+		drop_fattest(txq);
+}
+
+/** Returns the integer square root of a number */
+static uint64_t isqrt(uint64_t x) {
+	if (x < 2)
+		return x;
+
+	uint64_t r = x, y = (x + 1) / 2;
+	while (y < r) {
+		r = y;
+		y = (r + x / r) / 2;
+	}
+
+	return r;
+}
+
+/** Returns the time of the next drop in CoDel's dropping state, \e interval / sqrt(\e count) after \e t */
+static int64_t control_law(int64_t t, uint32_t count) {
+	return t + (int64_t)TXQ_CODEL_INTERVAL * NSEC_PER_MSEC * 1024 / isqrt((uint64_t)count << 20);
+}
+
+/** Removes the oldest packet from a flow and determines whether CoDel may drop it */
+static fastd_txq_packet_t *
+codel_pop(fastd_txq_t *txq, fastd_txq_class_t *class, fastd_txq_flow_t *flow, int64_t now, bool *ok_to_drop) {
+	fastd_txq_packet_t *packet = packet_pop(txq, class, flow);
+	*ok_to_drop = false;
+
+	if (!packet) {
+		flow->first_above_time = 0;
+		return NULL;
+	}
+
+	int64_t sojourn = now - packet->enqueued;
+
+	if (sojourn < TXQ_CODEL_TARGET * NSEC_PER_MSEC || flow->bytes <= (size_t)quantum())
+		flow->first_above_time = 0;
+	else if (!flow->first_above_time)
+		flow->first_above_time = now + TXQ_CODEL_INTERVAL * NSEC_PER_MSEC;
+	else if (now >= flow->first_above_time)
+		*ok_to_drop = true;
+
+	return packet;
+}
+
+/** Removes the next packet to send from a flow, dropping packets as decided by CoDel */
+static fastd_txq_packet_t *
+codel_dequeue(fastd_txq_t *txq, fastd_txq_class_t *class, fastd_txq_flow_t *flow, int64_t now) {
+	bool ok_to_drop;
+	fastd_txq_packet_t *packet = codel_pop(txq, class, flow, now, &ok_to_drop);
+
+	if (flow->dropping) {
+		if (!ok_to_drop) {
+			flow->dropping = false;
+			return packet;
+		}
+
+		while (flow->dropping && now >= flow->drop_next) {
+			packet_drop(txq, class, packet);
+			flow->count++;
+
+			packet = codel_pop(txq, class, flow, now, &ok_to_drop);
+			if (ok_to_drop)
+				flow->drop_next = control_law(flow->drop_next, flow->count);
+			else
+				flow->dropping = false;
+		}
+	} else if (ok_to_drop) {
+		packet_drop(txq, class, packet);
+		packet = codel_pop(txq, class, flow, now, &ok_to_drop);
+		flow->dropping = true;
+
+		/* Resume with a higher drop rate if the dropping state was left only a short time ago */
+		uint32_t delta = flow->count - flow->lastcount;
+		if (delta > 1 && now - flow->drop_next < 16 * TXQ_CODEL_INTERVAL * NSEC_PER_MSEC)
+			flow->count = delta;
+		else
+			flow->count = 1;
+
+		flow->lastcount = flow->count;
+		flow->drop_next = control_law(now, flow->count);
+	}
+
+	return packet;
+}
+
+/** Removes the next packet to send from a traffic class, serving its flows by deficit round robin */
+static fastd_txq_packet_t *class_dequeue(fastd_txq_t *txq, fastd_txq_class_t *class, int64_t now) {
+	while (true) {
+		fastd_txq_flow_list_t *list = class->new_flows.head ? &class->new_flows : &class->old_flows;
+		fastd_txq_flow_t *flow = list->head;
+		if (!flow)
+			return NULL;
+
+		if (flow->deficit <= 0) {
+			flow->deficit += quantum();
+			flow_list_pop(list);
+			flow_list_add(&class->old_flows, flow);
+			continue;
+		}
+
+		fastd_txq_packet_t *packet = codel_dequeue(txq, class, flow, now);
+		if (!packet) {
+			flow_list_pop(list);
+
+			/* An emptied new flow must wait for a round before it is preferred again */
+			if (list == &class->new_flows && class->old_flows.head)
+				flow_list_add(&class->old_flows, flow);
+			else
+				flow->active = false;
+
+			continue;
+		}
+
+		flow->deficit -= packet->len;
+		return packet;
+	}
+}
+
+/** Removes the next packet to send from the queue, serving the traffic classes by strict priority */
+static fastd_txq_packet_t *dequeue(fastd_txq_t *txq, int64_t now, size_t *class_index) {
+	size_t i;
+	for (i = 0; i < txq->n_classes; i++) {
+		fastd_txq_packet_t *packet = class_dequeue(txq, &txq->classes[i], now);
+		if (packet) {
+			*class_index = i;
+			return packet;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+   Passes a packet of a traffic class to the protocol for encryption and sending
+
+   Sending resets the peer when its session has timed out, which frees the transmit queue. Returns
+   false in this case, so the caller must not access the queue anymore.
+*/
+static bool class_send(fastd_txq_t *txq, size_t class_index, fastd_buffer_t *buffer) {
+	fastd_peer_t *peer = txq->peer;
+
+	fastd_txq_class_t *class = &txq->classes[class_index];
+	class->sent_packets++;
+	class->sent_bytes += buffer->len;
+
+	ctx.tx_priority = class_priority(class_index);
+	fastd_aggregate_send(peer, buffer);
+	ctx.tx_priority = 0;
+
+	return (peer->txq == txq);
+}
+
+/** Schedules the queue's task to resume sending after \e delay milliseconds */
+static void schedule(fastd_txq_t *txq, int64_t delay) {
+	fastd_task_unschedule(&txq->task);
+	fastd_task_schedule(&txq->task, TASK_TYPE_TXQ, ctx.now + delay);
+}
+
+/**
+   Sends queued packets as long as the peer's pacing rate and socket allow it
+
+   The queue may have been freed when this returns.
+*/
+static void run(fastd_txq_t *txq) {
+	while (txq->packets && !txq->blocked) {
+		int64_t now = fastd_get_time_ns();
+
+		int64_t delay = fastd_pacing_delay(txq->peer, now);
+		if (delay > 0) {
+			schedule(txq, (delay + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+			return;
+		}
+
+		size_t class_index;
+		fastd_txq_packet_t *packet = dequeue(txq, now, &class_index);
+		if (!packet)
+			return;
+
+		fastd_buffer_t *buffer = fastd_buffer_alloc(packet->len, conf.encrypt_headroom);
+		memcpy(buffer->data, packet->data, packet->len);
+		free(packet);
+
+		if (!class_send(txq, class_index, buffer))
+			return;
+	}
+}
+
+/** Creates the transmit queue of a peer */
+static fastd_txq_t *txq_init(fastd_peer_t *peer) {
+	size_t n_classes = VECTOR_LEN(conf.traffic_classes) + 1;
+	fastd_txq_t *txq = fastd_alloc0(sizeof(fastd_txq_t) + n_classes * sizeof(fastd_txq_class_t));
+
+	txq->peer = peer;
+	txq->n_classes = n_classes;
+	fastd_random_bytes(&txq->seed, sizeof(txq->seed), false);
+
+	peer->txq = txq;
+	return txq;
+}
+
+/** Frees the transmit queue of a peer, dropping all queued packets */
+void fastd_txq_free(fastd_peer_t *peer) {
+	fastd_txq_t *txq = peer->txq;
+	if (!txq)
+		return;
+
+	size_t i, j;
+	for (i = 0; i < txq->n_classes; i++) {
+		fastd_txq_class_t *class = &txq->classes[i];
+
+		for (j = 0; j < TXQ_FLOWS; j++) {
+			fastd_txq_packet_t *packet;
+			while ((packet = packet_pop(txq, class, &class->flows[j])))
+				free(packet);
+		}
+	}
+
+	fastd_task_unschedule(&txq->task);
+	free(txq);
+
+	peer->txq = NULL;
+}
+
+/**
+   Sends a payload packet to a peer through its transmit queue, consuming the buffer
+
+   When transmit queues are disabled, or nothing is queued and the packet can be sent right away,
+   the packet is passed to the protocol directly.
+*/
+void fastd_txq_send(fastd_peer_t *peer, fastd_buffer_t *buffer) {
+	if (!conf.tx_queue) {
+		fastd_aggregate_send(peer, buffer);
+		return;
+	}
+
+	fastd_txq_t *txq = peer->txq;
+	if (!txq)
+		txq = txq_init(peer);
+
+	packet_headers_t headers;
+	const packet_headers_t *headers_ptr = parse_headers(buffer, &headers) ? &headers : NULL;
+	size_t class_index = classify(headers_ptr);
+
+	int64_t now = fastd_get_time_ns();
+
+	if (!txq->packets && !txq->blocked && fastd_pacing_delay(peer, now) <= 0) {
+		class_send(txq, class_index, buffer);
+		return;
+	}
+
+	enqueue(txq, class_index, buffer, headers_ptr, now);
+	fastd_buffer_free(buffer);
+
+	run(txq);
+}
+
+/**
+   Suspends sending from a peer's transmit queue after its socket has returned EAGAIN
+
+   The peer's socket is polled for writability; as packets may have been sent on another socket,
+   sending is also resumed after TXQ_BLOCKED_TIMEOUT.
+*/
+void fastd_txq_blocked(fastd_peer_t *peer) {
+	fastd_txq_t *txq = peer->txq;
+	if (!txq || txq->blocked)
+		return;
+
+	txq->blocked = true;
+	txq->wait_sock = peer->connected_sock ? peer->connected_sock : peer->sock;
+
+	if (txq->wait_sock)
+		fastd_poll_fd_set_output(&txq->wait_sock->fd, true);
+
+	schedule(txq, TXQ_BLOCKED_TIMEOUT);
+}
+
+/** Resumes sending from the transmit queues waiting for a socket that has become writable */
+void fastd_txq_handle_writable(fastd_socket_t *sock) {
+	fastd_poll_fd_set_output(&sock->fd, false);
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
+		fastd_txq_t *txq = VECTOR_INDEX(ctx.peers, i)->txq;
+		if (!txq || !txq->blocked || txq->wait_sock != sock)
+			continue;
+
+		txq->blocked = false;
+		fastd_task_unschedule(&txq->task);
+
+		/* May free the queue */
+		run(txq);
+	}
+}
+
+/** Handles the task of a transmit queue */
+void fastd_txq_handle_task(fastd_task_t *task) {
+	fastd_txq_t *txq = container_of(task, fastd_txq_t, task);
+
+	txq->blocked = false;
+
+	/* May free the queue */
+	run(txq);
+}
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Per-peer transmit queues with traffic classes, flow-fair scheduling and CoDel active queue management
+*/
+
+
+#pragma once
+
+
+#include "peer.h"
+#include "task.h"
+
+
+/** A payload packet waiting in a transmit queue */
+typedef struct fastd_txq_packet fastd_txq_packet_t;
+
+/** A payload packet waiting in a transmit queue */
+struct fastd_txq_packet {
+	fastd_txq_packet_t *next; /**< The next packet of the same flow */
+	int64_t enqueued;         /**< The time the packet was enqueued (in nanoseconds) */
+	size_t len;               /**< The length of the packet */
+	uint8_t data[];           /**< The unencrypted packet */
+};
+
+/** A flow queue of a transmit queue */
+typedef struct fastd_txq_flow fastd_txq_flow_t;
+
+/** A flow queue of a transmit queue */
+struct fastd_txq_flow {
+	fastd_txq_packet_t *head; /**< The oldest packet of the flow */
+	fastd_txq_packet_t *tail; /**< The newest packet of the flow */
+	size_t bytes;             /**< The number of queued bytes of the flow */
+
+	fastd_txq_flow_t *next; /**< The next flow in the list of new or old flows */
+	bool active;            /**< Specifies if the flow is in the list of new or old flows */
+	int32_t deficit;        /**< The number of bytes the flow may still send in the current round */
+
+	bool dropping;            /**< Specifies if CoDel is in the dropping state */
+	uint32_t count;           /**< The number of packets dropped since entering the dropping state */
+	uint32_t lastcount;       /**< The value of \e count when the dropping state was last entered */
+	int64_t first_above_time; /**< The time the sojourn time will have been above the target for an interval */
+	int64_t drop_next;        /**< The time the next packet is dropped in the dropping state */
+};
+
+/** A list of flows */
+typedef struct fastd_txq_flow_list {
+	fastd_txq_flow_t *head; /**< The first flow of the list */
+	fastd_txq_flow_t *tail; /**< The last flow of the list */
+} fastd_txq_flow_list_t;
+
+/** A traffic class of a transmit queue */
+typedef struct fastd_txq_class {
+	size_t packets; /**< The number of queued packets of the class */
+	size_t bytes;   /**< The number of queued bytes of the class */
+
+	uint64_t sent_packets; /**< The number of packets of the class passed on for sending */
+	uint64_t sent_bytes;   /**< The number of bytes of the class passed on for sending */
+	uint64_t dropped;      /**< The number of packets of the class dropped from the queue */
+
+	fastd_txq_flow_list_t new_flows; /**< The flows that have become active in the current round */
+	fastd_txq_flow_list_t old_flows; /**< The flows that have been active before */
+
+	fastd_txq_flow_t flows[TXQ_FLOWS]; /**< The flow queues */
+} fastd_txq_class_t;
+
+/**
+   The transmit queue of a peer
+
+   The queue has a class for each configured traffic class, followed by the default class for
+   unclassified packets. Classes are served by strict priority.
+*/
+struct fastd_txq {
+	fastd_peer_t *peer; /**< The peer the queue belongs to */
+	fastd_task_t task;  /**< Task queue entry to resume sending when pacing or a blocked socket allows it */
+
+	uint32_t seed;             /**< The hash seed used to assign packets to flows */
+	size_t packets;            /**< The number of queued packets */
+	size_t bytes;              /**< The number of queued bytes */
+	bool blocked;              /**< Specifies if sending is suspended until the peer's socket becomes writable */
+	fastd_socket_t *wait_sock; /**< The socket that is polled for writability while the queue is blocked */
+
+	size_t n_classes;            /**< The number of traffic classes, including the default class */
+	fastd_txq_class_t classes[]; /**< The traffic classes, highest priority first */
+};
+
+void fastd_txq_free(fastd_peer_t *peer);
+const char *fastd_txq_class_name(size_t class);
+void fastd_txq_send(fastd_peer_t *peer, fastd_buffer_t *buffer);
+void fastd_txq_blocked(fastd_peer_t *peer);
+void fastd_txq_handle_writable(fastd_socket_t *sock);
+void fastd_txq_handle_task(fastd_task_t *task);
@@ -47,6 +47,12 @@ typedef struct fastd_tristate {
 #define PACKET_HANDSHAKE 0x01
 /** Pre-v22 packet type \em data (used for payload data) */
 #define PACKET_DATA_COMPAT 0x02
+/** Packet type \em indexed \em data (payload data prefixed with the receiver's session index) */
+#define PACKET_DATA_INDEXED 0x03
+/** Packet type \em path \em probe (measures the RTT to an address of a peer, prefixed with a session index) */
+#define PACKET_PATH_PROBE 0x04
+/** Packet type \em FEC \em data (indexed payload data or parity protected by forward error correction) */
+#define PACKET_DATA_FEC 0x05
 
 
 #define PACKET_L2TP_VER_MASK 0x0F /**< Mask of L2TP version number in flags_ver field */
@@ -62,6 +68,33 @@ typedef struct fastd_control_packet {
 	uint16_t nr;         /**< Receive sequence number */
 } fastd_control_packet_t;
 
+/** The header of indexed payload packets and path probes, preceding the method-specific packet */
+typedef struct fastd_index_header {
+	uint8_t packet_type; /**< PACKET_DATA_INDEXED, PACKET_PATH_PROBE or PACKET_DATA_FEC */
+	uint8_t index[3];    /**< The session index the receiver has assigned to the sender (big endian) */
+} fastd_index_header_t;
+
+/** Set in the \e pos field of the FEC header of parity packets */
+#define FEC_PARITY 0x80
+
+/** The header following the index header of PACKET_DATA_FEC packets */
+typedef struct fastd_fec_header {
+	uint8_t group; /**< The number of the group of packets protected by the same parity packet */
+	uint8_t pos;   /**< The position in the group, or FEC_PARITY ORed with the number of packets in the group */
+	/** Payload packets: the loss rate reported to the peer (in units of 1/256), parity: the XOR of the lengths */
+	uint16_t param;
+} fastd_fec_header_t;
+
+/** The header preceding each packet in the decrypted payload when aggregation has been negotiated */
+typedef struct fastd_aggregate_header {
+	uint16_t len; /**< The length of the packet (big endian) */
+} fastd_aggregate_header_t;
+
+/** The trailer following the decrypted payload when compression has been negotiated */
+typedef struct fastd_compress_trailer {
+	uint8_t type; /**< The compression applied to the payload (see fastd_compress_type_t) */
+} fastd_compress_trailer_t;
+
 
 /** The supported modes of operation */
 typedef enum fastd_mode {
@@ -79,13 +112,32 @@ typedef enum fastd_drop_caps {
 			    even when TUN/TAP interfaces need to be opened */
 } fastd_drop_caps_t;
 
+/** Specifies how payload packets are distributed across the paths to a peer */
+typedef enum fastd_multipath {
+	MULTIPATH_OFF = 0,     /**< All packets are sent to the peer's current address */
+	MULTIPATH_ROUND_ROBIN, /**< Packets are distributed evenly across all working paths */
+	MULTIPATH_CAPACITY,    /**< Packets are distributed according to the measured capacity of the paths */
+} fastd_multipath_t;
+
+/** The fields of the inner IP header that are copied to the outer header of encapsulated packets */
+typedef enum fastd_tos_copy {
+	TOS_COPY_DEFAULT = 0, /**< Inherited from the parent peer group (nothing is copied for the root group) */
+	TOS_COPY_NONE,        /**< Nothing is copied */
+	TOS_COPY_ECN,         /**< The ECN field is copied */
+	TOS_COPY_DSCP,        /**< The DSCP field is copied */
+	TOS_COPY_ALL,         /**< The DSCP and ECN fields are copied */
+} fastd_tos_copy_t;
+
 /** Types of file descriptors to poll on */
 typedef enum fastd_poll_type {
-	POLL_TYPE_UNSPEC = 0, /**< Unspecified file descriptor type */
-	POLL_TYPE_ASYNC,      /**< The async action socket */
-	POLL_TYPE_STATUS,     /**< The status socket */
-	POLL_TYPE_IFACE,      /**< A TUN/TAP interface */
-	POLL_TYPE_SOCKET,     /**< A network socket */
+	POLL_TYPE_UNSPEC = 0,   /**< Unspecified file descriptor type */
+	POLL_TYPE_ASYNC,        /**< The async action socket */
+	POLL_TYPE_STATUS,       /**< The status socket */
+	POLL_TYPE_IFACE,        /**< A TUN/TAP interface */
+	POLL_TYPE_SOCKET,       /**< A network socket */
+	POLL_TYPE_OFFLOAD_L2TP, /**< The L2TP offload Netlink socket */
+	POLL_TYPE_OFFLOAD_GUE,  /**< The GUE offload rtnetlink socket */
+	POLL_TYPE_OFFLOAD_ESP,  /**< The ESP offload Netlink socket */
 } fastd_poll_type_t;
 
 /** Task types */
@@ -93,8 +145,17 @@ typedef enum fastd_task_type {
 	TASK_TYPE_UNSPEC = 0,  /**< Unspecified task type */
 	TASK_TYPE_MAINTENANCE, /**< Scheduled maintenance */
 	TASK_TYPE_PEER,        /**< Peer maintenance (handshake, reset, keepalive) */
+	TASK_TYPE_TXQ,         /**< Resumption of sending from a peer's transmit queue */
+	TASK_TYPE_AGGREGATE,   /**< Sending of a peer's aggregated packets after the aggregation delay */
 } fastd_task_type_t;
 
+/** Address family indices of per-family multicast snooping state */
+typedef enum fastd_mcast_af {
+	MCAST_AF_IPV4 = 0, /**< IPv4 (IGMP) */
+	MCAST_AF_IPV6,     /**< IPv6 (MLD) */
+	MCAST_AF_MAX,      /**< (Number of address families) */
+} fastd_mcast_af_t;
+
 
 /** A timestamp used as a timeout */
 typedef int64_t fastd_timeout_t;
@@ -112,6 +173,9 @@ typedef struct fastd_buffer fastd_buffer_t;
 typedef struct fastd_buffer_view fastd_buffer_view_t;
 typedef struct fastd_poll_fd fastd_poll_fd_t;
 typedef struct fastd_pqueue fastd_pqueue_t;
+typedef struct fastd_prefix fastd_prefix_t;
+typedef struct fastd_route_node fastd_route_node_t;
+typedef struct fastd_route_table fastd_route_table_t;
 typedef struct fastd_task fastd_task_t;
 
 typedef union fastd_peer_address fastd_peer_address_t;
@@ -119,11 +183,22 @@ typedef struct fastd_bind_address fastd_bind_address_t;
 typedef struct fastd_iface fastd_iface_t;
 typedef struct fastd_socket fastd_socket_t;
 typedef struct fastd_peer_group fastd_peer_group_t;
+typedef struct fastd_rate_limit fastd_rate_limit_t;
 typedef struct fastd_eth_addr fastd_eth_addr_t;
 typedef struct fastd_eth_header fastd_eth_header_t;
 typedef struct fastd_peer fastd_peer_t;
 typedef struct fastd_peer_eth_addr fastd_peer_eth_addr_t;
+typedef struct fastd_token_bucket fastd_token_bucket_t;
+typedef struct fastd_pacing_rate fastd_pacing_rate_t;
+typedef struct fastd_neigh_entry fastd_neigh_entry_t;
+typedef struct fastd_mcast_member fastd_mcast_member_t;
 typedef struct fastd_remote fastd_remote_t;
+typedef struct fastd_path fastd_path_t;
+typedef struct fastd_fec fastd_fec_t;
+typedef struct fastd_txq fastd_txq_t;
+typedef struct fastd_aggregate fastd_aggregate_t;
+typedef struct fastd_compress fastd_compress_t;
+typedef struct fastd_traffic_class fastd_traffic_class_t;
 typedef struct fastd_stats fastd_stats_t;
 typedef struct fastd_handshake_timeout fastd_handshake_timeout_t;
 
@@ -150,7 +225,13 @@ typedef struct fastd_shell_command fastd_shell_command_t;
 typedef struct fastd_shell_env fastd_shell_env_t;
 
 typedef struct fastd_offload_l2tp fastd_offload_l2tp_t;
+typedef struct fastd_offload_gue fastd_offload_gue_t;
+typedef struct fastd_offload_esp fastd_offload_esp_t;
+
+typedef struct fastd_iface_nl fastd_iface_nl_t;
+typedef struct fastd_iface_pool fastd_iface_pool_t;
 typedef struct fastd_offload fastd_offload_t;
+typedef struct fastd_offload_keys fastd_offload_keys_t;
 typedef struct fastd_offload_state fastd_offload_state_t;
 
 
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "route.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+
+static int64_t get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (1000 * (int64_t)ts.tv_sec) + ts.tv_nsec / 1000000;
+}
+
+static void random_addr(uint8_t *addr, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		addr[i] = rand();
+}
+
+static void run_benchmark(uint8_t family, size_t n_prefixes, unsigned min_len, unsigned max_len, size_t iters) {
+	size_t addr_len = (family == AF_INET) ? 4 : 16;
+	fastd_route_table_t table = {};
+
+	printf("Adding %zd IPv%u prefixes (/%u to /%u)... ", n_prefixes, (family == AF_INET) ? 4 : 6, min_len,
+	       max_len);
+
+	int64_t start = get_time();
+	size_t i;
+	for (i = 0; i < n_prefixes; i++) {
+		fastd_prefix_t prefix = { .family = family, .len = min_len + rand() % (max_len - min_len + 1) };
+		random_addr(prefix.addr, addr_len);
+
+		char buf[FASTD_PREFIX_STRLEN];
+		if (!fastd_prefix_parse(&prefix, fastd_prefix_format(buf, &prefix)))
+			exit_bug("prefix parse failed");
+
+		fastd_route_add(&table, &prefix, (fastd_peer_t *)(uintptr_t)(i + 1));
+	}
+	int64_t end = get_time();
+
+	printf("done in %" PRId64 " ms, %zd routes, %zd nodes, %zd KiB\n", end - start, table.n_routes, table.n_nodes,
+	       table.n_nodes * sizeof(fastd_route_node_t) / 1024);
+
+	uint8_t(*addrs)[16] = calloc(1024, sizeof(*addrs));
+	for (i = 0; i < 1024; i++)
+		random_addr(addrs[i], addr_len);
+
+	printf("Running %zd lookups... ", iters);
+
+	size_t found = 0;
+	start = get_time();
+	for (i = 0; i < iters; i++) {
+		if (fastd_route_lookup(&table, family, addrs[i % 1024]))
+			found++;
+	}
+	end = get_time();
+
+	printf("done in %" PRId64 " ms (%zd matched)\n", end - start, found);
+
+	free(addrs);
+	fastd_route_free(&table);
+}
+
+
+int main(void) {
+	srand(1);
+
+	run_benchmark(AF_INET, 100000, 8, 32, 10000000);
+	run_benchmark(AF_INET, 100000, 16, 24, 10000000);
+	run_benchmark(AF_INET6, 100000, 16, 64, 10000000);
+	run_benchmark(AF_INET6, 100000, 32, 128, 10000000);
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Helpers for tests running two fastd instances in separate network namespaces
+# connected by a veth pair. Sourced by the netns test scripts; the path of the
+# fastd binary is passed as the first argument.
+#
+# Namespace "a" has the underlay addresses 192.0.2.1 and 2001:db8::1 and the
+# tunnel addresses 10.1.0.1 and fd00::1, namespace "b" uses .2/::2. Tests exit
+# with 77 (skipped) when they can't run on the current system.
+
+set -eu
+
+FASTD="$1"
+
+NS_A="fastd-test-a-$$"
+NS_B="fastd-test-b-$$"
+NS_PROBE="fastd-test-probe-$$"
+
+WORKDIR=
+
+skip() {
+	echo "SKIP: $*"
+	exit 77
+}
+
+fail() {
+	echo "FAIL: $*"
+	for log in "$WORKDIR"/*.log; do
+		[ -f "$log" ] || continue
+		echo "--- $log"
+		tail -n 50 "$log"
+	done
+	exit 1
+}
+
+cleanup() {
+	for pidfile in "$WORKDIR"/*.pid; do
+		[ -f "$pidfile" ] || continue
+		kill "$(cat "$pidfile")" 2>/dev/null || true
+	done
+	sleep 1
+	ip netns del "$NS_A" 2>/dev/null || true
+	ip netns del "$NS_B" 2>/dev/null || true
+	ip netns del "$NS_PROBE" 2>/dev/null || true
+	rm -rf "$WORKDIR"
+}
+
+# Runs a command in a namespace
+in_ns() {
+	ns="$1"
+	shift
+	ip netns exec "$ns" "$@"
+}
+
+# Checks the requirements shared by all netns tests
+check_common() {
+	WORKDIR="$(mktemp -d)"
+	trap cleanup EXIT INT TERM
+
+	[ -x "$FASTD" ] || skip "fastd binary $FASTD not found"
+	[ "$(id -u)" = 0 ] || skip "must be run as root"
+	command -v ip >/dev/null || skip "ip (iproute2) not found"
+	command -v ping >/dev/null || skip "ping not found"
+	ip netns add "$NS_PROBE" 2>/dev/null || skip "network namespaces are not supported"
+}
+
+# Skips the test unless the command succeeds in a scratch namespace
+require_kernel() {
+	what="$1"
+	shift
+	in_ns "$NS_PROBE" "$@" >/dev/null 2>&1 || skip "the kernel doesn't support $what"
+}
+
+# Creates the two namespaces and the veth pair connecting them
+setup_netns() {
+	ip netns add "$NS_A"
+	ip netns add "$NS_B"
+	ip link add veth0 netns "$NS_A" type veth peer name veth0 netns "$NS_B"
+
+	for ns in "$NS_A" "$NS_B"; do
+		in_ns "$ns" ip link set lo up
+		in_ns "$ns" ip link set veth0 up
+	done
+
+	in_ns "$NS_A" ip addr add 192.0.2.1/24 dev veth0
+	in_ns "$NS_A" ip addr add 2001:db8::1/64 dev veth0 nodad
+	in_ns "$NS_B" ip addr add 192.0.2.2/24 dev veth0
+	in_ns "$NS_B" ip addr add 2001:db8::2/64 dev veth0 nodad
+}
+
+# Generates a keypair for an instance, setting SECRET_<name> and PUBLIC_<name>
+generate_key() {
+	name="$1"
+	secret="$("$FASTD" --generate-key --machine-readable)"
+	echo "secret \"$secret\";" > "$WORKDIR/$name.key"
+	public="$("$FASTD" --config "$WORKDIR/$name.key" --show-key --machine-readable)"
+	eval "SECRET_$name=\$secret"
+	eval "PUBLIC_$name=\$public"
+}
+
+# Starts fastd in a namespace with the config file $WORKDIR/<name>.conf
+start_fastd() {
+	ns="$1"
+	name="$2"
+	in_ns "$ns" "$FASTD" --config "$WORKDIR/$name.conf" --log-level debug >"$WORKDIR/$name.log" 2>&1 &
+	echo $! > "$WORKDIR/$name.pid"
+}
+
+# Stops the fastd instance started with the given name
+stop_fastd() {
+	name="$1"
+	pid="$(cat "$WORKDIR/$name.pid")"
+	kill "$pid"
+	for _ in $(seq 50); do
+		kill -0 "$pid" 2>/dev/null || break
+		sleep 0.1
+	done
+	rm -f "$WORKDIR/$name.pid"
+}
+
+# Waits up to <timeout> seconds for a command to succeed
+wait_for() {
+	timeout="$1"
+	shift
+	for _ in $(seq $((timeout * 10))); do
+		if "$@" >/dev/null 2>&1; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	return 1
+}
+
+# Checks that the log of an instance contains a line matching the pattern
+log_contains() {
+	grep -q "$2" "$WORKDIR/$1.log"
+}
+
+# Returns the value of a statistics counter of a network device in a namespace
+dev_stat() {
+	in_ns "$1" cat "/sys/class/net/$2/statistics/$3"
+}
+
+# Pings the other namespace's tunnel address using IPv4 and IPv6, failing the test if a ping is lost
+ping_both() {
+	ns="$1"
+	v4="$2"
+	v6="$3"
+	in_ns "$ns" ping -q -c 3 -i 0.2 -W 2 "$v4" >/dev/null || fail "IPv4 ping from $ns to $v4 failed"
+	in_ns "$ns" ping -q -c 3 -i 0.2 -W 2 "$v6" >/dev/null || fail "IPv6 ping from $ns to $v6 failed"
+}
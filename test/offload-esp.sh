@@ -0,0 +1,141 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Tests ESP offloading, with offloading on both sides and against a userspace peer
+#
+# Instance "a" always uses "offload esp yes"; instance "b" uses it in the first run and
+# handles the "aes128-gcm@esp" method in userspace in the second. After checking pings
+# in both directions, "b" is restarted, making "a" rekey its offloaded session. The
+# pings are repeated with the new keys, and the security associations of "a" must
+# have been replaced without recreating its XFRM interface.
+
+. "$(dirname "$0")/netns-common.sh"
+
+check_common
+require_kernel "XFRM interfaces" \
+	ip link add xfrm-probe type xfrm if_id 1
+require_kernel "ESP-in-UDP with AES-GCM" \
+	ip xfrm state add src 127.0.0.1 dst 127.0.0.2 proto esp spi 0x100 mode tunnel \
+	aead 'rfc4106(gcm(aes))' 0x0102030405060708090a0b0c0d0e0f1011121314 128 \
+	encap espinudp-nonike 10000 10000 0.0.0.0 if_id 1
+
+setup_netns
+
+generate_key a
+generate_key b
+
+# Writes the on up command; the offload device of the peer is recorded in <name>.offload
+write_up() {
+	name="$1"
+	peer_v4="$2"
+	peer_v6="$3"
+	cat > "$WORKDIR/$name-up.sh" <<EOF
+[ -n "\$PEER_NAME" ] || exit 0
+ip route replace $peer_v4/32 dev "\$INTERFACE"
+ip -6 route replace $peer_v6/128 dev "\$INTERFACE"
+echo "\$INTERFACE" > "$WORKDIR/$name.offload"
+EOF
+}
+
+# Writes the configuration of an instance
+write_conf() {
+	name="$1"
+	offload="$2"
+	local_addr="$3"
+	remote_addr="$4"
+	addr_v4="$5"
+	addr_v6="$6"
+	peer_v4="$7"
+	peer_v6="$8"
+	peer_name="$9"
+	eval "secret=\$SECRET_$name"
+	eval "peer_key=\$PUBLIC_$peer_name"
+
+	write_up "$name" "$peer_v4" "$peer_v6"
+	cat > "$WORKDIR/$name.conf" <<EOF
+mode tun routed;
+interface "fastd-$name";
+interface address "$addr_v4/24";
+interface address "$addr_v6/64";
+method "aes128-gcm@esp";
+bind $local_addr:10000;
+secret "$secret";
+offload esp $offload;
+on up "sh '$WORKDIR/$name-up.sh'";
+
+peer "$peer_name" {
+	key "$peer_key";
+	remote $remote_addr:10000;
+	route "$peer_v4/32";
+	route "$peer_v6/128";
+}
+EOF
+}
+
+# Prints the sorted SPIs of the security associations in a namespace
+list_spis() {
+	in_ns "$1" ip xfrm state | awk '{ for (i = 1; i < NF; i++) if ($i == "spi") print $(i + 1) }' | sort
+}
+
+# Waits for the offload device of an instance, printing its name
+wait_offload() {
+	wait_for 20 test -s "$WORKDIR/$1.offload" || fail "offload device of $1 wasn't set up"
+	cat "$WORKDIR/$1.offload"
+}
+
+run_test() {
+	offload_b="$1"
+
+	echo "Testing ESP offload (offload on b: $offload_b)"
+
+	rm -f "$WORKDIR/a.offload" "$WORKDIR/b.offload"
+	write_conf a yes 192.0.2.1 192.0.2.2 10.1.0.1 fd00::1 10.1.0.2 fd00::2 b
+	write_conf b "$offload_b" 192.0.2.2 192.0.2.1 10.1.0.2 fd00::2 10.1.0.1 fd00::1 a
+
+	start_fastd "$NS_A" a
+	start_fastd "$NS_B" b
+
+	dev="$(wait_offload a)"
+	[ "$offload_b" = no ] || wait_offload b >/dev/null
+
+	tx_before="$(dev_stat "$NS_A" "$dev" tx_packets)"
+	rx_before="$(dev_stat "$NS_A" "$dev" rx_packets)"
+
+	ping_both "$NS_A" 10.1.0.2 fd00::2
+	ping_both "$NS_B" 10.1.0.1 fd00::1
+
+	[ "$(dev_stat "$NS_A" "$dev" tx_packets)" -ge $((tx_before + 12)) ] ||
+		fail "packets weren't sent through offload device $dev"
+	[ "$(dev_stat "$NS_A" "$dev" rx_packets)" -ge $((rx_before + 12)) ] ||
+		fail "packets weren't received through offload device $dev"
+
+	ifindex="$(in_ns "$NS_A" cat "/sys/class/net/$dev/ifindex")"
+	spis="$(list_spis "$NS_A")"
+
+	# Restarting b makes a establish a new session with the existing offload state
+	stop_fastd b
+	rm -f "$WORKDIR/b.offload"
+	start_fastd "$NS_B" b
+
+	# The old handshake key of a may have to expire before the new session is accepted
+	wait_for 60 in_ns "$NS_A" ping -c 1 -W 1 10.1.0.2 || fail "no connectivity after rekeying"
+	[ "$offload_b" = no ] || wait_offload b >/dev/null
+
+	ping_both "$NS_A" 10.1.0.2 fd00::2
+	ping_both "$NS_B" 10.1.0.1 fd00::1
+
+	[ "$(in_ns "$NS_A" cat "/sys/class/net/$dev/ifindex" 2>/dev/null)" = "$ifindex" ] ||
+		fail "offload device $dev was recreated on rekeying"
+	new_spis="$(list_spis "$NS_A" | grep -vxF "$spis" || true)"
+	[ -n "$new_spis" ] || fail "security associations weren't replaced on rekeying"
+
+	stop_fastd a
+	stop_fastd b
+
+	[ -z "$(list_spis "$NS_A")" ] || fail "security associations weren't removed"
+
+	echo "ESP offload (offload on b: $offload_b): OK"
+}
+
+run_test yes
+run_test no
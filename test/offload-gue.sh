@@ -0,0 +1,111 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Tests GUE offloading against a userspace peer
+#
+# Instance "a" uses "offload gue yes", instance "b" handles the "null@gue" method in
+# userspace. Pings in both directions check that the packets encapsulated by the
+# kernel are accepted by fastd, and that fastd's packets are accepted on the
+# offloaded side. The test is run with IPv4 (sit) and IPv6 (ip6tnl) underlays.
+
+. "$(dirname "$0")/netns-common.sh"
+
+check_common
+require_kernel "sit GUE tunnels" \
+	ip link add gue-probe4 type sit local 127.0.0.1 remote 127.0.0.2 encap gue encap-sport 1 encap-dport 2
+require_kernel "ip6tnl GUE tunnels" \
+	ip link add gue-probe6 type ip6tnl mode any local ::1 remote ::2 encap gue encap-sport 1 encap-dport 2
+
+setup_netns
+
+generate_key a
+generate_key b
+
+# Writes the on up command; the offload device of the peer is recorded in <name>.offload
+write_up() {
+	name="$1"
+	peer_v4="$2"
+	peer_v6="$3"
+	cat > "$WORKDIR/$name-up.sh" <<EOF
+[ -n "\$PEER_NAME" ] || exit 0
+ip route replace $peer_v4/32 dev "\$INTERFACE"
+ip -6 route replace $peer_v6/128 dev "\$INTERFACE"
+echo "\$INTERFACE" > "$WORKDIR/$name.offload"
+EOF
+}
+
+# Writes the configuration of an instance
+write_conf() {
+	name="$1"
+	offload="$2"
+	local_addr="$3"
+	remote_addr="$4"
+	addr_v4="$5"
+	addr_v6="$6"
+	peer_v4="$7"
+	peer_v6="$8"
+	peer_name="$9"
+	eval "secret=\$SECRET_$name"
+	eval "peer_key=\$PUBLIC_$peer_name"
+
+	write_up "$name" "$peer_v4" "$peer_v6"
+	cat > "$WORKDIR/$name.conf" <<EOF
+mode tun routed;
+interface "fastd-$name";
+interface address "$addr_v4/24";
+interface address "$addr_v6/64";
+method "null@gue";
+bind $local_addr:10000;
+secret "$secret";
+offload gue $offload;
+on up "sh '$WORKDIR/$name-up.sh'";
+
+peer "$peer_name" {
+	key "$peer_key";
+	remote $remote_addr:10000;
+	route "$peer_v4/32";
+	route "$peer_v6/128";
+}
+EOF
+}
+
+run_test() {
+	family="$1"
+	if [ "$family" = ipv4 ]; then
+		addr_a=192.0.2.1
+		addr_b=192.0.2.2
+	else
+		addr_a='[2001:db8::1]'
+		addr_b='[2001:db8::2]'
+	fi
+
+	echo "Testing GUE offload with $family underlay"
+
+	rm -f "$WORKDIR/a.offload"
+	write_conf a yes "$addr_a" "$addr_b" 10.1.0.1 fd00::1 10.1.0.2 fd00::2 b
+	write_conf b no "$addr_b" "$addr_a" 10.1.0.2 fd00::2 10.1.0.1 fd00::1 a
+
+	start_fastd "$NS_A" a
+	start_fastd "$NS_B" b
+
+	wait_for 20 test -s "$WORKDIR/a.offload" || fail "offload device wasn't set up"
+	dev="$(cat "$WORKDIR/a.offload")"
+
+	tx_before="$(dev_stat "$NS_A" "$dev" tx_packets)"
+
+	ping_both "$NS_A" 10.1.0.2 fd00::2
+	ping_both "$NS_B" 10.1.0.1 fd00::1
+
+	tx_after="$(dev_stat "$NS_A" "$dev" tx_packets)"
+	[ "$tx_after" -ge $((tx_before + 12)) ] || fail "packets weren't sent through offload device $dev"
+
+	stop_fastd a
+	stop_fastd b
+
+	in_ns "$NS_A" ip link show "$dev" >/dev/null 2>&1 && fail "offload device $dev wasn't removed"
+
+	echo "GUE offload with $family underlay: OK"
+}
+
+run_test ipv4
+run_test ipv6
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2021, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "methods/common.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <cmocka.h>
+
+
+/** The result of receiving a packet with a given sequence number */
+typedef enum result {
+	REJECTED,  /**< The nonce is outside of the reorder window */
+	DUPLICATE, /**< The packet has been seen before */
+	IN_ORDER,  /**< The packet is newer than all packets seen before */
+	REORDERED, /**< The packet is older than the newest packet, but hasn't been seen before */
+} result_t;
+
+
+/** Initializes a responder session, which receives the odd nonces of the initiator */
+static void init(fastd_method_common_t *session) {
+	ctx.now = 0;
+	fastd_method_common_init(session, NULL, 0);
+}
+
+static result_t receive(fastd_method_common_t *session, uint64_t seq) {
+	uint8_t nonce[COMMON_NONCEBYTES];
+	uint64_t value = 2 * seq + 1;
+
+	int i;
+	for (i = COMMON_NONCEBYTES - 1; i >= 0; i--) {
+		nonce[i] = value;
+		value >>= 8;
+	}
+
+	int64_t age;
+	if (!fastd_method_is_nonce_valid(session, nonce, &age))
+		return REJECTED;
+
+	fastd_tristate_t ret = fastd_method_reorder_check(session, nonce, age);
+	if (!ret.set)
+		return DUPLICATE;
+
+	return ret.state ? REORDERED : IN_ORDER;
+}
+
+
+static void test_reorder_in_order(UNUSED void **state) {
+	fastd_method_common_t session;
+	init(&session);
+
+	uint64_t seq;
+	for (seq = 1; seq <= 3 * REORDER_WINDOW; seq++)
+		assert_int_equal(receive(&session, seq), IN_ORDER);
+
+	assert_int_equal(receive(&session, seq - 1), DUPLICATE);
+}
+
+static void test_reorder_window(UNUSED void **state) {
+	fastd_method_common_t session;
+	init(&session);
+
+	assert_int_equal(receive(&session, 2000), IN_ORDER);
+	assert_int_equal(receive(&session, 1999), REORDERED);
+	assert_int_equal(receive(&session, 1999), DUPLICATE);
+	assert_int_equal(receive(&session, 2000 - REORDER_WINDOW + 1), REORDERED);
+	assert_int_equal(receive(&session, 2000 - REORDER_WINDOW), REJECTED);
+	assert_int_equal(receive(&session, 2001), IN_ORDER);
+	assert_int_equal(receive(&session, 2000 - REORDER_WINDOW + 1), REJECTED);
+}
+
+static void test_reorder_jump(UNUSED void **state) {
+	fastd_method_common_t session;
+	init(&session);
+
+	uint64_t seq;
+	for (seq = 1; seq <= 100; seq++)
+		assert_int_equal(receive(&session, seq), IN_ORDER);
+
+	/* Sequence numbers skipped by a jump within the window must not be marked as seen */
+	assert_int_equal(receive(&session, 1100), IN_ORDER);
+	assert_int_equal(receive(&session, 1099), REORDERED);
+	assert_int_equal(receive(&session, 101), REORDERED);
+	assert_int_equal(receive(&session, 100), DUPLICATE);
+	assert_int_equal(receive(&session, 1100 - REORDER_WINDOW + 1), DUPLICATE);
+
+	/* A jump beyond the window forgets all sequence numbers seen before */
+	assert_int_equal(receive(&session, 1100 + 5 * REORDER_WINDOW), IN_ORDER);
+	assert_int_equal(receive(&session, 1100 + 4 * REORDER_WINDOW + 1), REORDERED);
+	assert_int_equal(receive(&session, 1100), REJECTED);
+}
+
+static void test_reorder_timeout(UNUSED void **state) {
+	fastd_method_common_t session;
+	init(&session);
+
+	assert_int_equal(receive(&session, 10), IN_ORDER);
+
+	ctx.now += REORDER_TIME;
+	assert_int_equal(receive(&session, 9), REJECTED);
+	assert_int_equal(receive(&session, 11), IN_ORDER);
+	assert_int_equal(receive(&session, 9), REORDERED);
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_reorder_in_order),
+		cmocka_unit_test(test_reorder_window),
+		cmocka_unit_test(test_reorder_jump),
+		cmocka_unit_test(test_reorder_timeout),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
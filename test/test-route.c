@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "route.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <cmocka.h>
+
+
+/** Returns a distinct fake peer pointer for the routing table */
+#define PEER(n) ((fastd_peer_t *)(uintptr_t)(n))
+
+
+static fastd_prefix_t prefix(const char *str) {
+	fastd_prefix_t ret;
+	assert_true(fastd_prefix_parse(&ret, str));
+	return ret;
+}
+
+static void add(fastd_route_table_t *table, const char *str, uintptr_t peer) {
+	fastd_prefix_t p = prefix(str);
+	assert_true(fastd_route_add(table, &p, PEER(peer)));
+}
+
+static void del(fastd_route_table_t *table, const char *str, uintptr_t peer) {
+	fastd_prefix_t p = prefix(str);
+	fastd_route_remove(table, &p, PEER(peer));
+}
+
+static uintptr_t lookup(const fastd_route_table_t *table, const char *str) {
+	fastd_prefix_t p = prefix(str);
+	return (uintptr_t)fastd_route_lookup(table, p.family, p.addr);
+}
+
+
+static void test_prefix_parse(UNUSED void **state) {
+	fastd_prefix_t p;
+	char buf[FASTD_PREFIX_STRLEN];
+
+	assert_true(fastd_prefix_parse(&p, "10.1.2.3/8"));
+	assert_int_equal(p.family, AF_INET);
+	assert_int_equal(p.len, 8);
+	assert_string_equal(fastd_prefix_format(buf, &p), "10.0.0.0/8");
+
+	assert_true(fastd_prefix_parse(&p, "fd00::1:2:3/97"));
+	assert_int_equal(p.family, AF_INET6);
+	assert_string_equal(fastd_prefix_format(buf, &p), "fd00::1:0:0/97");
+
+	assert_true(fastd_prefix_parse(&p, "192.168.0.1"));
+	assert_int_equal(p.len, 32);
+
+	assert_false(fastd_prefix_parse(&p, "10.0.0.0/33"));
+	assert_false(fastd_prefix_parse(&p, "10.0.0.0/"));
+	assert_false(fastd_prefix_parse(&p, "10.0.0.0/-1"));
+	assert_false(fastd_prefix_parse(&p, "10.0.0.0/8x"));
+	assert_false(fastd_prefix_parse(&p, "::/129"));
+	assert_false(fastd_prefix_parse(&p, "foo/8"));
+}
+
+static void test_prefix_parse_address(UNUSED void **state) {
+	fastd_prefix_t p;
+	char buf[FASTD_PREFIX_STRLEN];
+
+	assert_true(fastd_prefix_parse_address(&p, "10.1.2.3/8"));
+	assert_int_equal(p.family, AF_INET);
+	assert_int_equal(p.len, 8);
+	assert_string_equal(fastd_prefix_format(buf, &p), "10.1.2.3/8");
+
+	assert_true(fastd_prefix_parse_address(&p, "fe80::1"));
+	assert_int_equal(p.family, AF_INET6);
+	assert_int_equal(p.len, 128);
+
+	assert_false(fastd_prefix_parse_address(&p, "10.0.0.1/33"));
+}
+
+static void test_route_ipv4(UNUSED void **state) {
+	fastd_route_table_t table = {};
+
+	add(&table, "10.0.0.0/8", 1);
+	add(&table, "10.1.0.0/16", 2);
+	add(&table, "10.1.2.3/32", 3);
+	add(&table, "10.128.0.0/9", 4);
+
+	assert_int_equal(lookup(&table, "10.1.2.3"), 3);
+	assert_int_equal(lookup(&table, "10.1.2.4"), 2);
+	assert_int_equal(lookup(&table, "10.2.0.1"), 1);
+	assert_int_equal(lookup(&table, "10.200.0.1"), 4);
+	assert_int_equal(lookup(&table, "11.0.0.1"), 0);
+
+	add(&table, "0.0.0.0/0", 5);
+	assert_int_equal(lookup(&table, "11.0.0.1"), 5);
+
+	del(&table, "10.1.0.0/16", 2);
+	assert_int_equal(lookup(&table, "10.1.2.4"), 1);
+	assert_int_equal(lookup(&table, "10.1.2.3"), 3);
+
+	/* Routes of other peers must not be removed */
+	del(&table, "10.0.0.0/8", 2);
+	assert_int_equal(lookup(&table, "10.2.0.1"), 1);
+
+	del(&table, "10.0.0.0/8", 1);
+	del(&table, "10.1.2.3/32", 3);
+	del(&table, "10.128.0.0/9", 4);
+	del(&table, "0.0.0.0/0", 5);
+
+	assert_int_equal(table.n_routes, 0);
+	assert_int_equal(table.n_nodes, 0);
+	assert_null(table.root[0]);
+}
+
+static void test_route_ipv6(UNUSED void **state) {
+	fastd_route_table_t table = {};
+
+	add(&table, "2001:db8::/32", 1);
+	add(&table, "2001:db8:1::/48", 2);
+	add(&table, "2001:db8:1::1/128", 3);
+	add(&table, "10.0.0.0/8", 4);
+
+	assert_int_equal(lookup(&table, "2001:db8:1::1"), 3);
+	assert_int_equal(lookup(&table, "2001:db8:1::2"), 2);
+	assert_int_equal(lookup(&table, "2001:db8:2::1"), 1);
+	assert_int_equal(lookup(&table, "2001:db9::1"), 0);
+	assert_int_equal(lookup(&table, "::ffff:10.0.0.1"), 0);
+
+	fastd_route_free(&table);
+	assert_int_equal(table.n_nodes, 0);
+}
+
+static void test_route_conflict(UNUSED void **state) {
+	fastd_route_table_t table = {};
+	fastd_prefix_t p = prefix("192.168.0.0/24");
+
+	assert_true(fastd_route_add(&table, &p, PEER(1)));
+	assert_true(fastd_route_add(&table, &p, PEER(1)));
+	assert_false(fastd_route_add(&table, &p, PEER(2)));
+	assert_int_equal(table.n_routes, 1);
+	assert_int_equal(lookup(&table, "192.168.0.1"), 1);
+
+	fastd_route_free(&table);
+}
+
+/** Compares the trie against a linear search with random prefixes */
+static void test_route_random(UNUSED void **state) {
+	enum { N = 2000 };
+
+	fastd_route_table_t table = {};
+	static fastd_prefix_t prefixes[N];
+	static bool active[N];
+	size_t i, j;
+
+	srand(1);
+
+	for (i = 0; i < N; i++) {
+		fastd_prefix_t *p = &prefixes[i];
+		p->family = AF_INET;
+		p->len = rand() % 33;
+
+		uint32_t addr = htonl(0x0a000000 | (rand() & 0x00ffffff));
+		memcpy(p->addr, &addr, 4);
+
+		/* Normalize the address */
+		char buf[FASTD_PREFIX_STRLEN];
+		*p = prefix(fastd_prefix_format(buf, p));
+
+		active[i] = fastd_route_add(&table, p, PEER(i + 1));
+	}
+
+	for (j = 0; j < 2; j++) {
+		size_t k;
+		for (k = 0; k < 10000; k++) {
+			uint32_t addr = htonl(0x0a000000 | (rand() & 0x00ffffff));
+			uint8_t bytes[4];
+			memcpy(bytes, &addr, 4);
+
+			uintptr_t expected = 0;
+			int best = -1;
+
+			for (i = 0; i < N; i++) {
+				const fastd_prefix_t *p = &prefixes[i];
+				if (!active[i] || (int)p->len <= best)
+					continue;
+
+				uint32_t mask = p->len ? htonl(~(uint32_t)0 << (32 - p->len)) : 0, net;
+				memcpy(&net, p->addr, 4);
+
+				if ((addr & mask) == net) {
+					best = p->len;
+					expected = i + 1;
+				}
+			}
+
+			assert_int_equal((uintptr_t)fastd_route_lookup(&table, AF_INET, bytes), expected);
+		}
+
+		/* Remove every other route for the second pass */
+		for (i = 0; i < N; i += 2) {
+			fastd_route_remove(&table, &prefixes[i], PEER(i + 1));
+			active[i] = false;
+		}
+
+		assert_true(table.n_nodes < 2 * table.n_routes);
+	}
+
+	fastd_route_free(&table);
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_prefix_parse), cmocka_unit_test(test_prefix_parse_address),
+		cmocka_unit_test(test_route_ipv4), cmocka_unit_test(test_route_ipv6),
+		cmocka_unit_test(test_route_conflict), cmocka_unit_test(test_route_random),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}